@@ -0,0 +1,438 @@
+/*
+ * sotl-bench: time a matrix of scenarios (conf files and generated
+ * lattices) against seq, OpenMP and OpenCL CPU devices, and report the
+ * median and spread of each phase over repeated runs, as CSV or JSON.
+ *
+ * The library keeps its state in globals, so each run happens in a child
+ * process, which sends its timings back through a pipe.
+ */
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "default_defines.h"
+#include "tools.h"
+#include "sotl.h"
+
+/* Same physics as the atoms application. */
+static const double md_delta_t  = 1.0;
+static const double lj_sigma    = 0.503968201;
+static const double lj_epsilon  = 0.001;
+static const double lj_rcut     = 0.6047618412; /* 1.2 * lj_sigma */
+
+#define MAX_SCENARIOS 32
+#define MAX_REPEATS   64
+
+typedef enum {
+    BACKEND_SEQ = 0,
+    BACKEND_OMP,
+    BACKEND_OCL_CPU,
+    NB_BACKENDS
+} bench_backend;
+
+static const char *backend_names[NB_BACKENDS] = { "seq", "omp", "ocl-cpu" };
+
+static const char *phase_names[SOTL_NB_PHASES] = {
+    "step", "exchange", "iteration"
+};
+
+static const char *default_confs[] = {
+    "16000_atoms.conf", "32000_atoms.conf", "dense.conf", "lattice.conf"
+};
+
+typedef struct {
+    const char *file;           /* Conf file, or NULL for a lattice */
+    unsigned natoms;            /* Atoms of the lattice */
+    char name[64];
+} bench_scenario_t;
+
+typedef struct {
+    unsigned warmup;
+    unsigned nb_iter;
+    unsigned repeats;
+    bool box_mode;
+    bool verbose;
+} bench_options_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [ options ] [ conf_file ... ]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "\t-h | --help\t\t\tDisplay this help\n");
+    fprintf(stderr, "\t-v | --verbose\t\t\tShow the output of runs\n");
+    fprintf(stderr, "\t-c | --conf-dir <dir>\t\tDirectory of the default conf files (default conf)\n");
+    fprintf(stderr, "\t-n | --natoms <n>[,<n>...]\tAlso run generated lattices of <n> atoms\n");
+    fprintf(stderr, "\t-B | --backends <list>\t\tBackends among seq,omp,ocl-cpu (default all)\n");
+    fprintf(stderr, "\t-W | --warmup <n>\t\tUntimed iterations of each run (default 10)\n");
+    fprintf(stderr, "\t-i | --nb-iter <n>\t\tTimed iterations of each run (default 50)\n");
+    fprintf(stderr, "\t-r | --repeat <n>\t\tRuns of each scenario and backend (default 5)\n");
+    fprintf(stderr, "\t-b | --box-mode\t\t\tSort atoms into boxes to compute forces\n");
+    fprintf(stderr, "\t-j | --json\t\t\tWrite JSON instead of CSV\n");
+    fprintf(stderr, "\t-o | --output <file>\t\tWrite results to <file> (default stdout)\n");
+}
+
+/* Generate a lattice of natoms atoms, as the atoms application does. */
+static int bench_lattice(const unsigned natoms)
+{
+    unsigned xytiles = (int)pow((float)natoms / 4.0, 1 / 3.0);
+    unsigned ztiles = (natoms + 4 * xytiles * xytiles - 1) /
+                      (4 * xytiles * xytiles);
+    double range[3][2];
+    int ret;
+
+    for (int l = 0; l < 3; ++l) {
+        range[l][0] = 0.0;
+        range[l][1] = (l < 2 ? xytiles : ztiles) * LATTICE_TILE -
+                      LATTICE_TILE * 0.5;
+    }
+
+    ret = sotl_domain_init(range[0], range[1], range[2], NULL, natoms);
+    if (ret < 0)
+        return ret;
+
+    psotl_lattice_atoms(natoms, xytiles, ztiles);
+
+    return SOTL_SUCCESS;
+}
+
+/* Child side of a run: simulate and write the timings to fd. */
+static int bench_child(const bench_scenario_t *sc, const bench_backend backend,
+                       const bench_options_t *opt, const int fd)
+{
+    sotl_timings_t timings;
+    int ret;
+
+    if (!opt->verbose) {
+        int null = open("/dev/null", O_WRONLY);
+
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+
+    if (sotl_init() < 0)
+        return 1;
+
+    switch (backend) {
+        case BACKEND_SEQ:
+            ret = sotl_add_seq_device_by_id(0);
+            break;
+        case BACKEND_OMP:
+            ret = sotl_add_omp_device_by_id(0);
+            break;
+        default:
+            ret = sotl_add_ocl_device_by_type(SOTL_CPU);
+            break;
+    }
+    if (ret < 0)
+        return 1;
+
+    if (opt->box_mode)
+        sotl_enable_box_mode();
+
+    ret = sc->file ? sotl_load_conf(sc->file) : bench_lattice(sc->natoms);
+    if (ret < 0)
+        return 1;
+
+    sotl_set_parameter(MD_DELTA_T, (void *)&md_delta_t);
+    sotl_set_parameter(LJ_SIGMA,   (void *)&lj_sigma);
+    sotl_set_parameter(LJ_EPSILON, (void *)&lj_epsilon);
+    sotl_set_parameter(LJ_RCUT,    (void *)&lj_rcut);
+
+    sotl_set_warmup(opt->warmup);
+    sotl_enable_benchmark();
+
+    if (sotl_runtime_init() < 0)
+        return 1;
+
+    sotl_main_loop(opt->nb_iter);
+
+    if (sotl_get_timings(&timings) < 0)
+        return 1;
+    if (write(fd, &timings, sizeof(timings)) != sizeof(timings))
+        return 1;
+
+    sotl_finalize();
+
+    return 0;
+}
+
+/* Run a scenario once on a backend. Returns 0 on success. */
+static int bench_run(const bench_scenario_t *sc, const bench_backend backend,
+                     const bench_options_t *opt, sotl_timings_t *timings)
+{
+    int fds[2], status;
+    ssize_t n;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return -errno;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -errno;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(bench_child(sc, backend, opt, fds[1]));
+    }
+
+    close(fds[1]);
+    do {
+        n = read(fds[0], timings, sizeof(*timings));
+    } while (n < 0 && errno == EINTR);
+    close(fds[0]);
+
+    waitpid(pid, &status, 0);
+
+    if (n != sizeof(*timings) || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Median, minimum and maximum of n values (sorted in place). */
+static void bench_stats(double *values, const unsigned n, double *median,
+                        double *min, double *max)
+{
+    qsort(values, n, sizeof(double), compare_double);
+
+    *min = values[0];
+    *max = values[n - 1];
+    *median = n % 2 ? values[n / 2] :
+              0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+/* Report the runs of a scenario on a backend, one record per phase. */
+static void bench_report(FILE *out, const bool json, bool *first,
+                         const bench_scenario_t *sc, const bench_backend backend,
+                         const sotl_timings_t *runs, const unsigned nruns)
+{
+    for (int p = 0; p < SOTL_NB_PHASES; p++) {
+        double values[MAX_REPEATS], median, min, max, spread, rate;
+
+        for (unsigned r = 0; r < nruns; r++)
+            values[r] = runs[r].phase[p];
+        bench_stats(values, nruns, &median, &min, &max);
+
+        /* Phases that did not happen (single device exchanges). */
+        if (max == 0.0 && p != SOTL_PHASE_ITERATION)
+            continue;
+
+        spread = median > 0.0 ? 100.0 * (max - min) / median : 0.0;
+        rate = median > 0.0 ? runs[0].natoms / median : 0.0;
+
+        if (json)
+            fprintf(out, "%s\n  { \"scenario\": \"%s\", \"backend\": \"%s\", "
+                    "\"natoms\": %u, \"runs\": %u, \"nb_iter\": %u, "
+                    "\"phase\": \"%s\", \"median_us\": %.1f, \"min_us\": %.1f, "
+                    "\"max_us\": %.1f, \"spread_pct\": %.2f, "
+                    "\"matoms_per_s\": %.3f }",
+                    *first ? "" : ",", sc->name, backend_names[backend],
+                    runs[0].natoms, nruns, runs[0].nb_iter, phase_names[p],
+                    median, min, max, spread, rate);
+        else
+            fprintf(out, "%s,%s,%u,%u,%u,%s,%.1f,%.1f,%.1f,%.2f,%.3f\n",
+                    sc->name, backend_names[backend], runs[0].natoms, nruns,
+                    runs[0].nb_iter, phase_names[p], median, min, max, spread,
+                    rate);
+        *first = false;
+    }
+    fflush(out);
+}
+
+/* Parse a comma-separated list of backends into a mask. */
+static unsigned bench_parse_backends(char *list)
+{
+    unsigned mask = 0;
+
+    for (char *b = strtok(list, ","); b != NULL; b = strtok(NULL, ",")) {
+        int k;
+
+        for (k = 0; k < NB_BACKENDS; k++)
+            if (!strcmp(b, backend_names[k]))
+                break;
+        if (k == NB_BACKENDS)
+            fprintf(stderr, "WARNING: Unknown backend '%s'. Ignored.\n", b);
+        else
+            mask |= 1u << k;
+    }
+
+    return mask;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t opt = { 10, 50, 5, false, false };
+    bench_scenario_t scenarios[MAX_SCENARIOS];
+    unsigned nscenarios = 0;
+    unsigned backends = (1u << NB_BACKENDS) - 1;
+    const char *conf_dir = "conf";
+    const char *output = NULL;
+    char *sizes = NULL;
+    bool json = false, first = true;
+    FILE *out = stdout;
+
+    while (1) {
+        static struct option long_options[] = {
+            {"help",            no_argument,        0, 'h'},
+            {"verbose",         no_argument,        0, 'v'},
+            {"conf-dir",        required_argument,  0, 'c'},
+            {"natoms",          required_argument,  0, 'n'},
+            {"backends",        required_argument,  0, 'B'},
+            {"warmup",          required_argument,  0, 'W'},
+            {"nb-iter",         required_argument,  0, 'i'},
+            {"repeat",          required_argument,  0, 'r'},
+            {"box-mode",        no_argument,        0, 'b'},
+            {"json",            no_argument,        0, 'j'},
+            {"output",          required_argument,  0, 'o'},
+            {0,0,0,0}
+        };
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "hvc:n:B:W:i:r:bjo:",
+                            long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'v':
+                opt.verbose = true;
+                break;
+            case 'c':
+                conf_dir = optarg;
+                break;
+            case 'n':
+                sizes = optarg;
+                break;
+            case 'B':
+                backends = bench_parse_backends(optarg);
+                break;
+            case 'W':
+                opt.warmup = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                opt.nb_iter = strtoul(optarg, NULL, 10);
+                if (opt.nb_iter == 0) {
+                    fprintf(stderr, "WARNING: Invalid value for iterations. Default to 1.\n");
+                    opt.nb_iter = 1;
+                }
+                break;
+            case 'r':
+                opt.repeats = strtoul(optarg, NULL, 10);
+                if (opt.repeats == 0 || opt.repeats > MAX_REPEATS) {
+                    fprintf(stderr, "WARNING: Invalid value for repeats. Default to 5.\n");
+                    opt.repeats = 5;
+                }
+                break;
+            case 'b':
+                opt.box_mode = true;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    /* Conf files given on the command line, or the default ones. */
+    if (optind < argc) {
+        for (; optind < argc && nscenarios < MAX_SCENARIOS; optind++) {
+            const char *base = strrchr(argv[optind], '/');
+
+            scenarios[nscenarios].file = argv[optind];
+            snprintf(scenarios[nscenarios].name, sizeof(scenarios[0].name),
+                     "%s", base ? base + 1 : argv[optind]);
+            nscenarios++;
+        }
+    } else {
+        static char paths[sizeof(default_confs) / sizeof(*default_confs)][256];
+
+        for (unsigned k = 0; k < sizeof(default_confs) / sizeof(*default_confs); k++) {
+            snprintf(paths[k], sizeof(paths[k]), "%s/%s", conf_dir, default_confs[k]);
+            scenarios[nscenarios].file = paths[k];
+            snprintf(scenarios[nscenarios].name, sizeof(scenarios[0].name),
+                     "%s", default_confs[k]);
+            nscenarios++;
+        }
+    }
+
+    /* Generated lattices. */
+    if (sizes != NULL)
+        for (char *n = strtok(sizes, ","); n != NULL && nscenarios < MAX_SCENARIOS;
+             n = strtok(NULL, ",")) {
+            scenarios[nscenarios].file = NULL;
+            scenarios[nscenarios].natoms = strtoul(n, NULL, 10);
+            if (scenarios[nscenarios].natoms == 0)
+                continue;
+            snprintf(scenarios[nscenarios].name, sizeof(scenarios[0].name),
+                     "lattice-%u", scenarios[nscenarios].natoms);
+            nscenarios++;
+        }
+
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Failed to open \"%s\" : '%s'.\n", output, strerror(errno));
+        return 1;
+    }
+
+    if (json)
+        fprintf(out, "{ \"warmup\": %u, \"box_mode\": %s, \"results\": [",
+                opt.warmup, opt.box_mode ? "true" : "false");
+    else
+        fprintf(out, "scenario,backend,natoms,runs,nb_iter,phase,"
+                "median_us,min_us,max_us,spread_pct,matoms_per_s\n");
+
+    for (unsigned s = 0; s < nscenarios; s++)
+        for (int b = 0; b < NB_BACKENDS; b++) {
+            sotl_timings_t runs[MAX_REPEATS];
+            unsigned nruns = 0;
+
+            if (!(backends & (1u << b)))
+                continue;
+
+            for (unsigned r = 0; r < opt.repeats; r++)
+                if (bench_run(&scenarios[s], b, &opt, &runs[nruns]) == 0)
+                    nruns++;
+
+            if (nruns == 0) {
+                fprintf(stderr, "%s on %s: no successful run (skipped)\n",
+                        scenarios[s].name, backend_names[b]);
+                continue;
+            }
+            fprintf(stderr, "%s on %s: %u/%u runs\n", scenarios[s].name,
+                    backend_names[b], nruns, opt.repeats);
+
+            bench_report(out, json, &first, &scenarios[s], b, runs, nruns);
+        }
+
+    if (json)
+        fprintf(out, "\n] }\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
@@ -36,6 +36,9 @@ typedef struct {
 typedef struct atom_set {
     sotl_atom_pos_t pos;        /**< positions in x, y, z */
     sotl_atom_speed_t speed;    /**< speeds in dx, dy, dz */
+    unsigned *id;               /**< original index of atoms (input order) */
+    void *map;                  /**< mapped file holding the arrays (or NULL) */
+    size_t map_size;            /**< size of the mapping */
     unsigned natoms;            /**< total number of atoms */
     unsigned current;           /**< current number of atoms (eg. during filling phase) */
     unsigned offset;            /**< maximum capacity of atoms */
@@ -60,6 +63,21 @@ typedef struct atom_set {
 int atom_set_init(sotl_atom_set_t *set, const unsigned long natoms,
                   const unsigned long maxatoms);
 
+/**
+ * Initialize an atom set on arrays of a mapped file: positions, speeds and
+ * ids follow each other at base, in blocks of offset entries (as allocated
+ * by atom_set_init()). The mapping is released by atom_set_free().
+ *
+ * @param set The atom set to initialize.
+ * @param natoms The total number of atoms.
+ * @param offset The length of each array (multiple of ALIGN, >= natoms).
+ * @param base The first array (page aligned).
+ * @param map The mapping, and map_size its size.
+ */
+void atom_set_init_mapped(sotl_atom_set_t *set, const unsigned natoms,
+                          const unsigned offset, void *base, void *map,
+                          const size_t map_size);
+
 /**
  * Print an atom set.
  */
@@ -89,7 +107,7 @@ size_t atom_set_offset(const sotl_atom_set_t *set);
 /**
  * Get size in bytes of the atom set.
  */
-size_t atom_set_size(sotl_atom_set_t *set);
+size_t atom_set_size(const sotl_atom_set_t *set);
 
 /**
  * Get size in bytes of one border (only in multi devices).
@@ -106,16 +124,33 @@ size_t atom_set_begin(const sotl_atom_set_t *set);
  */
 size_t atom_set_end(const sotl_atom_set_t *set);
 
+/**
+ * Get a view of the atom set extended to its ghosts (only in multi devices,
+ * where they lie just before and after its atoms in memory). Atoms of the
+ * set start at index set->nghosts_min in the view.
+ */
+void atom_set_with_ghosts(const sotl_atom_set_t *set, sotl_atom_set_t *view);
+
 /**
  * Free memory allocated by the atom set.
  */
 void atom_set_free(sotl_atom_set_t *set);
 
 /**
- * Sort atoms along z-axis using a heap sort algorithm.
+ * Sort atoms along z-axis. The algorithm adapts to the input: nothing is
+ * done if atoms are already sorted, an insertion sort is used when only a
+ * few of them are out of order (eg. between two steps), otherwise a
+ * parallel radix sort.
  */
 void atom_set_sort(sotl_atom_set_t *set);
 
+/**
+ * Sort atoms along a Morton (Z-order) curve of their boxes in dom, so that
+ * atoms close in space are close in memory. Original indexes are kept in
+ * set->id.
+ */
+void atom_set_sort_morton(sotl_atom_set_t *set, const sotl_domain_t *dom);
+
 void atom_build (int natoms, sotl_atom_pos_t* pos_vec);
 
 /**
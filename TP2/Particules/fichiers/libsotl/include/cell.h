@@ -0,0 +1,88 @@
+#ifndef __CELL_H
+#define __CELL_H
+
+#include "atom.h"
+#include "default_defines.h"
+#include "domain.h"
+
+/* Number of rows of boxes visited up to reach boxes around (and including)
+ * a box. */
+#define CELL_ROWS(reach) ((2 * (reach) + 1) * (2 * (reach) + 1))
+#define CELL_MAX_ROWS    CELL_ROWS(SUBCELL)
+
+/**
+ * A structure to represent atoms binned into the boxes of a domain
+ * (linked-cell method used by the CPU backends).
+ *
+ * Only non-empty boxes are stored: the box grid of sparse configurations
+ * (eg. 16000 atoms in a 500^3 domain) has several hundred millions boxes,
+ * so per-box arrays like atom_set_box_count() would cost far more than
+ * the force computation itself.
+ */
+typedef struct {
+    unsigned *keys;         /**< box of each atom, sorted */
+    unsigned *atoms;        /**< atom indexes sorted by box */
+    unsigned *tmp_keys;     /**< radix sort buffer */
+    unsigned *tmp_atoms;    /**< radix sort buffer */
+    unsigned *box_id;       /**< ids of non-empty boxes, sorted */
+    unsigned *box_start;    /**< first slot of each non-empty box (nboxes + 1) */
+    unsigned nboxes;        /**< number of non-empty boxes */
+    unsigned natoms;        /**< number of binned atoms */
+    unsigned capacity;      /**< maximum number of atoms */
+    unsigned boxes[3];      /**< number of boxes along each axis */
+    calc_t min[3];          /**< lower corner of the box grid */
+    calc_t rrc;             /**< inverse of the box size */
+} sotl_cell_list_t;
+
+/**
+ * A range of slots in the atoms array of a cell list.
+ */
+typedef struct {
+    unsigned begin;
+    unsigned end;
+} sotl_cell_range_t;
+
+/**
+ * Allocate a cell list.
+ *
+ * @param cells The cell list to initialize.
+ * @param maxatoms The maximum number of atoms to bin.
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns SOTL_OUT_OF_MEMORY.
+ */
+int cell_list_init(sotl_cell_list_t *cells, const unsigned maxatoms);
+
+/**
+ * Free memory allocated by a cell list.
+ */
+void cell_list_free(sotl_cell_list_t *cells);
+
+/**
+ * Bin all atoms of the set into boxes of the given size covering the domain
+ * (radix sort on box ids). BOX_SIZE gives the boxes of the domain.
+ */
+void cell_list_build(sotl_cell_list_t *cells, const sotl_domain_t *dom,
+                     const sotl_atom_set_t *set, const calc_t box_size);
+
+/**
+ * Get the box of a position. Unlike atom_get_num_box(), positions outside
+ * of the domain are clamped into the border boxes.
+ */
+unsigned cell_get_box(const sotl_cell_list_t *cells, const calc_t x,
+                      const calc_t y, const calc_t z);
+
+/**
+ * Get the atoms located in the boxes surrounding a non-empty box (including
+ * itself). Neighbour boxes are returned as rows along x, so that each row
+ * is one contiguous range of slots.
+ *
+ * @param k Index of the non-empty box (0 <= k < cells->nboxes).
+ * @param reach Number of boxes visited on each side (eg. SUBCELL for boxes
+ *              of size BOX_SIZE).
+ * @param ranges Array of at least CELL_ROWS(reach) entries.
+ * @return Return the number of non-empty ranges.
+ */
+unsigned cell_get_neighbours(const sotl_cell_list_t *cells, const unsigned k,
+                             const int reach, sotl_cell_range_t *ranges);
+
+#endif /* __CELL_H */
@@ -0,0 +1,54 @@
+#ifndef __CONF_H
+#define __CONF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "atom.h"
+
+/**
+ * A text configuration file, mapped in memory.
+ *
+ * The file holds the number of atoms, the min and max extents of the
+ * domain in x, y and z, a flag telling whether speeds are given, then the
+ * positions (and speeds) of all atoms. Values are separated by any amount
+ * of white space.
+ */
+typedef struct {
+    const char *data;           /**< mapped file */
+    size_t size;                /**< size of the file */
+    size_t body;                /**< offset of the first atom */
+    unsigned natoms;            /**< number of atoms */
+    double min_ext[3];          /**< domain extents */
+    double max_ext[3];
+    bool read_speed;            /**< whether speeds are given */
+} sotl_conf_file_t;
+
+/**
+ * Map a configuration file and read its header.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns -errno if the file can not be mapped, or
+ *         SOTL_INVALID_VALUE if the header is invalid.
+ */
+int conf_open(sotl_conf_file_t *conf, const char *filename);
+
+/**
+ * Parse the atoms of a configuration file into set, which must be able to
+ * hold conf->natoms atoms. Chunks of the file are parsed in parallel and
+ * written in place in the arrays of set. Speeds are drawn at random when
+ * the file does not give them.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - SOTL_INVALID_VALUE if a value is invalid or missing
+ *         - SOTL_OUT_OF_MEMORY if chunks can not be allocated
+ */
+int conf_read_atoms(const sotl_conf_file_t *conf, sotl_atom_set_t *set);
+
+/**
+ * Unmap a configuration file.
+ */
+void conf_close(sotl_conf_file_t *conf);
+
+#endif /* __CONF_H */
@@ -8,11 +8,14 @@
 #define TILE_SIZE_BOX_OFFSET TILE_SIZE
 #define SCAN_WG_SIZE         256 
 
+// Cluster-pair force kernel: atoms per cluster (work-groups have
+// CLUSTER_SIZE^2 threads) and length of the pair list of each cluster
+#define CLUSTER_SIZE         8
+#define CLUSTER_MAX_PAIRS    64
+
 // Compute forces and update positions within the same kernel
 #define FORCE_N_UPDATE
 
-#define TORUS
-
 #define SUBCELL 1
 
 //#define SLIDE 1
@@ -22,7 +25,9 @@
 
 #define SHOW_GRID
 
-//#define XEON_VECTORIZATION
+// CPU backends use explicit SIMD Lennard-Jones kernels (AVX-512, AVX2 or
+// omp simd, selected at runtime)
+#define XEON_VECTORIZATION
 
 // In _SPHERE_MODE_, atoms are displayed as a mesh of (many) triangles
 // and look pretty nice. However, this mode incurs a high memory
@@ -39,6 +44,21 @@
 
 #define OPENCL_BUILD_OPTIONS "-cl-mad-enable -cl-fast-relaxed-math "
 
+/* Molecular dynamics default parameters. */
+#define MD_DELTA_T_DEFAULT_VALUE        1.0
+#define MD_RESPA_STEPS_DEFAULT_VALUE    1
+#define MD_RESPA_CUTOFF_DEFAULT_VALUE   LJ_SIGMA_DEFAULT_VALUE
+#define MD_ADAPTIVE_DISPLACEMENT_DEFAULT_VALUE  0.0
+#define MD_DELTA_T_MAX_DEFAULT_VALUE    10.0
+
+/* Molecular dynamics user parameters. */
+#define MD_DELTA_T_VALUE        (*(double *)sotl_get_parameter(MD_DELTA_T))
+#define MD_RESPA_STEPS_VALUE    (*(unsigned *)sotl_get_parameter(MD_RESPA_STEPS))
+#define MD_RESPA_CUTOFF_VALUE   (*(double *)sotl_get_parameter(MD_RESPA_CUTOFF))
+#define MD_ADAPTIVE_DISPLACEMENT_VALUE \
+    (*(double *)sotl_get_parameter(MD_ADAPTIVE_DISPLACEMENT))
+#define MD_DELTA_T_MAX_VALUE    (*(double *)sotl_get_parameter(MD_DELTA_T_MAX))
+
 /* Lennard Jones default parameters. */
 #define LJ_SIGMA_DEFAULT_VALUE      0.5039684201
 #define LJ_EPSILON_DEFAULT_VALUE    0.001
@@ -51,6 +71,20 @@
 
 #define LENNARD_SQUARED_CUTOFF (LENNARD_CUTOFF * LENNARD_CUTOFF)
 
+/* Pair potential default parameters. */
+#define POTENTIAL_TYPE_DEFAULT_VALUE    SOTL_POTENTIAL_LJ
+#define MORSE_ALPHA_DEFAULT_VALUE       6.0
+
+/* Pair potential user parameters. */
+#define POTENTIAL_TYPE_VALUE (*(unsigned *)sotl_get_parameter(POTENTIAL_TYPE))
+#define MORSE_ALPHA_VALUE    (*(double *)sotl_get_parameter(MORSE_ALPHA))
+
+/* Verlet lists default parameters. */
+#define VERLET_SKIN_DEFAULT_VALUE   (0.5 * ATOM_RADIUS)
+
+/* Verlet lists user parameters. */
+#define VERLET_SKIN_DISTANCE (*(double *)sotl_get_parameter(VERLET_SKIN))
+
 ////////////////////////////////////
 
 #if defined(FORCE_N_UPDATE) && defined(SLIDE)
@@ -5,9 +5,11 @@
 #include <stdbool.h>
 
 #include "atom.h"
+#include "cell.h"
 #include "default_defines.h"
 #include "domain.h"
 #include "kernel_list.h"
+#include "verlet.h"
 #include "cl.h"
 
 typedef enum {
@@ -41,20 +43,44 @@ typedef struct {
   bool display;                 // Device also serves as display device (for OpenGL rendering)
   sotl_domain_t domain;         // Bounds of simulation domain
   sotl_atom_set_t atom_set;
+  sotl_cell_list_t cells;       // Atoms binned into boxes (CPU backends)
+  sotl_verlet_list_t verlet;    // Neighbour lists (CPU backends)
+  bool reorder_pending;         // Reordering waits for the next list rebuild
   unsigned long mem_allocated;  // Total mount of memory used by OpenCL buffers
-  cl_event prof_events[KERNEL_TAB_SIZE];
-  bool prof_used[KERNEL_TAB_SIZE];
+  struct sotl_profile *prof;    // Phase timings (see profiling.c)
   unsigned cur_pb;              // Current position buffer (0/1)
   unsigned cur_sb;              // Current speed buffer (0/1)
   cl_mem pos_buffer[2];
   cl_mem speed_buffer[2];
+  cl_mem id_buffer[2];          // Atom ids, permuted with positions (cur_pb)
   cl_mem box_buffer;
+  unsigned box_capacity;        // Boxes allocated in box_buffer and calc_offset_buffer
   cl_mem calc_offset_buffer;
   cl_mem min_buffer;
   cl_mem max_buffer;
   cl_mem fake_min_buffer;
   cl_mem fake_max_buffer;
   cl_mem domain_buffer;
+  cl_mem potential_buffer;      // Force table of the pair potential
+  unsigned potential_version;   // Version of the table in potential_buffer
+  cl_mem row_cluster_buffer;    // First cluster of each row of boxes (cluster mode)
+  cl_mem cluster_atom_buffer;   // First and end atoms of each cluster
+  cl_mem cluster_bound_buffer;  // Bounding box of each cluster
+  cl_mem pair_buffer;           // Clusters close to each cluster
+  cl_mem npairs_buffer;         // Length of the pair list of each cluster
+  unsigned cluster_capacity;    // Clusters allocated in cluster buffers (0 if none)
+  unsigned row_capacity;        // Rows allocated in row_cluster_buffer
+  cl_mem torus_row_buffer;      // First own atom of each inner row of boxes (torus mode)
+  cl_mem readback_buffer;       // Pinned staging buffer of readbacks
+  void *readback_ptr;           // Host mapping of readback_buffer
+  cl_mem kick_buffer;           // Squared speed increment of each atom (adaptive step)
+  cl_mem stats_buffer;          // Largest squared speed and increment of each work-group
+  calc_t max_speed2;            // Largest squared speed of the last (sub)step
+  calc_t max_kick2;             // Largest squared speed increment by pair forces
+  cl_mem energy_table_buffer;   // Energy table of the pair potential (observables)
+  cl_mem energy_buffer;         // Half the energy of the pairs of each atom
+  cl_mem obs_buffer;            // Observables of each work-group, then of the device
+  sotl_observables_t observables; // Observables accumulated during a sampled step
 } sotl_device_t;
 
 /**
@@ -72,16 +98,90 @@ void device_create_buffers(sotl_device_t *dev);
  */
 void device_write_buffers(sotl_device_t *dev);
 
+/**
+ * Write the force table again if it changed since the last upload (its
+ * kicks change between steps with RESPA).
+ */
+void device_write_potential(sotl_device_t *dev);
+
+/**
+ * Read back the largest squared speed and speed increment reduced by each
+ * work-group of the last update_position into max_speed2 and max_kick2
+ * (adaptive time step only).
+ */
+void device_read_stats(sotl_device_t *dev);
+
+/**
+ * Reduce the observables of the sampled step into the first slot of the
+ * observables buffer and read them back into observables (a few values).
+ */
+void device_read_observables(sotl_device_t *dev);
+
 /**
  * Init ghosts.
  */
 void device_init_ghosts(sotl_device_t *dev);
 
+/**
+ * Give the device the bounds of dom (its sub domain, after its z boundaries
+ * moved), and write them to its buffers. Box buffers are enlarged when the
+ * domain has more boxes than they can hold.
+ */
+void device_set_domain(sotl_device_t *dev, const sotl_domain_t *dom);
+
+/**
+ * Give the device the atoms and ghosts of set (a sub set of the global atom
+ * set, see domain_exchange()), and write them to its buffers. Borders are
+ * enlarged when ghosts no longer fit.
+ */
+void device_set_atoms(sotl_device_t *dev, const sotl_atom_set_t *set);
+
+/**
+ * Make room for natoms atoms and periodic images from the first atom on
+ * (torus mode): the buffers are enlarged when they no longer fit, atoms
+ * being read back and written again.
+ */
+void device_reserve_images(sotl_device_t *dev, const unsigned natoms);
+
 /**
  * Read buffer objects on the given device.
  */
 void device_read_buffers(sotl_device_t *dev);
 
+/**
+ * Number of values between x and y (or y and z) of positions and speeds
+ * read back with device_read_back_async().
+ */
+unsigned device_read_back_stride(const sotl_device_t *dev);
+
+/**
+ * Host memory needed by device_read_back_async() (in bytes).
+ */
+size_t device_read_back_size(const sotl_device_t *dev);
+
+/**
+ * Start reading back positions (or speeds when spd is set) in a single
+ * transfer, without waiting for it: x, y and z of the atoms land at host,
+ * host + stride and host + 2 * stride (see device_read_back_stride()).
+ * Commands enqueued afterwards, such as the next step, overlap with it.
+ *
+ * @return The event completing with the transfer. Host memory must not be
+ *         used before, and the caller releases the event.
+ */
+cl_event device_read_back_async(sotl_device_t *dev, const bool spd,
+                                calc_t *host);
+
+/**
+ * Start reading back the ids of the atoms, in the order box sort left them
+ * on the device, like device_read_back_async().
+ */
+cl_event device_read_back_ids_async(sotl_device_t *dev, unsigned *ids);
+
+/**
+ * Read back the ids of the atoms.
+ */
+void device_read_back_ids(sotl_device_t *dev, unsigned *ids);
+
 /**
  * Read back atom positions.
  */
@@ -105,15 +205,66 @@ void cl_create_kernels(sotl_device_t *dev);
 void device_one_step_move(sotl_device_t *dev);
 
 /**
- * Get number of atoms on left border (only used in multi devices).
+ * Same as device_one_step_move() in two passes, forces then moves, for
+ * host devices only: several host devices share the global atom set, and
+ * must all compute their forces before any of them moves its atoms.
+ */
+void device_one_step_force(sotl_device_t *dev);
+void device_one_step_integrate(sotl_device_t *dev);
+
+/**
+ * Sort atoms of the given device along a Morton curve (see
+ * atom_set_sort_morton()). Atoms of OpenCL devices are read back, sorted
+ * on the host and written again. With Verlet lists on CPU devices, sorting
+ * is postponed until the lists have to be rebuilt anyway: the force pass
+ * sorts atoms before the rebuild while dev->reorder_pending is set.
+ */
+void device_reorder_atoms(sotl_device_t *dev);
+
+/**
+ * Get number of atoms in z planes of boxes [begin_z, end_z[, from the box
+ * buffer. This function must be called after scan kernel.
+ */
+unsigned device_get_natoms_in_z(const sotl_device_t *dev, const int begin_z,
+                                const int end_z);
+
+/**
+ * Get number of atoms on left border (only used in multi devices): in the
+ * first two z planes of boxes, that is, after ocl_sort_own_atoms(), the
+ * atoms which left the device on this side then the ones its neighbour
+ * needs as ghosts.
  */
 unsigned device_get_natoms_left(const sotl_device_t *dev);
 
 /**
- * Get number of atoms on right border (only used in multi devices).
+ * Get number of atoms on right border (only used in multi devices): in the
+ * last two z planes of boxes, like device_get_natoms_left().
  */
 unsigned device_get_natoms_right(const sotl_device_t *dev);
 
+/**
+ * Start reading back set->natoms atoms from own atom first on (negative
+ * for left ghosts) into set (multi devices only). The caller waits for
+ * the queue of the device before using them.
+ */
+void device_read_atoms(sotl_device_t *dev, const int first,
+                       sotl_atom_set_t *set);
+
+/**
+ * Start writing atoms [from, from + n[ of set at own atom first (negative
+ * for left ghosts) of the device (multi devices only). Host memory must
+ * not change before the queue of the device is done.
+ */
+void device_write_atoms(sotl_device_t *dev, const sotl_atom_set_t *set,
+                        const unsigned from, const unsigned n, const int first);
+
+/**
+ * Move own atoms [from, from + n[ to [to, to + n[ on the device (multi
+ * devices only). Other atoms of the buffers are lost, unless from == to.
+ */
+void device_move_atoms(sotl_device_t *dev, const unsigned from,
+                       const unsigned to, const unsigned n);
+
 /**
  * Get total number of atoms by reading the box buffer.
  *
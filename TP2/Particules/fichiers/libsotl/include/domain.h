@@ -9,7 +9,9 @@
 typedef struct domain {
     calc_t min_border[3], max_border[3];    /**< min and max border pos in x, y, z */
     calc_t min_ext[3], max_ext[3];          /**< min and max pos in x, y, z */
+    calc_t min_range[3], max_range[3];      /**< extents given at init (without borders) */
     unsigned boxes[3];                      /**< number of boxes in x, y, z */
+    double box_inv[3];                      /**< inverse width of boxes in x, y, z */
     unsigned total_boxes;                   /**< total number of boxes */
     unsigned nb_subdomains;                 /**< number of sub domains. */
     struct domain **subdomains;             /**< array of sub domainbs. */
@@ -23,11 +25,45 @@ void domain_init(sotl_domain_t *dom, const calc_t x_min, const calc_t y_min,
                  const calc_t z_min, const calc_t x_max, const calc_t y_max,
                  const calc_t z_max);
 
+/**
+ * Rebuild the boxes of a domain for periodic boundaries (torus mode): the
+ * period along each axis is the extent given at init, cut into a whole
+ * number of boxes, as wide as BOX_SIZE or a bit wider.
+ */
+void domain_make_periodic(sotl_domain_t *dom);
+
 /**
  * Split a domain into n sub domains.
  */
 void domain_split(sotl_domain_t *dom, const unsigned n);
 
+/**
+ * Exchange atoms between the sub domains of a split domain, once devices
+ * have moved them: the global atom set is sorted along z again, then each
+ * sub domain gets the atoms lying between its z boundaries, followed and
+ * preceded by the atoms of the borders of its neighbours (ghosts).
+ */
+void domain_exchange(sotl_domain_t *dom);
+
+/**
+ * Same as domain_exchange() when the atoms of each sub domain have already
+ * been sorted along z (eg. by threads of its own NUMA node): only the atoms
+ * around the boundaries between sub domains are sorted again.
+ */
+void domain_exchange_borders(sotl_domain_t *dom);
+
+/**
+ * Move the z boundaries between the sub domains of a split domain, so that
+ * sub domain i gets about shares[i] of the atoms (shares sum to 1), as
+ * close as z planes of boxes allow. Atoms are given to their new sub domain
+ * at once: the global atom set must be sorted along z, as it is after
+ * domain_exchange().
+ *
+ * @return Return the number of atoms which changed sub domain (0 if no
+ *         boundary moved).
+ */
+unsigned domain_rebalance(sotl_domain_t *dom, const double *shares);
+
 /**
  * Free memory allocated by a domain.
  */
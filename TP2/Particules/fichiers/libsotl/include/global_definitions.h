@@ -17,5 +17,14 @@ extern unsigned gravity_enabled;
 extern unsigned borders_enabled;
 
 extern bool is_box_mode;
+extern bool is_verlet_mode;
+extern bool is_half_pair_mode;
+extern bool is_numa_mode;
+extern bool is_torus_mode;
+extern bool is_cluster_mode;
+extern bool is_mixed_precision;
+extern unsigned reorder_period;
+
+extern float normalized_vert[3];
 
 #endif
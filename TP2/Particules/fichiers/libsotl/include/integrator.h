@@ -0,0 +1,72 @@
+#ifndef __INTEGRATOR_H
+#define __INTEGRATOR_H
+
+#include <stdbool.h>
+
+#include "default_defines.h"
+
+/**
+ * Durations of the current (sub)step, read by the backends when they move
+ * atoms. Kicks by pair forces are folded into the force table instead
+ * (see potential_set_kicks).
+ */
+typedef struct {
+    calc_t kick;    /**< time over which gravity acts on speeds */
+    calc_t drift;   /**< time over which atoms move at their speed */
+} sotl_step_t;
+
+/**
+ * Read the time step and the multiple time stepping parameters, and split
+ * the potential when more than one inner step is requested. To be called
+ * once parameters of the potential are set.
+ */
+void integrator_init(void);
+
+/**
+ * Number of force evaluations of one step.
+ */
+unsigned integrator_nb_substeps(void);
+
+/**
+ * Prepare substep k of a step of velocity Verlet, in its leapfrog form: the
+ * second half kick of a step and the first half kick of the next one are
+ * merged into a single force evaluation. With RESPA, substep 0 kicks by
+ * the outer forces over the whole step and every substep kicks by the
+ * inner forces and drifts over a fraction of it.
+ */
+void integrator_set_substep(const unsigned k);
+
+/**
+ * Prepare one half of a step of velocity Verlet: a half kick by all forces,
+ * followed by a drift over the whole step when drift is true (first half),
+ * or not (second half, which leaves speeds synchronized with positions).
+ */
+void integrator_set_half_step(const bool drift);
+
+/**
+ * Get the durations of the current substep.
+ */
+const sotl_step_t *integrator_get_step(void);
+
+/**
+ * Whether the time step adapts to the motion of atoms (a displacement
+ * bound is set), in which case backends must report the largest squared
+ * speed and speed increment by pair forces of their last substep.
+ */
+bool integrator_is_adaptive(void);
+
+/**
+ * Pick the time step of the next step from the maxima over all devices
+ * reported by the last substep, so that no atom moves more than the
+ * displacement bound in an (inner) step, and log it to the history. The
+ * time step grows by at most a quarter per step, and never beyond
+ * MD_DELTA_T_MAX.
+ */
+void integrator_adapt(const calc_t max_speed2, const calc_t max_kick2);
+
+/**
+ * Close the history of time steps and report its extent.
+ */
+void integrator_finalize(void);
+
+#endif /* __INTEGRATOR_H */
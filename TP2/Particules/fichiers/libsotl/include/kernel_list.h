@@ -14,13 +14,23 @@ enum {
     KERNEL_COPY_BUFFER,
     KERNEL_BOX_SORT_ALL_ATOMS,
     KERNEL_BOX_SORT_OWN_ATOMS,
+    KERNEL_TORUS_COUNT_ALL_ATOMS,
+    KERNEL_TORUS_SORT_ALL_ATOMS,
+    KERNEL_TORUS_ROWS,
+    KERNEL_TORUS_GATHER,
     KERNEL_FORCE,
+    KERNEL_CLUSTER_SCAN,
+    KERNEL_CLUSTER_BUILD,
+    KERNEL_CLUSTER_PAIRS,
+    KERNEL_CLUSTER_FORCE,
     KERNEL_FORCE_N2,
     KERNEL_BORDER, 
     KERNEL_UPDATE_POSTION,
     KERNEL_UPDATE_VERTICES,
     KERNEL_ZERO_SPEED,
     KERNEL_COLLISION, 
+    KERNEL_OBSERVABLES,
+    KERNEL_OBSERVABLES_REDUCE,
     KERNEL_NULL,
 
     KERNEL_TAB_SIZE
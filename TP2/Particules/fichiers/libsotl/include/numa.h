@@ -0,0 +1,55 @@
+#ifndef __NUMA_H
+#define __NUMA_H
+
+#include "atom.h"
+#include "domain.h"
+
+/* Nodes beyond this number are ignored. */
+#define NUMA_MAX_NODES 8
+
+/**
+ * Find the NUMA nodes with CPUs usable by the process (from sysfs), and
+ * take a snapshot of their allocation counters.
+ *
+ * @return Return the number of nodes found (1 when the topology is not
+ *         available).
+ */
+unsigned numa_topology_init(void);
+
+/**
+ * Node of the threads numbered t among nthreads: threads are spread
+ * evenly and in order over the nodes.
+ */
+unsigned numa_thread_node(const int t, const int nthreads);
+
+/**
+ * Threads [*first, *last[ among nthreads are the ones of a node (see
+ * numa_thread_node()).
+ */
+void numa_node_threads(const unsigned node, const int nthreads, int *first,
+                       int *last);
+
+/**
+ * Pin the calling thread to the CPUs of a node. This is only done once per
+ * thread and node.
+ */
+void numa_pin_thread(const unsigned node);
+
+/**
+ * Move the arrays of set to fresh memory, where the atoms of each sub
+ * domain of dom are first touched by threads pinned to its node (sub
+ * domain i belongs to node i). Sub sets of dom are updated.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns SOTL_OUT_OF_MEMORY.
+ */
+int numa_place_atoms(sotl_atom_set_t *set, sotl_domain_t *dom);
+
+/**
+ * Log, for each node, the pages of its atoms found on itself and on other
+ * nodes, and its allocation counters (local and remote) since
+ * numa_topology_init().
+ */
+void numa_report(const sotl_domain_t *dom);
+
+#endif /* __NUMA_H */
@@ -0,0 +1,99 @@
+#ifndef __OBSERVABLES_H
+#define __OBSERVABLES_H
+
+#include <math.h>
+#include <stdbool.h>
+
+#include "default_defines.h"
+#include "sotl.h"
+
+/* Speed bins cover OBSERVABLES_SPEED_RANGE times the mean square root
+ * speed of the previous sample. */
+#define OBSERVABLES_SPEED_RANGE 3.0
+
+/* Values reduced by OpenCL devices: kinetic and potential energies,
+ * momentum and speed histogram. */
+#define OBSERVABLES_VALUES (5 + SOTL_SPEED_BINS)
+
+/**
+ * What backends accumulate into the observables of their device during the
+ * current substep.
+ */
+typedef struct {
+    bool energy;        /**< potential energy, in the force pass */
+    bool speeds;        /**< kinetic energy, momentum and speed histogram,
+                             when atoms move */
+    calc_t bin_width;   /**< width of the speed bins */
+} sotl_sampling_t;
+
+/**
+ * Open the file of samples (unless filename is NULL) and size the speed
+ * bins from the speeds of the global atom set.
+ */
+int observables_init(const char *filename);
+
+/**
+ * Whether observables are sampled.
+ */
+bool observables_is_enabled(void);
+
+/**
+ * Prepare substep k out of nsteps of a step sampled or not: the potential
+ * energy is accumulated during the first substep, where all pairs are
+ * visited, and speeds are reduced during the last one.
+ */
+void observables_set_substep(const bool sample, const unsigned k,
+                             const unsigned nsteps);
+
+/**
+ * Get what the current substep must accumulate.
+ */
+const sotl_sampling_t *observables_get_sampling(void);
+
+/**
+ * Reset accumulated observables.
+ */
+void observables_clear(sotl_observables_t *obs);
+
+/**
+ * Add observables accumulated by a device (or a thread) to sum.
+ */
+void observables_add(sotl_observables_t *sum, const sotl_observables_t *obs);
+
+/**
+ * Complete the sum over all devices as the sample of iteration iter, keep
+ * it for sotl_get_observables() and write it to the file. The speed bins of
+ * the next sample are sized from it.
+ */
+void observables_record(sotl_observables_t *obs, const unsigned long iter);
+
+/**
+ * Get the last sample.
+ */
+int observables_get(sotl_observables_t *obs);
+
+/**
+ * Close the file of samples.
+ */
+void observables_finalize(void);
+
+/**
+ * Add the speed v of an atom to observables.
+ */
+static inline void observables_add_atom(sotl_observables_t *obs,
+                                        const calc_t v[3],
+                                        const calc_t bin_width)
+{
+    const calc_t v2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    const calc_t bin = sqrt(v2) / bin_width;
+
+    obs->natoms++;
+    obs->kinetic += 0.5 * v2;
+    obs->momentum[0] += v[0];
+    obs->momentum[1] += v[1];
+    obs->momentum[2] += v[2];
+    obs->histogram[bin < SOTL_SPEED_BINS - 1 ? (unsigned)bin :
+                   SOTL_SPEED_BINS - 1]++;
+}
+
+#endif /* __OBSERVABLES_H */
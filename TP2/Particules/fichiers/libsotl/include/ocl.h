@@ -20,6 +20,10 @@ void ocl_write_buffers(sotl_device_t *dev);
 
 void ocl_one_step_move(sotl_device_t *dev);
 
+// Sort own atoms along boxes before exchanging them (multi devices only)
+//
+void ocl_sort_own_atoms(sotl_device_t *dev);
+
 void ocl_updateModelFromHost(sotl_device_t *dev);
 
 void ocl_finalize(void);
@@ -30,6 +34,9 @@ void ocl_finalize(void);
 #define alt_pos_buf(dev) (dev->pos_buffer + 1 - (dev)->cur_pb)
 #define alt_spd_buf(dev) (dev->speed_buffer + 1 - (dev)->cur_sb)
 
+#define cur_id_buf(dev) (dev->id_buffer + (dev)->cur_pb)
+#define alt_id_buf(dev) (dev->id_buffer + 1 - (dev)->cur_pb)
+
 extern cl_mem vbo_buffer;
 extern cl_mem model_buffer;
 
@@ -41,9 +41,23 @@ void box_sort_all_atoms(sotl_device_t *dev, const unsigned begin,
 void box_sort_own_atoms(sotl_device_t *dev, const unsigned begin,
                         const unsigned end);
 
+void torus_count_all_atoms(sotl_device_t *dev, const unsigned begin,
+                           const unsigned end);
+
+void torus_sort_all_atoms(sotl_device_t *dev, const unsigned begin,
+                          const unsigned end);
+
+void torus_rows(sotl_device_t *dev);
+void torus_gather(sotl_device_t *dev);
+
 void n2_lennard_jones (sotl_device_t *dev);
 void box_lennard_jones(sotl_device_t *dev, const unsigned begin,
                        const unsigned end);
+void cluster_lennard_jones(sotl_device_t *dev, const unsigned begin,
+                           const unsigned end);
+
+void observables_kernel(sotl_device_t *dev);
+void reduce_observables(sotl_device_t *dev);
 
 void null_kernel (sotl_device_t *dev);
 
@@ -9,6 +9,8 @@ void omp_alloc_buffers (sotl_device_t *dev);
 void omp_finalize (sotl_device_t *dev);
 
 void omp_one_step_move (sotl_device_t *dev);
+void omp_one_step_force (sotl_device_t *dev);
+void omp_one_step_integrate (sotl_device_t *dev);
 
 
 #endif
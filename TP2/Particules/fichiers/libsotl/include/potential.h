@@ -0,0 +1,126 @@
+#ifndef __POTENTIAL_H
+#define __POTENTIAL_H
+
+#include "default_defines.h"
+
+#include <stdbool.h>
+
+/* Number of intervals of the force table. With 4096 intervals, the table
+ * fits in 32KB of OpenCL constant memory, even in double precision. */
+#define POTENTIAL_TABLE_SIZE 4096
+
+/**
+ * A pair potential, tabulated from the user parameters.
+ *
+ * table[i] is F(r) / r for r² = i * rc² / POTENTIAL_TABLE_SIZE, so that the
+ * force applied on atom a by atom b is table(|ab|²) * (a - b) whatever the
+ * potential is. Values in between are linearly interpolated. The first
+ * entry (r = 0) is clamped to the value of the second one, and one extra
+ * entry is stored after rc² so that r² close to rc² never reads out of
+ * the table because of rounding.
+ *
+ * ftable holds the same values in single precision, for the mixed
+ * precision mode (see sotl_enable_mixed_precision).
+ *
+ * Both tables are scaled by the kicks of the current step (see
+ * potential_set_kicks), so that force loops add table(|ab|²) * (a - b) to
+ * speeds whatever the time step is.
+ *
+ * etable holds the energy U(r) - U(rc) of a pair at the same distances,
+ * whole and unscaled, for observables (see sotl_get_observables).
+ */
+typedef struct {
+    calc_t table[POTENTIAL_TABLE_SIZE + 2];
+    float ftable[POTENTIAL_TABLE_SIZE + 2];
+    calc_t etable[POTENTIAL_TABLE_SIZE + 2];
+    calc_t rc2;         /**< squared cutoff */
+    calc_t inv_step;    /**< POTENTIAL_TABLE_SIZE / rc² */
+    unsigned type;      /**< one of sotl_potential_type */
+    bool mixed;         /**< evaluate forces from ftable, in float */
+    unsigned version;   /**< incremented whenever the tables change */
+} sotl_potential_t;
+
+/**
+ * Build the table again from the current parameters.
+ *
+ * Called whenever a parameter of the potential is set: the table must not
+ * be in use by the CPU backends at that time. OpenCL devices upload it
+ * again before a step whenever its version has changed.
+ */
+void potential_update(void);
+
+/**
+ * Split the potential into an inner part, below inner_cutoff, and an outer
+ * part, for multiple time stepping. The inner part is switched off
+ * smoothly over the last width before inner_cutoff. A null width disables
+ * the split.
+ */
+void potential_set_split(const double inner_cutoff, const double width);
+
+/**
+ * Scale the tables to kick speeds by outer * F_outer + inner * F_inner.
+ * Without split, the whole force is scaled by outer. When outer is null,
+ * the cutoff is lowered to the inner cutoff.
+ */
+void potential_set_kicks(const double outer, const double inner);
+
+/**
+ * Evaluate forces in single precision (from ftable) or not.
+ */
+void potential_set_mixed(const bool mixed);
+
+/**
+ * Get the tabulated potential.
+ */
+const sotl_potential_t *get_potential(void);
+
+/**
+ * Get the name of a potential type.
+ */
+const char *potential_name(const unsigned type);
+
+/**
+ * Get F(r) / r, with r² < rc², in single precision.
+ */
+static inline float potential_force_mixed(const sotl_potential_t *pot,
+                                          const float r2)
+{
+    float x = r2 * (float)pot->inv_step;
+    unsigned i = (unsigned)x;
+    float t = x - i;
+
+    return pot->ftable[i] + t * (pot->ftable[i + 1] - pot->ftable[i]);
+}
+
+/**
+ * Get F(r) / r, with r² < rc².
+ */
+static inline calc_t potential_force(const sotl_potential_t *pot,
+                                     const calc_t r2)
+{
+#if USE_DOUBLE == 1
+    if (pot->mixed)
+        return potential_force_mixed(pot, (float)r2);
+#endif
+
+    calc_t x = r2 * pot->inv_step;
+    unsigned i = (unsigned)x;
+    calc_t t = x - i;
+
+    return pot->table[i] + t * (pot->table[i + 1] - pot->table[i]);
+}
+
+/**
+ * Get U(r) - U(rc), with r² < rc².
+ */
+static inline calc_t potential_energy(const sotl_potential_t *pot,
+                                      const calc_t r2)
+{
+    calc_t x = r2 * pot->inv_step;
+    unsigned i = (unsigned)x;
+    calc_t t = x - i;
+
+    return pot->etable[i] + t * (pot->etable[i + 1] - pot->etable[i]);
+}
+
+#endif /* __POTENTIAL_H */
@@ -1,17 +1,68 @@
 #ifndef PROFILING_H
 #define PROFILING_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "sotl.h"
 
+// Phases of a step, timed the same way on every backend: host clock
+// around the phase on CPU devices, start and end of the commands of the
+// phase on OpenCL devices. On CPU devices, gravity, bounce and the VBO
+// update are done by the same sweep over atoms as the move, so they are
+// part of PROF_MOVE.
+//
+enum {
+  PROF_GRAVITY,
+  PROF_SORT,                    // binning atoms into boxes, neighbour lists
+  PROF_FORCE,
+  PROF_BOUNCE,
+  PROF_MOVE,
+  PROF_VBO,
+  PROF_OTHER,                   // observables, collisions, ...
+  PROF_EXCHANGE,                // atoms exchanged between devices (host)
+
+  PROF_NB_PHASES
+};
+
+const char *profiling_phase_name (unsigned phase);
+
 void profiling_init (sotl_device_t *dev);
 void profiling_finalize (sotl_device_t *dev);
+void profiling_release (sotl_device_t *dev);
 
 void profiling_reset_counters (sotl_device_t *dev);
 
+// Read the timestamps of the completed OpenCL commands of dev (of all of
+// them if wait is set)
+void profiling_collect (sotl_device_t *dev, bool wait);
+
+// Keep every timed phase in memory until profiling_write_trace()
+void profiling_enable_trace (void);
+
+// Write a Chrome trace-event file of the phases of all devices (host
+// phases have their own track)
+int profiling_write_trace (const char *filename);
+
 #ifdef PROFILING
 cl_event *prof_event_ptr(sotl_device_t *dev, unsigned kernel_num);
+
+// Host clock, in ns
+uint64_t profiling_now (void);
+
+// Record phase from begin to now on dev (on the host track if dev is
+// NULL), and return now, so that phases can be chained
+uint64_t profiling_record (sotl_device_t *dev, unsigned phase, uint64_t begin);
 #else
 #define prof_event_ptr(device, kernel)  NULL
+#define profiling_now()  ((uint64_t) 0)
+static inline uint64_t profiling_record (sotl_device_t *dev, unsigned phase,
+					 uint64_t begin)
+{
+  (void) dev;
+  (void) phase;
+  return begin;
+}
 #endif
 
 #define TIME_DIFF(t1, t2) \
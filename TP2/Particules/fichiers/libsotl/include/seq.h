@@ -9,6 +9,8 @@ void seq_alloc_buffers (sotl_device_t *dev);
 void seq_finalize (sotl_device_t *dev);
 
 void seq_one_step_move (sotl_device_t *dev);
+void seq_one_step_force (sotl_device_t *dev);
+void seq_one_step_integrate (sotl_device_t *dev);
 
 
 #endif
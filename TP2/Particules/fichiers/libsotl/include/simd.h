@@ -0,0 +1,38 @@
+#ifndef __SIMD_H
+#define __SIMD_H
+
+#include "atom.h"
+#include "default_defines.h"
+
+/**
+ * Select the force kernels for the host CPU (AVX-512, AVX2 or a portable
+ * "omp simd" version), according to CPUID. In mixed precision mode, the
+ * portable version evaluating forces in float is always used.
+ */
+void simd_init(void);
+
+/**
+ * Get the name of the selected kernels.
+ */
+const char *simd_name(void);
+
+/**
+ * Add to force the forces applied on atom current by atoms [begin, end[ of
+ * the set, read from the table of the pair potential. The cutoff (and
+ * current itself) is handled with masks, so the range may contain any atom.
+ * Unless energy is NULL, the energies of these pairs are also added to it
+ * (by the portable version, which is only used on sampled steps).
+ */
+void simd_force_range(const sotl_atom_set_t *set, const unsigned current,
+                      const unsigned begin, const unsigned end,
+                      calc_t force[3], calc_t *energy);
+
+/**
+ * Same as simd_force_range() for the n atoms whose indexes are given in
+ * others (eg. a Verlet list or a box of a cell list).
+ */
+void simd_force_list(const sotl_atom_set_t *set, const unsigned current,
+                     const unsigned *others, const unsigned n,
+                     calc_t force[3], calc_t *energy);
+
+#endif /* __SIMD_H */
@@ -0,0 +1,71 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "atom.h"
+#include "domain.h"
+
+#define SNAPSHOT_MAGIC      "SOTLSNAP"
+#define SNAPSHOT_VERSION    1
+
+/* Arrays start on a page boundary, so that they can be mapped in place. */
+#define SNAPSHOT_HEADER_SIZE 4096
+
+/**
+ * Header of a snapshot file, in native byte order.
+ *
+ * It is followed, at SNAPSHOT_HEADER_SIZE, by the arrays of an atom set
+ * laid out as atom_set_init() allocates them: x, y, z, dx, dy and dz
+ * (offset values of precision bytes each), then ids (offset 32-bit values).
+ * Values after natoms in each array are zero.
+ */
+typedef struct {
+    char magic[8];              /**< SNAPSHOT_MAGIC, not null-terminated */
+    uint32_t version;           /**< SNAPSHOT_VERSION */
+    uint32_t precision;         /**< size of coordinates (4 or 8 bytes) */
+    uint32_t natoms;            /**< number of atoms */
+    uint32_t offset;            /**< length of each array */
+    double min_ext[3];          /**< domain extents, as given to */
+    double max_ext[3];          /**< sotl_domain_init() */
+} sotl_snapshot_header_t;
+
+/**
+ * Check whether a file starts with the snapshot magic.
+ */
+bool snapshot_probe(const char *filename);
+
+/**
+ * Read and check the header of a snapshot.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns -errno if the file can not be read, or
+ *         SOTL_INVALID_VALUE if it is not a valid snapshot.
+ */
+int snapshot_read_header(const char *filename, sotl_snapshot_header_t *header);
+
+/**
+ * Write a snapshot of an atom set.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns -errno.
+ */
+int snapshot_write(const char *filename, const sotl_domain_t *dom,
+                   const sotl_atom_set_t *set);
+
+/**
+ * Load a snapshot into set. When the file has the precision of calc_t, it
+ * is mapped privately and set points into the mapping (changes are not
+ * written back). Otherwise values are copied into a newly allocated set.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - -errno if the file can not be read or mapped
+ *         - SOTL_INVALID_VALUE if the file is not a valid snapshot, or if
+ *           its ids are not a permutation of [0, natoms)
+ *         - SOTL_OUT_OF_MEMORY if the converted set can not be allocated
+ */
+int snapshot_load(const char *filename, sotl_atom_set_t *set);
+
+#endif /* __SNAPSHOT_H */
@@ -50,8 +50,73 @@ typedef enum {
     LJ_SIGMA,
     LJ_EPSILON,
     LJ_RCUT,
+
+    /* Verlet lists parameters. */
+    VERLET_SKIN,
+
+    /* Pair potential parameters. */
+    POTENTIAL_TYPE,
+    MORSE_ALPHA,
+
+    /* Multiple time stepping parameters. */
+    MD_RESPA_STEPS,
+    MD_RESPA_CUTOFF,
+
+    /* Adaptive time step parameters. */
+    MD_ADAPTIVE_DISPLACEMENT,
+    MD_DELTA_T_MAX,
 } sotl_parameters;
 
+typedef enum {
+    SOTL_POTENTIAL_LJ = 0,      /* Lennard-Jones */
+    SOTL_POTENTIAL_MORSE,       /* Morse, with the minimum of Lennard-Jones */
+    SOTL_POTENTIAL_SOFT_SPHERE, /* Repulsive part of Lennard-Jones only */
+} sotl_potential_type;
+
+typedef enum {
+    SOTL_TRAJECTORY_BLOCK = 0,  /* Wait for the writer when it falls behind */
+    SOTL_TRAJECTORY_DROP,       /* Drop frames when it falls behind */
+} sotl_trajectory_policy;
+
+/* Number of bins of the speed histogram of observables. */
+#define SOTL_SPEED_BINS 32
+
+/*
+ * Observables of the system (atoms have unit masses and k_B = 1). Speeds
+ * are the ones atoms moved at during the step, half a step after the
+ * positions the potential energy is computed at.
+ */
+typedef struct {
+    unsigned long iter;         /* Iteration of the sample */
+    unsigned natoms;
+    double kinetic;             /* Kinetic energy */
+    double potential;           /* Pair energy, shifted to 0 at the cutoff */
+    double temperature;         /* 2 kinetic / (3 natoms) */
+    double momentum[3];         /* Total momentum */
+    double bin_width;           /* Width of the speed bins */
+    unsigned histogram[SOTL_SPEED_BINS];    /* Atoms per speed bin, the
+                                             * last one with all faster
+                                             * atoms */
+} sotl_observables_t;
+
+/* Phases of an iteration timed in benchmark mode. */
+typedef enum {
+    SOTL_PHASE_STEP = 0,        /* Force evaluation and move on all devices */
+    SOTL_PHASE_EXCHANGE,        /* Atoms exchanged between devices */
+    SOTL_PHASE_ITERATION,       /* Whole iteration */
+    SOTL_NB_PHASES
+} sotl_phase;
+
+/*
+ * Timings of the last sotl_main_loop() in benchmark mode, in µs per
+ * timed iteration.
+ */
+typedef struct {
+    unsigned natoms;
+    unsigned nb_iter;           /* Timed iterations */
+    double phase[SOTL_NB_PHASES];
+} sotl_timings_t;
+
 /**
  * Display a log message.
  */
@@ -87,6 +152,132 @@ void sotl_enable_verbose();
  */
 void sotl_enable_dump();
 
+/**
+ * Enable dump positions, as a binary snapshot ("dump.sotl") instead of a
+ * text file ("dump.conf").
+ */
+void sotl_enable_binary_dump();
+
+/**
+ * Enable box mode (atoms are sorted into boxes of size LJ_RCUT and only
+ * neighbouring boxes are visited when computing forces).
+ */
+void sotl_enable_box_mode();
+
+/**
+ * Enable Verlet mode (CPU backends keep a list of neighbours closer than
+ * LJ_RCUT + VERLET_SKIN for each atom, and only rebuild it when an atom
+ * moved more than VERLET_SKIN / 2). Ignored with multiple devices.
+ */
+void sotl_enable_verlet_mode();
+
+/**
+ * Enable half-pair mode (the OpenMP backend computes each interaction only
+ * once and applies opposite forces to both atoms).
+ */
+void sotl_enable_half_pair_mode();
+
+/**
+ * Enable NUMA mode (the OpenMP backend splits the domain along z into one
+ * slab per NUMA node, places the atoms of each slab on its node and only
+ * lets threads pinned to the node handle them). Page placement and NUMA
+ * allocation counters are reported at the end.
+ */
+void sotl_enable_numa_mode();
+
+/**
+ * Enable torus mode (periodic boundaries along x, y and z instead of
+ * walls). Atoms close to a face of the domain interact with the atoms
+ * close to the opposite face, through images replicated into the padding
+ * boxes. This requires the box mode on a single OpenMP or OpenCL device,
+ * without Verlet lists, half pairs, NUMA mode nor cluster pairs.
+ */
+void sotl_enable_torus_mode();
+
+/**
+ * Enable cluster-pair mode (OpenCL box mode only). Atoms of each row of
+ * boxes are grouped into clusters of CLUSTER_SIZE consecutive atoms, pairs
+ * of clusters are pruned by bounding box distance and forces are computed
+ * by dense CLUSTER_SIZE x CLUSTER_SIZE tiles, one work-group per cluster.
+ */
+void sotl_enable_cluster_mode();
+
+/**
+ * Enable mixed precision (double precision builds only). Pair forces are
+ * evaluated in float from a float copy of the force table, while forces
+ * are accumulated and positions and speeds are integrated in double.
+ */
+void sotl_enable_mixed_precision();
+
+/**
+ * Sort atoms along a Morton curve of their boxes every period iterations,
+ * so that atoms close in space are close in memory (0 disables it).
+ */
+void sotl_enable_reordering(const unsigned period);
+
+/**
+ * With multiple devices, measure the step time of each device and move the
+ * z boundaries between them every period iterations, so that faster devices
+ * get more atoms (0 disables it). Imbalance and migrated atoms are logged.
+ */
+void sotl_enable_rebalancing(const unsigned period);
+
+/**
+ * Write positions of all atoms to a trajectory file every period
+ * iterations. Frames are captured into a small ring of host buffers and
+ * written by a background thread while the next iterations run. When the
+ * writer falls behind, the simulation waits for it or frames are dropped,
+ * according to policy (one of sotl_trajectory_policy).
+ */
+void sotl_enable_trajectory(const char *filename, const unsigned period,
+                            const unsigned policy);
+
+/**
+ * Sample observables every period iterations: the potential energy is
+ * accumulated by the force pass and speeds are reduced on the devices, so
+ * that only a few values per device are read back. Samples are also
+ * written to filename, one per line, unless it is NULL.
+ */
+void sotl_enable_observables(const char *filename, const unsigned period);
+
+/**
+ * Get the last sample of observables (see sotl_enable_observables).
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - SOTL_INVALID_VALUE if no sample was taken yet
+ */
+int sotl_get_observables(sotl_observables_t *obs);
+
+/**
+ * Keep the begin and end of every phase of each device (sort, force, move,
+ * ...) and write them to filename as a Chrome trace-event file when SOTL
+ * is finalized. Phases of OpenCL devices are timed by their commands.
+ */
+void sotl_enable_trace(const char *filename);
+
+/**
+ * Run nb_iter iterations before sotl_main_loop() starts timing, so that
+ * caches, OpenCL programs and Verlet lists are warm.
+ */
+void sotl_set_warmup(const unsigned nb_iter);
+
+/**
+ * Time each phase of the iterations of sotl_main_loop() (see sotl_phase).
+ * OpenCL devices are waited for at the end of each step, so that their
+ * time is not charged to the next phase.
+ */
+void sotl_enable_benchmark(void);
+
+/**
+ * Get the timings of the last sotl_main_loop() in benchmark mode.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - SOTL_INVALID_VALUE if no iteration was timed
+ */
+int sotl_get_timings(sotl_timings_t *timings);
+
 /**
  * Add an OpenCL device by type.
  *
@@ -170,6 +361,38 @@ int sotl_get_selected_mics();
 int sotl_domain_init(const double *xrange, const double *yrange,
                      const double *zrange, const double *cellbox,
                      const unsigned natoms);
+
+/**
+ * Initialize the domain and the atoms from a binary snapshot, instead of
+ * sotl_domain_init() and sotl_add_atom(). Atoms are mapped from the file
+ * (changes are not written back) when it has the precision of this build,
+ * otherwise they are converted.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - -errno if the file can not be read or mapped
+ *         - SOTL_INVALID_VALUE if the file is not a valid snapshot
+ *         - SOTL_OUT_OF_MEMORY if the converted atoms can not be allocated
+ */
+int sotl_load_snapshot(const char *filename);
+
+/**
+ * Initialize the domain and the atoms from a text configuration file,
+ * instead of sotl_domain_init() and sotl_add_atom(). The file is mapped and
+ * parsed in parallel, straight into the global atom set.
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns one of the following errors :
+ *         - -errno if the file can not be read or mapped
+ *         - SOTL_INVALID_VALUE if the file is not a valid configuration
+ *         - SOTL_OUT_OF_MEMORY if the atoms can not be allocated
+ */
+int sotl_load_conf(const char *filename);
+
+/**
+ * Check whether a file is a binary snapshot (rather than a text file).
+ */
+int sotl_is_snapshot(const char *filename);
 /**
  * Set a parameter.
  *
@@ -182,10 +405,21 @@ int sotl_domain_init(const double *xrange, const double *yrange,
  *  - LJ_SIGMA      (double)
  *  - LJ_EPSILON    (double)
  *  - LJ_RCUT       (double)
+ *  - VERLET_SKIN   (double)
+ *  - POTENTIAL_TYPE (unsigned, one of sotl_potential_type)
+ *  - MORSE_ALPHA   (double, stiffness of the Morse well in 1 / r0 units)
+ *  - MD_RESPA_STEPS  (unsigned, inner steps per step, 1 without RESPA)
+ *  - MD_RESPA_CUTOFF (double, distance below which forces are inner ones)
+ *  - MD_ADAPTIVE_DISPLACEMENT (double, bound on the distance an atom moves
+ *    in one (inner) step, 0 for a fixed time step)
+ *  - MD_DELTA_T_MAX  (double, largest time step of the adaptive mode)
  *
  * @return Return SOTL_SUCCESS if the function is executed successfully.
  *         Otherwise, it returns one of the following errors :
  *         - SOTL_INVALID_PARAMETER if the parameter name is invalid
+ *         - SOTL_INVALID_VALUE if the potential type is unknown, the
+ *           number of RESPA steps is null, the displacement bound is
+ *           negative or the largest time step is not positive
  */
 int sotl_set_parameter(const unsigned int name, const void *value);
 
@@ -204,7 +438,8 @@ const void *sotl_get_parameter(const unsigned int name);
 /**
  * Synchronize all atom ids, positions and speeds.
  *
- * @param ids       Pointer to the array of ids (unused, set it to NULL).
+ * @param ids       Pointer to the array of ids, ie. the index of each atom in
+ *                  input order (may be NULL).
  * @param pos_x     Pointer to the array of positions in X.
  * @param pos_x     Pointer to the array of positions in Y.
  * @param pos_x     Pointer to the array of positions in Z.
@@ -223,12 +458,24 @@ int sotl_sync_all_atoms(unsigned *ids, calc_t *pos_x, calc_t *pos_y,
                         calc_t *spd_z, const unsigned natoms);
 
 /**
- * Update position 1.
+ * First half of a step of velocity Verlet: kick speeds by the forces of
+ * the current positions over half a time step, then move atoms over a
+ * whole time step.
+ *
+ * sotl_main_loop() merges the second half kick of a step with the first
+ * one of the next step, which takes a single force evaluation per step;
+ * calling sotl_push_pos_1() and sotl_push_pos_2() takes two, but leaves
+ * speeds synchronized with positions. RESPA inner steps are not used.
+ *
+ * @return Return SOTL_SUCCESS.
  */
 int sotl_push_pos_1();
 
 /**
- * Update position 2.
+ * Second half of a step of velocity Verlet: kick speeds by the forces of
+ * the new positions over half a time step.
+ *
+ * @return Return SOTL_SUCCESS.
  */
 int sotl_push_pos_2();
 
@@ -251,7 +498,8 @@ void sotl_add_atom (calc_t x, calc_t y, calc_t z,
 void sotl_add_random_atom();
 
 /**
- * Distribute atoms among selected devices.
+ * Distribute atoms among selected devices. At most one sequential and one
+ * OpenMP device may be selected (SOTL_INVALID_DEVICE otherwise).
  */
 int sotl_runtime_init();
 
@@ -263,6 +511,12 @@ void sotl_main_loop (unsigned nb_iter);
 //
 int sotl_dump_positions(const char *filename);
 
+// Dump atom positions to disk as a binary snapshot, which can be loaded
+// with sotl_load_snapshot(). Like sotl_dump_positions(), it may be called
+// before sotl_runtime_init() to convert an input file.
+//
+int sotl_dump_snapshot(const char *filename);
+
 #ifdef __cplusplus
 }
 #endif
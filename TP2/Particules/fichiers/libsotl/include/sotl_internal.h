@@ -7,6 +7,10 @@ typedef struct {
     /* Molecular dynamics parameters. */
     struct {
         double delta_t;
+        unsigned respa_steps;
+        double respa_cutoff;
+        double adaptive_displacement;
+        double delta_t_max;
     } md;
 
     /* Lennard Jones parameters. */
@@ -15,6 +19,17 @@ typedef struct {
         double epsilon;
         double rcut;
     } lj;
+
+    /* Verlet lists parameters. */
+    struct {
+        double skin;
+    } verlet;
+
+    /* Pair potential parameters. */
+    struct {
+        unsigned type;
+        double morse_alpha;
+    } potential;
 } sotl_params_t;
 
 sotl_params_t *get_params();
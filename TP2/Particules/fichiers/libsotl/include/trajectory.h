@@ -0,0 +1,54 @@
+#ifndef __TRAJECTORY_H
+#define __TRAJECTORY_H
+
+#include <stdint.h>
+
+#define TRAJECTORY_MAGIC    "SOTLTRAJ"
+#define TRAJECTORY_VERSION  1
+
+/* Number of frames that can be captured before the writer catches up. */
+#define TRAJECTORY_RING_SIZE 4
+
+/**
+ * Header of a trajectory file, in native byte order.
+ *
+ * It is followed by frames made of the step number (64-bit), then x, y and
+ * z of all atoms in input order (natoms values of precision bytes each).
+ */
+typedef struct {
+    char magic[8];              /**< TRAJECTORY_MAGIC, not null-terminated */
+    uint32_t version;           /**< TRAJECTORY_VERSION */
+    uint32_t precision;         /**< size of coordinates (4 or 8 bytes) */
+    uint32_t natoms;            /**< number of atoms */
+    uint32_t padding;
+} sotl_trajectory_header_t;
+
+/**
+ * Create the trajectory file, the ring of frames and the writer thread.
+ *
+ * @param filename The trajectory file.
+ * @param natoms The total number of atoms.
+ * @param policy What to do when the ring is full (sotl_trajectory_policy).
+ *
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns -errno, or SOTL_OUT_OF_MEMORY if the ring
+ *         can not be allocated.
+ */
+int trajectory_open(const char *filename, const unsigned natoms,
+                    const unsigned policy);
+
+/**
+ * Capture positions of all devices into a free frame of the ring, which the
+ * writer thread reorders and writes while the next steps run. OpenCL
+ * devices read back asynchronously, so the transfer overlaps the next steps
+ * as well. When no frame is free, wait for the writer or drop this one,
+ * depending on the policy.
+ */
+void trajectory_capture(const unsigned long step);
+
+/**
+ * Write the pending frames, stop the writer thread and close the file.
+ */
+void trajectory_close(void);
+
+#endif /* __TRAJECTORY_H */
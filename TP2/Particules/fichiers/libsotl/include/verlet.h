@@ -0,0 +1,72 @@
+#ifndef __VERLET_H
+#define __VERLET_H
+
+#include <stdbool.h>
+
+#include "atom.h"
+#include "cell.h"
+#include "default_defines.h"
+#include "domain.h"
+
+/**
+ * A structure to represent Verlet neighbour lists.
+ *
+ * Each atom stores all atoms closer than cutoff + skin. Lists are reused
+ * until one atom has moved more than skin / 2 since the last build: no
+ * pair can have entered the cutoff sphere before that.
+ */
+typedef struct {
+    unsigned *start;        /**< first neighbour of each atom (natoms + 1) */
+    unsigned *neighbours;   /**< neighbour indexes of all atoms */
+    size_t size;            /**< capacity of the neighbours array */
+    calc_t *ref_pos;        /**< positions at last build (x, y, z blocks) */
+    calc_t max_disp2;       /**< largest squared displacement since last build */
+    unsigned natoms;        /**< number of atoms at last build */
+    unsigned capacity;      /**< maximum number of atoms */
+    bool valid;             /**< false until the first build */
+    bool half;              /**< only neighbours with a greater index are stored */
+    unsigned long nb_builds;    /**< number of builds */
+    unsigned long nb_checks;    /**< number of displacement checks */
+} sotl_verlet_list_t;
+
+/**
+ * Allocate Verlet lists.
+ *
+ * @param list The lists to initialize.
+ * @param maxatoms The maximum number of atoms.
+ * @return Return SOTL_SUCCESS if the function is executed successfully.
+ *         Otherwise, it returns SOTL_OUT_OF_MEMORY.
+ */
+int verlet_list_init(sotl_verlet_list_t *list, const unsigned maxatoms);
+
+/**
+ * Free memory allocated by Verlet lists.
+ */
+void verlet_list_free(sotl_verlet_list_t *list);
+
+/**
+ * Check whether the lists have to be rebuilt, ie. if one atom moved more
+ * than skin / 2 since the last build.
+ *
+ * Can be called from inside an OpenMP parallel region (by all threads).
+ */
+bool verlet_list_needs_update(sotl_verlet_list_t *list,
+                              const sotl_atom_set_t *set, const calc_t skin);
+
+/**
+ * Build the lists of all atoms closer than cutoff + skin, using the cell
+ * list to find candidates. With half lists, each pair is only stored once
+ * (in the list of the atom with the lower index).
+ *
+ * Can be called from inside an OpenMP parallel region (by all threads).
+ */
+void verlet_list_build(sotl_verlet_list_t *list, sotl_cell_list_t *cells,
+                       const sotl_domain_t *dom, const sotl_atom_set_t *set,
+                       const calc_t skin, const bool half);
+
+/**
+ * Report the rebuild frequency of the lists.
+ */
+void verlet_list_print_stats(const sotl_verlet_list_t *list);
+
+#endif /* __VERLET_H */
@@ -14,6 +14,15 @@
 #define calc_t double
 #endif
 
+// In mixed precision, pair forces are evaluated in float and accumulated
+// in double, and the force table is uploaded in float
+//
+#if USE_DOUBLE == 1 && defined(MIXED_PRECISION)
+#define force_t float
+#else
+#define force_t calc_t
+#endif
+
 static inline coord_t load3coord (__global calc_t * pos, int offset)
 {
     coord_t f;
@@ -45,17 +54,40 @@ static inline calc_t squared_dist(coord_t a, coord_t b)
   return dot(f, f);
 }
 
-static inline calc_t lj_squared_v(calc_t r2)
+// F(r) / r of the pair potential, linearly interpolated from the table
+// built on the host (one entry every 1 / POT_TABLE_INV_STEP along r²)
+//
+static inline force_t pot_force(force_t r2, __constant force_t *pot_table)
 {
-    calc_t rr2 = 1.0 / r2;
-    calc_t r6;
+    force_t x = r2 * (force_t)POT_TABLE_INV_STEP;
+    unsigned i = (unsigned)x;
+    force_t t = x - i;
 
-    r6 = LENNARD_SIGMA * LENNARD_SIGMA * rr2;
-    r6 = r6 * r6 * r6;
+    return pot_table[i] + t * (pot_table[i + 1] - pot_table[i]);
+}
 
-    calc_t de = 24 * LENNARD_EPSILON * rr2 * (2.0f * r6 * r6 - r6);
+// Force applied on an atom by another one at distance d (r2 = |d|²)
+//
+static inline coord_t pair_force(coord_t d, calc_t r2,
+				 __constant force_t *pot_table)
+{
+#if USE_DOUBLE == 1 && defined(MIXED_PRECISION)
+    return convert_double3 (pot_force ((float)r2, pot_table) * convert_float3 (d));
+#else
+    return pot_force (r2, pot_table) * d;
+#endif
+}
+
+// Energy U(r) - U(rc) of a pair, from the energy table built on the host
+// (observables only)
+//
+static inline calc_t pair_energy(calc_t r2, __global calc_t *energy_table)
+{
+    calc_t x = r2 * (calc_t)POT_TABLE_INV_STEP;
+    unsigned i = (unsigned)x;
+    calc_t t = x - i;
 
-    return de;
+    return energy_table[i] + t * (energy_table[i + 1] - energy_table[i]);
 }
 
 static inline void get_boxes (const coord_t coord, __constant calc_t *min_buffer,
@@ -107,15 +139,141 @@ static inline int get_num_box_from_coord (const coord_t coord,
     return get_num_box(box_x, box_y, box_z, domain_buff);
 }
 
+// With ADAPTIVE_STEP, each work-group also reduces the largest squared
+// speed and squared speed increment by forces (written in kick_buffer by
+// the force kernels, which is cleared for the next step) of its atoms into
+// stats_buffer, read back by the host to pick the next time step. The
+// work-group size is a power of two
+//
 __kernel
 void update_position(__global calc_t *pos, __global calc_t *spd,
                      __constant calc_t *min, __constant calc_t *max,
-                     unsigned offset)
+                     unsigned offset, calc_t drift,
+                     __global calc_t *kick_buffer, __global calc_t *stats_buffer)
 {
     const unsigned gid = get_global_id(0);
     coord_t my_spd = load3coord(spd + gid, offset);
 
-    inc3coord (pos + gid, my_spd, offset);
+    inc3coord (pos + gid, my_spd * drift, offset);
+
+#ifdef TORUS
+    /* Back into the period, as omp_move_atom does: atoms move much less
+     * than a period per step. */
+    for (int i = 0; i < 3; i++) {
+      calc_t p = pos[gid + i * offset];
+
+      if (p >= max[i])
+        p -= max[i] - min[i];
+      else if (p < min[i]) {
+        p += max[i] - min[i];
+        if (p >= max[i])
+          p = min[i];
+      }
+      pos[gid + i * offset] = p;
+    }
+#endif
+
+#ifdef ADAPTIVE_STEP
+    __local calc_t max_spd[TILE_SIZE], max_kick[TILE_SIZE];
+    const unsigned lid = get_local_id(0);
+
+    max_spd[lid] = dot (my_spd, my_spd);
+    max_kick[lid] = kick_buffer[gid];
+    kick_buffer[gid] = 0;
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned s = get_local_size(0) / 2; s > 0; s >>= 1) {
+      if (lid < s) {
+        max_spd[lid] = fmax (max_spd[lid], max_spd[lid + s]);
+        max_kick[lid] = fmax (max_kick[lid], max_kick[lid + s]);
+      }
+      barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+      stats_buffer[2 * get_group_id(0)] = max_spd[0];
+      stats_buffer[2 * get_group_id(0) + 1] = max_kick[0];
+    }
+#endif
+}
+
+// With OBSERVABLES, on sampled steps, each work-group reduces the kinetic
+// energy, the potential energy (half the energy of the pairs of each atom,
+// written in energy_buffer by the force kernels, which is cleared for the
+// next sample), the momentum and the speed histogram of atoms [begin, end[
+// into OBS_VALUES values of obs_buffer. The work-group size is a power of
+// two
+//
+#define OBS_VALUES (5 + SPEED_BINS)
+
+__kernel
+void observables (__global calc_t *spd, unsigned offset,
+		  unsigned begin, unsigned end, calc_t bin_width,
+		  __global calc_t *energy_buffer, __global calc_t *obs_buffer)
+{
+#ifdef OBSERVABLES
+  __local calc_t sums[5][TILE_SIZE];
+  __local unsigned histogram[SPEED_BINS];
+  const unsigned gid = get_global_id (0);
+  const unsigned lid = get_local_id (0);
+  __global calc_t *group_obs = obs_buffer + get_group_id (0) * OBS_VALUES;
+
+  for (unsigned b = lid; b < SPEED_BINS; b += get_local_size (0))
+    histogram[b] = 0;
+
+  for (int v = 0; v < 5; v++)
+    sums[v][lid] = 0;
+
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  if (gid >= begin && gid < end) {
+    coord_t my_spd = load3coord (spd + gid, offset);
+    calc_t v2 = dot (my_spd, my_spd);
+    unsigned bin = (unsigned) fmin (sqrt (v2) / bin_width,
+				    (calc_t)(SPEED_BINS - 1));
+
+    sums[0][lid] = 0.5 * v2;
+    sums[1][lid] = energy_buffer[gid];
+    sums[2][lid] = my_spd.x;
+    sums[3][lid] = my_spd.y;
+    sums[4][lid] = my_spd.z;
+    atomic_inc (&histogram[bin]);
+  }
+  if (gid < offset)
+    energy_buffer[gid] = 0;
+
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  for (unsigned s = get_local_size (0) / 2; s > 0; s >>= 1) {
+    if (lid < s)
+      for (int v = 0; v < 5; v++)
+	sums[v][lid] += sums[v][lid + s];
+    barrier (CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid < 5)
+    group_obs[lid] = sums[lid][0];
+  for (unsigned b = lid; b < SPEED_BINS; b += get_local_size (0))
+    group_obs[5 + b] = histogram[b];
+#endif
+}
+
+// Sum the observables of ngroups work-groups into the first ones. This
+// kernel is executed with one thread per value (OBS_VALUES)
+//
+__kernel
+void reduce_observables (__global calc_t *obs_buffer, unsigned ngroups)
+{
+  const unsigned v = get_global_id (0);
+  calc_t sum = 0;
+
+  if (v >= OBS_VALUES)
+    return;
+
+  for (unsigned g = 0; g < ngroups; g++)
+    sum += obs_buffer[g * OBS_VALUES + v];
+  obs_buffer[v] = sum;
 }
 
 // This kernel is executed with offset x 3 threads
@@ -189,7 +347,11 @@ void gravity (__global calc_t * speed, calc_t gx, calc_t gy, calc_t gz,
 __kernel
 void lennard_jones (__global calc_t * pos,
 		       __global calc_t * speed,
-		       unsigned natoms, unsigned offset)
+		       unsigned natoms, unsigned offset,
+		       __constant force_t * pot_table,
+		       __global calc_t * kick_buffer,
+		       __global calc_t * energy_table,
+		       __global calc_t * energy_buffer, unsigned sample)
 {
     unsigned index = get_global_id (0);
     unsigned local_id = get_local_id (0);
@@ -198,6 +360,7 @@ void lennard_jones (__global calc_t * pos,
     mypos = load3coord (pos + index, offset);
 
     coord_t force = { 0.0f, 0.0f, 0.0f };
+    calc_t energy = 0;
 
     __local coord_t tile[TILE_SIZE];
     unsigned nb_blocs = get_num_groups(0); // ROUND (natoms) / TILE_SIZE;
@@ -213,16 +376,29 @@ void lennard_jones (__global calc_t * pos,
         {
             coord_t opos = tile[i % TILE_SIZE];
             calc_t dist = squared_dist (mypos, opos);
-            if (dist < LENNARD_SQUARED_CUTOFF)
-	      force += lj_squared_v(dist) * (mypos - opos);
+            if (dist < LENNARD_SQUARED_CUTOFF) {
+	      force += pair_force(mypos - opos, dist, pot_table);
+#ifdef OBSERVABLES
+	      if (sample)
+		energy += pair_energy(dist, energy_table);
+#endif
+	    }
         }
 
         barrier (CLK_LOCAL_MEM_FENCE);
     }
 
     // update speed
-    if (index < natoms)
+    if (index < natoms) {
       inc3coord (speed + index, force, offset);
+#ifdef ADAPTIVE_STEP
+      kick_buffer[index] = dot (force, force);
+#endif
+#ifdef OBSERVABLES
+      if (sample)
+	energy_buffer[index] = 0.5 * energy;
+#endif
+    }
 }
 
 __kernel void null_kernel (void)
@@ -299,9 +475,9 @@ void copy_buffer (__global unsigned * buff_dst, __global unsigned* buff_src, uns
 
 /**
  * This kernel counts the number of atoms per boxes (including ghosts and
- * leaving atoms). In single device, this is the default version. In multi
- * devices, this is currently used in order to count ghosts which are located
- * on min/max borders.
+ * leaving atoms) of [begin, end[. In single device, this is the default
+ * version. In multi devices, it also counts own atoms alone (without ghosts)
+ * before exchanges, see ocl_sort_own_atoms().
  */
 __kernel
 void box_count_all_atoms(__global calc_t *pos_buff, __global int *box_buff,
@@ -320,13 +496,99 @@ void box_count_all_atoms(__global calc_t *pos_buff, __global int *box_buff,
     atomic_inc(&box_buff[num_box]);
 }
 
+/**
+ * First step of the exclusive prefix sum of buffer[begin, end[ (the number
+ * of atoms per box, giving the first atom of each box): each work-group of
+ * SCAN_WG_SIZE threads scans a block of 2 * SCAN_WG_SIZE values in local
+ * memory, and stores the sum of the block in block_sums.
+ */
+__kernel
+void scan (__global int *buffer, __global int *block_sums,
+	   unsigned begin, unsigned end)
+{
+  __local int tmp[2 * SCAN_WG_SIZE];
+  const unsigned lid = get_local_id (0);
+  const unsigned first = begin + get_group_id (0) * 2 * SCAN_WG_SIZE;
+  const unsigned a = first + lid, b = a + SCAN_WG_SIZE;
+  unsigned stride = 1;
+
+  tmp[lid] = a < end ? buffer[a] : 0;
+  tmp[lid + SCAN_WG_SIZE] = b < end ? buffer[b] : 0;
+
+  // Up-sweep: sums of sub-blocks of increasing size
+  for (unsigned d = SCAN_WG_SIZE; d > 0; d >>= 1) {
+    barrier (CLK_LOCAL_MEM_FENCE);
+    if (lid < d)
+      tmp[stride * (2 * lid + 2) - 1] += tmp[stride * (2 * lid + 1) - 1];
+    stride *= 2;
+  }
+
+  if (lid == 0) {
+    block_sums[get_group_id (0)] = tmp[2 * SCAN_WG_SIZE - 1];
+    tmp[2 * SCAN_WG_SIZE - 1] = 0;
+  }
+
+  // Down-sweep: each sub-block gets the sum of the ones before it
+  for (unsigned d = 1; d < 2 * SCAN_WG_SIZE; d *= 2) {
+    stride >>= 1;
+    barrier (CLK_LOCAL_MEM_FENCE);
+    if (lid < d) {
+      const unsigned left = stride * (2 * lid + 1) - 1;
+      const unsigned right = stride * (2 * lid + 2) - 1;
+      int t = tmp[left];
+
+      tmp[left] = tmp[right];
+      tmp[right] += t;
+    }
+  }
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  if (a < end)
+    buffer[a] = tmp[lid];
+  if (b < end)
+    buffer[b] = tmp[lid + SCAN_WG_SIZE];
+}
+
+/**
+ * Second step of the prefix sum: the values of each block are shifted by
+ * the sum of the blocks before it (same work-groups as scan).
+ */
+__kernel
+void scan_down_step (__global int *buffer, __global int *block_sums,
+		     unsigned begin, unsigned end)
+{
+  __local int sums[SCAN_WG_SIZE];
+  const unsigned lid = get_local_id (0);
+  const unsigned group = get_group_id (0);
+  const unsigned a = begin + group * 2 * SCAN_WG_SIZE + lid;
+  const unsigned b = a + SCAN_WG_SIZE;
+  int sum = 0;
+
+  for (unsigned g = lid; g < group; g += SCAN_WG_SIZE)
+    sum += block_sums[g];
+  sums[lid] = sum;
+
+  for (unsigned d = SCAN_WG_SIZE / 2; d > 0; d >>= 1) {
+    barrier (CLK_LOCAL_MEM_FENCE);
+    if (lid < d)
+      sums[lid] += sums[lid + d];
+  }
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  if (a < end)
+    buffer[a] += sums[0];
+  if (b < end)
+    buffer[b] += sums[0];
+}
+
 __attribute__((vec_type_hint(int)))
 
 
 /**
- * This kernel sorts atoms (including ghosts and leaving atoms). In single
- * device, this is the default version. In multi devices, this is currently
- * used in order to sort ghosts which are located on min/max borders.
+ * This kernel sorts atoms (including ghosts and leaving atoms) of
+ * [begin, end[. In single device, this is the default version. In multi
+ * devices, it also sorts own atoms alone before exchanges, see
+ * ocl_sort_own_atoms().
  */
 __attribute__((vec_type_hint(calc_t)))
 __kernel
@@ -334,7 +596,9 @@ void box_sort_all_atoms(__global calc_t *pos_buff, __global calc_t *alt_pos_buff
 		        __global calc_t *spd_buff, __global calc_t *alt_spd_buff,
 		        __global int *calc_offset_buff, __constant calc_t *min_buff,
 		        __constant int *domain_buff, unsigned offset,
-                        unsigned begin, unsigned end)
+                        unsigned begin, unsigned end,
+                        __global unsigned *id_buff,
+                        __global unsigned *alt_id_buff)
 {
     unsigned gid = get_global_id(0) + begin;
     coord_t my_pos, my_spd;
@@ -348,10 +612,228 @@ void box_sort_all_atoms(__global calc_t *pos_buff, __global calc_t *alt_pos_buff
 
     int shift_atom = atomic_inc(calc_offset_buff + num_box);
 
-    /* Sort atom position and speed. */
+    /* Sort atom position, speed and id (box offsets start at begin). */
     my_spd = load3coord(spd_buff + gid, offset);
-    store3coord(alt_pos_buff + shift_atom, my_pos, offset);
-    store3coord(alt_spd_buff + shift_atom, my_spd, offset);
+    store3coord(alt_pos_buff + begin + shift_atom, my_pos, offset);
+    store3coord(alt_spd_buff + begin + shift_atom, my_spd, offset);
+    alt_id_buff[begin + shift_atom] = id_buff[gid];
+}
+
+// Torus mode: box coordinates of a position in a periodic domain, whose
+// boxes are stretched to a whole number per period, clamped to the boxes
+// of the domain (positions are wrapped and images lie in padding boxes, up
+// to rounding)
+//
+static inline void torus_get_boxes (const coord_t coord, __constant calc_t *min_buffer,
+				    __constant int *domain_buff, int *box)
+{
+#ifdef TORUS
+  box[0] = clamp ((int) ((coord.x - min_buffer[0]) * (calc_t)TORUS_INV_X), 0,
+		  domain_buff[0] - 1);
+  box[1] = clamp ((int) ((coord.y - min_buffer[1]) * (calc_t)TORUS_INV_Y), 0,
+		  domain_buff[1] - 1);
+  box[2] = clamp ((int) ((coord.z - min_buffer[2]) * (calc_t)TORUS_INV_Z), 0,
+		  domain_buff[2] - 1);
+#endif
+}
+
+// Torus mode: inner box of an atom, where its position lies once wrapped
+//
+static inline void torus_inner_box (int *box, __constant int *domain_buff)
+{
+  for (int i = 0; i < 3; i++)
+    box[i] = clamp (box[i], SUBCELL, domain_buff[i] - SUBCELL - 1);
+}
+
+// Torus mode: boxes of an atom and of its periodic images (own box first),
+// and the shifts of the images, as omp_torus_boxes() on the host. Atoms of
+// the first (last) SUBCELL layers of boxes along an axis are replicated
+// one period away, into the padding boxes past the last (before the first)
+// layer. Returns the number of boxes (up to 8)
+//
+static inline unsigned torus_boxes (const coord_t coord, __constant calc_t *min_buffer,
+				    __constant int *domain_buff, int *boxes,
+				    coord_t *shift)
+{
+#ifdef TORUS
+  const calc_t length[3] = { TORUS_LENGTH_X, TORUS_LENGTH_Y, TORUS_LENGTH_Z };
+  int box[3], c[3][2];
+  calc_t delta[3][2];
+  unsigned nb[3], count = 0;
+
+  torus_get_boxes (coord, min_buffer, domain_buff, box);
+  torus_inner_box (box, domain_buff);
+
+  for (int i = 0; i < 3; i++) {
+    const int period = domain_buff[i] - 2 * SUBCELL;
+
+    c[i][0] = box[i];
+    delta[i][0] = 0;
+    nb[i] = 1;
+
+    if (box[i] < 2 * SUBCELL) {
+      c[i][1] = box[i] + period;
+      delta[i][1] = length[i];
+      nb[i] = 2;
+    } else if (box[i] >= period) {
+      c[i][1] = box[i] - period;
+      delta[i][1] = -length[i];
+      nb[i] = 2;
+    }
+  }
+
+  for (unsigned k = 0; k < nb[2]; k++)
+    for (unsigned j = 0; j < nb[1]; j++)
+      for (unsigned i = 0; i < nb[0]; i++) {
+	boxes[count] = get_num_box (c[0][i], c[1][j], c[2][k], domain_buff);
+	shift[count] = (coord_t) (delta[0][i], delta[1][j], delta[2][k]);
+	count++;
+      }
+
+  return count;
+#else
+  return 0;
+#endif
+}
+
+// Torus mode: first box of the inner row of boxes r, rows being numbered
+// along y then z
+//
+static inline int torus_row_box (const int r, __constant int *domain_buff)
+{
+  const int rows_y = domain_buff[1] - 2 * SUBCELL;
+
+  return ((r / rows_y + SUBCELL) * domain_buff[1] + r % rows_y + SUBCELL) *
+    domain_buff[0];
+}
+
+// Torus mode: index, once gathered (see torus_gather), of the atom sorted at
+// index of the inner box num_box, or -1 if it is an image. Own atoms are
+// the ones sorted into the inner boxes of their row, images only lie in
+// padding boxes
+//
+static inline int torus_own_index (const int index, const int num_box,
+				   __global int *box_buffer,
+				   __global int *row_buffer,
+				   __constant int *domain_buff)
+{
+  const int row = num_box / domain_buff[0];
+  const int y = row % domain_buff[1] - SUBCELL;
+  const int z = row / domain_buff[1] - SUBCELL;
+  const int first = box_buffer[row * domain_buff[0] + SUBCELL];
+  const int last = box_buffer[(row + 1) * domain_buff[0] - SUBCELL];
+
+  if (index < first || index >= last)
+    return -1;
+
+  return row_buffer[z * (domain_buff[1] - 2 * SUBCELL) + y] + index - first;
+}
+
+/**
+ * Torus mode: same as box_count_all_atoms, counting periodic images as
+ * well.
+ */
+__kernel
+void torus_count_all_atoms(__global calc_t *pos_buff, __global int *box_buff,
+			   __constant calc_t *min_buff, __constant int *domain_buff,
+			   unsigned offset, unsigned begin, unsigned end)
+{
+    unsigned gid = get_global_id(0) + begin;
+    int boxes[8];
+    coord_t shift[8];
+    unsigned nb;
+
+    if (gid >= end)
+        return;
+
+    nb = torus_boxes(load3coord(pos_buff + gid, offset), min_buff, domain_buff,
+                     boxes, shift);
+    for (unsigned k = 0; k < nb; k++)
+        atomic_inc(&box_buff[boxes[k]]);
+}
+
+/**
+ * Torus mode: same as box_sort_all_atoms, writing periodic images as well.
+ * Atoms and images must fit in the alternate buffers from begin on.
+ */
+__kernel
+void torus_sort_all_atoms(__global calc_t *pos_buff, __global calc_t *alt_pos_buff,
+			  __global calc_t *spd_buff, __global calc_t *alt_spd_buff,
+			  __global int *calc_offset_buff, __constant calc_t *min_buff,
+			  __constant int *domain_buff, unsigned offset,
+			  unsigned begin, unsigned end,
+			  __global unsigned *id_buff,
+			  __global unsigned *alt_id_buff)
+{
+    unsigned gid = get_global_id(0) + begin;
+    coord_t my_pos, my_spd, shift[8];
+    int boxes[8];
+    unsigned nb;
+
+    if (gid >= end)
+        return;
+
+    my_pos = load3coord(pos_buff + gid, offset);
+    my_spd = load3coord(spd_buff + gid, offset);
+    nb = torus_boxes(my_pos, min_buff, domain_buff, boxes, shift);
+
+    for (unsigned k = 0; k < nb; k++) {
+        int shift_atom = atomic_inc(calc_offset_buff + boxes[k]);
+
+        store3coord(alt_pos_buff + begin + shift_atom, my_pos + shift[k], offset);
+        store3coord(alt_spd_buff + begin + shift_atom, my_spd, offset);
+        alt_id_buff[begin + shift_atom] = id_buff[gid];
+    }
+}
+
+/**
+ * Torus mode: number of own atoms of each inner row of boxes (the ones of
+ * its inner boxes), and 0 after the last row, for the exclusive prefix sum
+ * giving the first own atom of each row once gathered.
+ */
+__kernel
+void torus_rows (__global int *box_buffer, __global int *row_buffer,
+		 __constant int *domain_buff)
+{
+  const int nrows = (domain_buff[1] - 2 * SUBCELL) * (domain_buff[2] - 2 * SUBCELL);
+  const int r = get_global_id (0);
+
+  if (r < nrows) {
+    const int row = torus_row_box (r, domain_buff);
+
+    row_buffer[r] = box_buffer[row + domain_buff[0] - SUBCELL] -
+      box_buffer[row + SUBCELL];
+  } else if (r == nrows)
+    row_buffer[r] = 0;
+}
+
+/**
+ * Torus mode: copy own atoms back from the sorted atoms and images into
+ * the alternate buffers, from begin on, where they stay sorted by box.
+ * Each work-group copies an inner row of boxes, which is contiguous along
+ * x.
+ */
+__kernel
+void torus_gather (__global calc_t *pos_buff, __global calc_t *alt_pos_buff,
+		   __global calc_t *spd_buff, __global calc_t *alt_spd_buff,
+		   __global unsigned *id_buff, __global unsigned *alt_id_buff,
+		   __global int *box_buffer, __global int *row_buffer,
+		   __constant int *domain_buff, unsigned offset, unsigned begin)
+{
+  const int r = get_group_id (0);
+  const int row = torus_row_box (r, domain_buff);
+  const int first = box_buffer[row + SUBCELL];
+  const int n = box_buffer[row + domain_buff[0] - SUBCELL] - first;
+  const unsigned src = begin + first;
+  const unsigned dst = begin + row_buffer[r];
+
+  for (int i = get_local_id (0); i < n; i += get_local_size (0)) {
+    store3coord (alt_pos_buff + dst + i, load3coord (pos_buff + src + i, offset),
+		 offset);
+    store3coord (alt_spd_buff + dst + i, load3coord (spd_buff + src + i, offset),
+		 offset);
+    alt_id_buff[dst + i] = id_buff[src + i];
+  }
 }
 
 __attribute__((vec_type_hint(calc_t)))
@@ -365,7 +847,10 @@ void box_force (__global calc_t *pos_buffer,
 		__global calc_t *alt_pos_buffer,
 		__constant calc_t *min, __constant calc_t *max,
 		unsigned offset, unsigned begin,
-		unsigned end)
+		unsigned end, __constant force_t *pot_table,
+		__global calc_t *kick_buffer, __global calc_t *energy_table,
+		__global calc_t *energy_buffer, unsigned sample,
+		__global int *row_buffer)
 {
   const int shift_x = SUBCELL;            
   const int shift_y = domain_buff[0]; // shall be int to avoid promoting cy to unsigned...
@@ -375,14 +860,39 @@ void box_force (__global calc_t *pos_buffer,
   const unsigned gid = get_global_id(0) + (begin & (~(TILE_SIZE - 1)));
   const unsigned wid = get_local_id(0);
   coord_t force_total = { 0.0f, 0.0f, 0.0f };
+  calc_t energy = 0;
   coord_t my_pos;
   int num_box;
   bool is_border;
+  unsigned out = gid;
+  // Local variables must be declared at kernel scope
+  __local coord_t tile_pos[TILE_SIZE];
+  __local unsigned local_min;
+  __local unsigned local_max;
 
   if (gid >= begin && gid < end) {
     /* Pre-compute the box ID of the current work-item. */
     my_pos = load3coord(pos_buffer + gid, offset);
+#ifdef TORUS
+    // Images are borders. Own atoms are gathered once their forces are
+    // known, per-atom values go to their index then
+    //
+    int box[3], own;
+
+    torus_get_boxes (my_pos, min_buffer, domain_buff, box);
+    num_box = get_num_box (box[0], box[1], box[2], domain_buff);
+    torus_inner_box (box, domain_buff);
+    own = torus_own_index (gid - begin,
+			   get_num_box (box[0], box[1], box[2], domain_buff),
+			   box_buffer, row_buffer, domain_buff);
+    is_border = own < 0;
+    if (!is_border) {
+      num_box = get_num_box (box[0], box[1], box[2], domain_buff);
+      out = begin + own;
+    }
+#else
     is_border = get_num_box_ext (&num_box, my_pos, min_buffer, domain_buff);
+#endif
   }
 
   for (int cz = -SUBCELL * shift_z; cz <= SUBCELL * shift_z; cz += shift_z) {
@@ -392,9 +902,6 @@ void box_force (__global calc_t *pos_buffer,
       unsigned current_num_box;
       unsigned my_min_box, my_max_box;
       unsigned min_index, max_index, my_min_index, my_max_index;
-      __local coord_t tile_pos[TILE_SIZE];
-      __local unsigned local_min;
-      __local unsigned local_max;
 
       if(gid >= begin && gid < end) {
 	current_num_box = num_box + cz + cy;
@@ -467,7 +974,11 @@ void box_force (__global calc_t *pos_buffer,
 	      calc_t dist2 = squared_dist(my_pos, atom_checked_position);
 
 	      if(dist2 < LENNARD_SQUARED_CUTOFF) {
-		force_total += lj_squared_v(dist2) * (my_pos - atom_checked_position);
+		force_total += pair_force(my_pos - atom_checked_position, dist2, pot_table);
+#ifdef OBSERVABLES
+		if (sample)
+		  energy += pair_energy(dist2, energy_table);
+#endif
 	      }
 	    }
 	  }
@@ -482,6 +993,19 @@ void box_force (__global calc_t *pos_buffer,
   if (gid >= begin && gid < end)
   {
     force_total *= (calc_t)DELTA_T;
+#ifdef TORUS
+    if (!is_border) {
+#endif
+#ifdef ADAPTIVE_STEP
+    kick_buffer[out] = dot (force_total, force_total);
+#endif
+#ifdef OBSERVABLES
+    if (sample)
+      energy_buffer[out] = 0.5 * energy;
+#endif
+#ifdef TORUS
+    }
+#endif
 #ifndef FORCE_N_UPDATE
     inc3coord (spd_buffer + gid, force_total, offset);
 #else
@@ -497,3 +1021,334 @@ void box_force (__global calc_t *pos_buffer,
 #endif
   }
 }
+
+/*
+ * Cluster-pair version of box_force. Atoms of each row of boxes (same y
+ * and z, sorted along x) are grouped by CLUSTER_SIZE consecutive atoms
+ * into clusters with bounding boxes. Each cluster gets the list of
+ * clusters of the neighbour rows whose bounding box is within the cutoff,
+ * and pairs of clusters are evaluated as dense CLUSTER_SIZE x
+ * CLUSTER_SIZE tiles, without index range tests nor barriers.
+ */
+
+static inline int row_first_atom (__global int *box_buffer, const int row,
+				  __constant int *domain_buff)
+{
+  return box_buffer[row * domain_buff[0]];
+}
+
+static inline int row_nb_clusters (__global int *box_buffer, const int row,
+				   __constant int *domain_buff)
+{
+  int n = row_first_atom (box_buffer, row + 1, domain_buff) -
+    row_first_atom (box_buffer, row, domain_buff);
+
+  return (n + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+}
+
+/**
+ * First cluster of each row of boxes (exclusive prefix sum of the number of
+ * clusters per row, the total being stored after the last row). This kernel
+ * is executed by a single work-group of SCAN_WG_SIZE threads.
+ */
+__kernel
+void cluster_scan (__global int *box_buffer, __global int *row_clusters,
+		   __constant int *domain_buff, unsigned nrows)
+{
+  __local int sums[SCAN_WG_SIZE];
+  const unsigned lid = get_local_id (0);
+  const unsigned chunk = (nrows + SCAN_WG_SIZE - 1) / SCAN_WG_SIZE;
+  const unsigned first = min (lid * chunk, nrows);
+  const unsigned last = min (first + chunk, nrows);
+  int sum = 0, own;
+
+  for (unsigned r = first; r < last; r++)
+    sum += row_nb_clusters (box_buffer, r, domain_buff);
+  own = sum;
+  sums[lid] = sum;
+
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  for (unsigned d = 1; d < SCAN_WG_SIZE; d *= 2) {
+    int v = lid >= d ? sums[lid - d] : 0;
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+    sums[lid] += v;
+    barrier (CLK_LOCAL_MEM_FENCE);
+  }
+
+  sum = sums[lid] - own;
+  for (unsigned r = first; r < last; r++) {
+    row_clusters[r] = sum;
+    sum += row_nb_clusters (box_buffer, r, domain_buff);
+  }
+
+  if (lid == SCAN_WG_SIZE - 1)
+    row_clusters[nrows] = sum;
+}
+
+/**
+ * Atoms (first, end) and bounding box (min then max corner) of each cluster.
+ * This kernel is executed with one thread per row of boxes.
+ */
+__kernel
+void cluster_build (__global calc_t *pos_buffer, __global int *box_buffer,
+		    __global int *row_clusters, __global int *cluster_atoms,
+		    __global calc_t *cluster_bounds, __constant int *domain_buff,
+		    unsigned offset, unsigned begin, unsigned nrows)
+{
+  const unsigned row = get_global_id (0);
+  unsigned first, last, c;
+
+  if (row >= nrows)
+    return;
+
+  first = row_first_atom (box_buffer, row, domain_buff) + begin;
+  last = row_first_atom (box_buffer, row + 1, domain_buff) + begin;
+  c = row_clusters[row];
+
+  for (unsigned a = first; a < last; a += CLUSTER_SIZE, c++) {
+    const unsigned end = min (a + CLUSTER_SIZE, last);
+    coord_t lo = load3coord (pos_buffer + a, offset), hi = lo;
+
+    for (unsigned i = a + 1; i < end; i++) {
+      coord_t p = load3coord (pos_buffer + i, offset);
+
+      lo = fmin (lo, p);
+      hi = fmax (hi, p);
+    }
+
+    cluster_atoms[2 * c] = a;
+    cluster_atoms[2 * c + 1] = end;
+    cluster_bounds[6 * c + 0] = lo.x;
+    cluster_bounds[6 * c + 1] = lo.y;
+    cluster_bounds[6 * c + 2] = lo.z;
+    cluster_bounds[6 * c + 3] = hi.x;
+    cluster_bounds[6 * c + 4] = hi.y;
+    cluster_bounds[6 * c + 5] = hi.z;
+  }
+}
+
+static inline bool cluster_close (__global calc_t *cluster_bounds,
+				  const unsigned i, const unsigned j)
+{
+  __global calc_t *bi = cluster_bounds + 6 * i;
+  __global calc_t *bj = cluster_bounds + 6 * j;
+  calc_t d2 = 0.0;
+
+  for (int k = 0; k < 3; k++) {
+    calc_t d = fmax (bi[k] - bj[k + 3], bj[k] - bi[k + 3]);
+
+    if (d > 0.0)
+      d2 += d * d;
+  }
+
+  return d2 < LENNARD_SQUARED_CUTOFF;
+}
+
+/**
+ * Candidate clusters [*j0, *j1[ of cluster i in neighbour row number w
+ * (among (2 SUBCELL + 1)^2): the clusters holding atoms of the boxes around
+ * the ones of cluster i. Returns false when the row is out of the domain.
+ */
+static inline bool cluster_candidates (__global calc_t *pos_buffer,
+				       __global int *box_buffer,
+				       __global int *row_clusters,
+				       __global int *cluster_atoms,
+				       __constant calc_t *min_buffer,
+				       __constant int *domain_buff,
+				       const unsigned offset, const unsigned i,
+				       const int w,
+				       unsigned *j0, unsigned *j1)
+{
+  const int width = 2 * SUBCELL + 1;
+  int x0, x1, y, z, unused;
+  int row, lo, hi, start, a, b;
+
+  get_boxes (load3coord (pos_buffer + cluster_atoms[2 * i], offset), min_buffer,
+	     &x0, &y, &z);
+  get_boxes (load3coord (pos_buffer + cluster_atoms[2 * i + 1] - 1, offset),
+	     min_buffer, &x1, &unused, &unused);
+
+  y += w % width - SUBCELL;
+  z += w / width - SUBCELL;
+  if (y < 0 || y >= domain_buff[1] || z < 0 || z >= domain_buff[2])
+    return false;
+
+  row = z * domain_buff[1] + y;
+  lo = max (x0 - SUBCELL, 0);
+  hi = min (x1 + SUBCELL, domain_buff[0] - 1);
+
+  start = row_first_atom (box_buffer, row, domain_buff);
+  a = box_buffer[row * domain_buff[0] + lo];
+  b = box_buffer[row * domain_buff[0] + hi + 1];
+
+  *j0 = row_clusters[row] + (a - start) / CLUSTER_SIZE;
+  *j1 = a < b ? row_clusters[row] + (b - 1 - start) / CLUSTER_SIZE + 1 : *j0;
+
+  return true;
+}
+
+/**
+ * List of clusters close to each cluster (up to CLUSTER_MAX_PAIRS, the
+ * count being stored anyway: cluster_force falls back to the candidates
+ * when the list overflowed). This kernel is executed with one thread per
+ * cluster.
+ */
+__kernel
+void cluster_pairs (__global calc_t *pos_buffer, __global int *box_buffer,
+		    __global int *row_clusters, __global int *cluster_atoms,
+		    __global calc_t *cluster_bounds, __global int *pair_buffer,
+		    __global int *npairs_buffer, __constant calc_t *min_buffer,
+		    __constant int *domain_buff, unsigned offset, unsigned nrows)
+{
+  const unsigned i = get_global_id (0);
+  const int width = 2 * SUBCELL + 1;
+  unsigned n = 0;
+
+  if (i >= row_clusters[nrows])
+    return;
+
+  for (int w = 0; w < width * width; w++) {
+    unsigned j0, j1;
+
+    if (!cluster_candidates (pos_buffer, box_buffer, row_clusters, cluster_atoms,
+			     min_buffer, domain_buff, offset, i, w, &j0, &j1))
+      continue;
+
+    for (unsigned j = j0; j < j1; j++)
+      if (cluster_close (cluster_bounds, i, j)) {
+	if (n < CLUSTER_MAX_PAIRS)
+	  pair_buffer[i * CLUSTER_MAX_PAIRS + n] = j;
+	n++;
+      }
+  }
+
+  npairs_buffer[i] = n;
+}
+
+/* Interactions of atom ia (at my_pos) with atom lane of cluster j, whose
+ * energy is added to energy when energy_table is not NULL. */
+static inline coord_t cluster_tile (__global calc_t *pos_buffer,
+				    __global int *cluster_atoms,
+				    __constant force_t *pot_table,
+				    __global calc_t *energy_table,
+				    calc_t *energy,
+				    const unsigned offset, const unsigned ia,
+				    const coord_t my_pos, const unsigned lane,
+				    const unsigned j)
+{
+  const unsigned jb = cluster_atoms[2 * j] + lane;
+  coord_t force = { 0.0f, 0.0f, 0.0f };
+
+  if (jb < cluster_atoms[2 * j + 1] && jb != ia) {
+    coord_t other = load3coord (pos_buffer + jb, offset);
+    calc_t dist2 = squared_dist (my_pos, other);
+
+    if (dist2 < LENNARD_SQUARED_CUTOFF) {
+      force = pair_force (my_pos - other, dist2, pot_table);
+      if (energy_table)
+	*energy += pair_energy (dist2, energy_table);
+    }
+  }
+
+  return force;
+}
+
+/**
+ * Forces between pairs of clusters. This kernel is executed with one
+ * work-group of CLUSTER_SIZE x CLUSTER_SIZE threads per cluster: thread
+ * (a, b) computes the interactions of atom a of the cluster with atoms b
+ * of the clusters of its list, then they are summed over b. As in
+ * box_force, no force is applied on atoms of border boxes.
+ */
+__kernel
+void cluster_force (__global calc_t *pos_buffer, __global calc_t *spd_buffer,
+		    __global int *box_buffer, __global int *row_clusters,
+		    __global int *cluster_atoms, __global calc_t *cluster_bounds,
+		    __global int *pair_buffer, __global int *npairs_buffer,
+		    __constant calc_t *min_buffer, __constant int *domain_buff,
+		    unsigned offset, unsigned nrows, __constant force_t *pot_table,
+		    __global calc_t *kick_buffer, __global calc_t *energy_table,
+		    __global calc_t *energy_buffer, unsigned sample)
+{
+  __local coord_t partial[CLUSTER_SIZE * CLUSTER_SIZE];
+#ifdef OBSERVABLES
+  __local calc_t partial_energy[CLUSTER_SIZE * CLUSTER_SIZE];
+  __global calc_t *etable = sample ? energy_table : 0;
+#else
+  __global calc_t *etable = 0;
+#endif
+  calc_t energy = 0;
+  const unsigned i = get_group_id (0);
+  const unsigned lid = get_local_id (0);
+  const unsigned a = lid / CLUSTER_SIZE;
+  const unsigned b = lid % CLUSTER_SIZE;
+  coord_t force = { 0.0f, 0.0f, 0.0f };
+  coord_t my_pos;
+  unsigned ia = 0;
+  bool valid = false;
+
+  // Same cluster for the whole work-group: no divergence between tiles
+  if (i < row_clusters[nrows]) {
+    const unsigned n = npairs_buffer[i];
+    int num_box;
+
+    ia = cluster_atoms[2 * i] + a;
+    if (ia < cluster_atoms[2 * i + 1]) {
+      my_pos = load3coord (pos_buffer + ia, offset);
+      valid = !get_num_box_ext (&num_box, my_pos, min_buffer, domain_buff);
+    }
+
+    if (n <= CLUSTER_MAX_PAIRS) {
+      for (unsigned p = 0; p < n; p++) {
+	const unsigned j = pair_buffer[i * CLUSTER_MAX_PAIRS + p];
+
+	if (valid)
+	  force += cluster_tile (pos_buffer, cluster_atoms, pot_table, etable,
+				 &energy, offset, ia, my_pos, b, j);
+      }
+    } else {
+      const int width = 2 * SUBCELL + 1;
+
+      for (int w = 0; w < width * width; w++) {
+	unsigned j0, j1;
+
+	if (!cluster_candidates (pos_buffer, box_buffer, row_clusters,
+				 cluster_atoms, min_buffer, domain_buff,
+				 offset, i, w, &j0, &j1))
+	  continue;
+
+	for (unsigned j = j0; j < j1; j++)
+	  if (valid && cluster_close (cluster_bounds, i, j))
+	    force += cluster_tile (pos_buffer, cluster_atoms, pot_table, etable,
+				   &energy, offset, ia, my_pos, b, j);
+      }
+    }
+  }
+
+  partial[lid] = force;
+#ifdef OBSERVABLES
+  partial_energy[lid] = energy;
+#endif
+
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  if (b == 0 && valid) {
+    for (unsigned k = 1; k < CLUSTER_SIZE; k++)
+      force += partial[lid + k];
+
+    force *= (calc_t)DELTA_T;
+    inc3coord (spd_buffer + ia, force, offset);
+#ifdef ADAPTIVE_STEP
+    kick_buffer[ia] = dot (force, force);
+#endif
+#ifdef OBSERVABLES
+    if (sample) {
+      for (unsigned k = 1; k < CLUSTER_SIZE; k++)
+	energy += partial_energy[lid + k];
+      energy_buffer[ia] = 0.5 * energy;
+    }
+#endif
+  }
+}
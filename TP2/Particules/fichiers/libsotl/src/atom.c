@@ -6,9 +6,11 @@
 #include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -26,71 +28,291 @@
 #include "shaders.h"
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 static sotl_atom_set_t global_atom_set;
 
-static void sift_down(sotl_atom_set_t *set, const int start, const int count);
+/* Insertion sort is used when less than 1 / SORT_INSERTION_RATIO of the
+ * atoms are out of order, and gives up after SORT_INSERTION_BUDGET * natoms
+ * moves (a few atoms moving far would make it quadratic). */
+#define SORT_INSERTION_RATIO    64
+#define SORT_INSERTION_BUDGET   8
+
+#define RADIX_BITS  8
+#define RADIX_SIZE  (1 << RADIX_BITS)
+#define RADIX_MASK  (RADIX_SIZE - 1)
+
+/* Keys of the radix sort: z keys of doubles need all their bits. */
+#if USE_DOUBLE == 0
+typedef uint32_t sort_key_t;
+#else
+typedef uint64_t sort_key_t;
+#endif
 
-#define SWAP(a, b)                  \
-    do {                            \
-        calc_t t = a; a = b; b = t; \
-    } while(0)
+/* Number of consecutive atoms out of order along z. */
+static unsigned count_descents(const sotl_atom_set_t *set)
+{
+    const calc_t *z = set->pos.z;
+    unsigned descents = 0;
 
-#define SWAP_ATOM(a, b)                             \
-    do {                                            \
-        SWAP(set->pos.z[a], set->pos.z[b]);         \
-        SWAP(set->pos.y[a], set->pos.y[b]);         \
-        SWAP(set->pos.x[a], set->pos.x[b]);         \
-        SWAP(set->speed.dz[a], set->speed.dz[b]);   \
-        SWAP(set->speed.dy[a], set->speed.dy[b]);   \
-        SWAP(set->speed.dx[a], set->speed.dx[b]);   \
-    } while(0)
+    #pragma omp parallel for reduction(+:descents)
+    for (unsigned i = 1; i < set->natoms; i++)
+        descents += z[i - 1] > z[i];
 
-static void heap_sort(sotl_atom_set_t *set, const unsigned count)
+    return descents;
+}
+
+/* Straight insertion sort along z, cheap when atoms have barely moved
+ * since the last sort. Returns false (with atoms partially sorted) when
+ * more than budget moves are needed. */
+static bool insertion_sort(sotl_atom_set_t *set, unsigned long budget)
 {
-    int start, end;
+    calc_t *x = set->pos.x, *y = set->pos.y, *z = set->pos.z;
+    calc_t *dx = set->speed.dx, *dy = set->speed.dy, *dz = set->speed.dz;
+    unsigned *id = set->id;
+
+    for (unsigned i = 1; i < set->natoms; i++) {
+        calc_t xi, yi, zi, dxi, dyi, dzi;
+        unsigned j = i, idi;
 
-    /* heapify */
-    start = (count - 2) / 2;
-    for (; start >= 0; start--) {
-        sift_down(set, start, count);
+        if (z[i - 1] <= z[i])
+            continue;
+
+        xi  = x[i];  yi  = y[i];  zi  = z[i];
+        dxi = dx[i]; dyi = dy[i]; dzi = dz[i];
+        idi = id[i];
+
+        for (; j > 0 && z[j - 1] > zi && budget > 0; j--, budget--) {
+            x[j]  = x[j - 1];  y[j]  = y[j - 1];  z[j]  = z[j - 1];
+            dx[j] = dx[j - 1]; dy[j] = dy[j - 1]; dz[j] = dz[j - 1];
+            id[j] = id[j - 1];
+        }
+
+        x[j]  = xi;  y[j]  = yi;  z[j]  = zi;
+        dx[j] = dxi; dy[j] = dyi; dz[j] = dzi;
+        id[j] = idi;
+
+        if (budget == 0)
+            return false;
     }
 
-    for (end = count - 1; end > 0; end--) {
-        SWAP_ATOM(end, 0);
-        sift_down(set, 0, end);
+    return true;
+}
+
+/* Map z to an unsigned key with the same order (IEEE 754 trick: flip all
+ * bits of negative values, only the sign bit of positive ones). */
+static inline sort_key_t z_key(const calc_t z)
+{
+#if USE_DOUBLE == 0
+    uint32_t u;
+
+    memcpy(&u, &z, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+#else
+    uint64_t u;
+
+    memcpy(&u, &z, sizeof(u));
+    return (u & 0x8000000000000000ull) ? ~u : (u | 0x8000000000000000ull);
+#endif
+}
+
+/* Reorder one array of the set following perm (a[i] = old a[perm[i]]). */
+static void permute_array(calc_t *a, calc_t *tmp, const unsigned *perm,
+                          const unsigned n)
+{
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for (unsigned i = 0; i < n; i++)
+            tmp[i] = a[perm[i]];
+
+        #pragma omp for
+        for (unsigned i = 0; i < n; i++)
+            a[i] = tmp[i];
     }
 }
 
-static void sift_down(sotl_atom_set_t *set, const int start, const int end)
+/* Spread the 10 low bits of v so that there are two zeros between each. */
+static inline uint32_t morton_spread(uint32_t v)
 {
-    int root = start;
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8))  & 0x0300f00f;
+    v = (v | (v << 4))  & 0x030c30c3;
+    v = (v | (v << 2))  & 0x09249249;
+    return v;
+}
 
-    while (root * 2 + 1 < end) {
-        int child = 2 * root + 1;
-        if ((child + 1 < end) && (set->pos.z[child] < set->pos.z[child + 1])) {
-            child += 1;
-        }
-        if (set->pos.z[root] >= set->pos.z[child])
-            return;
+/* Box coordinate of pos along one axis, clamped to the domain and reduced
+ * to MORTON_BITS bits. */
+#define MORTON_BITS 10
 
-        SWAP_ATOM(child, root);
-        root = child;
+static inline uint32_t morton_coord(const calc_t pos, const calc_t min,
+                                    const unsigned nboxes, const int shift)
+{
+    calc_t b = (pos - min) * BOX_SIZE_INV;
+
+    if (!(b > 0))
+        return 0;
+    if (b >= nboxes)
+        return (nboxes - 1) >> shift;
+    return (uint32_t)b >> shift;
+}
+
+/* Same as permute_array() for the original indexes of atoms. */
+static void permute_ids(unsigned *id, unsigned *tmp, const unsigned *perm,
+                        const unsigned n)
+{
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for (unsigned i = 0; i < n; i++)
+            tmp[i] = id[perm[i]];
+
+        #pragma omp for
+        for (unsigned i = 0; i < n; i++)
+            id[i] = tmp[i];
     }
 }
 
-int atom_set_init(sotl_atom_set_t *set, const unsigned long natoms,
-                  const unsigned long maxatoms)
+/* Parallel LSD radix sort of atoms by keys (one per atom, overwritten).
+ * Keys are sorted together with a permutation array, then the SoA arrays
+ * are gathered once each. Passes on a digit shared by all keys are
+ * skipped, such as the high bits of Morton keys in double precision. */
+static int radix_sort(sotl_atom_set_t *set, sort_key_t *keys)
 {
-    if (maxatoms < natoms)
-        return SOTL_INVALID_VALUE;
+    const unsigned n = set->natoms;
+    sort_key_t *const orig_keys = keys;
+    int nthreads = 1;
+    sort_key_t *tmp_keys;
+    unsigned *perm, *tmp_perm, *hist;
+    calc_t *tmp;
+
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+
+    tmp_keys = malloc(n * sizeof(sort_key_t));
+    perm     = malloc(n * sizeof(unsigned));
+    tmp_perm = malloc(n * sizeof(unsigned));
+    hist     = malloc(nthreads * RADIX_SIZE * sizeof(unsigned));
+    tmp      = malloc(n * sizeof(calc_t));
+
+    if (!tmp_keys || !perm || !tmp_perm || !hist || !tmp) {
+        free(tmp_keys); free(perm); free(tmp_perm);
+        free(hist); free(tmp);
+        return SOTL_OUT_OF_MEMORY;
+    }
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        int t = 0, nt = 1;
+        unsigned begin, end, *count;
+
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+        nt = omp_get_num_threads();
+#endif
+        /* Contiguous chunks per thread keep the sort stable. */
+        begin = (unsigned long)n * t / nt;
+        end = (unsigned long)n * (t + 1) / nt;
+        count = hist + t * RADIX_SIZE;
+
+        for (unsigned i = begin; i < end; i++)
+            perm[i] = i;
+
+        for (unsigned shift = 0; shift < 8 * sizeof(sort_key_t);
+             shift += RADIX_BITS) {
+            bool skip = false;
+
+            memset(count, 0, RADIX_SIZE * sizeof(unsigned));
+            for (unsigned i = begin; i < end; i++)
+                count[(keys[i] >> shift) & RADIX_MASK]++;
+
+            #pragma omp barrier
+
+            /* All keys have the same digit: nothing to do for this pass. */
+            for (unsigned d = 0; d < RADIX_SIZE && !skip; d++) {
+                unsigned c = 0;
+
+                for (int u = 0; u < nt; u++)
+                    c += hist[u * RADIX_SIZE + d];
+                skip = (c == n);
+            }
+
+            #pragma omp barrier
+
+            if (skip)
+                continue;
+
+            #pragma omp single
+            {
+                unsigned sum = 0;
+
+                for (unsigned d = 0; d < RADIX_SIZE; d++) {
+                    for (int u = 0; u < nt; u++) {
+                        unsigned c = hist[u * RADIX_SIZE + d];
+
+                        hist[u * RADIX_SIZE + d] = sum;
+                        sum += c;
+                    }
+                }
+            }
 
-    set->natoms  = natoms;
-    set->current = 0;
-    set->offset  = ROUND(maxatoms);
+            for (unsigned i = begin; i < end; i++) {
+                unsigned slot = count[(keys[i] >> shift) & RADIX_MASK]++;
+
+                tmp_keys[slot] = keys[i];
+                tmp_perm[slot] = perm[i];
+            }
+
+            #pragma omp barrier
+
+            #pragma omp single
+            {
+                sort_key_t *k = keys;
+                unsigned *p = perm;
+
+                keys = tmp_keys; tmp_keys = k;
+                perm = tmp_perm; tmp_perm = p;
+            }
+        }
+    }
+
+    permute_array(set->pos.x, tmp, perm, n);
+    permute_array(set->pos.y, tmp, perm, n);
+    permute_array(set->pos.z, tmp, perm, n);
+    permute_array(set->speed.dx, tmp, perm, n);
+    permute_array(set->speed.dy, tmp, perm, n);
+    permute_array(set->speed.dz, tmp, perm, n);
+    /* tmp_perm is free again and large enough. */
+    permute_ids(set->id, tmp_perm, perm, n);
+
+    /* keys and tmp_keys may have been swapped an odd number of times. */
+    if (tmp_keys != orig_keys)
+        free(tmp_keys);
+    else
+        free(keys);
+    free(perm); free(tmp_perm);
+    free(hist); free(tmp);
+    return SOTL_SUCCESS;
+}
+
+static void atom_set_init_sizes(sotl_atom_set_t *set, const unsigned natoms,
+                                const unsigned offset)
+{
+    set->natoms   = natoms;
+    set->current  = 0;
+    set->offset   = offset;
+    set->map      = NULL;
+    set->map_size = 0;
 
     if (!sotl_have_multi()) {
-        /* No need to have ghosts for a single device. */
-        /* XXX: This is absolutely wrong when the torus mode is enabled. :-) */
+        /* No need to have ghosts for a single device (periodic images of
+         * the torus mode live in the box buffers of the OpenMP backend, and
+         * past the atoms in the buffers of an OpenCL device). */
         set->offset_ghosts = 0;
     } else {
         set->offset_ghosts = ROUND(set->natoms * 0.05);
@@ -98,6 +320,15 @@ int atom_set_init(sotl_atom_set_t *set, const unsigned long natoms,
 
     /* No ghosts at the beginning. */
     set->nghosts_min = set->nghosts_max = 0;
+}
+
+int atom_set_init(sotl_atom_set_t *set, const unsigned long natoms,
+                  const unsigned long maxatoms)
+{
+    if (maxatoms < natoms)
+        return SOTL_INVALID_VALUE;
+
+    atom_set_init_sizes(set, natoms, ROUND(maxatoms));
 
     set->pos.x = malloc(atom_set_size(set));
     if (!set->pos.x)
@@ -113,9 +344,35 @@ int atom_set_init(sotl_atom_set_t *set, const unsigned long natoms,
     set->speed.dy = set->speed.dx + set->offset;
     set->speed.dz = set->speed.dy + set->offset;
 
+    set->id = malloc(set->offset * sizeof(unsigned));
+    if (!set->id) {
+        atom_set_free(set);
+        return SOTL_OUT_OF_MEMORY;
+    }
+
     return SOTL_SUCCESS;
 }
 
+void atom_set_init_mapped(sotl_atom_set_t *set, const unsigned natoms,
+                          const unsigned offset, void *base, void *map,
+                          const size_t map_size)
+{
+    atom_set_init_sizes(set, natoms, offset);
+    set->current  = natoms;
+    set->map      = map;
+    set->map_size = map_size;
+
+    set->pos.x = base;
+    set->pos.y = set->pos.x + offset;
+    set->pos.z = set->pos.y + offset;
+
+    set->speed.dx = set->pos.z + offset;
+    set->speed.dy = set->speed.dx + offset;
+    set->speed.dz = set->speed.dy + offset;
+
+    set->id = (unsigned *)(set->speed.dz + offset);
+}
+
 void atom_set_print(const sotl_atom_set_t *set)
 {
     sotl_log(DEBUG, "natoms = %d, current = %d, offset = %d\n",
@@ -144,6 +401,8 @@ int atom_set_add(sotl_atom_set_t *set, const calc_t x, const calc_t y,
     set->speed.dy[set->current] = dy;
     set->speed.dz[set->current] = dz;
 
+    set->id[set->current] = set->current;
+
     set->current++;
     return SOTL_SUCCESS;
 }
@@ -153,7 +412,7 @@ size_t atom_set_offset(const sotl_atom_set_t *set)
     return set->offset + set->offset_ghosts * 2;
 }
 
-size_t atom_set_size(sotl_atom_set_t *set)
+size_t atom_set_size(const sotl_atom_set_t *set)
 {
     return sizeof(calc_t) * set->offset * 3;
 }
@@ -173,6 +432,23 @@ size_t atom_set_end(const sotl_atom_set_t *set)
     return atom_set_begin(set) + set->natoms;
 }
 
+void atom_set_with_ghosts(const sotl_atom_set_t *set, sotl_atom_set_t *view)
+{
+    const unsigned shift = set->nghosts_min;
+
+    *view = *set;
+    view->pos.x    -= shift;
+    view->pos.y    -= shift;
+    view->pos.z    -= shift;
+    view->speed.dx -= shift;
+    view->speed.dy -= shift;
+    view->speed.dz -= shift;
+    view->id       -= shift;
+    view->natoms   += set->nghosts_min + set->nghosts_max;
+    view->current   = view->natoms;
+    view->nghosts_min = view->nghosts_max = 0;
+}
+
 #define FREE(x)     \
     do {            \
         free(x);    \
@@ -181,14 +457,79 @@ size_t atom_set_end(const sotl_atom_set_t *set)
 
 void atom_set_free(sotl_atom_set_t *set)
 {
+    if (set->map) {
+        /* Arrays live in the mapping. */
+        munmap(set->map, set->map_size);
+        set->map = NULL;
+        set->pos.x = set->speed.dx = NULL;
+        set->id = NULL;
+        return;
+    }
+
     FREE(set->pos.x);
     FREE(set->speed.dx);
+    FREE(set->id);
 }
 
 void atom_set_sort(sotl_atom_set_t *set)
 {
-    /* Sort atoms along z-axis. */
-    heap_sort(set, set->natoms);
+    unsigned descents = count_descents(set);
+    sort_key_t *keys;
+
+    /* Already sorted. */
+    if (descents == 0)
+        return;
+
+    if (descents <= set->natoms / SORT_INSERTION_RATIO &&
+        insertion_sort(set, (unsigned long)SORT_INSERTION_BUDGET * set->natoms))
+        return;
+
+    keys = malloc(set->natoms * sizeof(sort_key_t));
+    if (!keys) {
+        sotl_log(CRITICAL, "Failed to allocate sort buffers\n");
+        return;
+    }
+
+    #pragma omp parallel for
+    for (unsigned i = 0; i < set->natoms; i++)
+        keys[i] = z_key(set->pos.z[i]);
+
+    if (radix_sort(set, keys) < 0)
+        sotl_log(CRITICAL, "Failed to allocate sort buffers\n");
+    free(keys);
+}
+
+void atom_set_sort_morton(sotl_atom_set_t *set, const sotl_domain_t *dom)
+{
+    const calc_t *x = set->pos.x, *y = set->pos.y, *z = set->pos.z;
+    unsigned max_boxes = MAX(MAX(dom->boxes[0], dom->boxes[1]), dom->boxes[2]);
+    int shift = 0;
+    sort_key_t *keys;
+
+    /* Coarsen the grid until each coordinate fits in MORTON_BITS bits:
+     * atoms of a same coarse box are still close to each other. */
+    while ((max_boxes - 1) >> shift >= (1u << MORTON_BITS))
+        shift++;
+
+    keys = malloc(set->natoms * sizeof(sort_key_t));
+    if (!keys) {
+        sotl_log(CRITICAL, "Failed to allocate sort buffers\n");
+        return;
+    }
+
+    #pragma omp parallel for
+    for (unsigned i = 0; i < set->natoms; i++) {
+        uint32_t bx = morton_coord(x[i], dom->min_border[0], dom->boxes[0], shift);
+        uint32_t by = morton_coord(y[i], dom->min_border[1], dom->boxes[1], shift);
+        uint32_t bz = morton_coord(z[i], dom->min_border[2], dom->boxes[2], shift);
+
+        keys[i] = morton_spread(bx) | morton_spread(by) << 1 |
+                  morton_spread(bz) << 2;
+    }
+
+    if (radix_sort(set, keys) < 0)
+        sotl_log(CRITICAL, "Failed to allocate sort buffers\n");
+    free(keys);
 }
 
 #ifdef HAVE_LIBGL
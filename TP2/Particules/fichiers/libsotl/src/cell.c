@@ -0,0 +1,205 @@
+#include "cell.h"
+#include "sotl.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RADIX_BITS  8
+#define RADIX_SIZE  (1 << RADIX_BITS)
+#define RADIX_MASK  (RADIX_SIZE - 1)
+
+#define FREE(x)     \
+    do {            \
+        free(x);    \
+        x = NULL;   \
+    } while (0)
+
+int cell_list_init(sotl_cell_list_t *cells, const unsigned maxatoms)
+{
+    cells->capacity = maxatoms;
+    cells->nboxes   = 0;
+    cells->natoms   = 0;
+
+    cells->keys      = malloc(maxatoms * sizeof(unsigned));
+    cells->atoms     = malloc(maxatoms * sizeof(unsigned));
+    cells->tmp_keys  = malloc(maxatoms * sizeof(unsigned));
+    cells->tmp_atoms = malloc(maxatoms * sizeof(unsigned));
+    cells->box_id    = malloc(maxatoms * sizeof(unsigned));
+    cells->box_start = malloc((maxatoms + 1) * sizeof(unsigned));
+
+    if (!cells->keys || !cells->atoms || !cells->tmp_keys ||
+        !cells->tmp_atoms || !cells->box_id || !cells->box_start) {
+        cell_list_free(cells);
+        return SOTL_OUT_OF_MEMORY;
+    }
+
+    return SOTL_SUCCESS;
+}
+
+void cell_list_free(sotl_cell_list_t *cells)
+{
+    FREE(cells->keys);
+    FREE(cells->atoms);
+    FREE(cells->tmp_keys);
+    FREE(cells->tmp_atoms);
+    FREE(cells->box_id);
+    FREE(cells->box_start);
+}
+
+static inline unsigned clamp_box(const calc_t pos, const calc_t min,
+                                 const calc_t rrc, const unsigned nboxes)
+{
+    calc_t b = (pos - min) * rrc;
+
+    if (!(b > 0))
+        return 0;
+    if (b >= nboxes)
+        return nboxes - 1;
+    return (unsigned)b;
+}
+
+unsigned cell_get_box(const sotl_cell_list_t *cells, const calc_t x,
+                      const calc_t y, const calc_t z)
+{
+    unsigned box_x, box_y, box_z;
+
+    box_x = clamp_box(x, cells->min[0], cells->rrc, cells->boxes[0]);
+    box_y = clamp_box(y, cells->min[1], cells->rrc, cells->boxes[1]);
+    box_z = clamp_box(z, cells->min[2], cells->rrc, cells->boxes[2]);
+
+    return box_z * cells->boxes[0] * cells->boxes[1] +
+           box_y * cells->boxes[0] +
+           box_x;
+}
+
+/* Stable LSD radix sort of (keys, atoms) pairs, only on significant bits. */
+static void radix_sort(sotl_cell_list_t *cells, const unsigned n,
+                       const unsigned max_key)
+{
+    unsigned *keys = cells->keys, *atoms = cells->atoms;
+    unsigned *tmp_keys = cells->tmp_keys, *tmp_atoms = cells->tmp_atoms;
+    unsigned count[RADIX_SIZE];
+
+    for (unsigned shift = 0; shift < 32 && (max_key >> shift) != 0;
+         shift += RADIX_BITS) {
+        unsigned *t;
+
+        memset(count, 0, sizeof(count));
+        for (unsigned i = 0; i < n; i++)
+            count[(keys[i] >> shift) & RADIX_MASK]++;
+
+        for (unsigned d = 0, sum = 0; d < RADIX_SIZE; d++) {
+            unsigned c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            unsigned slot = count[(keys[i] >> shift) & RADIX_MASK]++;
+            tmp_keys[slot]  = keys[i];
+            tmp_atoms[slot] = atoms[i];
+        }
+
+        t = keys;  keys  = tmp_keys;  tmp_keys  = t;
+        t = atoms; atoms = tmp_atoms; tmp_atoms = t;
+    }
+
+    cells->keys      = keys;
+    cells->atoms     = atoms;
+    cells->tmp_keys  = tmp_keys;
+    cells->tmp_atoms = tmp_atoms;
+}
+
+void cell_list_build(sotl_cell_list_t *cells, const sotl_domain_t *dom,
+                     const sotl_atom_set_t *set, const calc_t box_size)
+{
+    unsigned max_key = 0;
+    unsigned k = 0;
+
+    /* Same grid as the domain, but with boxes of the requested size. */
+    cells->rrc = 1.0 / box_size;
+    for (int i = 0; i < 3; i++) {
+        cells->min[i] = dom->min_border[i];
+        cells->boxes[i] = MAX((dom->max_border[i] - dom->min_border[i]) *
+                              cells->rrc, 1);
+    }
+
+    /* Compute the box of each atom. */
+    for (unsigned n = 0; n < set->natoms; n++) {
+        unsigned box = cell_get_box(cells, set->pos.x[n], set->pos.y[n],
+                                    set->pos.z[n]);
+        cells->keys[n]  = box;
+        cells->atoms[n] = n;
+        max_key = MAX(max_key, box);
+    }
+    cells->natoms = set->natoms;
+
+    radix_sort(cells, set->natoms, max_key);
+
+    /* Compress runs of identical keys into non-empty boxes. */
+    for (unsigned n = 0; n < set->natoms; n++) {
+        if (n == 0 || cells->keys[n] != cells->keys[n - 1]) {
+            cells->box_id[k]    = cells->keys[n];
+            cells->box_start[k] = n;
+            k++;
+        }
+    }
+    cells->box_start[k] = set->natoms;
+    cells->nboxes = k;
+}
+
+/* Index of the first non-empty box whose id is not less than id. */
+static unsigned lower_bound(const sotl_cell_list_t *cells, const unsigned id)
+{
+    unsigned lo = 0, hi = cells->nboxes;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (cells->box_id[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+unsigned cell_get_neighbours(const sotl_cell_list_t *cells, const unsigned k,
+                             const int reach, sotl_cell_range_t *ranges)
+{
+    const int shift_y = cells->boxes[0];
+    const int shift_z = cells->boxes[0] * cells->boxes[1];
+    const unsigned box = cells->box_id[k];
+    const int box_x = box % cells->boxes[0];
+    const int box_y = (box / shift_y) % cells->boxes[1];
+    const int box_z = box / shift_z;
+    const int min_x = MAX(box_x - reach, 0);
+    const int max_x = MIN(box_x + reach, (int)cells->boxes[0] - 1);
+    unsigned n = 0;
+
+    for (int z = box_z - reach; z <= box_z + reach; z++) {
+        if (z < 0 || z >= (int)cells->boxes[2])
+            continue;
+
+        for (int y = box_y - reach; y <= box_y + reach; y++) {
+            unsigned row, first, last;
+
+            if (y < 0 || y >= (int)cells->boxes[1])
+                continue;
+
+            /* Boxes [min_x, max_x] of a row have consecutive ids. */
+            row   = z * shift_z + y * shift_y;
+            first = lower_bound(cells, row + min_x);
+            last  = lower_bound(cells, row + max_x + 1);
+
+            if (first < last) {
+                ranges[n].begin = cells->box_start[first];
+                ranges[n].end   = cells->box_start[last];
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
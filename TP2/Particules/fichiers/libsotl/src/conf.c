@@ -0,0 +1,325 @@
+#define _XOPEN_SOURCE 600
+
+#include "conf.h"
+#include "sotl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Atoms are parsed by chunks of about this size. */
+#define CONF_CHUNK_SIZE (1 << 20)
+
+/* Longest value handed to strtod(). */
+#define CONF_MAX_TOKEN 64
+
+/* Values are exact in a double up to 10^22. */
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool conf_is_space(const char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+           c == '\f';
+}
+
+/* Parse the value of a token with strtod(), which handles all cases. */
+static bool conf_parse_slow(const char *p, const char *end, double *value)
+{
+    char buf[CONF_MAX_TOKEN], *last;
+    size_t len = 0;
+
+    while (p + len < end && !conf_is_space(p[len])) {
+        if (len == CONF_MAX_TOKEN - 1)
+            return false;
+        buf[len] = p[len];
+        len++;
+    }
+    buf[len] = '\0';
+
+    *value = strtod(buf, &last);
+    return len && *last == '\0';
+}
+
+/* Parse the token starting at p. Decimal values with up to 19 significant
+ * digits are converted exactly (the mantissa is scaled by an exact power of
+ * ten), anything else is left to strtod(). */
+static bool conf_parse_value(const char *p, const char *end, double *value)
+{
+    const char *start = p;
+    uint64_t mantissa = 0;
+    int digits = 0, exp = 0;
+    bool neg = false, any = false;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+        if (mantissa || *p != '0')
+            digits++;
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+            if (mantissa || *p != '0')
+                digits++;
+            mantissa = mantissa * 10 + (*p - '0');
+            exp--;
+        }
+    }
+
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        bool exp_neg = false;
+        int e = 0;
+
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+            exp_neg = *p++ == '-';
+        if (p == end || *p < '0' || *p > '9')
+            return conf_parse_slow(start, end, value);
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            if (e < 10000)
+                e = e * 10 + (*p - '0');
+        exp += exp_neg ? -e : e;
+    }
+
+    if (!any || (p < end && !conf_is_space(*p)) || digits > 19 ||
+        mantissa > (UINT64_C(1) << 53) || exp < -22 || exp > 22)
+        return conf_parse_slow(start, end, value);
+
+    if (exp < 0)
+        *value = mantissa / powers_of_ten[-exp];
+    else
+        *value = mantissa * powers_of_ten[exp];
+    if (neg)
+        *value = -*value;
+    return true;
+}
+
+/* Skip white space from offset pos. */
+static size_t conf_skip_spaces(const sotl_conf_file_t *conf, size_t pos)
+{
+    while (pos < conf->size && conf_is_space(conf->data[pos]))
+        pos++;
+    return pos;
+}
+
+/* Parse the token at offset *pos and move after it. */
+static bool conf_next_value(const sotl_conf_file_t *conf, size_t *pos,
+                            double *value)
+{
+    *pos = conf_skip_spaces(conf, *pos);
+    if (*pos == conf->size ||
+        !conf_parse_value(conf->data + *pos, conf->data + conf->size, value))
+        return false;
+
+    while (*pos < conf->size && !conf_is_space(conf->data[*pos]))
+        (*pos)++;
+    return true;
+}
+
+static int conf_read_header(sotl_conf_file_t *conf)
+{
+    double natoms, speed;
+    size_t pos = 0;
+
+    if (!conf_next_value(conf, &pos, &natoms) || natoms < 0 ||
+        natoms > UINT32_MAX || natoms != floor(natoms))
+        return SOTL_INVALID_VALUE;
+
+    for (int i = 0; i < 3; i++) {
+        if (!conf_next_value(conf, &pos, &conf->min_ext[i]) ||
+            !conf_next_value(conf, &pos, &conf->max_ext[i]))
+            return SOTL_INVALID_VALUE;
+    }
+
+    if (!conf_next_value(conf, &pos, &speed))
+        return SOTL_INVALID_VALUE;
+
+    conf->natoms     = natoms;
+    conf->read_speed = speed != 0;
+    conf->body       = pos;
+
+    return SOTL_SUCCESS;
+}
+
+int conf_open(sotl_conf_file_t *conf, const char *filename)
+{
+    struct stat st;
+    void *data;
+    int fd, ret;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    if (!st.st_size) {
+        close(fd);
+        return SOTL_INVALID_VALUE;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ret = data == MAP_FAILED ? -errno : SOTL_SUCCESS;
+    close(fd);
+    if (ret < 0)
+        return ret;
+
+    /* Chunks are read concurrently, start reading ahead everywhere. */
+    posix_madvise(data, st.st_size, POSIX_MADV_WILLNEED);
+
+    conf->data = data;
+    conf->size = st.st_size;
+
+    ret = conf_read_header(conf);
+    if (ret < 0) {
+        sotl_log(ERROR, "Invalid header in \"%s\"\n", filename);
+        conf_close(conf);
+    }
+
+    return ret;
+}
+
+void conf_close(sotl_conf_file_t *conf)
+{
+    munmap((void *)conf->data, conf->size);
+    conf->data = NULL;
+    conf->size = 0;
+}
+
+/* Offset of chunk c: the first token starting at or after its nominal
+ * offset, so that every token belongs to exactly one chunk. */
+static size_t conf_chunk_start(const sotl_conf_file_t *conf, const size_t c)
+{
+    size_t pos = conf->body + c * CONF_CHUNK_SIZE;
+
+    if (!c)
+        return conf->body;
+    if (pos >= conf->size)
+        return conf->size;
+
+    while (pos < conf->size && !conf_is_space(conf->data[pos - 1]))
+        pos++;
+    return pos;
+}
+
+/* Count tokens starting in [begin, end[. */
+static size_t conf_count_tokens(const char *data, size_t begin, size_t end)
+{
+    size_t count = 0;
+    bool in_token = false;
+
+    for (size_t i = begin; i < end; i++) {
+        bool space = conf_is_space(data[i]);
+
+        count += in_token == false && !space;
+        in_token = !space;
+    }
+
+    return count;
+}
+
+static calc_t rand_calc_t(const calc_t a, const calc_t b)
+{
+    calc_t r = random() / (calc_t)RAND_MAX;
+    return a + (b - a) * r;
+}
+
+int conf_read_atoms(const sotl_conf_file_t *conf, sotl_atom_set_t *set)
+{
+    const unsigned nvalues = conf->read_speed ? 6 : 3;
+    const size_t needed = (size_t)conf->natoms * nvalues;
+    const size_t nchunks = (conf->size - conf->body) / CONF_CHUNK_SIZE + 1;
+    calc_t *arrays[6] = { set->pos.x, set->pos.y, set->pos.z,
+                          set->speed.dx, set->speed.dy, set->speed.dz };
+    size_t bad = SIZE_MAX;
+    size_t *first;
+
+    /* Index of the first value of each chunk. */
+    first = malloc((nchunks + 1) * sizeof(size_t));
+    if (!first)
+        return SOTL_OUT_OF_MEMORY;
+
+    first[0] = 0;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < nchunks; c++)
+        first[c + 1] = conf_count_tokens(conf->data, conf_chunk_start(conf, c),
+                                         conf_chunk_start(conf, c + 1));
+
+    for (size_t c = 0; c < nchunks; c++)
+        first[c + 1] += first[c];
+
+    if (first[nchunks] < needed) {
+        sotl_log(ERROR, "Only %zu values found for %u atoms\n",
+                 first[nchunks], conf->natoms);
+        free(first);
+        return SOTL_INVALID_VALUE;
+    }
+
+    /* Values are stored by atom: value k is field k % nvalues of atom
+     * k / nvalues. */
+    #pragma omp parallel for schedule(dynamic) reduction(min:bad)
+    for (size_t c = 0; c < nchunks; c++) {
+        size_t k = first[c];
+        size_t pos = conf_chunk_start(conf, c);
+        const size_t end = conf_chunk_start(conf, c + 1);
+        unsigned atom = k / nvalues, field = k % nvalues;
+
+        for (; k < MIN(first[c + 1], needed); k++) {
+            double value;
+
+            pos = conf_skip_spaces(conf, pos);
+            if (!conf_parse_value(conf->data + pos, conf->data + end, &value)) {
+                bad = MIN(bad, pos);
+                break;
+            }
+            while (pos < end && !conf_is_space(conf->data[pos]))
+                pos++;
+
+            arrays[field][atom] = value;
+            if (++field == nvalues) {
+                field = 0;
+                atom++;
+            }
+        }
+    }
+
+    free(first);
+    if (bad != SIZE_MAX) {
+        sotl_log(ERROR, "Invalid value at byte %zu\n", bad);
+        return SOTL_INVALID_VALUE;
+    }
+
+    for (unsigned n = 0; n < conf->natoms; n++)
+        set->id[n] = n;
+    set->current = conf->natoms;
+
+    if (!conf->read_speed) {
+        /* Velocity norm is between 5% and 20% of atom radius, in a random
+         * direction (drawn in order, as atoms are added one by one). */
+        for (unsigned n = 0; n < conf->natoms; n++) {
+            calc_t speed = rand_calc_t(ATOM_RADIUS * 0.05, ATOM_RADIUS * 0.2);
+            calc_t lat = rand_calc_t(-M_PI / 2, M_PI / 2);
+            calc_t lon = rand_calc_t(0.0, M_PI * 2);
+
+            set->speed.dx[n] = cos(lon) * cos(lat) * speed;
+            set->speed.dy[n] = sin(lat) * speed;
+            set->speed.dz[n] = -sin(lon) * cos(lat) * speed;
+        }
+    }
+
+    return SOTL_SUCCESS;
+}
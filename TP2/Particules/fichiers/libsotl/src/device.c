@@ -1,7 +1,11 @@
 #include "atom.h"
 #include "default_defines.h"
 #include "device.h"
+#include "integrator.h"
+#include "observables.h"
 #include "ocl.h"
+#include "ocl_kernels.h"
+#include "potential.h"
 #include "seq.h"
 #include "sotl.h"
 
@@ -14,6 +18,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 
 static int device_is_first(const sotl_device_t *dev)
 {
@@ -66,27 +71,94 @@ static void release_kernels(sotl_device_t *dev)
     }
 }
 
-void device_finalize(sotl_device_t *dev)
+/* Work-groups of update_position the stats buffer has room for. */
+static size_t stats_capacity(const sotl_device_t *dev)
 {
-    int i;
+    return device_read_back_stride(dev) /
+           MIN(dev->tile_size, dev->max_workgroup_size) + 1;
+}
+
+/* Release position, speed, id and readback buffers. */
+static void release_atom_buffers(sotl_device_t *dev)
+{
+    for (int i = 0; i < 2; ++i) {
+        clReleaseMemObject(dev->pos_buffer[i]);
+        clReleaseMemObject(dev->speed_buffer[i]);
+        clReleaseMemObject(dev->id_buffer[i]);
+    }
+
+    clEnqueueUnmapMemObject(dev->queue, dev->readback_buffer,
+                            dev->readback_ptr, 0, NULL, NULL);
+    clFinish(dev->queue);
+    clReleaseMemObject(dev->readback_buffer);
+
+    dev->mem_allocated -= 4 * (atom_set_size(&dev->atom_set) +
+                               2 * atom_set_border_size(&dev->atom_set));
+    dev->mem_allocated -= device_read_back_size(dev);
+    dev->mem_allocated -= 2 * device_read_back_stride(dev) * sizeof(unsigned);
+
+    if (integrator_is_adaptive()) {
+        clReleaseMemObject(dev->kick_buffer);
+        clReleaseMemObject(dev->stats_buffer);
+        dev->mem_allocated -= (device_read_back_stride(dev) +
+                               2 * stats_capacity(dev)) * sizeof(calc_t);
+    }
 
+    if (observables_is_enabled()) {
+        clReleaseMemObject(dev->energy_buffer);
+        clReleaseMemObject(dev->obs_buffer);
+        dev->mem_allocated -= (device_read_back_stride(dev) +
+                               OBSERVABLES_VALUES * stats_capacity(dev)) *
+                              sizeof(calc_t);
+    }
+}
+
+/* Size in bytes of the cluster buffers. */
+static size_t cluster_buffers_size(const sotl_device_t *dev)
+{
+    return dev->row_capacity * sizeof(int) +
+           dev->cluster_capacity * ((3 + CLUSTER_MAX_PAIRS) * sizeof(int) +
+                                    6 * sizeof(calc_t));
+}
+
+/* Release cluster buffers (if any). */
+static void release_cluster_buffers(sotl_device_t *dev)
+{
+    if (!dev->cluster_capacity)
+        return;
+
+    clReleaseMemObject(dev->row_cluster_buffer);
+    clReleaseMemObject(dev->cluster_atom_buffer);
+    clReleaseMemObject(dev->cluster_bound_buffer);
+    clReleaseMemObject(dev->pair_buffer);
+    clReleaseMemObject(dev->npairs_buffer);
+
+    dev->mem_allocated -= cluster_buffers_size(dev);
+    dev->cluster_capacity = dev->row_capacity = 0;
+}
+
+void device_finalize(sotl_device_t *dev)
+{
     if (dev->compute != SOTL_COMPUTE_OCL) {
         /* Do not free OpenCL ressources when an other mode is used. */
         return;
     }
 
-    for (i = 0; i < 2; ++i) {
-        clReleaseMemObject(dev->pos_buffer[i]);
-        clReleaseMemObject(dev->speed_buffer[i]);
-    }
+    release_atom_buffers(dev);
 
     clReleaseMemObject(dev->box_buffer);
     clReleaseMemObject(dev->calc_offset_buffer);
+    if (dev->torus_row_buffer)
+        clReleaseMemObject(dev->torus_row_buffer);
     clReleaseMemObject(dev->min_buffer);
     clReleaseMemObject(dev->max_buffer);
     clReleaseMemObject(dev->fake_min_buffer);
     clReleaseMemObject(dev->fake_max_buffer);
     clReleaseMemObject(dev->domain_buffer);
+    clReleaseMemObject(dev->potential_buffer);
+    if (dev->energy_table_buffer)
+        clReleaseMemObject(dev->energy_table_buffer);
+    release_cluster_buffers(dev);
 
     /* Release memory allocated by kernel objects. */
     release_kernels(dev);
@@ -96,19 +168,22 @@ void device_finalize(sotl_device_t *dev)
     clReleaseContext(dev->context);
 }
 
-#define ALLOC_BUF(buf, size, flags, name)                               \
+#define ALLOC_BUF(buf, size, flags, ptr, name)                          \
     do {                                                                \
         cl_int err;                                                     \
-        buf = clCreateBuffer(dev->context, flags, size, NULL, &err);    \
+        buf = clCreateBuffer(dev->context, flags, size, ptr, &err);     \
         check(err, "Failed to create "name" buffer.");                  \
         dev->mem_allocated += size;                                     \
     } while (0)
 
 #define ALLOC_RO_BUF(buf, size,  name) \
-    ALLOC_BUF(buf, size, CL_MEM_READ_ONLY, name)
+    ALLOC_BUF(buf, size, CL_MEM_READ_ONLY, NULL, name)
 
 #define ALLOC_RW_BUF(buf, size,  name) \
-    ALLOC_BUF(buf, size, CL_MEM_READ_WRITE, name)
+    ALLOC_BUF(buf, size, CL_MEM_READ_WRITE, NULL, name)
+
+#define ALLOC_COPY_BUF(buf, size, ptr, name) \
+    ALLOC_BUF(buf, size, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (void *)(ptr), name)
 
 static void create_gl_buffers(sotl_device_t *dev)
 {
@@ -133,7 +208,10 @@ static void create_gl_buffers(sotl_device_t *dev)
 #endif
 }
 
-void device_create_buffers(sotl_device_t *dev)
+/* Create position, speed and id buffers (with room for ghosts on both sides
+ * in multi devices), and the staging buffer of their readbacks. Ids are laid
+ * out like one axis of positions, so that box sort moves them together. */
+static void create_atom_buffers(sotl_device_t *dev)
 {
     size_t size;
 
@@ -148,20 +226,138 @@ void device_create_buffers(sotl_device_t *dev)
     for (int i = 0; i < 2; ++i) {
         ALLOC_RW_BUF(dev->pos_buffer[i], size, "pos_buffer(i)");
         ALLOC_RW_BUF(dev->speed_buffer[i], size, "speed_buffer(i)");
+        ALLOC_RW_BUF(dev->id_buffer[i],
+                     device_read_back_stride(dev) * sizeof(unsigned),
+                     "id_buffer(i)");
     }
 
     /* Init current position and speed buffers. */
     dev->cur_pb = 0;
     dev->cur_sb = 0;
 
+    /* Create the pinned staging buffer of readbacks, mapped once for all. */
+    size = device_read_back_size(dev);
+    ALLOC_BUF(dev->readback_buffer, size, CL_MEM_ALLOC_HOST_PTR, NULL,
+              "readback_buffer");
+    {
+        cl_int err;
+
+        dev->readback_ptr = clEnqueueMapBuffer(dev->queue, dev->readback_buffer,
+                                               CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                               0, size, 0, NULL, NULL, &err);
+        check(err, "Failed to map readback_buffer.");
+    }
+
+    /* Create the buffers of the adaptive time step, the squared speed
+     * increments being accumulated from zero. */
+    dev->kick_buffer = dev->stats_buffer = NULL;
+    if (integrator_is_adaptive()) {
+        calc_t *zero = calloc(device_read_back_stride(dev), sizeof(calc_t));
+
+        if (zero == NULL)
+            sotl_log(CRITICAL, "Failed to allocate memory\n");
+
+        size = device_read_back_stride(dev) * sizeof(calc_t);
+        ALLOC_BUF(dev->kick_buffer, size,
+                  CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, zero,
+                  "kick_buffer");
+        size = 2 * stats_capacity(dev) * sizeof(calc_t);
+        ALLOC_RW_BUF(dev->stats_buffer, size, "stats_buffer");
+        free(zero);
+    }
+
+    /* Create the buffers of observables, pair energies being cleared by
+     * the observables kernel once summed. */
+    dev->energy_buffer = dev->obs_buffer = NULL;
+    if (observables_is_enabled()) {
+        calc_t *zero = calloc(device_read_back_stride(dev), sizeof(calc_t));
+
+        if (zero == NULL)
+            sotl_log(CRITICAL, "Failed to allocate memory\n");
+
+        size = device_read_back_stride(dev) * sizeof(calc_t);
+        ALLOC_BUF(dev->energy_buffer, size,
+                  CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, zero,
+                  "energy_buffer");
+        size = OBSERVABLES_VALUES * stats_capacity(dev) * sizeof(calc_t);
+        ALLOC_RW_BUF(dev->obs_buffer, size, "obs_buffer");
+        free(zero);
+    }
+}
+
+/* Create box buffers, large enough for the boxes of the device domain. */
+static void create_box_buffers(sotl_device_t *dev)
+{
+    size_t size;
+
     /* Compute size of box buffers. */
-    unsigned total_boxes = ALRND(2 * SCAN_WG_SIZE, dev->domain.total_boxes + 1);
-    size = total_boxes * sizeof(int);
+    dev->box_capacity = ALRND(2 * SCAN_WG_SIZE, dev->domain.total_boxes + 1);
+    size = dev->box_capacity * sizeof(int);
 
-    /* Create box buffers. */
     ALLOC_RW_BUF(dev->box_buffer, size, "box_buffer");
     ALLOC_RW_BUF(dev->calc_offset_buffer, size, "calc_offset_buffer");
 
+    /* Own atoms of each inner row of boxes, then their prefix sum (torus
+     * mode only). */
+    dev->torus_row_buffer = NULL;
+    if (is_torus_mode) {
+        size = ALRND(2 * SCAN_WG_SIZE,
+                     dev->domain.boxes[1] * dev->domain.boxes[2] + 1) * sizeof(int);
+        ALLOC_RW_BUF(dev->torus_row_buffer, size, "torus_row_buffer");
+    }
+}
+
+/* Clusters of the atoms and ghosts of the device: at most one partial
+ * cluster per row of boxes. */
+static unsigned cluster_capacity_needed(const sotl_device_t *dev)
+{
+    return device_read_back_stride(dev) / CLUSTER_SIZE + 1 +
+           dev->domain.boxes[1] * dev->domain.boxes[2];
+}
+
+/* Create cluster buffers (cluster mode only). */
+static void create_cluster_buffers(sotl_device_t *dev)
+{
+    if (!is_box_mode || !is_cluster_mode)
+        return;
+
+    dev->cluster_capacity = cluster_capacity_needed(dev);
+    dev->row_capacity = dev->domain.boxes[1] * dev->domain.boxes[2] + 1;
+
+    ALLOC_RW_BUF(dev->row_cluster_buffer, dev->row_capacity * sizeof(int),
+                 "row_cluster_buffer");
+    ALLOC_RW_BUF(dev->cluster_atom_buffer, 2 * dev->cluster_capacity * sizeof(int),
+                 "cluster_atom_buffer");
+    ALLOC_RW_BUF(dev->cluster_bound_buffer, 6 * dev->cluster_capacity * sizeof(calc_t),
+                 "cluster_bound_buffer");
+    ALLOC_RW_BUF(dev->pair_buffer,
+                 CLUSTER_MAX_PAIRS * dev->cluster_capacity * sizeof(int),
+                 "pair_buffer");
+    ALLOC_RW_BUF(dev->npairs_buffer, dev->cluster_capacity * sizeof(int),
+                 "npairs_buffer");
+}
+
+/* Enlarge cluster buffers when the rows of boxes or the borders grew. */
+static void update_cluster_buffers(sotl_device_t *dev)
+{
+    if (dev->cluster_capacity &&
+        (cluster_capacity_needed(dev) > dev->cluster_capacity ||
+         dev->domain.boxes[1] * dev->domain.boxes[2] + 1 > dev->row_capacity)) {
+        release_cluster_buffers(dev);
+        create_cluster_buffers(dev);
+    }
+}
+
+void device_create_buffers(sotl_device_t *dev)
+{
+    size_t size;
+
+    /* Create position, speed and readback buffers. */
+    create_atom_buffers(dev);
+
+    /* Create box buffers. */
+    create_box_buffers(dev);
+
     /* Create min and max buffers. */
     size = 3 * sizeof(calc_t);
     ALLOC_RO_BUF(dev->min_buffer, size, "min_buffer");
@@ -173,6 +369,30 @@ void device_create_buffers(sotl_device_t *dev)
     size = 4 * sizeof(int);
     ALLOC_RO_BUF(dev->domain_buffer, size, "domain_buffer");
 
+    /* Create the force table, uploaded once for all (in float in mixed
+     * precision mode). */
+    if (get_potential()->mixed) {
+        size = sizeof(get_potential()->ftable);
+        ALLOC_COPY_BUF(dev->potential_buffer, size, get_potential()->ftable,
+                       "potential_buffer");
+    } else {
+        size = sizeof(get_potential()->table);
+        ALLOC_COPY_BUF(dev->potential_buffer, size, get_potential()->table,
+                       "potential_buffer");
+    }
+    dev->potential_version = get_potential()->version;
+
+    /* Create the energy table (observables only). */
+    dev->energy_table_buffer = NULL;
+    if (observables_is_enabled()) {
+        size = sizeof(get_potential()->etable);
+        ALLOC_COPY_BUF(dev->energy_table_buffer, size, get_potential()->etable,
+                       "energy_table_buffer");
+    }
+
+    /* Create cluster buffers (cluster mode only). */
+    create_cluster_buffers(dev);
+
     /* Create GL buffers for display. */
     create_gl_buffers(dev);
 }
@@ -213,7 +433,20 @@ static void write_gl_buffers(sotl_device_t *dev)
 #endif
 }
 
-void device_write_buffers(sotl_device_t *dev)
+/* Write ids of n atoms from first (negative for left ghosts) on. */
+static void write_id_buffer(sotl_device_t *dev, const int first,
+                            const unsigned n)
+{
+    const size_t begin = atom_set_begin(&dev->atom_set);
+
+    if (n)
+        WRITE_BUF(*cur_id_buf(dev), n * sizeof(unsigned),
+                  (begin + first) * sizeof(unsigned), dev->atom_set.id + first,
+                  "id_buffer");
+}
+
+/* Write positions, speeds and ids of the atoms owned by the device. */
+static void write_atom_buffers(sotl_device_t *dev)
 {
     size_t cb, size, size_border, offset;
 
@@ -240,6 +473,14 @@ void device_write_buffers(sotl_device_t *dev)
     offset += size + size_border * 2;
     WRITE_BUF(*cur_spd_buf(dev), cb, offset, dev->atom_set.speed.dz, "speed_buffer(z)");
 
+    write_id_buffer(dev, 0, dev->atom_set.natoms);
+}
+
+/* Write min, max and domain buffers. */
+static void write_domain_buffers(sotl_device_t *dev)
+{
+    size_t cb;
+
     /* Write min and max buffers. */
     cb = 3 * sizeof(calc_t);
     WRITE_BUF(dev->min_buffer, cb, 0, dev->domain.min_ext, "min_buffer");
@@ -250,11 +491,40 @@ void device_write_buffers(sotl_device_t *dev)
     /* Write domain buffer. */
     cb = 4 * sizeof(int);
     WRITE_BUF(dev->domain_buffer, cb, 0, dev->domain.boxes, "domain_buffer");
+}
+
+void device_write_buffers(sotl_device_t *dev)
+{
+    /* Write positions and speeds. */
+    write_atom_buffers(dev);
+
+    /* Write domain bounds. */
+    write_domain_buffers(dev);
 
     /* Write GL buffers for display. */
     write_gl_buffers(dev);
 }
 
+void device_write_potential(sotl_device_t *dev)
+{
+    const sotl_potential_t *pot = get_potential();
+
+    if (dev->potential_version == pot->version)
+        return;
+
+    /* Blocking writes: the host changes the table for the next step. */
+    if (pot->mixed)
+        WRITE_BUF(dev->potential_buffer, sizeof(pot->ftable), 0, pot->ftable,
+                  "potential_buffer");
+    else
+        WRITE_BUF(dev->potential_buffer, sizeof(pot->table), 0, pot->table,
+                  "potential_buffer");
+    if (dev->energy_table_buffer)
+        WRITE_BUF(dev->energy_table_buffer, sizeof(pot->etable), 0,
+                  pot->etable, "energy_table_buffer");
+    dev->potential_version = pot->version;
+}
+
 void device_init_ghosts(sotl_device_t *dev)
 {
     sotl_atom_set_t *set = &dev->atom_set;
@@ -288,6 +558,8 @@ void device_init_ghosts(sotl_device_t *dev)
     offset += size + size_border * 2;
     WRITE_BUF(*cur_spd_buf(dev), cb, offset, set->speed.dz - set->nghosts_min, "speed_buffer(z)");
 
+    write_id_buffer(dev, -(int)set->nghosts_min, set->nghosts_min);
+
     /**
      * Right ghosts.
      */
@@ -313,6 +585,85 @@ void device_init_ghosts(sotl_device_t *dev)
     WRITE_BUF(*cur_spd_buf(dev), cb, offset, set->speed.dy + set->natoms, "speed_buffer(y)");
     offset += size + size_border * 2;
     WRITE_BUF(*cur_spd_buf(dev), cb, offset, set->speed.dz + set->natoms, "speed_buffer(z)");
+
+    write_id_buffer(dev, set->natoms, set->nghosts_max);
+}
+
+void device_set_domain(sotl_device_t *dev, const sotl_domain_t *dom)
+{
+    dev->domain = *dom;
+
+    if (dev->compute != SOTL_COMPUTE_OCL)
+        return;
+
+    if (ALRND(2 * SCAN_WG_SIZE, dom->total_boxes + 1) > dev->box_capacity) {
+        unsigned long size = dev->box_capacity * sizeof(int);
+
+        clReleaseMemObject(dev->box_buffer);
+        clReleaseMemObject(dev->calc_offset_buffer);
+        dev->mem_allocated -= 2 * size;
+        create_box_buffers(dev);
+    }
+    update_cluster_buffers(dev);
+
+    write_domain_buffers(dev);
+}
+
+void device_set_atoms(sotl_device_t *dev, const sotl_atom_set_t *set)
+{
+    sotl_atom_set_t *own = &dev->atom_set;
+    unsigned nghosts = MAX(set->nghosts_min, set->nghosts_max);
+
+    own->pos         = set->pos;
+    own->speed       = set->speed;
+    own->id          = set->id;
+    own->natoms      = set->natoms;
+    own->current     = set->current;
+    own->nghosts_min = set->nghosts_min;
+    own->nghosts_max = set->nghosts_max;
+
+    if (dev->compute != SOTL_COMPUTE_OCL) {
+        /* Neighbour lists store indexes of atoms, which have changed. */
+        dev->verlet.valid = false;
+        return;
+    }
+
+    if (nghosts > own->offset_ghosts) {
+        /* Ghosts no longer fit in borders: enlarge them, with some margin
+         * so that this does not happen again at the next steps. */
+        release_atom_buffers(dev);
+        own->offset_ghosts = ROUND(nghosts + nghosts / 4);
+        create_atom_buffers(dev);
+        update_cluster_buffers(dev);
+
+        if (sotl_verbose)
+            sotl_log(INFO, "Borders of device [%s] enlarged to %d ghosts\n",
+                     dev->name, own->offset_ghosts);
+    }
+
+    write_atom_buffers(dev);
+    device_init_ghosts(dev);
+}
+
+void device_reserve_images(sotl_device_t *dev, const unsigned natoms)
+{
+    sotl_atom_set_t *set = &dev->atom_set;
+
+    if (natoms <= set->offset + set->offset_ghosts)
+        return;
+
+    /* Atoms are read back and written again to the enlarged buffers, with
+     * some margin as the number of images varies. */
+    device_read_buffers(dev);
+    release_atom_buffers(dev);
+    set->offset_ghosts = ROUND(natoms + natoms / 8 - set->offset);
+    create_atom_buffers(dev);
+    update_cluster_buffers(dev);
+    write_atom_buffers(dev);
+
+    if (sotl_verbose)
+        sotl_log(INFO, "Buffers of device [%s] enlarged to %d atoms and "
+                 "images\n", dev->name, set->offset + set->offset_ghosts);
 }
 
 #define READ_BUF(buffer, cb, offset, ptr, name)                             \
@@ -323,54 +674,158 @@ void device_init_ghosts(sotl_device_t *dev)
         check(err, "Failed to read "name" back to host memory.");           \
     } while (0)
 
-void device_read_buffers(sotl_device_t *dev)
+unsigned device_read_back_stride(const sotl_device_t *dev)
 {
-    device_read_back_pos(dev, dev->atom_set.pos.x, dev->atom_set.pos.y,
-                         dev->atom_set.pos.z);
-    device_read_back_spd(dev, dev->atom_set.speed.dx, dev->atom_set.speed.dy,
-                         dev->atom_set.speed.dz);
+    /* One axis and the right and left borders around the next one. */
+    return (atom_set_size(&dev->atom_set) +
+            2 * atom_set_border_size(&dev->atom_set)) / 3 / sizeof(calc_t);
 }
 
-void device_read_back_pos(sotl_device_t *dev, calc_t *pos_x, calc_t *pos_y,
-                          calc_t *pos_z)
+size_t device_read_back_size(const sotl_device_t *dev)
 {
-    size_t cb, size, size_border, offset;
+    return 3 * device_read_back_stride(dev) * sizeof(calc_t);
+}
 
-    /* Compute the size and the offset in bytes of data to read. */
-    cb   = sizeof(calc_t) * dev->atom_set.natoms;
-    size = atom_set_size(&dev->atom_set) / 3;
+cl_event device_read_back_async(sotl_device_t *dev, const bool spd,
+                                calc_t *host)
+{
+    const size_t stride = device_read_back_stride(dev) * sizeof(calc_t);
+    const size_t size_border = atom_set_border_size(&dev->atom_set) / 3;
+    cl_mem buffer = spd ? *cur_spd_buf(dev) : *cur_pos_buf(dev);
+    cl_event event;
+    cl_int err;
 
-    /* Get size of one border (ie. left) (only in multi devices). */
-    size_border = atom_set_border_size(&dev->atom_set) / 3;
+    /* From the first atom in x to the last one in z. */
+    err = clEnqueueReadBuffer(dev->queue, buffer, CL_FALSE, size_border,
+                              2 * stride + sizeof(calc_t) * dev->atom_set.natoms,
+                              host, 0, NULL, &event);
+    check(err, "Failed to read %s back to host memory.",
+          spd ? "speed_buffer" : "pos_buffer");
 
-    /* Read back positions. */
-    offset = size_border;
-    READ_BUF(*cur_pos_buf(dev), cb, offset, pos_x, "pos_buffer(x)");
-    offset += size + size_border * 2;
-    READ_BUF(*cur_pos_buf(dev), cb, offset, pos_y, "pos_buffer(y)");
-    offset += size + size_border * 2;
-    READ_BUF(*cur_pos_buf(dev), cb, offset, pos_z, "pos_buffer(z)");
+    /* Start the transfer now, not at the next synchronization. */
+    clFlush(dev->queue);
+
+    return event;
+}
+
+/* Read back positions or speeds in one transfer, in place when the host
+ * arrays have the layout of the buffer, else through the staging buffer. */
+static void device_read_back(sotl_device_t *dev, const bool spd,
+                             calc_t *x, calc_t *y, calc_t *z)
+{
+    const unsigned stride = device_read_back_stride(dev);
+    const calc_t *staging = dev->readback_ptr;
+    const bool in_place = y == x + stride && z == y + stride;
+    cl_event event;
+
+    event = device_read_back_async(dev, spd, in_place ? x : dev->readback_ptr);
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+
+    if (in_place)
+        return;
+
+    memcpy(x, staging, dev->atom_set.natoms * sizeof(calc_t));
+    memcpy(y, staging + stride, dev->atom_set.natoms * sizeof(calc_t));
+    memcpy(z, staging + 2 * stride, dev->atom_set.natoms * sizeof(calc_t));
+}
+
+cl_event device_read_back_ids_async(sotl_device_t *dev, unsigned *ids)
+{
+    const size_t begin = atom_set_begin(&dev->atom_set);
+    cl_event event;
+    cl_int err;
+
+    err = clEnqueueReadBuffer(dev->queue, *cur_id_buf(dev), CL_FALSE,
+                              begin * sizeof(unsigned),
+                              dev->atom_set.natoms * sizeof(unsigned), ids,
+                              0, NULL, &event);
+    check(err, "Failed to read id_buffer back to host memory.");
+
+    return event;
+}
+
+void device_read_back_ids(sotl_device_t *dev, unsigned *ids)
+{
+    cl_event event = device_read_back_ids_async(dev, ids);
+
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+}
+
+void device_read_buffers(sotl_device_t *dev)
+{
+    const unsigned stride = device_read_back_stride(dev);
+    sotl_atom_set_t *set = &dev->atom_set;
+    cl_event events[3];
+
+    /* Box sort permutes atoms on the device, ids included. */
+    events[2] = device_read_back_ids_async(dev, set->id);
+
+    if (set->pos.y != set->pos.x + stride ||
+        set->speed.dy != set->speed.dx + stride) {
+        device_read_back_pos(dev, set->pos.x, set->pos.y, set->pos.z);
+        device_read_back_spd(dev, set->speed.dx, set->speed.dy, set->speed.dz);
+        clWaitForEvents(1, events + 2);
+        clReleaseEvent(events[2]);
+        return;
+    }
+
+    /* All transfers are queued before waiting for them. */
+    events[0] = device_read_back_async(dev, false, set->pos.x);
+    events[1] = device_read_back_async(dev, true, set->speed.dx);
+    clWaitForEvents(3, events);
+    for (int i = 0; i < 3; ++i)
+        clReleaseEvent(events[i]);
+}
+
+void device_read_back_pos(sotl_device_t *dev, calc_t *pos_x, calc_t *pos_y,
+                          calc_t *pos_z)
+{
+    device_read_back(dev, false, pos_x, pos_y, pos_z);
 }
 
 void device_read_back_spd(sotl_device_t *dev, calc_t *spd_x, calc_t *spd_y,
                           calc_t *spd_z)
 {
-    size_t cb, size, size_border, offset;
-
-    /* Compute the size and the offset in bytes of data to read. */
-    cb   = sizeof(calc_t) * dev->atom_set.natoms;
-    size = atom_set_size(&dev->atom_set) / 3;
+    device_read_back(dev, true, spd_x, spd_y, spd_z);
+}
 
-    /* Get size of one border (ie. left) (only in multi devices). */
-    size_border = atom_set_border_size(&dev->atom_set) / 3;
+void device_read_stats(sotl_device_t *dev)
+{
+    const size_t local = MIN(dev->tile_size, dev->max_workgroup_size);
+    const size_t groups = (atom_set_offset(&dev->atom_set) + local - 1) / local;
+    const calc_t *stats = dev->readback_ptr;
+
+    /* Through the staging buffer, which is much larger. */
+    READ_BUF(dev->stats_buffer, 2 * groups * sizeof(calc_t), 0,
+             dev->readback_ptr, "stats_buffer");
+
+    dev->max_speed2 = dev->max_kick2 = 0.0;
+    for (size_t g = 0; g < groups; g++) {
+        dev->max_speed2 = MAX(dev->max_speed2, stats[2 * g]);
+        dev->max_kick2 = MAX(dev->max_kick2, stats[2 * g + 1]);
+    }
+}
 
-    /* Read back speeds. */
-    offset = size_border;
-    READ_BUF(*cur_spd_buf(dev), cb, offset, spd_x, "speed_buffer(x)");
-    offset += size + size_border * 2;
-    READ_BUF(*cur_spd_buf(dev), cb, offset, spd_y, "speed_buffer(y)");
-    offset += size + size_border * 2;
-    READ_BUF(*cur_spd_buf(dev), cb, offset, spd_z, "speed_buffer(z)");
+void device_read_observables(sotl_device_t *dev)
+{
+    const calc_t *sums = dev->readback_ptr;
+
+    reduce_observables(dev);
+
+    /* Through the staging buffer, which is much larger. */
+    READ_BUF(dev->obs_buffer, OBSERVABLES_VALUES * sizeof(calc_t), 0,
+             dev->readback_ptr, "obs_buffer");
+
+    observables_clear(&dev->observables);
+    dev->observables.natoms = dev->atom_set.natoms;
+    dev->observables.kinetic = sums[0];
+    dev->observables.potential = sums[1];
+    for (int i = 0; i < 3; i++)
+        dev->observables.momentum[i] = sums[2 + i];
+    for (int b = 0; b < SOTL_SPEED_BINS; b++)
+        dev->observables.histogram[b] = (unsigned)sums[5 + b];
 }
 
 void device_one_step_move(sotl_device_t *dev)
@@ -393,6 +848,69 @@ void device_one_step_move(sotl_device_t *dev)
     }
 }
 
+void device_one_step_force(sotl_device_t *dev)
+{
+    switch (dev->compute) {
+        case SOTL_COMPUTE_SEQ:
+            seq_one_step_force(dev);
+            break;
+#ifdef HAVE_OMP
+        case SOTL_COMPUTE_OMP:
+            omp_one_step_force(dev);
+            break;
+#endif
+        default:
+            sotl_log(ERROR, "Undefined compute method %d.\n", dev->compute);
+            break;
+    }
+}
+
+void device_one_step_integrate(sotl_device_t *dev)
+{
+    switch (dev->compute) {
+        case SOTL_COMPUTE_SEQ:
+            seq_one_step_integrate(dev);
+            break;
+#ifdef HAVE_OMP
+        case SOTL_COMPUTE_OMP:
+            omp_one_step_integrate(dev);
+            break;
+#endif
+        default:
+            sotl_log(ERROR, "Undefined compute method %d.\n", dev->compute);
+            break;
+    }
+}
+
+void device_reorder_atoms(sotl_device_t *dev)
+{
+    switch (dev->compute) {
+        case SOTL_COMPUTE_OCL:
+            device_read_buffers(dev);
+            atom_set_sort_morton(&dev->atom_set, &dev->domain);
+            device_write_buffers(dev);
+            break;
+        case SOTL_COMPUTE_SEQ:
+        case SOTL_COMPUTE_OMP:
+            /* Neighbour lists store indexes of atoms: rebuilding them only
+             * for the new order would cost more than the reorder saves, so
+             * the next rebuild sorts atoms first (see the Verlet force
+             * paths of seq.c and openmp.c). */
+            if (is_verlet_mode && dev->verlet.valid) {
+                dev->reorder_pending = true;
+                return;
+            }
+            atom_set_sort_morton(&dev->atom_set, &dev->domain);
+            dev->verlet.valid = false;
+            break;
+        default:
+            sotl_log(ERROR, "Undefined compute method %d.\n", dev->compute);
+            break;
+    }
+
+    dev->reorder_pending = false;
+}
+
 void cl_create_kernels(sotl_device_t *dev)
 {
     cl_int err;
@@ -404,6 +922,8 @@ void cl_create_kernels(sotl_device_t *dev)
     }
 }
 
+/* Number of atoms in the z planes of boxes before z, from the offsets of
+ * boxes computed by the scan. */
 static unsigned read_natoms_from_boxes(const sotl_device_t *dev, const int z)
 {
     const int shift_z = dev->domain.boxes[0] * dev->domain.boxes[1];
@@ -411,15 +931,15 @@ static unsigned read_natoms_from_boxes(const sotl_device_t *dev, const int z)
     unsigned natoms = 0;
     size_t offset;
 
-    if (z > 1) {
+    if (z > 0) {
         offset = shift_z * z * cb;
-        READ_BUF(dev->box_buffer, cb, offset, &natoms, "box_buffer[z - 1]");
+        READ_BUF(dev->box_buffer, cb, offset, &natoms, "box_buffer[z]");
     }
 
     return natoms;
 }
 
-static unsigned get_natoms_in_z(const sotl_device_t *dev, const int begin_z,
+unsigned device_get_natoms_in_z(const sotl_device_t *dev, const int begin_z,
                                 const int end_z)
 {
     return read_natoms_from_boxes(dev, end_z)
@@ -432,7 +952,7 @@ unsigned device_get_natoms_left(const sotl_device_t *dev)
     clFinish(dev->queue);
 
     /* Get number of atoms for the first two Z planes. */
-    return get_natoms_in_z(dev, 0, 3);
+    return device_get_natoms_in_z(dev, 0, 2);
 }
 
 unsigned device_get_natoms_right(const sotl_device_t *dev)
@@ -441,7 +961,105 @@ unsigned device_get_natoms_right(const sotl_device_t *dev)
     clFinish(dev->queue);
 
     /* Get number of atoms for the last two Z planes. */
-    return get_natoms_in_z(dev, dev->domain.boxes[2] - 3, dev->domain.boxes[2]);
+    return device_get_natoms_in_z(dev, dev->domain.boxes[2] - 2,
+                                  dev->domain.boxes[2]);
+}
+
+/* Index in buffers of atom i of the own atoms (negative for left ghosts),
+ * along x for positions and speeds. */
+static size_t atom_index(const sotl_device_t *dev, const int i)
+{
+    return atom_set_begin(&dev->atom_set) + i;
+}
+
+void device_read_atoms(sotl_device_t *dev, const int first,
+                       sotl_atom_set_t *set)
+{
+    const size_t stride = device_read_back_stride(dev) * sizeof(calc_t);
+    const size_t offset = atom_index(dev, first) * sizeof(calc_t);
+    const size_t cb = set->natoms * sizeof(calc_t);
+    calc_t *pos[3] = { set->pos.x, set->pos.y, set->pos.z };
+    calc_t *spd[3] = { set->speed.dx, set->speed.dy, set->speed.dz };
+    cl_int err = CL_SUCCESS;
+
+    if (!set->natoms)
+        return;
+
+    for (int i = 0; i < 3; i++) {
+        err |= clEnqueueReadBuffer(dev->queue, *cur_pos_buf(dev), CL_FALSE,
+                                   offset + i * stride, cb, pos[i],
+                                   0, NULL, NULL);
+        err |= clEnqueueReadBuffer(dev->queue, *cur_spd_buf(dev), CL_FALSE,
+                                   offset + i * stride, cb, spd[i],
+                                   0, NULL, NULL);
+    }
+    err |= clEnqueueReadBuffer(dev->queue, *cur_id_buf(dev), CL_FALSE,
+                               atom_index(dev, first) * sizeof(unsigned),
+                               set->natoms * sizeof(unsigned), set->id,
+                               0, NULL, NULL);
+    check(err, "Failed to read atoms back to host memory.");
+}
+
+void device_write_atoms(sotl_device_t *dev, const sotl_atom_set_t *set,
+                        const unsigned from, const unsigned n, const int first)
+{
+    const size_t stride = device_read_back_stride(dev) * sizeof(calc_t);
+    const size_t offset = atom_index(dev, first) * sizeof(calc_t);
+    const size_t cb = n * sizeof(calc_t);
+    const calc_t *pos[3] = { set->pos.x, set->pos.y, set->pos.z };
+    const calc_t *spd[3] = { set->speed.dx, set->speed.dy, set->speed.dz };
+    cl_int err = CL_SUCCESS;
+
+    if (!n)
+        return;
+
+    for (int i = 0; i < 3; i++) {
+        err |= clEnqueueWriteBuffer(dev->queue, *cur_pos_buf(dev), CL_FALSE,
+                                    offset + i * stride, cb, pos[i] + from,
+                                    0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(dev->queue, *cur_spd_buf(dev), CL_FALSE,
+                                    offset + i * stride, cb, spd[i] + from,
+                                    0, NULL, NULL);
+    }
+    err |= clEnqueueWriteBuffer(dev->queue, *cur_id_buf(dev), CL_FALSE,
+                                atom_index(dev, first) * sizeof(unsigned),
+                                n * sizeof(unsigned), set->id + from,
+                                0, NULL, NULL);
+    check(err, "Failed to write atoms to buffers.");
+}
+
+void device_move_atoms(sotl_device_t *dev, const unsigned from,
+                       const unsigned to, const unsigned n)
+{
+    const size_t stride = device_read_back_stride(dev) * sizeof(calc_t);
+    const size_t src = atom_index(dev, from) * sizeof(calc_t);
+    const size_t dst = atom_index(dev, to) * sizeof(calc_t);
+    const size_t cb = n * sizeof(calc_t);
+    cl_int err = CL_SUCCESS;
+
+    if (from == to)
+        return;
+
+    /* A buffer cannot be copied onto itself: atoms go to the alternate
+     * buffers, which become the current ones, as with box sort. */
+    for (int i = 0; i < 3 && n; i++) {
+        err |= clEnqueueCopyBuffer(dev->queue, *cur_pos_buf(dev),
+                                   *alt_pos_buf(dev), src + i * stride,
+                                   dst + i * stride, cb, 0, NULL, NULL);
+        err |= clEnqueueCopyBuffer(dev->queue, *cur_spd_buf(dev),
+                                   *alt_spd_buf(dev), src + i * stride,
+                                   dst + i * stride, cb, 0, NULL, NULL);
+    }
+    if (n)
+        err |= clEnqueueCopyBuffer(dev->queue, *cur_id_buf(dev),
+                                   *alt_id_buf(dev),
+                                   atom_index(dev, from) * sizeof(unsigned),
+                                   atom_index(dev, to) * sizeof(unsigned),
+                                   n * sizeof(unsigned), 0, NULL, NULL);
+    check(err, "Failed to copy atoms between buffers.");
+
+    dev->cur_pb = 1 - dev->cur_pb;
+    dev->cur_sb = 1 - dev->cur_sb;
 }
 
 unsigned device_get_natoms(const sotl_device_t *dev)
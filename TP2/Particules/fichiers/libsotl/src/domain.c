@@ -22,6 +22,10 @@ void domain_init(sotl_domain_t *dom, const calc_t x_min, const calc_t y_min,
     dom->max_ext[2] = z_max;
     dom->total_boxes = 1;
 
+    /* Keep the requested extents: they rebuild the same domain. */
+    memcpy(dom->min_range, dom->min_ext, sizeof(dom->min_range));
+    memcpy(dom->max_range, dom->max_ext, sizeof(dom->max_range));
+
     /* Init sub domains. */
     dom->nb_subdomains = 0;
     dom->subdomains    = NULL;
@@ -42,12 +46,35 @@ void domain_init(sotl_domain_t *dom, const calc_t x_min, const calc_t y_min,
         dom->min_border[i] = dom->min_ext[i] - BOX_SIZE * SUBCELL;
         dom->max_border[i] = dom->max_ext[i] + BOX_SIZE * SUBCELL;
         dom->boxes[i] += 2 * SUBCELL;
+        dom->box_inv[i] = BOX_SIZE_INV;
 
         /* Compute total number of boxes. */
         dom->total_boxes *= dom->boxes[i];
     }
 }
 
+void domain_make_periodic(sotl_domain_t *dom)
+{
+    dom->total_boxes = 1;
+
+    for (int i = 0; i < 3; i++) {
+        const calc_t length = dom->max_range[i] - dom->min_range[i];
+        const unsigned n = floor(length / BOX_SIZE);
+        const calc_t width = length / n;
+
+        /* Images of atoms are shifted by the period: no extra radius. */
+        dom->min_ext[i] = dom->min_range[i];
+        dom->max_ext[i] = dom->max_range[i];
+
+        dom->min_border[i] = dom->min_ext[i] - width * SUBCELL;
+        dom->max_border[i] = dom->max_ext[i] + width * SUBCELL;
+        dom->boxes[i] = n + 2 * SUBCELL;
+        dom->box_inv[i] = n / (double)length;
+
+        dom->total_boxes *= dom->boxes[i];
+    }
+}
+
 void domain_free(sotl_domain_t *dom)
 {
     /* Free sub domains. */
@@ -87,7 +114,7 @@ static unsigned *count_atoms_per_z_planes(const sotl_domain_t *dom)
 }
 
 static void find_zcut_values(const sotl_domain_t *dom, const unsigned *z_planes,
-                             const unsigned n, int *zcuts, int *natoms)
+                             const unsigned n, int *zcuts)
 {
     unsigned natoms_per_domains = dom->atom_set->natoms / n;
     unsigned natoms_acc = 0;
@@ -101,9 +128,8 @@ static void find_zcut_values(const sotl_domain_t *dom, const unsigned *z_planes,
             continue;
         }
 
-        /* Store Z boundary and the number of atoms of this Z plan. */
-        zcuts[n - nzcuts]  = z + 1;
-        natoms[n - nzcuts] = natoms_acc;
+        /* Store Z boundary. */
+        zcuts[n - nzcuts] = z + 1;
 
         /* Find out the next domain if needed. */
         natoms_acc = 0;
@@ -116,38 +142,78 @@ static void find_zcut_values(const sotl_domain_t *dom, const unsigned *z_planes,
     }
 }
 
-void domain_split(sotl_domain_t *dom, const unsigned n)
+/* Index of the first atom whose z is not lower than z_min, in a set sorted
+ * along z. */
+static unsigned lower_bound_z(const sotl_atom_set_t *set, const calc_t z_min)
 {
-    unsigned *z_planes = NULL;
-    int zcuts[n], natoms[n];
+    unsigned lo = 0, hi = set->natoms;
 
-    /* Allocate and initialize the array of sub domains. */
-    dom->nb_subdomains = n;
-    dom->subdomains    = xmalloc(sizeof(*dom) * dom->nb_subdomains);
-    for (unsigned int i = 0; i < dom->nb_subdomains; i++) {
-        dom->subdomains[i] = xmalloc(sizeof(*dom));
-        memcpy(dom->subdomains[i], dom, sizeof(*dom));
-        dom->subdomains[i]->nb_subdomains = 0;
-        dom->subdomains[i]->subdomains = NULL;
-    }
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
 
-    if (n == 1) {
-        /* Do no split the domain. */
-        return;
+        if (set->pos.z[mid] < z_min)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    /* Count number atoms per Z planes. */
-    z_planes = count_atoms_per_z_planes(dom);
-    for (unsigned z = 0; z < dom->boxes[2]; z++)
-        fprintf(stderr, "z_planes[%d] = %d\n", z, z_planes[z]);
+    return lo;
+}
 
-    /* Find z-axis boundaries. */
-    find_zcut_values(dom, z_planes, n, zcuts, natoms);
-    for (unsigned i = 0; i < n - 1; i++)
-        sotl_log(DEBUG, "zcuts[%d] = %d, natoms[%d] = %d\n", i, zcuts[i], i, natoms[i]);
+/* Give each sub domain the atoms of the global set (sorted along z) lying
+ * between its z boundaries, with the atoms on the borders of its neighbours
+ * as ghosts: they are the atoms just before and after its own ones. The
+ * first and last sub domains also own atoms which left the domain. */
+static void domain_assign_atoms(sotl_domain_t *dom)
+{
+    const unsigned n = dom->nb_subdomains;
+    sotl_atom_set_t *set = dom->atom_set;
+    unsigned first = 0;
 
-    /* Split the domain along z-axis. */
-    for (unsigned i = 0; i < dom->nb_subdomains; i++) {
+    for (unsigned i = 0; i < n; i++) {
+        sotl_domain_t *subdom = dom->subdomains[i];
+        sotl_atom_set_t *sub = subdom->atom_set;
+        unsigned last = set->natoms;
+
+        if (i < n - 1)
+            last = MAX(lower_bound_z(set, subdom->max_ext[2]), first);
+
+        sub->natoms  = last - first;
+        sub->current = sub->natoms;
+
+        /* Sub sets point to the global set, and any of them may end up
+         * with all atoms. */
+        sub->offset        = set->offset;
+        sub->offset_ghosts = set->offset_ghosts;
+
+        sub->nghosts_min = 0;
+        sub->nghosts_max = 0;
+        if (i > 0)
+            sub->nghosts_min = first - lower_bound_z(set, subdom->min_border[2]);
+        if (i < n - 1)
+            sub->nghosts_max = lower_bound_z(set, subdom->max_border[2]) - last;
+
+        sub->pos.x    = set->pos.x    + first;
+        sub->pos.y    = set->pos.y    + first;
+        sub->pos.z    = set->pos.z    + first;
+        sub->speed.dx = set->speed.dx + first;
+        sub->speed.dy = set->speed.dy + first;
+        sub->speed.dz = set->speed.dz + first;
+        sub->id       = set->id       + first;
+        sub->map      = NULL;
+        sub->map_size = 0;
+
+        first = last;
+    }
+}
+
+/* Set the z extents of the sub domains of dom from the z boundaries between
+ * them: zcuts[i] is the first z plane of boxes (of dom) after sub domain i. */
+static void domain_set_zcuts(sotl_domain_t *dom, const int *zcuts)
+{
+    const unsigned n = dom->nb_subdomains;
+
+    for (unsigned i = 0; i < n; i++) {
         sotl_domain_t *subdom = dom->subdomains[i];
         int zcut;
 
@@ -177,56 +243,46 @@ void domain_split(sotl_domain_t *dom, const unsigned n)
 
         /* Update the total number of boxes. */
         subdom->total_boxes = subdom->boxes[0] * subdom->boxes[1] * subdom->boxes[2];
+    }
+}
 
-        subdom->atom_set = xmalloc(sizeof(sotl_atom_set_t));
-        sotl_atom_set_t *prev_set = NULL;
-        unsigned natoms_offset;
-        int natom;
-        if (i < n - 1) {
-            natom = natoms[i];
-        } else {
-            unsigned acc = 0;
-            for (unsigned j = 0; j < dom->nb_subdomains - 1; j++)
-                acc += natoms[j];
-            natom = dom->atom_set->natoms - acc;
-        }
+void domain_split(sotl_domain_t *dom, const unsigned n)
+{
+    unsigned *z_planes = NULL;
+    int zcuts[n];
 
-        /* Atom set borders (left/right). */
-        if (i == 0) {
-            subdom->atom_set->nghosts_min = 0;
-            subdom->atom_set->nghosts_max = z_planes[zcuts[i]];
-        } else if (i < n - 1) {
-            subdom->atom_set->nghosts_min = z_planes[zcuts[i - 1] - 1];
-            subdom->atom_set->nghosts_max = z_planes[zcuts[i]];
-        } else {
-            subdom->atom_set->nghosts_min = z_planes[zcuts[i - 1] - 1];
-            subdom->atom_set->nghosts_max = z_planes[dom->boxes[2] - 1];
-        }
+    /* Allocate and initialize the array of sub domains. */
+    dom->nb_subdomains = n;
+    dom->subdomains    = xmalloc(sizeof(*dom) * dom->nb_subdomains);
+    for (unsigned int i = 0; i < dom->nb_subdomains; i++) {
+        dom->subdomains[i] = xmalloc(sizeof(*dom));
+        memcpy(dom->subdomains[i], dom, sizeof(*dom));
+        dom->subdomains[i]->nb_subdomains = 0;
+        dom->subdomains[i]->subdomains = NULL;
+    }
 
-        /* Atom set */
-        subdom->atom_set->natoms  = natom;
-        subdom->atom_set->current = natom;
-        subdom->atom_set->offset  = ROUND(natom);
-        subdom->atom_set->offset_ghosts = dom->atom_set->offset_ghosts;
+    if (n == 1) {
+        /* Do no split the domain. */
+        return;
+    }
 
-        if (i == 0) {
-            /* The first sub atom set points to the global atom set. */
-            prev_set      = dom->atom_set;
-            natoms_offset = 0;
-        } else {
-            /* Others sub sets point to the previous one. */
-            prev_set      = dom->subdomains[i - 1]->atom_set;
-            natoms_offset = prev_set->natoms;
-        }
+    /* Count number atoms per Z planes. */
+    z_planes = count_atoms_per_z_planes(dom);
+    for (unsigned z = 0; z < dom->boxes[2]; z++)
+        fprintf(stderr, "z_planes[%d] = %d\n", z, z_planes[z]);
 
-        /* Initialize atom positions and speeds. */
-        subdom->atom_set->pos.x    = prev_set->pos.x    + natoms_offset;
-        subdom->atom_set->pos.y    = prev_set->pos.y    + natoms_offset;
-        subdom->atom_set->pos.z    = prev_set->pos.z    + natoms_offset;
-        subdom->atom_set->speed.dx = prev_set->speed.dx + natoms_offset;
-        subdom->atom_set->speed.dy = prev_set->speed.dy + natoms_offset;
-        subdom->atom_set->speed.dz = prev_set->speed.dz + natoms_offset;
-    }
+    /* Find z-axis boundaries. */
+    find_zcut_values(dom, z_planes, n, zcuts);
+    for (unsigned i = 0; i < n - 1; i++)
+        sotl_log(DEBUG, "zcuts[%d] = %d\n", i, zcuts[i]);
+
+    /* Split the domain along z-axis. */
+    for (unsigned i = 0; i < n; i++)
+        dom->subdomains[i]->atom_set = xmalloc(sizeof(sotl_atom_set_t));
+    domain_set_zcuts(dom, zcuts);
+
+    /* Atoms are sorted along z: each sub domain gets a contiguous part. */
+    domain_assign_atoms(dom);
 
     free(z_planes);
 
@@ -252,6 +308,114 @@ void domain_split(sotl_domain_t *dom, const unsigned n)
 #endif
 }
 
+void domain_exchange(sotl_domain_t *dom)
+{
+    if (dom->nb_subdomains < 2)
+        return;
+
+    /* Atoms barely move between two exchanges: sorting them again is
+     * mostly done in place (see atom_set_sort()). */
+    atom_set_sort(dom->atom_set);
+    domain_assign_atoms(dom);
+}
+
+void domain_exchange_borders(sotl_domain_t *dom)
+{
+    sotl_atom_set_t *set = dom->atom_set;
+
+    if (dom->nb_subdomains < 2)
+        return;
+
+    /* Atoms [0, end[ are sorted: merge them with the next sub domain, by
+     * sorting the atoms of both sides lying past the boundary. */
+    for (unsigned i = 1; i < dom->nb_subdomains; i++) {
+        sotl_atom_set_t prefix = *set, next = *dom->subdomains[i]->atom_set;
+        sotl_atom_set_t window = *set;
+        unsigned end = next.pos.x - set->pos.x, lo, hi;
+
+        if (!end || !next.natoms)
+            continue;
+
+        prefix.natoms = end;
+        lo = lower_bound_z(&prefix, next.pos.z[0]);
+        hi = end + lower_bound_z(&next, set->pos.z[end - 1]);
+
+        window.pos.x    += lo;
+        window.pos.y    += lo;
+        window.pos.z    += lo;
+        window.speed.dx += lo;
+        window.speed.dy += lo;
+        window.speed.dz += lo;
+        window.id       += lo;
+        window.natoms    = hi - lo;
+        atom_set_sort(&window);
+    }
+
+    domain_assign_atoms(dom);
+}
+
+/* Number of atoms below z plane of boxes z, in a set sorted along z. */
+static unsigned atoms_below_plane(const sotl_domain_t *dom, const int z)
+{
+    return lower_bound_z(dom->atom_set, dom->min_border[2] + z * BOX_SIZE);
+}
+
+unsigned domain_rebalance(sotl_domain_t *dom, const double *shares)
+{
+    const unsigned n = dom->nb_subdomains;
+    int zcuts[n], old_zcuts[n];
+    unsigned old_first[n], moved = 0;
+    double target = 0.0;
+    bool changed = false;
+
+    if (n < 2)
+        return 0;
+
+    for (unsigned i = 0; i < n - 1; i++) {
+        /* Sub domain i ends where sub domain i + 1 begins. */
+        old_zcuts[i] = lround((dom->subdomains[i]->max_ext[2] -
+                               dom->min_border[2]) * BOX_SIZE_INV);
+        old_first[i + 1] = dom->subdomains[i + 1]->atom_set->pos.x -
+                           dom->atom_set->pos.x;
+    }
+
+    for (unsigned i = 0; i < n - 1; i++) {
+        /* Keep at least one z plane of boxes in each sub domain (the first
+         * and last planes of dom are borders). */
+        int z_min = i ? zcuts[i - 1] + 1 : 2;
+        int z_max = dom->boxes[2] - 2 - (n - 2 - i);
+        int z = z_min;
+
+        target += shares[i] * dom->atom_set->natoms;
+        while (z < z_max && atoms_below_plane(dom, z + 1) <= target)
+            z++;
+
+        /* Take the closest of both planes around the target. */
+        if (z < z_max && atoms_below_plane(dom, z + 1) - target <
+                         target - atoms_below_plane(dom, z))
+            z++;
+
+        zcuts[i] = z;
+        changed |= (z != old_zcuts[i]);
+    }
+
+    if (!changed)
+        return 0;
+
+    domain_set_zcuts(dom, zcuts);
+    domain_assign_atoms(dom);
+
+    /* Atoms between the old and the new boundary change sub domain. */
+    for (unsigned i = 1; i < n; i++) {
+        unsigned first = dom->subdomains[i]->atom_set->pos.x -
+                         dom->atom_set->pos.x;
+
+        moved += MAX(first, old_first[i]) - MIN(first, old_first[i]);
+    }
+
+    return moved;
+}
+
 void domain_print(const sotl_domain_t *dom)
 {
     for (int i = 0; i < 3; i++) {
@@ -15,4 +15,14 @@ unsigned gravity_enabled = 0;
 unsigned borders_enabled = 1;
 
 bool is_box_mode = false; 
+bool is_verlet_mode = false;
+bool is_half_pair_mode = false;
+bool is_numa_mode = false;
+bool is_torus_mode = false;
+bool is_cluster_mode = false;
+bool is_mixed_precision = false;
+unsigned reorder_period = 0;
+
+// Gravity direction (follows the camera when the display is enabled)
+float normalized_vert[3] = { 0.0, 1.0, 0.0 };
 
@@ -0,0 +1,171 @@
+#include "integrator.h"
+#include "global_definitions.h"
+#include "potential.h"
+#include "sotl.h"
+
+#include <math.h>
+#include <stdio.h>
+
+/* Width of the switch from the inner to the outer part of the potential,
+ * relative to the cutoff. */
+#define RESPA_SWITCH_WIDTH 0.1
+
+/* Largest ratio between two consecutive adaptive time steps. */
+#define ADAPTIVE_MAX_GROWTH 1.25
+
+/* History of adaptive time steps: iteration, time, time step, largest
+ * speed and largest force, one step per line. */
+#define ADAPTIVE_HISTORY_FILE "timesteps.dat"
+
+static struct {
+    double dt;
+    double dt_prev;     /* time step of the previous step */
+    unsigned nsteps;    /* inner steps per step */
+    sotl_step_t step;
+
+    /* Adaptive time step. */
+    double displacement;    /* 0 for a fixed time step */
+    double dt_max;
+    double dt_lo, dt_hi;    /* extent of the time steps used */
+    double time;
+    unsigned long iter;
+    FILE *history;
+} integrator = { .dt = 1.0, .dt_prev = 1.0, .nsteps = 1, .step = { 1.0, 1.0 } };
+
+void integrator_init(void)
+{
+    const double rc = LENNARD_CUTOFF;
+    const double width = RESPA_SWITCH_WIDTH * rc;
+    double inner = MD_RESPA_CUTOFF_VALUE;
+
+    integrator.dt = MD_DELTA_T_VALUE;
+    integrator.dt_prev = integrator.dt;
+    integrator.nsteps = MD_RESPA_STEPS_VALUE;
+
+    if (integrator.nsteps > 1 && (inner <= width || inner >= rc)) {
+        sotl_log(WARNING, "RESPA cutoff %g is out of ]%g, %g[: multiple "
+                 "time stepping is disabled.\n", inner, width, rc);
+        integrator.nsteps = 1;
+    }
+
+    potential_set_split(integrator.nsteps > 1 ? inner : 0.0,
+                        integrator.nsteps > 1 ? width : 0.0);
+
+    if (sotl_verbose && integrator.nsteps > 1)
+        sotl_log(INFO, "RESPA: %d inner steps per step of %g, inner "
+                 "forces below %g\n", integrator.nsteps, integrator.dt,
+                 inner);
+
+    integrator.displacement = MD_ADAPTIVE_DISPLACEMENT_VALUE;
+    integrator.dt_max = MD_DELTA_T_MAX_VALUE;
+    integrator.dt_lo = integrator.dt_hi = integrator.dt;
+    integrator.time = 0.0;
+    integrator.iter = 0;
+
+    if (integrator.displacement > 0.0) {
+        integrator.history = fopen(ADAPTIVE_HISTORY_FILE, "w");
+        if (integrator.history == NULL)
+            sotl_log(WARNING, "Failed to open \"%s\": time steps are not "
+                     "logged.\n", ADAPTIVE_HISTORY_FILE);
+        else
+            fprintf(integrator.history, "# iter time dt vmax fmax\n");
+
+        if (sotl_verbose)
+            sotl_log(INFO, "Adaptive time step: displacement below %g per "
+                     "step, time step up to %g\n", integrator.displacement,
+                     integrator.dt_max);
+    }
+}
+
+unsigned integrator_nb_substeps(void)
+{
+    return integrator.nsteps;
+}
+
+void integrator_set_substep(const unsigned k)
+{
+    const double dt = integrator.dt / integrator.nsteps;
+
+    if (k == 0) {
+        /* The second half kick of the previous step, merged with the first
+         * one of this step, which differ with an adaptive time step. */
+        const double kick = 0.5 * (integrator.dt_prev + integrator.dt);
+
+        potential_set_kicks(kick, kick / integrator.nsteps);
+        integrator.step.kick = kick / integrator.nsteps;
+    } else {
+        potential_set_kicks(0.0, dt);
+        integrator.step.kick = dt;
+    }
+    integrator.step.drift = dt;
+}
+
+void integrator_set_half_step(const bool drift)
+{
+    const double dt = integrator.dt;
+
+    potential_set_kicks(0.5 * dt, 0.5 * dt);
+    integrator.step.kick = 0.5 * dt;
+    integrator.step.drift = drift ? dt : 0.0;
+}
+
+const sotl_step_t *integrator_get_step(void)
+{
+    return &integrator.step;
+}
+
+bool integrator_is_adaptive(void)
+{
+    return integrator.displacement > 0.0;
+}
+
+void integrator_adapt(const calc_t max_speed2, const calc_t max_kick2)
+{
+    const double d = integrator.displacement;
+    const double vmax = sqrt(max_speed2);
+    double fmax = 0.0, h, bound;
+
+    if (d <= 0.0)
+        return;
+
+    /* Speed increments of the last substep were kicks by pair forces over
+     * step.kick (by inner forces only with RESPA, the fastest ones). */
+    if (integrator.step.kick > 0.0)
+        fmax = sqrt(max_kick2) / integrator.step.kick;
+
+    integrator.time += integrator.dt;
+    integrator.iter++;
+    if (integrator.history)
+        fprintf(integrator.history, "%lu %g %g %g %g\n", integrator.iter,
+                integrator.time, integrator.dt, vmax, fmax);
+
+    /* Largest inner step h such that vmax h + fmax h^2 / 2 <= d (the
+     * positive root, in a form which does not cancel out). */
+    h = MIN(integrator.dt_max, ADAPTIVE_MAX_GROWTH * integrator.dt) /
+        integrator.nsteps;
+    if (vmax > 0.0 || fmax > 0.0) {
+        bound = 2.0 * d / (vmax + sqrt(vmax * vmax + 2.0 * fmax * d));
+        h = MIN(h, bound);
+    }
+
+    integrator.dt_prev = integrator.dt;
+    integrator.dt = h * integrator.nsteps;
+    integrator.dt_lo = MIN(integrator.dt_lo, integrator.dt);
+    integrator.dt_hi = MAX(integrator.dt_hi, integrator.dt);
+}
+
+void integrator_finalize(void)
+{
+    if (integrator.history) {
+        fclose(integrator.history);
+        integrator.history = NULL;
+    }
+
+    if (integrator.displacement <= 0.0 || integrator.iter == 0)
+        return;
+
+    sotl_log(PERF, "Adaptive time step: %lu steps over %g, time step in "
+             "[%g, %g] (mean %g)\n", integrator.iter, integrator.time,
+             integrator.dt_lo, integrator.dt_hi,
+             integrator.time / integrator.iter);
+}
@@ -8,13 +8,21 @@ static char *kernels_name[KERNEL_TAB_SIZE] = {
   "growing", // Growing
   "reset_int_buffer", // reset_int
   "box_count_all_atoms", // box count_all
-  "null_kernel", // box_count (NOT USED)
-  "null_kernel", // scan (TODO)
-  "null_kernel", // scan2 (TODO)
+  "box_count_all_atoms", // box_count_own (own atoms only, at exchanges)
+  "scan", // scan
+  "scan_down_step", // scan2
   "copy_buffer", // copy
   "box_sort_all_atoms", // box_sort_all
-  "null_kernel", // box_sort (NOT_USED)
+  "box_sort_all_atoms", // box_sort_own (own atoms only, at exchanges)
+  "torus_count_all_atoms", // torus_count_all (atoms and periodic images)
+  "torus_sort_all_atoms", // torus_sort_all
+  "torus_rows", // torus_rows
+  "torus_gather", // torus_gather
   "box_force", // box_force
+  "cluster_scan", // cluster_scan
+  "cluster_build", // cluster_build
+  "cluster_pairs", // cluster_pairs
+  "cluster_force", // cluster_force
   "lennard_jones", // force
   "border_collision",  // bounce
   "update_position", // update_position
@@ -26,6 +34,8 @@ static char *kernels_name[KERNEL_TAB_SIZE] = {
 
   "zero_speed", // zero_speed
   "atom_collision", // collision
+  "observables", // observables
+  "reduce_observables", // observables_reduce
   "null_kernel", // NULL 
 };
 
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include "numa.h"
+#include "sotl.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Number of pages queried at once in numa_report(). */
+#define NUMA_QUERY_PAGES 1024
+
+static struct {
+    unsigned nnodes;
+    unsigned id[NUMA_MAX_NODES];            /* node number in sysfs */
+    cpu_set_t cpus[NUMA_MAX_NODES];         /* usable CPUs of each node */
+    unsigned long local[NUMA_MAX_NODES];    /* numastat at init */
+    unsigned long remote[NUMA_MAX_NODES];
+} topo;
+
+/* Node pinned by the calling thread (-1 if none). */
+static __thread int pinned_node = -1;
+
+/* Parse a sysfs CPU list ("0-3,8,10-11") into cpus. */
+static void numa_parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+    const char *p = list;
+
+    CPU_ZERO(cpus);
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+            CPU_SET(c, cpus);
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Read the local_node and other_node counters of a node. */
+static void numa_read_numastat(const unsigned id, unsigned long *local,
+                               unsigned long *remote)
+{
+    char path[64], name[32];
+    unsigned long value;
+    FILE *f;
+
+    *local = *remote = 0;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/numastat", id);
+    if (!(f = fopen(path, "r")))
+        return;
+
+    while (fscanf(f, "%31s %lu", name, &value) == 2) {
+        if (!strcmp(name, "local_node"))
+            *local = value;
+        else if (!strcmp(name, "other_node"))
+            *remote = value;
+    }
+    fclose(f);
+}
+
+unsigned numa_topology_init(void)
+{
+    cpu_set_t allowed;
+
+    topo.nnodes = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return 1;
+
+    for (unsigned id = 0; id < 64 && topo.nnodes < NUMA_MAX_NODES; id++) {
+        cpu_set_t *cpus = &topo.cpus[topo.nnodes];
+        char path[64], list[4096];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+        if (!(f = fopen(path, "r")))
+            continue;
+        if (!fgets(list, sizeof(list), f))
+            list[0] = '\0';
+        fclose(f);
+
+        /* Nodes with memory only, or no CPU for us, are left out. */
+        numa_parse_cpulist(list, cpus);
+        CPU_AND(cpus, cpus, &allowed);
+        if (!CPU_COUNT(cpus))
+            continue;
+
+        topo.id[topo.nnodes] = id;
+        numa_read_numastat(id, &topo.local[topo.nnodes], &topo.remote[topo.nnodes]);
+        topo.nnodes++;
+    }
+
+    if (!topo.nnodes)
+        topo.nnodes = 1;
+    return topo.nnodes;
+}
+
+unsigned numa_thread_node(const int t, const int nthreads)
+{
+    return (unsigned long)t * topo.nnodes / nthreads;
+}
+
+void numa_node_threads(const unsigned node, const int nthreads, int *first,
+                       int *last)
+{
+    /* Smallest t such that t * nnodes / nthreads >= node. */
+    *first = ((unsigned long)node * nthreads + topo.nnodes - 1) / topo.nnodes;
+    *last  = ((unsigned long)(node + 1) * nthreads + topo.nnodes - 1) / topo.nnodes;
+}
+
+void numa_pin_thread(const unsigned node)
+{
+    if (pinned_node == (int)node)
+        return;
+
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &topo.cpus[node]) < 0)
+        sotl_log(WARNING, "Failed to pin a thread to NUMA node %u\n",
+                 topo.id[node]);
+    pinned_node = node;
+}
+
+/* First atom of sub domain i in the global set. */
+static unsigned numa_first_atom(const sotl_atom_set_t *set,
+                                const sotl_domain_t *dom, const unsigned i)
+{
+    return dom->subdomains[i]->atom_set->pos.x - set->pos.x;
+}
+
+int numa_place_atoms(sotl_atom_set_t *set, sotl_domain_t *dom)
+{
+    const unsigned offset = set->offset;
+    unsigned first[NUMA_MAX_NODES];
+    sotl_atom_set_t fresh;
+    int ret;
+
+    /* Not touched yet: pages are only allocated by the copies below. */
+    ret = atom_set_init(&fresh, set->natoms, offset);
+    if (ret < 0)
+        return ret;
+
+    for (unsigned i = 0; i < dom->nb_subdomains; i++)
+        first[i] = numa_first_atom(set, dom, i);
+
+    #pragma omp parallel
+    {
+        int t = 0, nt = 1;
+
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+        nt = omp_get_num_threads();
+#endif
+        {
+            const unsigned node = numa_thread_node(t, nt);
+            const unsigned n = dom->subdomains[node]->atom_set->natoms;
+            unsigned begin, end;
+            int t0, t1;
+
+            numa_node_threads(node, nt, &t0, &t1);
+            begin = first[node] + (unsigned long)n * (t - t0) / (t1 - t0);
+            end   = first[node] + (unsigned long)n * (t - t0 + 1) / (t1 - t0);
+
+            numa_pin_thread(node);
+
+            for (int a = 0; a < 3; a++) {
+                memcpy(fresh.pos.x + a * offset + begin, set->pos.x + a * offset + begin,
+                       (end - begin) * sizeof(calc_t));
+                memcpy(fresh.speed.dx + a * offset + begin,
+                       set->speed.dx + a * offset + begin,
+                       (end - begin) * sizeof(calc_t));
+            }
+            memcpy(fresh.id + begin, set->id + begin, (end - begin) * sizeof(unsigned));
+        }
+    }
+
+    atom_set_free(set);
+    set->pos      = fresh.pos;
+    set->speed    = fresh.speed;
+    set->id       = fresh.id;
+    set->map      = NULL;
+    set->map_size = 0;
+
+    for (unsigned i = 0; i < dom->nb_subdomains; i++) {
+        sotl_atom_set_t *sub = dom->subdomains[i]->atom_set;
+
+        sub->pos.x    = set->pos.x    + first[i];
+        sub->pos.y    = set->pos.y    + first[i];
+        sub->pos.z    = set->pos.z    + first[i];
+        sub->speed.dx = set->speed.dx + first[i];
+        sub->speed.dy = set->speed.dy + first[i];
+        sub->speed.dz = set->speed.dz + first[i];
+        sub->id       = set->id       + first[i];
+    }
+
+    return SOTL_SUCCESS;
+}
+
+/* Count the pages of [begin, end[ found on node id and on other nodes. */
+static void numa_count_pages(const void *begin, const void *end,
+                             const unsigned id, unsigned long *local,
+                             unsigned long *remote)
+{
+#ifdef SYS_move_pages
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t)begin & ~(page - 1);
+    void *pages[NUMA_QUERY_PAGES];
+    int status[NUMA_QUERY_PAGES];
+
+    while (addr < (uintptr_t)end) {
+        unsigned count = 0;
+
+        for (; count < NUMA_QUERY_PAGES && addr < (uintptr_t)end; addr += page)
+            pages[count++] = (void *)addr;
+
+        /* Without target nodes, move_pages() only tells where pages are. */
+        if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) < 0)
+            return;
+
+        for (unsigned p = 0; p < count; p++) {
+            if (status[p] == (int)id)
+                (*local)++;
+            else if (status[p] >= 0)
+                (*remote)++;
+        }
+    }
+#else
+    (void)begin; (void)end; (void)id; (void)local; (void)remote;
+#endif
+}
+
+void numa_report(const sotl_domain_t *dom)
+{
+    const sotl_atom_set_t *set = dom->atom_set;
+
+    for (unsigned i = 0; i < topo.nnodes && i < dom->nb_subdomains; i++) {
+        const sotl_atom_set_t *sub = dom->subdomains[i]->atom_set;
+        const calc_t *arrays[6] = { sub->pos.x, sub->pos.y, sub->pos.z,
+                                    sub->speed.dx, sub->speed.dy, sub->speed.dz };
+        unsigned long pages_local = 0, pages_remote = 0;
+        unsigned long local, remote;
+
+        for (int a = 0; a < 6; a++)
+            numa_count_pages(arrays[a], arrays[a] + sub->natoms, topo.id[i],
+                             &pages_local, &pages_remote);
+        numa_count_pages(sub->id, sub->id + sub->natoms, topo.id[i],
+                         &pages_local, &pages_remote);
+
+        numa_read_numastat(topo.id[i], &local, &remote);
+
+        sotl_log(PERF, "  NUMA node %u: %d atoms (%d to %d), %lu pages local, "
+                 "%lu remote\n", topo.id[i], sub->natoms,
+                 (int)(sub->pos.x - set->pos.x),
+                 (int)(sub->pos.x - set->pos.x) + sub->natoms,
+                 pages_local, pages_remote);
+        sotl_log(PERF, "  NUMA node %u: %lu local and %lu remote page "
+                 "allocations during the run\n", topo.id[i],
+                 local - topo.local[i], remote - topo.remote[i]);
+    }
+}
@@ -0,0 +1,128 @@
+#include "observables.h"
+#include "atom.h"
+#include "global_definitions.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static bool enabled = false;
+static sotl_sampling_t sampling;
+static sotl_observables_t last;
+static bool have_last = false;
+static FILE *samples = NULL;
+
+/* Bin width for a given mean square speed (when not null). */
+static void observables_size_bins(const double v2)
+{
+    if (v2 > 0.0)
+        sampling.bin_width = OBSERVABLES_SPEED_RANGE * sqrt(v2) /
+                             SOTL_SPEED_BINS;
+}
+
+int observables_init(const char *filename)
+{
+    const sotl_atom_set_t *set = get_global_atom_set();
+    double v2 = 0.0;
+
+    enabled = true;
+    have_last = false;
+    sampling.energy = sampling.speeds = false;
+
+    /* Atoms at rest: any width until they move. */
+    sampling.bin_width = 1.0 / SOTL_SPEED_BINS;
+    for (unsigned n = 0; n < set->natoms; n++)
+        v2 += set->speed.dx[n] * set->speed.dx[n] +
+              set->speed.dy[n] * set->speed.dy[n] +
+              set->speed.dz[n] * set->speed.dz[n];
+    if (set->natoms)
+        observables_size_bins(v2 / set->natoms);
+
+    if (filename == NULL)
+        return SOTL_SUCCESS;
+
+    samples = fopen(filename, "w");
+    if (samples == NULL)
+        return -errno;
+
+    fprintf(samples, "# iter kinetic potential total temperature "
+            "px py pz bin_width histogram[%d]\n", SOTL_SPEED_BINS);
+
+    return SOTL_SUCCESS;
+}
+
+bool observables_is_enabled(void)
+{
+    return enabled;
+}
+
+void observables_set_substep(const bool sample, const unsigned k,
+                             const unsigned nsteps)
+{
+    sampling.energy = sample && k == 0;
+    sampling.speeds = sample && k == nsteps - 1;
+}
+
+const sotl_sampling_t *observables_get_sampling(void)
+{
+    return &sampling;
+}
+
+void observables_clear(sotl_observables_t *obs)
+{
+    memset(obs, 0, sizeof(*obs));
+}
+
+void observables_add(sotl_observables_t *sum, const sotl_observables_t *obs)
+{
+    sum->natoms += obs->natoms;
+    sum->kinetic += obs->kinetic;
+    sum->potential += obs->potential;
+    for (int i = 0; i < 3; i++)
+        sum->momentum[i] += obs->momentum[i];
+    for (int b = 0; b < SOTL_SPEED_BINS; b++)
+        sum->histogram[b] += obs->histogram[b];
+}
+
+void observables_record(sotl_observables_t *obs, const unsigned long iter)
+{
+    obs->iter = iter;
+    obs->bin_width = sampling.bin_width;
+    obs->temperature = obs->natoms ?
+        2.0 * obs->kinetic / (3.0 * obs->natoms) : 0.0;
+
+    last = *obs;
+    have_last = true;
+
+    if (obs->natoms)
+        observables_size_bins(2.0 * obs->kinetic / obs->natoms);
+
+    if (samples == NULL)
+        return;
+
+    fprintf(samples, "%lu %g %g %g %g %g %g %g %g", iter, obs->kinetic,
+            obs->potential, obs->kinetic + obs->potential, obs->temperature,
+            obs->momentum[0], obs->momentum[1], obs->momentum[2],
+            obs->bin_width);
+    for (int b = 0; b < SOTL_SPEED_BINS; b++)
+        fprintf(samples, " %u", obs->histogram[b]);
+    fprintf(samples, "\n");
+}
+
+int observables_get(sotl_observables_t *obs)
+{
+    if (!have_last)
+        return SOTL_INVALID_VALUE;
+
+    *obs = last;
+    return SOTL_SUCCESS;
+}
+
+void observables_finalize(void)
+{
+    if (samples) {
+        fclose(samples);
+        samples = NULL;
+    }
+    enabled = false;
+}
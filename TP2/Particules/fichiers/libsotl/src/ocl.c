@@ -23,6 +23,9 @@
 #include "ocl.h"
 #include "ocl_kernels.h"
 #include "atom.h"
+#include "integrator.h"
+#include "observables.h"
+#include "potential.h"
 #include "window.h"
 #include "sotl.h"
 #include "util.h"
@@ -32,12 +35,15 @@
 #endif
 
 #define OPENCL_PROG_MAX_STRING_SIZE_OPTIONS 2048
-#define OPENCL_PROG_STRING_OPTIONS "-DSCAN_WG_SIZE=%d -DTILE_SIZE_BOX_OFFSET=%d -DUSE_DOUBLE=%d"
-#define OPENCL_PROG_PARAM_OPTIONS SCAN_WG_SIZE, TILE_SIZE_BOX_OFFSET, USE_DOUBLE
+#define OPENCL_PROG_STRING_OPTIONS "-DSCAN_WG_SIZE=%d -DTILE_SIZE_BOX_OFFSET=%d -DUSE_DOUBLE=%d -DCLUSTER_SIZE=%d -DCLUSTER_MAX_PAIRS=%d"
+#define OPENCL_PROG_PARAM_OPTIONS SCAN_WG_SIZE, TILE_SIZE_BOX_OFFSET, USE_DOUBLE, CLUSTER_SIZE, CLUSTER_MAX_PAIRS
 
 #define LENNARD_STRING "-DLENNARD_SIGMA=%.10f -DLENNARD_EPSILON=%.10f -DLENNARD_CUTOFF=%.10f -DBOX_SIZE_INV=%.10f -DLENNARD_SQUARED_CUTOFF=%.10f"
 #define LENNARD_PARAM  (double)LENNARD_SIGMA,LENNARD_EPSILON,LENNARD_CUTOFF,BOX_SIZE_INV,LENNARD_SQUARED_CUTOFF
 
+#define POTENTIAL_STRING " -DPOT_TABLE_INV_STEP=%.10f"
+#define POTENTIAL_PARAM  (double)get_potential()->inv_step
+
 #ifdef HAVE_LIBGL
 cl_mem vbo_buffer;
 cl_mem model_buffer;
@@ -142,7 +148,8 @@ void ocl_init(sotl_device_t *dev)
 	     "-DSLIDE=%d "
 #endif
 	     OPENCL_PROG_STRING_OPTIONS " -I "OCL_INCLUDE " " 
-	     LENNARD_STRING,
+	     LENNARD_STRING
+	     POTENTIAL_STRING,
 	     dev->tile_size,
 	     SUBCELL,
              1.0f,
@@ -150,7 +157,8 @@ void ocl_init(sotl_device_t *dev)
 	     dev->slide_steps,
 #endif
 	     OPENCL_PROG_PARAM_OPTIONS,
-	     LENNARD_PARAM);
+	     LENNARD_PARAM,
+	     POTENTIAL_PARAM);
 
     // If not a GPU, do not use Tiling
     //
@@ -169,15 +177,41 @@ void ocl_init(sotl_device_t *dev)
     if (sotl_have_multi())
       strcat (options, " -DHAVE_MULTI");
 
+    // Float pair forces, accumulated in double
+    //
+    if (get_potential()->mixed)
+      strcat (options, " -DMIXED_PRECISION");
+
+    // Maximum speed and speed increment reduced for the adaptive time step
+    //
+    if (integrator_is_adaptive())
+      strcat (options, " -DADAPTIVE_STEP");
+
+    // Pair energies and per work-group sums of observables
+    //
+    sprintf (options + strlen (options), " -DSPEED_BINS=%d", SOTL_SPEED_BINS);
+    if (observables_is_enabled())
+      strcat (options, " -DOBSERVABLES");
+
+    // Periodic images, in boxes stretched to a whole number per period
+    //
+    if (is_torus_mode) {
+      const sotl_domain_t *dom = get_global_domain ();
+
+      sprintf (options + strlen (options),
+	       " -DTORUS -DTORUS_INV_X=%.17g -DTORUS_INV_Y=%.17g -DTORUS_INV_Z=%.17g"
+	       " -DTORUS_LENGTH_X=%.17g -DTORUS_LENGTH_Y=%.17g -DTORUS_LENGTH_Z=%.17g",
+	       dom->box_inv[0], dom->box_inv[1], dom->box_inv[2],
+	       dom->max_range[0] - dom->min_range[0],
+	       dom->max_range[1] - dom->min_range[1],
+	       dom->max_range[2] - dom->min_range[2]);
+    }
+
 #ifdef FORCE_N_UPDATE
-    if (!sotl_have_multi())
+    if (!sotl_have_multi() && !is_torus_mode)
       strcat (options, " -DFORCE_N_UPDATE");
 #endif
 
-#ifdef TORUS
-    strcat (options, " -DXY_TORUS -DZ_TORUS");
-#endif
-
 #ifdef XEON_VECTORIZATION
     strcat (options, " -DXEON_VECTORIZATION");
 #endif
@@ -222,6 +256,23 @@ void ocl_init(sotl_device_t *dev)
 
 void ocl_alloc_buffers (sotl_device_t *dev)
 {
+  // Cluster-pair work-groups have CLUSTER_SIZE^2 threads, and the scan of
+  // clusters runs in one work-group
+  if (is_cluster_mode &&
+      dev->max_workgroup_size < MAX (CLUSTER_SIZE * CLUSTER_SIZE, SCAN_WG_SIZE)) {
+    sotl_log(WARNING, "Work-groups of device [%s] are too small for cluster "
+	     "pairs: using the box kernel.\n", dev->name);
+    is_cluster_mode = false;
+  }
+
+  // The scan of boxes runs in work-groups of SCAN_WG_SIZE threads
+  if (is_box_mode && dev->max_workgroup_size < SCAN_WG_SIZE) {
+    sotl_log(WARNING, "Work-groups of device [%s] are too small for the "
+	     "scan of boxes: box mode disabled.\n", dev->name);
+    is_box_mode = false;
+    is_cluster_mode = false;
+  }
+
   device_create_buffers(dev);
 
   if (sotl_verbose)
@@ -241,10 +292,47 @@ void ocl_write_buffers(sotl_device_t *dev)
     }
 }
 
+// Torus mode: sort atoms along with their periodic images, compute the
+// forces of atoms (images are borders), then gather atoms back from the
+// first atom on, still sorted by box, as omp_torus_force does
+//
+static void ocl_torus_force (sotl_device_t *dev)
+{
+  unsigned begin = atom_set_begin (&dev->atom_set);
+  unsigned end   = atom_set_end (&dev->atom_set);
+  unsigned total;
+
+  reset_box_buffer (dev);
+  torus_count_all_atoms (dev, begin, end);
+  scan (dev, 0, dev->domain.total_boxes + 1);
+
+  // Atoms and images must fit in the buffers from begin on
+  //
+  total = device_get_natoms (dev);
+  device_reserve_images (dev, total);
+  begin = atom_set_begin (&dev->atom_set);
+  end   = atom_set_end (&dev->atom_set);
+
+  copy_box_buffer (dev);
+  torus_sort_all_atoms (dev, begin, end);
+  dev->cur_pb = 1 - dev->cur_pb;
+  dev->cur_sb = 1 - dev->cur_sb;
+
+  torus_rows (dev);
+  box_lennard_jones (dev, begin, begin + total);
+
+  torus_gather (dev);
+  dev->cur_pb = 1 - dev->cur_pb;
+  dev->cur_sb = 1 - dev->cur_sb;
+}
+
 void ocl_one_step_move(sotl_device_t *dev)
 {
-  unsigned begin = atom_set_begin(&dev->atom_set);
-  unsigned end   = atom_set_end(&dev->atom_set);
+  // Ghosts (multi devices only) are binned and sorted with own atoms, they
+  // lie in the first and last z planes of boxes, where no force is computed
+  //
+  unsigned begin = atom_set_begin(&dev->atom_set) - dev->atom_set.nghosts_min;
+  unsigned end   = atom_set_end(&dev->atom_set) + dev->atom_set.nghosts_max;
 
   if (gravity_enabled)
     gravity (dev);
@@ -259,7 +347,11 @@ void ocl_one_step_move(sotl_device_t *dev)
 
   if (force_enabled) {
 
-    if (is_box_mode) {
+    device_write_potential (dev);
+
+    if (is_box_mode && is_torus_mode) {
+      ocl_torus_force (dev);
+    } else if (is_box_mode) {
       reset_box_buffer(dev);
       box_count_all_atoms(dev, begin, end);
 
@@ -279,7 +371,10 @@ void ocl_one_step_move(sotl_device_t *dev)
       }
 
       /* Compute potential */
-      box_lennard_jones(dev, begin, end);
+      if (is_cluster_mode)
+	cluster_lennard_jones(dev, begin, end);
+      else
+	box_lennard_jones(dev, begin, end);
 
     } else { // !BOX_MODE
 
@@ -292,17 +387,45 @@ void ocl_one_step_move(sotl_device_t *dev)
   if(detect_collision)
     atom_collision (dev);
 
-  if(borders_enabled)
+  // Atoms cross the borders of a torus, see update_position
+  //
+  if(borders_enabled && !is_torus_mode)
     border_collision (dev);
 
   update_position (dev);
 
+  // Observables are reduced once the speeds of the sampled step are known
+  //
+  if (observables_get_sampling ()->speeds)
+    observables_kernel (dev);
+
 #ifdef HAVE_LIBGL
   if (dev->display)
     update_vertices (dev);
 #endif
 }
 
+// Sort own atoms (multi devices only) along the boxes of their positions
+// after the move, without ghosts: the atoms which left the sub domain then
+// lie in the first and last z planes of boxes, and the ones its neighbours
+// need as ghosts in the next ones (see device_get_natoms_left/right)
+//
+void ocl_sort_own_atoms (sotl_device_t *dev)
+{
+  unsigned begin = atom_set_begin (&dev->atom_set);
+  unsigned end   = atom_set_end (&dev->atom_set);
+
+  reset_box_buffer (dev);
+  box_count_own_atoms (dev, begin, end);
+  scan (dev, 0, dev->domain.total_boxes + 1);
+
+  copy_box_buffer (dev);
+  box_sort_own_atoms (dev, begin, end);
+
+  dev->cur_pb = 1 - dev->cur_pb;
+  dev->cur_sb = 1 - dev->cur_sb;
+}
+
 
 #ifdef HAVE_LIBGL
 
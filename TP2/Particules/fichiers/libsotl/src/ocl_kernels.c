@@ -4,7 +4,9 @@
 
 #include "default_defines.h"
 #include "device.h"
+#include "integrator.h"
 #include "kernel_list.h"
+#include "observables.h"
 #include "ocl.h"
 #ifdef HAVE_LIBGL
 #include "vbo.h"
@@ -77,6 +79,7 @@ void border_collision (sotl_device_t *dev)
 void update_position(sotl_device_t *dev)
 {
     unsigned offset = atom_set_offset(&dev->atom_set);
+    calc_t drift = integrator_get_step()->drift;
     size_t global, local;
 
     int k = KERNEL_UPDATE_POSTION;
@@ -87,9 +90,12 @@ void update_position(sotl_device_t *dev)
     err |= clSetKernelArg (dev->kernel[k], 2, sizeof (cl_mem), &dev->min_buffer);
     err |= clSetKernelArg (dev->kernel[k], 3, sizeof (cl_mem), &dev->max_buffer);
     err |= clSetKernelArg (dev->kernel[k], 4, sizeof (offset), &offset);
+    err |= clSetKernelArg (dev->kernel[k], 5, sizeof (drift), &drift);
+    err |= clSetKernelArg (dev->kernel[k], 6, sizeof (cl_mem), &dev->kick_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 7, sizeof (cl_mem), &dev->stats_buffer);
     check(err, "Failed to set kernel arguments: %s", kernel_name(k));
 
-    global = dev->atom_set.offset;     // One thread per atom, rounded
+    global = offset;     // One thread per atom (and ghost), rounded
     local = MIN(dev->tile_size, dev->max_workgroup_size);
 
     err = clEnqueueNDRangeKernel (dev->queue, dev->kernel[k], 1, NULL, &global, &local, 0,
@@ -142,6 +148,7 @@ void atom_collision (sotl_device_t *dev)
 void n2_lennard_jones (sotl_device_t *dev)
 {
     size_t global, local;
+    unsigned sample = observables_get_sampling()->energy;
 
     // Set the arguments to our compute kernel
     int k = KERNEL_FORCE_N2;
@@ -151,6 +158,11 @@ void n2_lennard_jones (sotl_device_t *dev)
     err |= clSetKernelArg (dev->kernel[k], 1, sizeof(cl_mem), cur_spd_buf(dev));
     err |= clSetKernelArg (dev->kernel[k], 2, sizeof(dev->atom_set.natoms), &dev->atom_set.natoms);
     err |= clSetKernelArg (dev->kernel[k], 3, sizeof(dev->atom_set.offset), &dev->atom_set.offset);
+    err |= clSetKernelArg (dev->kernel[k], 4, sizeof(cl_mem), &dev->potential_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 5, sizeof(cl_mem), &dev->kick_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 6, sizeof(cl_mem), &dev->energy_table_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 7, sizeof(cl_mem), &dev->energy_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 8, sizeof(sample), &sample);
     check(err, "Failed to set kernel arguments: %s", kernel_name(k));
 
     local = dev->tile_size;	
@@ -216,6 +228,41 @@ void reset_box_buffer(sotl_device_t *dev)
     reset_int_buffer(dev, &dev->box_buffer, 0, dev->domain.total_boxes + 1);
 }
 
+static void scan_buffer(sotl_device_t *dev, cl_mem *buffer,
+                        const unsigned begin, const unsigned end)
+{
+    const int kernels[2] = { KERNEL_SCAN, KERNEL_SCAN_DOWN_STEP };
+    size_t global, local;
+
+    /* Sums of blocks go to calc_offset_buffer, which copy_box_buffer()
+     * overwrites next (the rows of the torus are scanned once atoms are
+     * sorted). It holds as many values as box_buffer, that is at least one
+     * per block. */
+    for (int i = 0; i < 2; i++) {
+        int k = kernels[i];
+        cl_int err = CL_SUCCESS;
+
+        err |= clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), buffer);
+        err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), &dev->calc_offset_buffer);
+        err |= clSetKernelArg(dev->kernel[k], 2, sizeof(begin), &begin);
+        err |= clSetKernelArg(dev->kernel[k], 3, sizeof(end), &end);
+        check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+        /* One work-group per block of 2 * SCAN_WG_SIZE values. */
+        local = SCAN_WG_SIZE;
+        global = ALRND(2 * SCAN_WG_SIZE, end - begin) / 2;
+        err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL,
+                                     &global, &local, 0, NULL,
+                                     prof_event_ptr(dev, k));
+        check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+    }
+}
+
+void scan(sotl_device_t *dev, const unsigned begin, const unsigned end)
+{
+    scan_buffer(dev, &dev->box_buffer, begin, end);
+}
+
 static void box_count(sotl_device_t *dev, const unsigned begin,
                       const unsigned end, const int k)
 {
@@ -253,6 +300,12 @@ void box_count_own_atoms(sotl_device_t *dev, const unsigned begin,
     box_count(dev, begin, end, KERNEL_BOX_COUNT_OWN_ATOMS);
 }
 
+void torus_count_all_atoms(sotl_device_t *dev, const unsigned begin,
+                           const unsigned end)
+{
+    box_count(dev, begin, end, KERNEL_TORUS_COUNT_ALL_ATOMS);
+}
+
 void box_lennard_jones(sotl_device_t *dev, const unsigned begin,
                        const unsigned end)
 {
@@ -261,6 +314,7 @@ void box_lennard_jones(sotl_device_t *dev, const unsigned begin,
     int err = CL_SUCCESS;
     unsigned natoms;
     unsigned offset = atom_set_offset(&dev->atom_set);
+    unsigned sample = observables_get_sampling()->energy;
 
     err |= clSetKernelArg(dev->kernel[k], 0,
                           sizeof(cl_mem), cur_pos_buf(dev));
@@ -284,6 +338,19 @@ void box_lennard_jones(sotl_device_t *dev, const unsigned begin,
                           sizeof(begin), &begin);
     err |= clSetKernelArg(dev->kernel[k], 10,
                           sizeof(end), &end);
+    err |= clSetKernelArg(dev->kernel[k], 11,
+                          sizeof(cl_mem), &dev->potential_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 12,
+                          sizeof(cl_mem), &dev->kick_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 13,
+                          sizeof(cl_mem), &dev->energy_table_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 14,
+                          sizeof(cl_mem), &dev->energy_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 15,
+                          sizeof(sample), &sample);
+    /* Only read in torus mode. */
+    err |= clSetKernelArg(dev->kernel[k], 16, sizeof(cl_mem),
+                          is_torus_mode ? &dev->torus_row_buffer : &dev->box_buffer);
     check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
 
     natoms = ROUND(end) - (begin & (~(dev->tile_size - 1)));
@@ -295,6 +362,100 @@ void box_lennard_jones(sotl_device_t *dev, const unsigned begin,
     check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
 }
 
+void cluster_lennard_jones(sotl_device_t *dev, const unsigned begin,
+                           const unsigned end)
+{
+    const unsigned nrows = dev->domain.boxes[1] * dev->domain.boxes[2];
+    unsigned offset = atom_set_offset(&dev->atom_set);
+    unsigned sample = observables_get_sampling()->energy;
+    unsigned nclusters;
+    size_t global, local;
+    int err = CL_SUCCESS;
+    int k;
+
+    /* At most one partial cluster per row of boxes. */
+    nclusters = (end - begin + CLUSTER_SIZE - 1) / CLUSTER_SIZE + nrows;
+
+    /* First cluster of each row, in a single work-group. */
+    k = KERNEL_CLUSTER_SCAN;
+    err |= clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), &dev->row_cluster_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), &dev->domain_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 3, sizeof(nrows), &nrows);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    global = local = SCAN_WG_SIZE;
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+
+    /* Atoms and bounding box of clusters, one thread per row. */
+    k = KERNEL_CLUSTER_BUILD;
+    err  = clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), cur_pos_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), &dev->row_cluster_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 3, sizeof(cl_mem), &dev->cluster_atom_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 4, sizeof(cl_mem), &dev->cluster_bound_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 5, sizeof(cl_mem), &dev->domain_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 6, sizeof(offset), &offset);
+    err |= clSetKernelArg(dev->kernel[k], 7, sizeof(begin), &begin);
+    err |= clSetKernelArg(dev->kernel[k], 8, sizeof(nrows), &nrows);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    local = MIN(dev->tile_size, dev->max_workgroup_size);
+    global = ROUND(nrows);
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+
+    /* Pair lists pruned by bounding box distance, one thread per cluster. */
+    k = KERNEL_CLUSTER_PAIRS;
+    err  = clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), cur_pos_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), &dev->row_cluster_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 3, sizeof(cl_mem), &dev->cluster_atom_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 4, sizeof(cl_mem), &dev->cluster_bound_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 5, sizeof(cl_mem), &dev->pair_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 6, sizeof(cl_mem), &dev->npairs_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 7, sizeof(cl_mem), &dev->fake_min_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 8, sizeof(cl_mem), &dev->domain_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 9, sizeof(offset), &offset);
+    err |= clSetKernelArg(dev->kernel[k], 10, sizeof(nrows), &nrows);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    global = ROUND(nclusters);
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+
+    /* Dense tiles, one work-group per cluster. */
+    k = KERNEL_CLUSTER_FORCE;
+    err  = clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), cur_pos_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), cur_spd_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 3, sizeof(cl_mem), &dev->row_cluster_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 4, sizeof(cl_mem), &dev->cluster_atom_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 5, sizeof(cl_mem), &dev->cluster_bound_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 6, sizeof(cl_mem), &dev->pair_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 7, sizeof(cl_mem), &dev->npairs_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 8, sizeof(cl_mem), &dev->fake_min_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 9, sizeof(cl_mem), &dev->domain_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 10, sizeof(offset), &offset);
+    err |= clSetKernelArg(dev->kernel[k], 11, sizeof(nrows), &nrows);
+    err |= clSetKernelArg(dev->kernel[k], 12, sizeof(cl_mem), &dev->potential_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 13, sizeof(cl_mem), &dev->kick_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 14, sizeof(cl_mem), &dev->energy_table_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 15, sizeof(cl_mem), &dev->energy_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 16, sizeof(sample), &sample);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    local = CLUSTER_SIZE * CLUSTER_SIZE;
+    global = (size_t)nclusters * local;
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+}
+
 static void box_sort(sotl_device_t *dev, const unsigned begin,
                      const unsigned end, const int k)
 {
@@ -312,6 +473,8 @@ static void box_sort(sotl_device_t *dev, const unsigned begin,
   err |= clSetKernelArg (dev->kernel[k], 7, sizeof(offset), &offset);
   err |= clSetKernelArg (dev->kernel[k], 8, sizeof(begin), &begin);
   err |= clSetKernelArg (dev->kernel[k], 9, sizeof(end), &end);
+  err |= clSetKernelArg (dev->kernel[k], 10, sizeof(cl_mem), cur_id_buf(dev));
+  err |= clSetKernelArg (dev->kernel[k], 11, sizeof(cl_mem), alt_id_buf(dev));
   check(err, "Failed to set kernel arguments: %s", kernel_name(k));
 
   global = ROUND(end) - (begin & (~(dev->tile_size - 1)));
@@ -334,6 +497,70 @@ void box_sort_own_atoms(sotl_device_t *dev, const unsigned begin,
     box_sort(dev, begin, end, KERNEL_BOX_SORT_OWN_ATOMS);
 }
 
+void torus_sort_all_atoms(sotl_device_t *dev, const unsigned begin,
+                          const unsigned end)
+{
+    box_sort(dev, begin, end, KERNEL_TORUS_SORT_ALL_ATOMS);
+}
+
+/* Inner rows of boxes of the torus, numbered along y then z. */
+static unsigned torus_nrows(const sotl_device_t *dev)
+{
+    return (dev->domain.boxes[1] - 2 * SUBCELL) *
+           (dev->domain.boxes[2] - 2 * SUBCELL);
+}
+
+void torus_rows(sotl_device_t *dev)
+{
+    const unsigned nrows = torus_nrows(dev);
+    size_t global, local;
+    int k = KERNEL_TORUS_ROWS;
+    cl_int err = CL_SUCCESS;
+
+    err |= clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), &dev->torus_row_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), &dev->domain_buffer);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    local = MIN(dev->tile_size, dev->max_workgroup_size);
+    global = ALRND(local, nrows + 1);
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+
+    /* First own atom of each row once gathered. */
+    scan_buffer(dev, &dev->torus_row_buffer, 0, nrows + 1);
+}
+
+void torus_gather(sotl_device_t *dev)
+{
+    unsigned offset = atom_set_offset(&dev->atom_set);
+    unsigned begin = atom_set_begin(&dev->atom_set);
+    size_t global, local;
+    int k = KERNEL_TORUS_GATHER;
+    cl_int err = CL_SUCCESS;
+
+    err |= clSetKernelArg(dev->kernel[k], 0, sizeof(cl_mem), cur_pos_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 1, sizeof(cl_mem), alt_pos_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 2, sizeof(cl_mem), cur_spd_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 3, sizeof(cl_mem), alt_spd_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 4, sizeof(cl_mem), cur_id_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 5, sizeof(cl_mem), alt_id_buf(dev));
+    err |= clSetKernelArg(dev->kernel[k], 6, sizeof(cl_mem), &dev->box_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 7, sizeof(cl_mem), &dev->torus_row_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 8, sizeof(cl_mem), &dev->domain_buffer);
+    err |= clSetKernelArg(dev->kernel[k], 9, sizeof(offset), &offset);
+    err |= clSetKernelArg(dev->kernel[k], 10, sizeof(begin), &begin);
+    check(err, "Failed to set kernel arguments: %s.\n", kernel_name(k));
+
+    /* One work-group per row. */
+    local = MIN(dev->tile_size, dev->max_workgroup_size);
+    global = torus_nrows(dev) * local;
+    err = clEnqueueNDRangeKernel(dev->queue, dev->kernel[k], 1, NULL, &global,
+                                 &local, 0, NULL, prof_event_ptr(dev, k));
+    check(err, "Failed to exec kernel: %s.\n", kernel_name(k));
+}
+
 #ifdef HAVE_LIBGL
 void update_vertices (sotl_device_t *dev)
 {
@@ -423,11 +650,50 @@ void resetAnimation (void)
 }
 
 
-void scan(sotl_device_t *dev, const unsigned begin, const unsigned end)
+void observables_kernel(sotl_device_t *dev)
+{
+    unsigned offset = atom_set_offset(&dev->atom_set);
+    unsigned begin = atom_set_begin(&dev->atom_set);
+    unsigned end = atom_set_end(&dev->atom_set);
+    calc_t bin_width = observables_get_sampling()->bin_width;
+    size_t global, local;
+
+    int k = KERNEL_OBSERVABLES;
+    int err = CL_SUCCESS;
+
+    err |= clSetKernelArg (dev->kernel[k], 0, sizeof (cl_mem), cur_spd_buf(dev));
+    err |= clSetKernelArg (dev->kernel[k], 1, sizeof (offset), &offset);
+    err |= clSetKernelArg (dev->kernel[k], 2, sizeof (begin), &begin);
+    err |= clSetKernelArg (dev->kernel[k], 3, sizeof (end), &end);
+    err |= clSetKernelArg (dev->kernel[k], 4, sizeof (bin_width), &bin_width);
+    err |= clSetKernelArg (dev->kernel[k], 5, sizeof (cl_mem), &dev->energy_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 6, sizeof (cl_mem), &dev->obs_buffer);
+    check(err, "Failed to set kernel arguments: %s", kernel_name(k));
+
+    global = offset;     // One thread per atom (and ghost), rounded
+    local = MIN(dev->tile_size, dev->max_workgroup_size);
+
+    err = clEnqueueNDRangeKernel (dev->queue, dev->kernel[k], 1, NULL, &global, &local, 0,
+				  NULL, prof_event_ptr(dev,k));
+    check(err, "Failed to exec kernel: %s\n", kernel_name(k));
+}
+
+void reduce_observables(sotl_device_t *dev)
 {
-    // TODO
-  if(begin < end) // Silly code to avoid warning
-    dev = NULL;
+    const size_t local = MIN(dev->tile_size, dev->max_workgroup_size);
+    unsigned ngroups = (atom_set_offset(&dev->atom_set) + local - 1) / local;
+    size_t global = OBSERVABLES_VALUES;
+
+    int k = KERNEL_OBSERVABLES_REDUCE;
+    int err = CL_SUCCESS;
+
+    err |= clSetKernelArg (dev->kernel[k], 0, sizeof (cl_mem), &dev->obs_buffer);
+    err |= clSetKernelArg (dev->kernel[k], 1, sizeof (ngroups), &ngroups);
+    check(err, "Failed to set kernel arguments: %s", kernel_name(k));
+
+    err = clEnqueueNDRangeKernel (dev->queue, dev->kernel[k], 1, NULL, &global, NULL, 0,
+				  NULL, prof_event_ptr(dev,k));
+    check(err, "Failed to exec kernel: %s\n", kernel_name(k));
 }
 
 void null_kernel (sotl_device_t *dev)
@@ -1,184 +1,1290 @@
 
+#include "cell.h"
 #include "default_defines.h"
 #include "global_definitions.h"
 #include "device.h"
+#include "integrator.h"
+#include "numa.h"
+#include "observables.h"
 #include "openmp.h"
+#include "potential.h"
+#include "profiling.h"
+#include "simd.h"
 #include "sotl.h"
+#include "verlet.h"
 
 #ifdef HAVE_LIBGL
 #include "vbo.h"
 #endif
 
+#include <omp.h>
 #include <stdio.h>
+#include <string.h>
 
+// State of the OpenMP device: there is at most one of them (see
+// sotl_runtime_init())
+//
 static int *atom_state = NULL;
 
-#ifdef HAVE_LIBGL
+// Per-thread force accumulators used in half-pair mode (one block of
+// 3 * offset values per thread)
+static calc_t *force_buffer = NULL;
+
+// Box pipeline (same steps as the OpenCL box mode): per-thread box
+// histograms, prefix sum and scatter of atoms into alternate buffers, so
+// that the atoms of each box are contiguous
+//
+static unsigned *box_count = NULL;     // Per-thread counters (nthreads * total_boxes)
+static unsigned *box_start = NULL;     // First atom of each box (total_boxes + 1)
+static unsigned *box_partial = NULL;   // Per-thread sums of the scan
+static unsigned *atom_box = NULL;      // Box of each atom
+static calc_t *alt_pos_buffer = NULL;
+static calc_t *alt_spd_buffer = NULL;
+static unsigned *alt_id_buffer = NULL;
+
+// Torus mode: the alternate buffers also receive the periodic images of
+// atoms close to the faces, in the padding boxes, so they may hold more
+// entries than the atom set (alt_offset apart). Own atoms are then copied
+// back to the atom set, row of boxes by row of boxes
+//
+static unsigned alt_offset = 0;
+static unsigned *torus_row_start = NULL; // First own atom of each row of boxes
+
+// Dense box arrays are only used when they are not much larger than the
+// atom set; sparse configurations use the cell list instead
+//
+#define BOX_MAX_RATIO 64
+
+// NUMA mode: the domain is split along z into one slab per node, whose
+// atoms are placed on the node and only handled by threads pinned to it.
+// Threads of a node share out boxes (or atoms) by chunks
+//
+#define NUMA_CHUNK 16
+
+static unsigned numa_nodes = 0;        // 0 when NUMA mode is not used
+static sotl_cell_list_t numa_cells[NUMA_MAX_NODES];
+static struct {
+  unsigned next;                       // Next chunk of the node
+  char padding[60];                    // (one cache line per node)
+} numa_work[NUMA_MAX_NODES];
+
+// Adaptive time step: largest squared speed increment by forces and
+// squared speed of the current step, per thread (reduced at the end of
+// the step). Not allocated for a fixed time step
+//
+static struct {
+  calc_t kick2;
+  calc_t speed2;
+  char padding[64 - 2 * sizeof (calc_t)]; // (one cache line per thread)
+} *thread_max = NULL;
+
+// Observables of sampled steps, per thread (summed into the device at the
+// end of each pass). Not allocated when observables are not sampled
+//
+static sotl_observables_t *thread_obs = NULL;
 
 #define SHOCK_PERIOD  50
 
 int THREAD_COUNT = 1;
 
-// Update OpenGL Vertex Buffer Object
+#ifdef HAVE_LIBGL
+
+// Update OpenGL Vertex Buffer Object for one atom
+//
+static inline void omp_update_vbo (sotl_atom_set_t *set, unsigned n)
+{
+  vbo_vertex[n*3 + 0] = set->pos.x[n];
+  vbo_vertex[n*3 + 1] = set->pos.y[n];
+  vbo_vertex[n*3 + 2] = set->pos.z[n];
+
+  // Atom color depends on the thread which computed it
+  {
+    float ratio = (1.0 * atom_state[n]) / THREAD_COUNT;
+
+    vbo_color[n*3 + 0] = (1.0 - ratio) * atom_color[0].R + ratio * 1.0;
+    vbo_color[n*3 + 1] = (1.0 - ratio) * atom_color[0].G + ratio * 0.0;
+    vbo_color[n*3 + 2] = (1.0 - ratio) * atom_color[0].B + ratio * 0.0;
+  }
+}
+#endif
+
+extern float normalized_vert[3];
+
+// Apply gravity, bounce on borders and update positions of atoms by
+// adding (dx, dy, dz) times drift, all in a single parallel sweep over the
+// atoms (forces have already been added to speeds). The VBO is only filled
+// when this device is displayed. With multiple devices, atoms bounce on
+// the borders of the global domain, not on the z cuts of this device.
+// In torus mode, atoms leaving the domain enter it on the opposite side.
 //
-static void omp_update_vbo (sotl_device_t *dev)
+static inline void omp_move_atom (sotl_device_t *dev, sotl_atom_set_t *set,
+				  const sotl_domain_t *domain,
+				  const calc_t *gravity, calc_t drift, unsigned n)
+{
+  const sotl_sampling_t *sampling = observables_get_sampling ();
+  calc_t s2 = 0.0, v[3];
+
+  for (int i = 0; i < 3; i++) {
+    calc_t *pos = set->pos.x + i * set->offset + n;
+    calc_t *spd = set->speed.dx + i * set->offset + n;
+    calc_t p = *pos, s = *spd - gravity[i];
+
+    if (is_torus_mode) {
+      // Atoms move much less than a period per step
+      p += s * drift;
+      if (p >= domain->max_range[i])
+	p -= domain->max_range[i] - domain->min_range[i];
+      else if (p < domain->min_range[i]) {
+	p += domain->max_range[i] - domain->min_range[i];
+	if (p >= domain->max_range[i])
+	  p = domain->min_range[i];
+      }
+      *pos = p;
+      *spd = s;
+      s2 += s * s;
+      v[i] = s;
+      continue;
+    }
+
+    if (borders_enabled) {
+      if (p < domain->min_ext[i]) {
+	p = domain->min_ext[i];
+	s = -s;
+	atom_state[n] = SHOCK_PERIOD;
+      }
+      if (p > domain->max_ext[i]) {
+	p = domain->max_ext[i];
+	s = -s;
+	atom_state[n] = SHOCK_PERIOD;
+      }
+    }
+
+    *pos = p + s * drift;
+    *spd = s;
+    s2 += s * s;
+    v[i] = s;
+  }
+
+  if (thread_max) {
+    const int t = omp_get_thread_num ();
+
+    thread_max[t].speed2 = MAX (thread_max[t].speed2, s2);
+  }
+
+  if (sampling->speeds)
+    observables_add_atom (&thread_obs[omp_get_thread_num ()], v,
+			  sampling->bin_width);
+
+#ifdef HAVE_LIBGL
+  if (dev->display)
+    omp_update_vbo (set, n);
+#else
+  (void) dev;
+#endif
+}
+
+static void omp_gravity (calc_t *gravity)
+{
+  const calc_t g = gravity_enabled ? 0.005 * integrator_get_step ()->kick : 0.0;
+
+  for (int i = 0; i < 3; i++)
+    gravity[i] = normalized_vert[i] * g;
+}
+
+static void omp_integrate (sotl_device_t *dev)
 {
   sotl_atom_set_t *set = &dev->atom_set;
-  sotl_domain_t *domain = &dev->domain;
+  sotl_domain_t *domain = get_global_domain ();
+  const calc_t drift = integrator_get_step ()->drift;
+  calc_t gravity[3];
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    vbo_vertex[n*3 + 0] = set->pos.x[n];
-    vbo_vertex[n*3 + 1] = set->pos.y[n];
-    vbo_vertex[n*3 + 2] = set->pos.z[n];
+  omp_gravity (gravity);
 
-    // Atom color depends on z coordinate
-    {
-      float ratio = (1.0 * atom_state[n]) / THREAD_COUNT;
+  #pragma omp parallel for schedule(static)
+  for (unsigned n = 0; n < set->natoms; n++)
+    omp_move_atom (dev, set, domain, gravity, drift, n);
+}
+
+static calc_t squared_distance (sotl_atom_set_t *set, unsigned p1, unsigned p2)
+{
+  calc_t *pos1 = set->pos.x + p1,
+    *pos2 = set->pos.x + p2;
+
+  calc_t dx = pos2[0] - pos1[0],
+         dy = pos2[set->offset] - pos1[set->offset],
+         dz = pos2[set->offset*2] - pos1[set->offset*2];
+
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// Add energy to the potential energy of the calling thread
+//
+static inline void omp_add_energy (calc_t energy)
+{
+  thread_obs[omp_get_thread_num ()].potential += energy;
+}
+
+// Add the force on atom current to its speed
+//
+static inline void omp_kick_atom (sotl_atom_set_t *set, unsigned current,
+				  const calc_t *force)
+{
+  set->speed.dx[current] += force[0];
+  set->speed.dx[set->offset + current] += force[1];
+  set->speed.dx[set->offset * 2 + current] += force[2];
+
+  if (thread_max) {
+    const int t = omp_get_thread_num ();
+    const calc_t f2 = force[0] * force[0] + force[1] * force[1] +
+      force[2] * force[2];
+
+    thread_max[t].kick2 = MAX (thread_max[t].kick2, f2);
+  }
+}
+
+// Add the forces applied on atom current by all atoms of set
+//
+static inline void omp_atom_force (sotl_atom_set_t *set, unsigned current,
+				   bool sample)
+{
+  calc_t force[3] = { 0.0, 0.0, 0.0 };
+  calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+  atom_state[current] = omp_get_thread_num();
+
+#ifdef XEON_VECTORIZATION
+  simd_force_range (set, current, 0, set->natoms, force, energy);
+#else
+  const sotl_potential_t *pot = get_potential ();
+
+  for (unsigned other = 0; other < set->natoms; other++)
+    if (current != other) {
+    	calc_t sq_dist = squared_distance (set, current, other);
+
+    	if (sq_dist < pot->rc2) {
+    	  calc_t intensity = potential_force (pot, sq_dist);
+
+    	  force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
+    	  force[1] += intensity * (set->pos.x[set->offset + current] -
+    				   set->pos.x[set->offset + other]);
+    	  force[2] += intensity * (set->pos.x[set->offset * 2 + current] -
+    				   set->pos.x[set->offset * 2 + other]);
+    	  if (energy)
+    	    *energy += potential_energy (pot, sq_dist);
+    	}
+
+    }
+#endif
+
+  omp_kick_atom (set, current, force);
+  if (energy)
+    omp_add_energy (0.5 * e);
+}
+
+// Forces are computed on atoms [first, last[ of set, the atoms of the
+// device among its ghosts (see omp_one_step_move)
+//
+static void omp_force (sotl_atom_set_t *set, unsigned first, unsigned last)
+{
+  const bool sample = observables_get_sampling ()->energy;
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (unsigned current = first; current < last; current++) {
+    THREAD_COUNT = omp_get_num_threads();
+    omp_atom_force (set, current, sample);
+  }
+}
+
+// Apply the interaction between current and other to both atoms, in the
+// force buffer of the calling thread. On sampled steps, the energy of the
+// pair is added to energy, only half of it when one of the atoms is a
+// ghost (out of [first, last[, the other device counts the other half)
+//
+static inline void omp_add_pair (sotl_atom_set_t *set, const sotl_potential_t *pot,
+				 calc_t *force, calc_t *energy,
+				 unsigned first, unsigned last,
+				 unsigned current, unsigned other)
+{
+  calc_t sq_dist = squared_distance (set, current, other);
+
+  if (sq_dist < pot->rc2) {
+    calc_t intensity = potential_force (pot, sq_dist);
+    calc_t fx = intensity * (set->pos.x[current] - set->pos.x[other]);
+    calc_t fy = intensity * (set->pos.y[current] - set->pos.y[other]);
+    calc_t fz = intensity * (set->pos.z[current] - set->pos.z[other]);
+
+    force[current] += fx;
+    force[other] -= fx;
+    force[set->offset + current] += fy;
+    force[set->offset + other] -= fy;
+    force[set->offset * 2 + current] += fz;
+    force[set->offset * 2 + other] -= fz;
+
+    if (energy) {
+      const bool own = current >= first && current < last &&
+	other >= first && other < last;
 
-      vbo_color[n*3 + 0] = (1.0 - ratio) * atom_color[0].R + ratio * 1.0;
-      vbo_color[n*3 + 1] = (1.0 - ratio) * atom_color[0].G + ratio * 0.0;
-      vbo_color[n*3 + 2] = (1.0 - ratio) * atom_color[0].B + ratio * 0.0;
+      *energy += (own ? 1.0 : 0.5) * potential_energy (pot, sq_dist);
     }
   }
 }
+
+// Clear the force buffer of the calling thread (must be called by all
+// threads of the parallel region)
+//
+static calc_t *omp_reset_force_buffer (sotl_atom_set_t *set)
+{
+  calc_t *force = force_buffer + omp_get_thread_num () * 3 * set->offset;
+
+  memset (force, 0, 3 * set->offset * sizeof (calc_t));
+
+  return force;
+}
+
+// Sum the force buffers of all threads into speeds of atoms [first, last[
+// (must be called by all threads of the parallel region)
+//
+static void omp_reduce_force_buffers (sotl_atom_set_t *set, unsigned first,
+				      unsigned last)
+{
+  const unsigned stride = 3 * set->offset;
+  const int nthreads = omp_get_num_threads ();
+
+  #pragma omp for
+  for (unsigned n = first; n < last; n++) {
+    calc_t force[3] = { 0.0, 0.0, 0.0 };
+
+    for (int t = 0; t < nthreads; t++) {
+      calc_t *f = force_buffer + t * stride;
+
+      force[0] += f[n];
+      force[1] += f[set->offset + n];
+      force[2] += f[set->offset * 2 + n];
+    }
+
+    omp_kick_atom (set, n, force);
+  }
+}
+
+// Half-pair version: each interaction is computed once (other > current)
+// and applied to both atoms, using per-thread force buffers to avoid races.
+// Pairs of two ghosts are skipped: ghosts before first only meet own atoms,
+// ghosts after last are only met by them
+//
+static void omp_half_force (sotl_atom_set_t *set, unsigned first, unsigned last)
+{
+  const sotl_potential_t *pot = get_potential ();
+  const bool sample = observables_get_sampling ()->energy;
+
+  #pragma omp parallel
+  {
+    calc_t *force = omp_reset_force_buffer (set);
+    calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+    #pragma omp for schedule(dynamic, 1)
+    for (unsigned current = 0; current < last; current++) {
+      atom_state[current] = omp_get_thread_num();
+
+      const unsigned end = current < first ? last : set->natoms;
+
+      for (unsigned other = MAX (current + 1, first); other < end; other++)
+	omp_add_pair (set, pot, force, energy, first, last, current, other);
+    }
+
+    if (energy)
+      omp_add_energy (e);
+
+    omp_reduce_force_buffers (set, first, last);
+  }
+
+  THREAD_COUNT = omp_get_max_threads();
+}
+
+// Box of an atom in the domain grid (atoms out of the domain are put
+// in the nearest box)
+//
+static inline unsigned omp_clamp_box (calc_t pos, calc_t min, unsigned nboxes,
+				       double inv)
+{
+  calc_t b = (pos - min) * inv;
+
+  if (!(b > 0))
+    return 0;
+  if (b >= nboxes)
+    return nboxes - 1;
+  return (unsigned) b;
+}
+
+static inline unsigned omp_get_num_box (sotl_domain_t *domain, sotl_atom_set_t *set,
+					unsigned n)
+{
+  unsigned x = omp_clamp_box (set->pos.x[n], domain->min_border[0], domain->boxes[0],
+			      domain->box_inv[0]);
+  unsigned y = omp_clamp_box (set->pos.y[n], domain->min_border[1], domain->boxes[1],
+			      domain->box_inv[1]);
+  unsigned z = omp_clamp_box (set->pos.z[n], domain->min_border[2], domain->boxes[2],
+			      domain->box_inv[2]);
+
+  return (z * domain->boxes[1] + y) * domain->boxes[0] + x;
+}
+
+// Count atoms [begin, end[ in the histogram of the calling thread
+//
+static void omp_box_count_all_atoms (sotl_device_t *dev, unsigned *count,
+				     unsigned begin, unsigned end)
+{
+  memset (count, 0, dev->domain.total_boxes * sizeof (unsigned));
+
+  for (unsigned n = begin; n < end; n++) {
+    atom_box[n] = omp_get_num_box (&dev->domain, &dev->atom_set, n);
+    count[atom_box[n]]++;
+  }
+}
+
+// Exclusive prefix sum of the histograms, in (box, thread) order: each
+// thread first sums a range of boxes, then offsets its range by the sums
+// of the previous threads (must be called by all threads)
+//
+static void omp_box_scan (sotl_device_t *dev)
+{
+  const unsigned nboxes = dev->domain.total_boxes;
+  const int nthreads = omp_get_num_threads ();
+  const int t = omp_get_thread_num ();
+  const unsigned first = (unsigned long) nboxes * t / nthreads;
+  const unsigned last = (unsigned long) nboxes * (t + 1) / nthreads;
+  unsigned sum = 0;
+
+  for (unsigned b = first; b < last; b++)
+    for (int u = 0; u < nthreads; u++)
+      sum += box_count[u * nboxes + b];
+  box_partial[t] = sum;
+
+  #pragma omp barrier
+
+  sum = 0;
+  for (int u = 0; u < t; u++)
+    sum += box_partial[u];
+
+  for (unsigned b = first; b < last; b++) {
+    box_start[b] = sum;
+    for (int u = 0; u < nthreads; u++) {
+      unsigned c = box_count[u * nboxes + b];
+
+      box_count[u * nboxes + b] = sum;
+      sum += c;
+    }
+  }
+
+  if (t == nthreads - 1)
+    box_start[nboxes] = sum;
+}
+
+// Scatter atoms [begin, end[ into the alternate buffers, at the offsets
+// computed by the scan (stable, as each thread handles consecutive atoms)
+//
+static void omp_box_sort_all_atoms (sotl_device_t *dev, unsigned *count,
+				    unsigned begin, unsigned end)
+{
+  sotl_atom_set_t *set = &dev->atom_set;
+  const unsigned offset = set->offset;
+
+  for (unsigned n = begin; n < end; n++) {
+    unsigned slot = count[atom_box[n]]++;
+
+    alt_pos_buffer[slot] = set->pos.x[n];
+    alt_pos_buffer[offset + slot] = set->pos.y[n];
+    alt_pos_buffer[offset * 2 + slot] = set->pos.z[n];
+    alt_spd_buffer[slot] = set->speed.dx[n];
+    alt_spd_buffer[offset + slot] = set->speed.dy[n];
+    alt_spd_buffer[offset * 2 + slot] = set->speed.dz[n];
+    alt_id_buffer[slot] = set->id[n];
+  }
+}
+
+// The sorted atoms become the current ones
+//
+static void omp_box_switch_buffers (sotl_atom_set_t *set)
+{
+  calc_t *pos = set->pos.x, *spd = set->speed.dx;
+  unsigned *id = set->id;
+
+  set->pos.x = alt_pos_buffer;
+  set->pos.y = set->pos.x + set->offset;
+  set->pos.z = set->pos.y + set->offset;
+  set->speed.dx = alt_spd_buffer;
+  set->speed.dy = set->speed.dx + set->offset;
+  set->speed.dz = set->speed.dy + set->offset;
+  set->id = alt_id_buffer;
+
+  alt_pos_buffer = pos;
+  alt_spd_buffer = spd;
+  alt_id_buffer = id;
+}
+
+// Add the forces applied on atoms [begin, end[ by atoms of the given
+// ranges (atoms of neighbour boxes), except on ghosts (atoms out of
+// [first, last[)
+//
+static void omp_box_lennard_jones (sotl_atom_set_t *set, unsigned begin, unsigned end,
+				   sotl_cell_range_t *ranges, unsigned nb_ranges,
+				   const unsigned *atoms, unsigned first, unsigned last)
+{
+  const bool sample = observables_get_sampling ()->energy;
+
+  for (unsigned i = begin; i < end; i++) {
+    unsigned current = atoms ? atoms[i] : i;
+    calc_t force[3] = { 0.0, 0.0, 0.0 };
+    calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+    if (current < first || current >= last)
+      continue;
+
+    atom_state[current] = omp_get_thread_num();
+
+    for (unsigned r = 0; r < nb_ranges; r++) {
+#ifdef XEON_VECTORIZATION
+      if (atoms)
+	simd_force_list (set, current, atoms + ranges[r].begin,
+			 ranges[r].end - ranges[r].begin, force, energy);
+      else
+	simd_force_range (set, current, ranges[r].begin, ranges[r].end, force,
+			  energy);
+#else
+      const sotl_potential_t *pot = get_potential ();
+
+      for (unsigned j = ranges[r].begin; j < ranges[r].end; j++) {
+	unsigned other = atoms ? atoms[j] : j;
+
+	if (current != other) {
+	  calc_t sq_dist = squared_distance (set, current, other);
+
+	  if (sq_dist < pot->rc2) {
+	    calc_t intensity = potential_force (pot, sq_dist);
+
+	    force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
+	    force[1] += intensity * (set->pos.y[current] - set->pos.y[other]);
+	    force[2] += intensity * (set->pos.z[current] - set->pos.z[other]);
+	    if (energy)
+	      *energy += potential_energy (pot, sq_dist);
+	  }
+	}
+      }
 #endif
+    }
+
+    omp_kick_atom (set, current, force);
+    if (energy)
+      omp_add_energy (0.5 * e);
+  }
+}
+
+// Ranges of atoms of the boxes around box b, which are contiguous along x
+// (rows of boxes). Returns the number of non-empty ranges
+//
+static unsigned omp_box_neighbours (const sotl_domain_t *domain, unsigned b,
+				    sotl_cell_range_t *ranges)
+{
+  const int shift_y = domain->boxes[0];
+  const int shift_z = domain->boxes[0] * domain->boxes[1];
+  const int x = b % shift_y;
+  const int y = (b / shift_y) % domain->boxes[1];
+  const int z = b / shift_z;
+  const int min_x = MAX (x - SUBCELL, 0);
+  const int max_x = MIN (x + SUBCELL, (int) domain->boxes[0] - 1);
+  unsigned nb_ranges = 0;
 
-// Update positions of atoms by adding (dx, dy, dz)
+  for (int cz = MAX (z - SUBCELL, 0); cz <= MIN (z + SUBCELL, (int) domain->boxes[2] - 1); cz++)
+    for (int cy = MAX (y - SUBCELL, 0); cy <= MIN (y + SUBCELL, (int) domain->boxes[1] - 1); cy++) {
+      unsigned row = cz * shift_z + cy * shift_y;
+
+      ranges[nb_ranges].begin = box_start[row + min_x];
+      ranges[nb_ranges].end = box_start[row + max_x + 1];
+      if (ranges[nb_ranges].begin < ranges[nb_ranges].end)
+	nb_ranges++;
+    }
+
+  return nb_ranges;
+}
+
+// Box version: count, scan, sort, then each atom only looks at the
+// boxes around its own box, which are contiguous along x
 //
-static void omp_move (sotl_device_t *dev)
+static void omp_box_force (sotl_device_t *dev)
 {
   sotl_atom_set_t *set = &dev->atom_set;
+  sotl_domain_t *domain = &dev->domain;
+  uint64_t phase_start = profiling_now ();
+
+  #pragma omp parallel
+  {
+    const int nthreads = omp_get_num_threads ();
+    const int t = omp_get_thread_num ();
+    const unsigned begin = (unsigned long) set->natoms * t / nthreads;
+    const unsigned end = (unsigned long) set->natoms * (t + 1) / nthreads;
+    unsigned *count = box_count + t * domain->total_boxes;
+
+    omp_box_count_all_atoms (dev, count, begin, end);
+
+    #pragma omp barrier
+
+    omp_box_scan (dev);
+
+    #pragma omp barrier
+
+    omp_box_sort_all_atoms (dev, count, begin, end);
+
+    #pragma omp barrier
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    set->pos.x[n] += set->speed.dx[n];
-    set->pos.y[n] += set->speed.dy[n];
-    set->pos.z[n] += set->speed.dz[n];
+    #pragma omp single
+    omp_box_switch_buffers (set);
+
+    #pragma omp master
+    phase_start = profiling_record (dev, PROF_SORT, phase_start);
+
+    #pragma omp for schedule(dynamic, 64)
+    for (unsigned b = 0; b < domain->total_boxes; b++) {
+      sotl_cell_range_t ranges[CELL_MAX_ROWS];
+      unsigned nb_ranges;
+
+      if (box_start[b] == box_start[b + 1])
+	continue;
+
+      nb_ranges = omp_box_neighbours (domain, b, ranges);
+      omp_box_lennard_jones (set, box_start[b], box_start[b + 1],
+			     ranges, nb_ranges, NULL, 0, set->natoms);
+    }
   }
+
+  profiling_record (dev, PROF_FORCE, phase_start);
+
+  THREAD_COUNT = omp_get_max_threads();
 }
 
-// Apply gravity force
+// Torus mode: boxes of atom n and of its periodic images (own box first),
+// and the shifts of the images. Atoms of the first (last) SUBCELL layers
+// of boxes along an axis are replicated one period away, into the padding
+// boxes past the last (before the first) layer. Returns the number of
+// boxes (up to 8)
 //
-extern float normalized_vert[3];
+static unsigned omp_torus_boxes (const sotl_domain_t *domain, const sotl_atom_set_t *set,
+				 unsigned n, unsigned *boxes, calc_t (*shift)[3])
+{
+  const calc_t *pos[3] = { set->pos.x + n, set->pos.y + n, set->pos.z + n };
+  int coord[3][2];
+  calc_t delta[3][2];
+  unsigned nb[3], count = 0;
+
+  for (int i = 0; i < 3; i++) {
+    const int period = domain->boxes[i] - 2 * SUBCELL;
+    const calc_t length = domain->max_range[i] - domain->min_range[i];
+    int c = omp_clamp_box (*pos[i], domain->min_border[i], domain->boxes[i],
+			   domain->box_inv[i]);
+
+    // Positions are wrapped into the domain, up to rounding
+    c = MIN (MAX (c, SUBCELL), (int) domain->boxes[i] - SUBCELL - 1);
 
-static void omp_gravity (sotl_device_t *dev)
+    coord[i][0] = c;
+    delta[i][0] = 0.0;
+    nb[i] = 1;
+
+    if (c < 2 * SUBCELL) {
+      coord[i][1] = c + period;
+      delta[i][1] = length;
+      nb[i] = 2;
+    } else if (c >= period) {
+      coord[i][1] = c - period;
+      delta[i][1] = -length;
+      nb[i] = 2;
+    }
+  }
+
+  for (unsigned k = 0; k < nb[2]; k++)
+    for (unsigned j = 0; j < nb[1]; j++)
+      for (unsigned i = 0; i < nb[0]; i++) {
+	boxes[count] = (coord[2][k] * domain->boxes[1] + coord[1][j]) * domain->boxes[0] +
+	  coord[0][i];
+	shift[count][0] = delta[0][i];
+	shift[count][1] = delta[1][j];
+	shift[count][2] = delta[2][k];
+	count++;
+      }
+
+  return count;
+}
+
+// Same as omp_box_count_all_atoms, counting periodic images as well
+//
+static void omp_torus_count_all_atoms (sotl_device_t *dev, unsigned *count,
+				       unsigned begin, unsigned end)
+{
+  memset (count, 0, dev->domain.total_boxes * sizeof (unsigned));
+
+  for (unsigned n = begin; n < end; n++) {
+    unsigned boxes[8];
+    calc_t shift[8][3];
+    unsigned nb = omp_torus_boxes (&dev->domain, &dev->atom_set, n, boxes, shift);
+
+    for (unsigned k = 0; k < nb; k++)
+      count[boxes[k]]++;
+  }
+}
+
+// Same as omp_box_sort_all_atoms, writing periodic images as well
+//
+static void omp_torus_sort_all_atoms (sotl_device_t *dev, unsigned *count,
+				      unsigned begin, unsigned end)
 {
   sotl_atom_set_t *set = &dev->atom_set;
-  const calc_t g = 0.005;
+  const unsigned offset = set->offset;
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    set->speed.dx[n] -= normalized_vert[0] * g;
-    set->speed.dy[n] -= normalized_vert[1] * g;
-    set->speed.dz[n] -= normalized_vert[2] * g;
+  for (unsigned n = begin; n < end; n++) {
+    unsigned boxes[8];
+    calc_t shift[8][3];
+    unsigned nb = omp_torus_boxes (&dev->domain, set, n, boxes, shift);
+
+    for (unsigned k = 0; k < nb; k++) {
+      unsigned slot = count[boxes[k]]++;
+
+      for (int i = 0; i < 3; i++) {
+	alt_pos_buffer[i * alt_offset + slot] = set->pos.x[i * offset + n] + shift[k][i];
+	alt_spd_buffer[i * alt_offset + slot] = set->speed.dx[i * offset + n];
+      }
+      alt_id_buffer[slot] = set->id[n];
+    }
   }
 }
 
-static void omp_bounce (sotl_device_t *dev)
+// Make room for n atoms and images in the alternate buffers (called by a
+// single thread)
+//
+static void omp_torus_reserve (unsigned n)
+{
+  if (n <= alt_offset)
+    return;
+
+  alt_offset = ROUND (n + n / 8);
+
+  free(alt_pos_buffer);
+  free(alt_spd_buffer);
+  free(alt_id_buffer);
+  free(atom_state);
+  alt_pos_buffer = malloc(3 * alt_offset * sizeof(calc_t));
+  alt_spd_buffer = malloc(3 * alt_offset * sizeof(calc_t));
+  alt_id_buffer = malloc(alt_offset * sizeof(unsigned));
+  atom_state = calloc(alt_offset, sizeof(int));
+  if (!alt_pos_buffer || !alt_spd_buffer || !alt_id_buffer || !atom_state)
+    sotl_log(CRITICAL, "Failed to allocate box buffers\n");
+}
+
+// Copy own atoms (the ones of inner boxes) back to the atom set, which
+// stays sorted by box. Rows of inner boxes are contiguous along x
+//
+static void omp_torus_gather (sotl_device_t *dev)
 {
   sotl_atom_set_t *set = &dev->atom_set;
-  sotl_domain_t *domain = &dev->domain;
+  const sotl_domain_t *domain = &dev->domain;
+  const unsigned rows_y = domain->boxes[1] - 2 * SUBCELL;
+  const unsigned nrows = rows_y * (domain->boxes[2] - 2 * SUBCELL);
+  const unsigned offset = set->offset;
+
+  #pragma omp single
+  {
+    unsigned sum = 0;
+
+    for (unsigned r = 0; r < nrows; r++) {
+      unsigned row = ((r / rows_y + SUBCELL) * domain->boxes[1] + r % rows_y + SUBCELL) *
+	domain->boxes[0];
+
+      torus_row_start[r] = sum;
+      sum += box_start[row + domain->boxes[0] - SUBCELL] - box_start[row + SUBCELL];
+    }
+    torus_row_start[nrows] = sum;
+
+    if (sum != set->natoms)
+      sotl_log(CRITICAL, "Torus mode lost atoms (%d instead of %d)\n",
+	       sum, set->natoms);
+  }
+
+  #pragma omp for schedule(static)
+  for (unsigned r = 0; r < nrows; r++) {
+    unsigned row = ((r / rows_y + SUBCELL) * domain->boxes[1] + r % rows_y + SUBCELL) *
+      domain->boxes[0];
+    unsigned src = box_start[row + SUBCELL];
+    unsigned dst = torus_row_start[r];
+    unsigned n = torus_row_start[r + 1] - dst;
 
-  for (unsigned n = 0; n < set->natoms; n++) {
     for (int i = 0; i < 3; i++) {
-        if (set->pos.x[n + i * set->offset] < domain->min_ext[i]) {
-            set->pos.x[n + i * set->offset] = domain->min_ext[i];
-            set->speed.dx[n + i * set->offset] *= -1;
-            atom_state[n] = SHOCK_PERIOD;
-        }
-        if (set->pos.x[n + i * set->offset] > domain->max_ext[i]) {
-            set->pos.x[n + i * set->offset] = domain->max_ext[i];
-            set->speed.dx[n + i * set->offset] *= -1;
-            atom_state[n] = SHOCK_PERIOD;
-        }
+      memcpy (set->pos.x + i * offset + dst, alt_pos_buffer + i * alt_offset + src,
+	      n * sizeof (calc_t));
+      memcpy (set->speed.dx + i * offset + dst, alt_spd_buffer + i * alt_offset + src,
+	      n * sizeof (calc_t));
     }
+    memcpy (set->id + dst, alt_id_buffer + src, n * sizeof (unsigned));
   }
 }
 
-static calc_t squared_distance (sotl_atom_set_t *set, unsigned p1, unsigned p2)
+// Torus version of omp_box_force: atoms and their periodic images are
+// sorted into the alternate buffers, forces are computed on the atoms of
+// inner boxes (images only lie in padding boxes), then own atoms are
+// copied back
+//
+static void omp_torus_force (sotl_device_t *dev)
 {
-  calc_t *pos1 = set->pos.x + p1,
-    *pos2 = set->pos.x + p2;
+  sotl_atom_set_t *set = &dev->atom_set;
+  sotl_domain_t *domain = &dev->domain;
+  sotl_atom_set_t images = *set;
+  uint64_t phase_start = profiling_now ();
 
-  calc_t dx = pos2[0] - pos1[0],
-         dy = pos2[set->offset] - pos1[set->offset],
-         dz = pos2[set->offset*2] - pos1[set->offset*2];
+  #pragma omp parallel
+  {
+    const int nthreads = omp_get_num_threads ();
+    const int t = omp_get_thread_num ();
+    const unsigned begin = (unsigned long) set->natoms * t / nthreads;
+    const unsigned end = (unsigned long) set->natoms * (t + 1) / nthreads;
+    unsigned *count = box_count + t * domain->total_boxes;
 
-  return dx * dx + dy * dy + dz * dz;
+    omp_torus_count_all_atoms (dev, count, begin, end);
+
+    #pragma omp barrier
+
+    omp_box_scan (dev);
+
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+      omp_torus_reserve (box_start[domain->total_boxes]);
+
+      images.natoms = box_start[domain->total_boxes];
+      images.offset = alt_offset;
+      images.pos.x = alt_pos_buffer;
+      images.pos.y = images.pos.x + alt_offset;
+      images.pos.z = images.pos.y + alt_offset;
+      images.speed.dx = alt_spd_buffer;
+      images.speed.dy = images.speed.dx + alt_offset;
+      images.speed.dz = images.speed.dy + alt_offset;
+      images.id = alt_id_buffer;
+    }
+
+    omp_torus_sort_all_atoms (dev, count, begin, end);
+
+    #pragma omp barrier
+
+    #pragma omp master
+    phase_start = profiling_record (dev, PROF_SORT, phase_start);
+
+    #pragma omp for schedule(dynamic, 64)
+    for (unsigned b = 0; b < domain->total_boxes; b++) {
+      sotl_cell_range_t ranges[CELL_MAX_ROWS];
+      unsigned x = b % domain->boxes[0];
+      unsigned y = (b / domain->boxes[0]) % domain->boxes[1];
+      unsigned z = b / (domain->boxes[0] * domain->boxes[1]);
+      unsigned nb_ranges;
+
+      if (box_start[b] == box_start[b + 1] ||
+	  x < SUBCELL || x >= domain->boxes[0] - SUBCELL ||
+	  y < SUBCELL || y >= domain->boxes[1] - SUBCELL ||
+	  z < SUBCELL || z >= domain->boxes[2] - SUBCELL)
+	continue;
+
+      nb_ranges = omp_box_neighbours (domain, b, ranges);
+      omp_box_lennard_jones (&images, box_start[b], box_start[b + 1],
+			     ranges, nb_ranges, NULL, 0, images.natoms);
+    }
+
+    omp_torus_gather (dev);
+  }
+
+  profiling_record (dev, PROF_FORCE, phase_start);
+
+  THREAD_COUNT = omp_get_max_threads();
 }
 
-static calc_t lennard_jones (calc_t r2)
+// Same as omp_box_force for domains too sparse for dense box arrays, and
+// with multiple devices (atoms stay in place in the global set): atoms are
+// binned into the non-empty boxes of the cell list
+//
+static void omp_cell_force (sotl_device_t *dev, sotl_atom_set_t *set,
+			    unsigned first, unsigned last)
 {
-  calc_t rr2 = 1.0 / r2;
-  calc_t r6;
+  sotl_cell_list_t *cells = &dev->cells;
+  uint64_t t = profiling_now ();
+
+  cell_list_build (cells, &dev->domain, set, BOX_SIZE);
+  t = profiling_record (dev, PROF_SORT, t);
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (unsigned k = 0; k < cells->nboxes; k++) {
+    sotl_cell_range_t ranges[CELL_MAX_ROWS];
+    unsigned nb_ranges = cell_get_neighbours (cells, k, SUBCELL, ranges);
+
+    omp_box_lennard_jones (set, cells->box_start[k], cells->box_start[k + 1],
+			   ranges, nb_ranges, cells->atoms, first, last);
+  }
 
-  r6 = LENNARD_SIGMA * LENNARD_SIGMA * rr2;
-  r6 = r6 * r6 * r6;
+  profiling_record (dev, PROF_FORCE, t);
 
-  return 24 * LENNARD_EPSILON * rr2 * (2.0f * r6 * r6 - r6);
+  THREAD_COUNT = omp_get_max_threads();
 }
 
-static void omp_force (sotl_device_t *dev)
+// Verlet version: lists are rebuilt by all threads when an atom moved
+// more than half the skin distance
+//
+static void omp_verlet_force (sotl_device_t *dev, sotl_atom_set_t *set,
+			      unsigned first, unsigned last)
 {
-  sotl_atom_set_t *set = &dev->atom_set;
+  sotl_verlet_list_t *list = &dev->verlet;
+  const sotl_potential_t *pot = get_potential ();
+  const calc_t skin = VERLET_SKIN_DISTANCE;
+  const bool sample = observables_get_sampling ()->energy;
+  uint64_t t = profiling_now ();
 
-  #pragma omp parallel for schedule(dynamic, 1)
-  for (unsigned current = 0; current < set->natoms; current++) {
-    calc_t force[3] = { 0.0, 0.0, 0.0 };
+  #pragma omp parallel
+  {
+    // Read before verlet_list_needs_update, whose barriers keep the single
+    // thread reordering atoms from clearing it too early
+    const bool reorder = dev->reorder_pending;
 
-    THREAD_COUNT = omp_get_num_threads();
-    atom_state[current] = omp_get_thread_num();
+    // Both end with a barrier
+    if (verlet_list_needs_update (list, set, skin)) {
+      // A Morton reordering waits for the lists to be rebuilt
+      if (reorder) {
+	#pragma omp single
+	{
+	  atom_set_sort_morton (&dev->atom_set, &dev->domain);
+	  dev->reorder_pending = false;
+	}
+      }
+      verlet_list_build (list, &dev->cells, &dev->domain, set, skin,
+			 is_half_pair_mode);
+    }
 
-    for (unsigned other = 0; other < set->natoms; other++)
-      if (current != other) {
-      	calc_t sq_dist = squared_distance (set, current, other);
+    #pragma omp master
+    t = profiling_record (dev, PROF_SORT, t);
 
-      	if (sq_dist < LENNARD_SQUARED_CUTOFF) {
-      	  calc_t intensity = lennard_jones (sq_dist);
+    if (is_half_pair_mode) {
+      calc_t *force = omp_reset_force_buffer (set);
+      calc_t e = 0.0, *energy = sample ? &e : NULL;
 
-      	  force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
-      	  force[1] += intensity * (set->pos.x[set->offset + current] -
-      				   set->pos.x[set->offset + other]);
-      	  force[2] += intensity * (set->pos.x[set->offset * 2 + current] -
-      				   set->pos.x[set->offset * 2 + other]);
-      	}
+      #pragma omp for schedule(dynamic, 64)
+      for (unsigned current = 0; current < last; current++) {
+	atom_state[current] = omp_get_thread_num();
 
+	for (unsigned j = list->start[current]; j < list->start[current + 1]; j++)
+	  if (current >= first || list->neighbours[j] >= first)
+	    omp_add_pair (set, pot, force, energy, first, last, current,
+			  list->neighbours[j]);
       }
 
-    set->speed.dx[current] += force[0];
-    set->speed.dx[set->offset + current] += force[1];
-    set->speed.dx[set->offset * 2 + current] += force[2];
+      if (energy)
+	omp_add_energy (e);
+
+      omp_reduce_force_buffers (set, first, last);
+    } else {
+      #pragma omp for schedule(dynamic, 64)
+      for (unsigned current = first; current < last; current++) {
+	calc_t force[3] = { 0.0, 0.0, 0.0 };
+	calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+	atom_state[current] = omp_get_thread_num();
+
+#ifdef XEON_VECTORIZATION
+	simd_force_list (set, current, list->neighbours + list->start[current],
+			 list->start[current + 1] - list->start[current], force,
+			 energy);
+#else
+	for (unsigned j = list->start[current]; j < list->start[current + 1]; j++) {
+	  unsigned other = list->neighbours[j];
+	  calc_t sq_dist = squared_distance (set, current, other);
+
+	  if (sq_dist < pot->rc2) {
+	    calc_t intensity = potential_force (pot, sq_dist);
+
+	    force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
+	    force[1] += intensity * (set->pos.y[current] - set->pos.y[other]);
+	    force[2] += intensity * (set->pos.z[current] - set->pos.z[other]);
+	    if (energy)
+	      *energy += potential_energy (pot, sq_dist);
+	  }
+	}
+#endif
+
+	omp_kick_atom (set, current, force);
+	if (energy)
+	  omp_add_energy (0.5 * e);
+      }
+    }
   }
+
+  profiling_record (dev, PROF_FORCE, t);
+
+  THREAD_COUNT = omp_get_max_threads();
 }
 
+// Take the next chunk of boxes (or atoms) of a node, up to n
+//
+static inline bool omp_numa_next_chunk (unsigned node, unsigned n,
+					unsigned *begin, unsigned *end)
+{
+  unsigned b;
 
-// Main simulation function
+  #pragma omp atomic capture
+  { b = numa_work[node].next; numa_work[node].next += NUMA_CHUNK; }
+
+  *begin = b;
+  *end = MIN (b + NUMA_CHUNK, n);
+  return b < n;
+}
+
+// NUMA version: threads of each node compute forces on the atoms of its
+// slab (with the atoms of the neighbour slabs as ghosts), move them, then
+// sort them along z again. Only atoms around slab boundaries are then
+// exchanged between nodes
 //
-void omp_one_step_move (sotl_device_t *dev)
+static void omp_numa_one_step_move (sotl_device_t *dev)
 {
-  // Apply gravity force
-  //
-  if (gravity_enabled)
-    omp_gravity (dev);
+  sotl_domain_t *dom = get_global_domain ();
+  sotl_domain_t *walls = dom;
+  const calc_t drift = integrator_get_step ()->drift;
+  const bool sample = observables_get_sampling ()->energy;
+  calc_t gravity[3];
+  uint64_t phase_start = profiling_now ();
 
-  // Compute interactions between atoms
-  //
-  if (force_enabled)
-    omp_force (dev);
+  omp_gravity (gravity);
 
-  // Bounce on borders
-  //
-  if(borders_enabled)
-    omp_bounce (dev);
+  for (unsigned node = 0; node < numa_nodes; node++)
+    numa_work[node].next = 0;
+
+  #pragma omp parallel
+  {
+    const int t = omp_get_thread_num ();
+    const int nthreads = omp_get_num_threads ();
+    const unsigned node = numa_thread_node (t, nthreads);
+    sotl_domain_t *subdom = dom->subdomains[node];
+    sotl_atom_set_t *sub = subdom->atom_set;
+    const unsigned first = sub->nghosts_min;
+    const unsigned last = first + sub->natoms;
+    const unsigned shift = sub->pos.x - dev->atom_set.pos.x;
+    sotl_atom_set_t set;
+    unsigned begin, end;
+    int t0, t1;
+
+    numa_pin_thread (node);
+    numa_node_threads (node, nthreads, &t0, &t1);
+    atom_set_with_ghosts (sub, &set);
+
+    if (force_enabled && is_box_mode) {
+      sotl_cell_list_t *cells = &numa_cells[node];
+
+      if (t == t0)
+	cell_list_build (cells, subdom, &set, BOX_SIZE);
+
+      #pragma omp barrier
+
+      while (omp_numa_next_chunk (node, cells->nboxes, &begin, &end))
+	for (unsigned k = begin; k < end; k++) {
+	  sotl_cell_range_t ranges[CELL_MAX_ROWS];
+	  unsigned nb_ranges = cell_get_neighbours (cells, k, SUBCELL, ranges);
+
+	  omp_box_lennard_jones (&set, cells->box_start[k], cells->box_start[k + 1],
+				 ranges, nb_ranges, cells->atoms, first, last);
+	}
+    } else if (force_enabled) {
+      while (omp_numa_next_chunk (node, sub->natoms, &begin, &end))
+	for (unsigned n = begin; n < end; n++)
+	  omp_atom_force (&set, first + n, sample);
+    }
+
+    // Ghosts are read by other nodes until all forces are computed
+    #pragma omp barrier
+
+    #pragma omp master
+    phase_start = profiling_record (dev, PROF_FORCE, phase_start);
+
+    begin = shift + (unsigned long) sub->natoms * (t - t0) / (t1 - t0);
+    end = shift + (unsigned long) sub->natoms * (t - t0 + 1) / (t1 - t0);
+    for (unsigned n = begin; n < end; n++)
+      omp_move_atom (dev, &dev->atom_set, walls, gravity, drift, n);
+
+    #pragma omp barrier
+
+    #pragma omp master
+    phase_start = profiling_record (dev, PROF_MOVE, phase_start);
+
+    if (t == t0)
+      atom_set_sort (sub);
+  }
+
+  domain_exchange_borders (dom);
+
+  profiling_record (dev, PROF_SORT, phase_start);
+
+  THREAD_COUNT = omp_get_max_threads();
+}
+
+// Split the domain into one slab per NUMA node and place atoms on their
+// node. Returns the number of nodes used (0 if the NUMA mode can not be
+// used)
+//
+static unsigned omp_numa_init (sotl_device_t *dev)
+{
+  sotl_atom_set_t *set = get_global_atom_set ();
+  unsigned nodes = numa_topology_init ();
+
+  if (nodes < 2) {
+    sotl_log(WARNING, "Only one NUMA node found: NUMA mode disabled\n");
+    return 0;
+  }
+  if (sotl_have_multi() || is_verlet_mode || is_half_pair_mode) {
+    sotl_log(WARNING, "NUMA mode does not support multiple devices, Verlet "
+	     "lists nor half pairs: NUMA mode disabled\n");
+    return 0;
+  }
+  if (omp_get_max_threads() < (int) nodes) {
+    sotl_log(WARNING, "Less threads than NUMA nodes: NUMA mode disabled\n");
+    return 0;
+  }
+
+  if (reorder_period) {
+    // Slabs are contiguous ranges of atoms sorted along z
+    sotl_log(WARNING, "Morton reordering is disabled in NUMA mode.\n");
+    reorder_period = 0;
+  }
+
+  atom_set_sort (set);
+  domain_split (get_global_domain (), nodes);
+
+  if (numa_place_atoms (set, get_global_domain ()) < 0) {
+    sotl_log(CRITICAL, "Failed to place atoms on NUMA nodes\n");
+    return 0;
+  }
+  dev->atom_set = *set;
+
+  for (unsigned node = 0; node < nodes; node++)
+    if (cell_list_init (&numa_cells[node], set->offset) != SOTL_SUCCESS)
+      sotl_log(CRITICAL, "Failed to allocate the cell list\n");
+
+  if (sotl_verbose)
+    sotl_log(INFO, "NUMA mode: %d slabs, %d threads\n", nodes,
+	     omp_get_max_threads());
+
+  return nodes;
+}
+
+// Maxima of all threads over the step (adaptive time step)
+//
+static void omp_reduce_max (sotl_device_t *dev)
+{
+  dev->max_kick2 = dev->max_speed2 = 0.0;
+
+  if (!thread_max)
+    return;
+
+  for (int t = 0; t < omp_get_max_threads (); t++) {
+    dev->max_kick2 = MAX (dev->max_kick2, thread_max[t].kick2);
+    dev->max_speed2 = MAX (dev->max_speed2, thread_max[t].speed2);
+  }
+}
+
+// Observables of all threads over the step (sampled steps only)
+//
+static void omp_reduce_observables (sotl_device_t *dev)
+{
+  const sotl_sampling_t *sampling = observables_get_sampling ();
+
+  if (!sampling->energy && !sampling->speeds)
+    return;
+
+  // The device keeps the potential energy of the first substep
+  if (sampling->energy)
+    observables_clear (&dev->observables);
+
+  for (int t = 0; t < omp_get_max_threads (); t++)
+    observables_add (&dev->observables, &thread_obs[t]);
+}
+
+// Clear the per-thread maxima and observables of a step
+//
+static void omp_reset_step (void)
+{
+  const sotl_sampling_t *sampling = observables_get_sampling ();
+
+  if (thread_max)
+    memset (thread_max, 0, omp_get_max_threads () * sizeof (*thread_max));
+
+  if (sampling->energy || sampling->speeds)
+    memset (thread_obs, 0, omp_get_max_threads () * sizeof (*thread_obs));
+}
 
-  // Update positions
+// Force pass of a step (not in NUMA mode, which is single device)
+//
+void omp_one_step_force (sotl_device_t *dev)
+{
+  uint64_t t;
+
+  omp_reset_step ();
+
+  // Compute interactions between atoms: with multiple devices, atoms of
+  // this device also interact with ghosts, the atoms of neighbour devices
+  // lying next to them in the global set
   //
-  omp_move (dev);
+  if (force_enabled) {
+    sotl_atom_set_t set;
+    const unsigned first = dev->atom_set.nghosts_min;
+    const unsigned last = first + dev->atom_set.natoms;
 
-#ifdef HAVE_LIBGL
-  // Update OpenGL position
+    atom_set_with_ghosts (&dev->atom_set, &set);
+
+    if (is_verlet_mode)
+      omp_verlet_force (dev, &set, first, last);
+    else if (is_box_mode && box_start && is_torus_mode)
+      omp_torus_force (dev);
+    else if (is_box_mode && box_start)
+      omp_box_force (dev);
+    else if (is_box_mode)
+      omp_cell_force (dev, &set, first, last);
+    else {
+      t = profiling_now ();
+      if (is_half_pair_mode)
+	omp_half_force (&set, first, last);
+      else
+	omp_force (&set, first, last);
+      profiling_record (dev, PROF_FORCE, t);
+    }
+  }
+}
+
+// Move pass of a step, after omp_one_step_force
+//
+void omp_one_step_integrate (sotl_device_t *dev)
+{
+  uint64_t t;
+
+  // Apply gravity, bounce on borders, update positions (and OpenGL
+  // positions)
   //
-  if (dev->display)
-    omp_update_vbo (dev);
-#endif
+  t = profiling_now ();
+  omp_integrate (dev);
+  profiling_record (dev, PROF_MOVE, t);
+
+  omp_reduce_max (dev);
+  omp_reduce_observables (dev);
+}
+
+// Main simulation function
+//
+void omp_one_step_move (sotl_device_t *dev)
+{
+  if (numa_nodes) {
+    omp_reset_step ();
+    omp_numa_one_step_move (dev);
+    omp_reduce_max (dev);
+    omp_reduce_observables (dev);
+    return;
+  }
+
+  omp_one_step_force (dev);
+  omp_one_step_integrate (dev);
 }
 
 void omp_init (sotl_device_t *dev)
@@ -190,18 +1296,113 @@ void omp_init (sotl_device_t *dev)
 
   borders_enabled = 1;
 
+#ifdef XEON_VECTORIZATION
+  simd_init ();
+#endif
+
   dev->compute = SOTL_COMPUTE_OMP; // dummy op to avoid warning
 }
 
 void omp_alloc_buffers (sotl_device_t *dev)
 {
-  atom_state = calloc(dev->atom_set.natoms, sizeof(int));
+  // Indexed by atoms and ghosts, whose number varies with multiple devices
+  atom_state = calloc(dev->atom_set.offset, sizeof(int));
   printf("natoms: %d\n", dev->atom_set.natoms);
+
+  if (is_numa_mode)
+    numa_nodes = omp_numa_init (dev);
+
+  if (cell_list_init (&dev->cells, dev->atom_set.offset) != SOTL_SUCCESS)
+    sotl_log(CRITICAL, "Failed to allocate the cell list\n");
+
+  if (verlet_list_init (&dev->verlet, dev->atom_set.offset) != SOTL_SUCCESS)
+    sotl_log(CRITICAL, "Failed to allocate Verlet lists\n");
+
+  // Dense boxes move atoms to other buffers, while atoms of multiple
+  // devices (or NUMA nodes) must stay in the global set
+  if (is_box_mode && !is_verlet_mode && !sotl_have_multi() && !numa_nodes &&
+      (is_torus_mode || (unsigned long) omp_get_max_threads() * dev->domain.total_boxes <=
+       (unsigned long) BOX_MAX_RATIO * dev->atom_set.offset)) {
+    const unsigned long size = atom_set_size (&dev->atom_set);
+
+    box_count = malloc(omp_get_max_threads() * dev->domain.total_boxes * sizeof(unsigned));
+    box_start = malloc((dev->domain.total_boxes + 1) * sizeof(unsigned));
+    box_partial = malloc(omp_get_max_threads() * sizeof(unsigned));
+    atom_box = malloc(dev->atom_set.offset * sizeof(unsigned));
+    alt_pos_buffer = malloc(size);
+    alt_spd_buffer = malloc(size);
+    alt_id_buffer = malloc(dev->atom_set.offset * sizeof(unsigned));
+    alt_offset = dev->atom_set.offset;
+    if (!box_count || !box_start || !box_partial || !atom_box ||
+	!alt_pos_buffer || !alt_spd_buffer || !alt_id_buffer)
+      sotl_log(CRITICAL, "Failed to allocate box buffers\n");
+
+    if (is_torus_mode) {
+      torus_row_start = malloc((dev->domain.boxes[1] * dev->domain.boxes[2] + 1) *
+			       sizeof(unsigned));
+      if (!torus_row_start)
+	sotl_log(CRITICAL, "Failed to allocate box buffers\n");
+    }
+  }
+
+  if (is_box_mode && sotl_verbose)
+    sotl_log(INFO, "Box mode uses %s\n", box_start ? "dense boxes" : "the cell list");
+
+  if (is_half_pair_mode) {
+    force_buffer = malloc(omp_get_max_threads() * 3 * dev->atom_set.offset * sizeof(calc_t));
+    if (force_buffer == NULL)
+      sotl_log(CRITICAL, "Failed to allocate force buffers\n");
+  }
+
+  if (integrator_is_adaptive ()) {
+    thread_max = calloc(omp_get_max_threads(), sizeof(*thread_max));
+    if (thread_max == NULL)
+      sotl_log(CRITICAL, "Failed to allocate per-thread maxima\n");
+  }
+
+  if (observables_is_enabled ()) {
+    thread_obs = calloc(omp_get_max_threads(), sizeof(*thread_obs));
+    if (thread_obs == NULL)
+      sotl_log(CRITICAL, "Failed to allocate per-thread observables\n");
+  }
 }
 
 void omp_finalize (sotl_device_t *dev)
 {
+  if (numa_nodes) {
+    numa_report (get_global_domain ());
+    for (unsigned node = 0; node < numa_nodes; node++)
+      cell_list_free (&numa_cells[node]);
+    numa_nodes = 0;
+  }
+
   free(atom_state);
+  atom_state = NULL;
+  free(force_buffer);
+  force_buffer = NULL;
+  free(thread_max);
+  thread_max = NULL;
+  free(thread_obs);
+  thread_obs = NULL;
+
+  // Give back its own buffers to the atom set after an odd number of sorts
+  if (alt_pos_buffer && dev->atom_set.pos.x != get_global_atom_set()->pos.x)
+    omp_box_switch_buffers (&dev->atom_set);
+
+  free(box_count);
+  free(box_start);
+  free(box_partial);
+  free(atom_box);
+  free(alt_pos_buffer);
+  free(alt_spd_buffer);
+  free(alt_id_buffer);
+  free(torus_row_start);
+  box_count = box_start = box_partial = atom_box = alt_id_buffer = NULL;
+  torus_row_start = NULL;
+  alt_offset = 0;
+  alt_pos_buffer = alt_spd_buffer = NULL;
+  cell_list_free (&dev->cells);
+  verlet_list_free (&dev->verlet);
 
   dev->compute = SOTL_COMPUTE_OMP; // dummy op to avoid warning
 }
@@ -0,0 +1,172 @@
+#include "potential.h"
+#include "sotl.h"
+
+#include <math.h>
+
+static sotl_potential_t potential;
+
+/* F(r) / r without kicks, and weight of the inner part of each entry. */
+static double base[POTENTIAL_TABLE_SIZE + 2];
+static double inner_weight[POTENTIAL_TABLE_SIZE + 2];
+
+static double split_cutoff = 0.0, split_width = 0.0;
+static double split_rc2 = 0.0;      /* 0 without split */
+static double kick_outer = 1.0, kick_inner = 1.0;
+
+/* F(r) / r of the Lennard-Jones potential 4e((s/r)^12 - (s/r)^6). */
+static double lj_force(const double r2)
+{
+    double s6 = LENNARD_SIGMA * LENNARD_SIGMA / r2;
+
+    s6 = s6 * s6 * s6;
+    return 24 * LENNARD_EPSILON / r2 * (2 * s6 * s6 - s6);
+}
+
+static double lj_energy(const double r2)
+{
+    double s6 = LENNARD_SIGMA * LENNARD_SIGMA / r2;
+
+    s6 = s6 * s6 * s6;
+    return 4 * LENNARD_EPSILON * (s6 * s6 - s6);
+}
+
+/* F(r) / r of the Morse potential e((1 - exp(-a(r - r0)))^2 - 1), whose
+ * minimum is the one of the Lennard-Jones potential (r0 = 2^(1/6) s). */
+static double morse_force(const double r2)
+{
+    const double r0 = pow(2.0, 1.0 / 6.0) * LENNARD_SIGMA;
+    const double a = MORSE_ALPHA_VALUE / r0;
+    const double r = sqrt(r2);
+    const double e = exp(-a * (r - r0));
+
+    return -2 * LENNARD_EPSILON * a * e * (1 - e) / r;
+}
+
+static double morse_energy(const double r2)
+{
+    const double r0 = pow(2.0, 1.0 / 6.0) * LENNARD_SIGMA;
+    const double a = MORSE_ALPHA_VALUE / r0;
+    const double e = exp(-a * (sqrt(r2) - r0));
+
+    return LENNARD_EPSILON * ((1 - e) * (1 - e) - 1);
+}
+
+/* F(r) / r of the soft-sphere potential e(s/r)^12 (repulsion only). */
+static double soft_sphere_force(const double r2)
+{
+    double s6 = LENNARD_SIGMA * LENNARD_SIGMA / r2;
+
+    s6 = s6 * s6 * s6;
+    return 12 * LENNARD_EPSILON / r2 * s6 * s6;
+}
+
+static double soft_sphere_energy(const double r2)
+{
+    double s6 = LENNARD_SIGMA * LENNARD_SIGMA / r2;
+
+    s6 = s6 * s6 * s6;
+    return LENNARD_EPSILON * s6 * s6;
+}
+
+/* Scale base by the current kicks into both tables. */
+static void potential_apply_kicks(void)
+{
+    const double outer = kick_outer, inner = kick_inner;
+
+    for (unsigned i = 0; i < POTENTIAL_TABLE_SIZE + 2; i++) {
+        double w = inner_weight[i];
+        double k = (split_rc2 == 0.0 || outer == inner) ?
+            outer : outer * (1.0 - w) + inner * w;
+
+        potential.table[i] = base[i] * k;
+        potential.ftable[i] = (float)potential.table[i];
+    }
+
+    potential.rc2 = (split_rc2 > 0.0 && outer == 0.0) ?
+        split_rc2 : LENNARD_SQUARED_CUTOFF;
+    potential.version++;
+}
+
+void potential_update(void)
+{
+    const double rc2 = LENNARD_SQUARED_CUTOFF;
+    const double step = rc2 / POTENTIAL_TABLE_SIZE;
+    double (*force)(const double) = lj_force;
+    double (*energy)(const double) = lj_energy;
+
+    potential.type = POTENTIAL_TYPE_VALUE;
+    switch (potential.type) {
+        case SOTL_POTENTIAL_MORSE:
+            force = morse_force;
+            energy = morse_energy;
+            break;
+        case SOTL_POTENTIAL_SOFT_SPHERE:
+            force = soft_sphere_force;
+            energy = soft_sphere_energy;
+            break;
+        default:
+            potential.type = SOTL_POTENTIAL_LJ;
+            break;
+    }
+
+    potential.inv_step = POTENTIAL_TABLE_SIZE / rc2;
+
+    for (unsigned i = 1; i < POTENTIAL_TABLE_SIZE + 2; i++) {
+        base[i] = force(i * step);
+        potential.etable[i] = energy(i * step) - energy(rc2);
+    }
+    base[0] = base[1];
+    potential.etable[0] = potential.etable[1];
+
+    /* Inner weights: 1 up to the switch, 0 after the inner cutoff. */
+    split_rc2 = split_width > 0.0 ? split_cutoff * split_cutoff : 0.0;
+    for (unsigned i = 0; i < POTENTIAL_TABLE_SIZE + 2; i++) {
+        double x = 0.0;
+
+        if (split_rc2 > 0.0)
+            x = (sqrt(i * step) - split_cutoff + split_width) / split_width;
+        x = x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x);
+        inner_weight[i] = 1.0 - x * x * (3.0 - 2.0 * x);
+    }
+
+    potential_apply_kicks();
+}
+
+void potential_set_split(const double inner_cutoff, const double width)
+{
+    split_cutoff = inner_cutoff;
+    split_width = width;
+    potential_update();
+}
+
+void potential_set_kicks(const double outer, const double inner)
+{
+    if (outer == kick_outer && inner == kick_inner)
+        return;
+
+    kick_outer = outer;
+    kick_inner = inner;
+    potential_apply_kicks();
+}
+
+void potential_set_mixed(const bool mixed)
+{
+    potential.mixed = mixed;
+}
+
+const sotl_potential_t *get_potential(void)
+{
+    return &potential;
+}
+
+const char *potential_name(const unsigned type)
+{
+    switch (type) {
+        case SOTL_POTENTIAL_MORSE:
+            return "Morse";
+        case SOTL_POTENTIAL_SOFT_SPHERE:
+            return "soft-sphere";
+        default:
+            return "Lennard-Jones";
+    }
+}
@@ -1,87 +1,443 @@
+#define _XOPEN_SOURCE 600
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "device.h"
+#include "global_definitions.h"
 #include "profiling.h"
 #include "cl.h"
 
-void profiling_reset_counters (sotl_device_t *dev)
+// Durations are binned by powers of two of µs: [0, 1), [1, 2), [2, 4)...
+#define PROF_BUCKETS     24
+
+// OpenCL commands whose timestamps are not read yet
+#define PROF_PENDING     256
+
+// Phases kept for the trace, per device (24 bytes each)
+#define PROF_MAX_EVENTS  (1 << 20)
+
+typedef struct {
+  unsigned long count;
+  uint64_t total, min, max;     // ns
+  unsigned long buckets[PROF_BUCKETS];
+} prof_histogram_t;
+
+typedef struct {
+  uint64_t begin, end;          // ns, host clock
+  unsigned short phase;
+  short kernel;                 // -1 for phases timed on the host
+} prof_event_t;
+
+typedef struct {
+  cl_event event;
+  unsigned kernel;
+  uint64_t queued;              // Host clock when the command was enqueued
+} prof_pending_t;
+
+struct sotl_profile {
+  prof_histogram_t phases[PROF_NB_PHASES];
+  prof_histogram_t kernels[KERNEL_TAB_SIZE];
+  prof_pending_t pending[PROF_PENDING];
+  unsigned first_pending, nb_pending;
+  int64_t clock_offset;         // Host clock minus device clock
+  bool clock_known;
+  prof_event_t *events;         // Trace only
+  unsigned long nb_events, max_events, dropped;
+};
+
+// Phases timed on the host, out of any device
+static struct sotl_profile host_profile;
+
+static bool trace_enabled = false;
+
+static const char *phase_names[PROF_NB_PHASES] = {
+  "gravity",
+  "sort",
+  "force",
+  "bounce",
+  "move",
+  "vbo",
+  "other",
+  "exchange",
+};
+
+const char *profiling_phase_name (unsigned phase)
+{
+  return phase_names[phase];
+}
+
+static struct sotl_profile *profile_of (sotl_device_t *dev)
 {
-  for (unsigned k = 0; k < KERNEL_TAB_SIZE; k++) {
-    dev->prof_used[k] = false;
+  return dev ? dev->prof : &host_profile;
+}
+
+static unsigned kernel_phase (unsigned kernel_num)
+{
+  switch (kernel_num) {
+  case KERNEL_GRAVITY:
+    return PROF_GRAVITY;
+  case KERNEL_RESET_BOXES:
+  case KERNEL_BOX_COUNT_ALL_ATOMS:
+  case KERNEL_BOX_COUNT_OWN_ATOMS:
+  case KERNEL_SCAN:
+  case KERNEL_SCAN_DOWN_STEP:
+  case KERNEL_COPY_BUFFER:
+  case KERNEL_BOX_SORT_ALL_ATOMS:
+  case KERNEL_BOX_SORT_OWN_ATOMS:
+  case KERNEL_TORUS_COUNT_ALL_ATOMS:
+  case KERNEL_TORUS_SORT_ALL_ATOMS:
+  case KERNEL_TORUS_ROWS:
+  case KERNEL_TORUS_GATHER:
+  case KERNEL_CLUSTER_SCAN:
+  case KERNEL_CLUSTER_BUILD:
+  case KERNEL_CLUSTER_PAIRS:
+    return PROF_SORT;
+  case KERNEL_FORCE:
+  case KERNEL_CLUSTER_FORCE:
+  case KERNEL_FORCE_N2:
+    return PROF_FORCE;
+  case KERNEL_BORDER:
+    return PROF_BOUNCE;
+  case KERNEL_UPDATE_POSTION:
+  case KERNEL_ZERO_SPEED:
+    return PROF_MOVE;
+  case KERNEL_UPDATE_VERTICES:
+    return PROF_VBO;
+  default:
+    return PROF_OTHER;
   }
 }
 
-void profiling_init (sotl_device_t *dev) 
+static void histogram_add (prof_histogram_t *h, uint64_t duration)
 {
-  profiling_reset_counters (dev);
+  uint64_t us = duration / 1000;
+  unsigned b = 0;
+
+  while (us && b < PROF_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+
+  if (!h->count || duration < h->min)
+    h->min = duration;
+  if (duration > h->max)
+    h->max = duration;
+  h->count++;
+  h->total += duration;
+  h->buckets[b]++;
 }
 
-void profiling_finalize (sotl_device_t *dev)
+// Histograms are always updated, while events are only kept for the
+// trace, up to PROF_MAX_EVENTS per device
+//
+static void profile_add (struct sotl_profile *prof, unsigned phase, int kernel,
+			 uint64_t begin, uint64_t end)
 {
-  float total_time = 0.0f;
+  const uint64_t duration = end > begin ? end - begin : 0;
 
-  sotl_log(PERF, "Detailed performance report for device [%s]\n", dev->name);
-  for (unsigned k = 0; k < KERNEL_TAB_SIZE; k++) {
+  histogram_add (&prof->phases[phase], duration);
+  if (kernel >= 0)
+    histogram_add (&prof->kernels[kernel], duration);
 
-    if(k == KERNEL_SCAN_DOWN_STEP)
-      continue;
+  if (!trace_enabled)
+    return;
+
+  if (prof->nb_events == prof->max_events) {
+    unsigned long max = prof->max_events ? 2 * prof->max_events : 4096;
+    prof_event_t *events;
+
+    if (prof->max_events == PROF_MAX_EVENTS ||
+	!(events = realloc (prof->events, MIN (max, PROF_MAX_EVENTS) * sizeof (prof_event_t)))) {
+      prof->dropped++;
+      return;
+    }
+    prof->events = events;
+    prof->max_events = MIN (max, PROF_MAX_EVENTS);
+  }
 
-    if (dev->prof_used[k]) {
+  prof->events[prof->nb_events].begin = begin;
+  prof->events[prof->nb_events].end = end;
+  prof->events[prof->nb_events].phase = phase;
+  prof->events[prof->nb_events].kernel = kernel;
+  prof->nb_events++;
+}
+
+static void profile_reset (struct sotl_profile *prof)
+{
+  memset (prof->phases, 0, sizeof (prof->phases));
+  memset (prof->kernels, 0, sizeof (prof->kernels));
+  prof->nb_events = 0;
+  prof->dropped = 0;
+}
+
+void profiling_reset_counters (sotl_device_t *dev)
+{
+  struct sotl_profile *prof = profile_of (dev);
 
-      cl_ulong start, end;
-      float timeInMicroseconds;
+  if (!prof)
+    return;
 
-      clGetEventProfilingInfo(dev->prof_events[k], CL_PROFILING_COMMAND_START,
-			      sizeof(cl_ulong), &start, NULL);
+  if (dev)
+    profiling_collect (dev, true);
+  profile_reset (prof);
+}
 
-#if 0
-      // Uncomment to check elapsed time between two consecutive kernels
-      {
-	int previous = -1;
+void profiling_init (sotl_device_t *dev)
+{
+  if (!dev->prof) {
+    dev->prof = calloc (1, sizeof (struct sotl_profile));
+    if (!dev->prof)
+      sotl_log(WARNING, "Failed to allocate profiling counters of device [%s]\n",
+	       dev->name);
+  }
 
-	for (int i = k-1; i > 0; i--)
-	  if (dev->prof_used[i]) {
-	    previous = i;
-	    break;
-	  }
+  profiling_reset_counters (dev);
+}
+
+// Commands of an in-order queue complete in order: stop at the first one
+// still running
+//
+void profiling_collect (sotl_device_t *dev, bool wait)
+{
+  struct sotl_profile *prof = dev->prof;
 
-	if (previous != -1) {
-	  clGetEventProfilingInfo(dev->prof_events[previous], CL_PROFILING_COMMAND_END,
-				  sizeof(cl_ulong), &end, NULL);
+  if (!prof)
+    return;
 
-	  sotl_log(PERF, "Lost time between kernels: %f\n", (start -end) * 1.0e-3f);
+  while (prof->nb_pending) {
+    prof_pending_t *p = &prof->pending[prof->first_pending];
+
+    if (p->event) {
+      cl_ulong queued, start, end;
+      cl_int status = CL_COMPLETE;
+      cl_int err;
+
+      if (wait)
+	clWaitForEvents (1, &p->event);
+      else
+	clGetEventInfo (p->event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+			sizeof (status), &status, NULL);
+      if (status > CL_COMPLETE)
+	break;
+
+      err  = clGetEventProfilingInfo (p->event, CL_PROFILING_COMMAND_QUEUED,
+				      sizeof (cl_ulong), &queued, NULL);
+      err |= clGetEventProfilingInfo (p->event, CL_PROFILING_COMMAND_START,
+				      sizeof (cl_ulong), &start, NULL);
+      err |= clGetEventProfilingInfo (p->event, CL_PROFILING_COMMAND_END,
+				      sizeof (cl_ulong), &end, NULL);
+
+      // Device timestamps are moved to the host clock, taking the first
+      // command as enqueued when it was queued
+      if (err == CL_SUCCESS) {
+	if (!prof->clock_known) {
+	  prof->clock_offset = (int64_t) p->queued - (int64_t) queued;
+	  prof->clock_known = true;
 	}
+	profile_add (prof, kernel_phase (p->kernel), p->kernel,
+		     start + prof->clock_offset, end + prof->clock_offset);
       }
-#endif
 
-      if(k == KERNEL_SCAN && dev->prof_used[KERNEL_SCAN_DOWN_STEP])
-	clGetEventProfilingInfo(dev->prof_events[KERNEL_SCAN_DOWN_STEP], CL_PROFILING_COMMAND_END,
-				sizeof(cl_ulong), &end, NULL);
-      else
-	clGetEventProfilingInfo(dev->prof_events[k], CL_PROFILING_COMMAND_END,
-				sizeof(cl_ulong), &end, NULL);
+      clReleaseEvent (p->event);
+    }
+
+    prof->first_pending = (prof->first_pending + 1) % PROF_PENDING;
+    prof->nb_pending--;
+  }
+}
+
+static void profiling_print_histogram (const char *name, const prof_histogram_t *h)
+{
+  char line[512] = "";
+  int len = 0;
 
-      timeInMicroseconds = (end - start) * 1.0e-3f;
-      total_time += timeInMicroseconds;
+  sotl_log(PERF, "  %-20s %8lu calls %10.1f µs avg %10.1f min %10.1f max %12.1f total\n",
+	   name, h->count, h->total * 1.0e-3 / h->count, h->min * 1.0e-3,
+	   h->max * 1.0e-3, h->total * 1.0e-3);
 
-      sotl_log(PERF, "  Kernel <%s> performed in %f µs\n",
-	       kernel_name(k),
-	       timeInMicroseconds);
+  // Lower bound (µs) of each non empty bin
+  for (unsigned b = 0; b < PROF_BUCKETS && len < (int) sizeof (line) - 32; b++)
+    if (h->buckets[b])
+      len += sprintf (line + len, " %lu:%lu", b ? 1UL << (b - 1) : 0UL,
+		      h->buckets[b]);
+  sotl_log(PERF, "  %-20s  µs:calls%s\n", "", line);
+}
+
+void profiling_finalize (sotl_device_t *dev)
+{
+  struct sotl_profile *prof = profile_of (dev);
+  uint64_t total_time = 0;
+  bool any = false;
+
+  if (!prof)
+    return;
+
+  if (dev)
+    profiling_collect (dev, true);
+
+  for (unsigned p = 0; p < PROF_NB_PHASES; p++)
+    any |= prof->phases[p].count > 0;
+  if (!any)
+    return;
+
+  if (dev)
+    sotl_log(PERF, "Detailed performance report for device [%s]\n", dev->name);
+  else
+    sotl_log(PERF, "Detailed performance report for the host\n");
+
+  for (unsigned k = 0; k < KERNEL_TAB_SIZE; k++)
+    if (prof->kernels[k].count) {
+      sotl_log(PERF, "  Kernel <%s> performed %lu times in %.1f µs on average\n",
+	       kernel_name (k), prof->kernels[k].count,
+	       prof->kernels[k].total * 1.0e-3 / prof->kernels[k].count);
+      total_time += prof->kernels[k].total;
     }
+  if (total_time)
+    sotl_log(PERF, "  All kernels performed in %.1f µs\n", total_time * 1.0e-3);
+
+  for (unsigned p = 0; p < PROF_NB_PHASES; p++)
+    if (prof->phases[p].count)
+      profiling_print_histogram (phase_names[p], &prof->phases[p]);
+
+  if (dev && is_verlet_mode && dev->compute != SOTL_COMPUTE_OCL)
+    verlet_list_print_stats (&dev->verlet);
+}
+
+void profiling_release (sotl_device_t *dev)
+{
+  if (!dev->prof)
+    return;
+
+  profiling_collect (dev, true);
+  free (dev->prof->events);
+  free (dev->prof);
+  dev->prof = NULL;
+}
+
+void profiling_enable_trace (void)
+{
+  trace_enabled = true;
+}
+
+static void trace_write_string (FILE *f, const char *s)
+{
+  fputc ('"', f);
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\')
+      fprintf (f, "\\%c", *s);
+    else if ((unsigned char) *s >= ' ')
+      fputc (*s, f);
+  fputc ('"', f);
+}
+
+static void trace_write_track (FILE *f, const struct sotl_profile *prof,
+			       unsigned tid, const char *name, uint64_t origin,
+			       const char **sep)
+{
+  fprintf (f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %u, "
+	   "\"args\": {\"name\": ", *sep, tid);
+  trace_write_string (f, name);
+  fprintf (f, "}}");
+  *sep = ",\n";
+
+  for (unsigned long e = 0; e < prof->nb_events; e++) {
+    const prof_event_t *ev = &prof->events[e];
+
+    fprintf (f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, "
+	     "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+	     ev->kernel >= 0 ? kernel_name (ev->kernel) : phase_names[ev->phase],
+	     phase_names[ev->phase], tid, (ev->begin - origin) * 1.0e-3,
+	     (ev->end > ev->begin ? ev->end - ev->begin : 0) * 1.0e-3);
   }
 
-  sotl_log(PERF, "  All kernels performed in %f µs with %1.1lf Matoms/i/s\n", total_time,
-           (double)dev->atom_set.natoms / total_time);
+  if (prof->dropped)
+    sotl_log(WARNING, "Trace of %s lacks its last %lu phases\n", name, prof->dropped);
+}
+
+// Chrome trace-event format (JSON object with a traceEvents array): one
+// track per device after the host one, times in µs since the first phase
+//
+int profiling_write_trace (const char *filename)
+{
+  FILE *f = fopen (filename, "w");
+  const char *sep = "";
+  uint64_t origin = UINT64_MAX;
+  char name[256];
+
+  if (!f)
+    return -1;
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    profiling_collect (sotl_devices[d], true);
+
+  // Device tracks mix host phases with OpenCL commands read afterwards
+  for (unsigned d = 0; d <= sotl_nb_devices; d++) {
+    const struct sotl_profile *prof = profile_of (d ? sotl_devices[d - 1] : NULL);
+
+    for (unsigned long e = 0; prof && e < prof->nb_events; e++)
+      origin = MIN (origin, prof->events[e].begin);
+  }
+
+  fprintf (f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+  trace_write_track (f, &host_profile, 0, "host", origin, &sep);
+  for (unsigned d = 0; d < sotl_nb_devices; d++) {
+    if (!sotl_devices[d]->prof)
+      continue;
+
+    snprintf (name, sizeof (name), "Device %d [%s]", d, sotl_devices[d]->name);
+    trace_write_track (f, sotl_devices[d]->prof, d + 1, name, origin, &sep);
+  }
+
+  fprintf (f, "\n]}\n");
+
+  return fclose (f) ? -1 : 0;
 }
 
 #ifdef PROFILING
 
+uint64_t profiling_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t profiling_record (sotl_device_t *dev, unsigned phase, uint64_t begin)
+{
+  struct sotl_profile *prof = profile_of (dev);
+  const uint64_t end = profiling_now ();
+
+  if (prof)
+    profile_add (prof, phase, -1, begin, end);
+
+  return end;
+}
+
 cl_event *prof_event_ptr(sotl_device_t *dev, unsigned kernel_num)
 {
-  dev->prof_used[kernel_num] = true;
+  struct sotl_profile *prof = dev->prof;
+  prof_pending_t *p;
+
+  if (!prof)
+    return NULL;
+
+  // Read the commands already done, and wait for them when all slots
+  // are taken
+  if (prof->nb_pending >= PROF_PENDING / 2)
+    profiling_collect (dev, prof->nb_pending == PROF_PENDING);
+
+  p = &prof->pending[(prof->first_pending + prof->nb_pending) % PROF_PENDING];
+  p->event = NULL;
+  p->kernel = kernel_num;
+  p->queued = profiling_now ();
+  prof->nb_pending++;
 
-  return &dev->prof_events[kernel_num];
+  return &p->event;
 }
 
 #endif
@@ -1,9 +1,16 @@
 
+#include "cell.h"
 #include "default_defines.h"
 #include "global_definitions.h"
 #include "device.h"
+#include "integrator.h"
+#include "observables.h"
+#include "potential.h"
+#include "profiling.h"
 #include "seq.h"
+#include "simd.h"
 #include "sotl.h"
+#include "verlet.h"
 
 #ifdef HAVE_LIBGL
 #include "vbo.h"
@@ -11,85 +18,99 @@
 
 #include <stdio.h>
 
+// State of the sequential device: there is at most one of them (see
+// sotl_runtime_init())
+//
 static int *atom_state = NULL;
 
-#ifdef HAVE_LIBGL
+// Largest squared speed increment by forces and squared speed of the
+// current step (adaptive time step)
+static calc_t max_kick2 = 0.0, max_speed2 = 0.0;
+
+// Potential energy of the current step (sampled steps only)
+static double pair_energy = 0.0;
 
 #define SHOCK_PERIOD  50
 
-// Update OpenGL Vertex Buffer Object
+#ifdef HAVE_LIBGL
+
+// Update OpenGL Vertex Buffer Object for one atom
 //
-static void seq_update_vbo (sotl_device_t *dev)
+static inline void seq_update_vbo (sotl_atom_set_t *set, unsigned n)
 {
-  sotl_atom_set_t *set = &dev->atom_set;
-  sotl_domain_t *domain = &dev->domain;
+  vbo_vertex[n*3 + 0] = set->pos.x[n];
+  vbo_vertex[n*3 + 1] = set->pos.y[n];
+  vbo_vertex[n*3 + 2] = set->pos.z[n];
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    vbo_vertex[n*3 + 0] = set->pos.x[n];
-    vbo_vertex[n*3 + 1] = set->pos.y[n];
-    vbo_vertex[n*3 + 2] = set->pos.z[n];
-
-    // Atom color depends on z coordinate
-    {
-      float ratio = (atom_state[n]*1.0 / SHOCK_PERIOD); // (set->pos.z[n] - domain->min_ext[2]) / (domain->max_ext[2] - domain->min_ext[2]);
+  // Atom color depends on recent shocks
+  {
+    float ratio = (atom_state[n]*1.0 / SHOCK_PERIOD);
 
-      vbo_color[n*3 + 0] = (1.0 - ratio) * atom_color[0].R + ratio * 1.0;
-      vbo_color[n*3 + 1] = (1.0 - ratio) * atom_color[0].G + ratio * 0.0;
-      vbo_color[n*3 + 2] = (1.0 - ratio) * atom_color[0].B + ratio * 0.0;
-    }
+    vbo_color[n*3 + 0] = (1.0 - ratio) * atom_color[0].R + ratio * 1.0;
+    vbo_color[n*3 + 1] = (1.0 - ratio) * atom_color[0].G + ratio * 0.0;
+    vbo_color[n*3 + 2] = (1.0 - ratio) * atom_color[0].B + ratio * 0.0;
   }
 }
 #endif
 
-// Update positions of atoms by adding (dx, dy, dz)
+extern float normalized_vert[3];
+
+// Apply gravity, bounce on borders and update positions of atoms by
+// adding (dx, dy, dz) times the drift of the step, all in a single sweep
+// over the atoms (forces have already been added to speeds). The VBO is
+// only filled when this device is displayed. With multiple devices, atoms
+// bounce on the borders of the global domain, not on the z cuts of this
+// device.
 //
-static void seq_move (sotl_device_t *dev)
+static void seq_integrate (sotl_device_t *dev)
 {
   sotl_atom_set_t *set = &dev->atom_set;
+  sotl_domain_t *domain = get_global_domain ();
+  const sotl_step_t *step = integrator_get_step ();
+  const sotl_sampling_t *sampling = observables_get_sampling ();
+  const calc_t g = gravity_enabled ? 0.005 * step->kick : 0.0;
+  const calc_t gravity[3] = { normalized_vert[0] * g,
+			      normalized_vert[1] * g,
+			      normalized_vert[2] * g };
 
   for (unsigned n = 0; n < set->natoms; n++) {
-    if(atom_state[n] > 0)
-        atom_state[n]--;
-    set->pos.x[n] += set->speed.dx[n];
-    set->pos.y[n] += set->speed.dy[n];
-    set->pos.z[n] += set->speed.dz[n];
-  }
-}
+    calc_t s2 = 0.0, v[3];
 
-// Apply gravity force
-//
-extern float normalized_vert[3];
+    for (int i = 0; i < 3; i++) {
+      calc_t *pos = set->pos.x + i * set->offset + n;
+      calc_t *spd = set->speed.dx + i * set->offset + n;
+      calc_t p = *pos, s = *spd - gravity[i];
+
+      if (borders_enabled) {
+	if (p < domain->min_ext[i]) {
+	  p = domain->min_ext[i];
+	  s = -s;
+	  atom_state[n] = SHOCK_PERIOD;
+	}
+	if (p > domain->max_ext[i]) {
+	  p = domain->max_ext[i];
+	  s = -s;
+	  atom_state[n] = SHOCK_PERIOD;
+	}
+      }
 
-static void seq_gravity (sotl_device_t *dev)
-{
-  sotl_atom_set_t *set = &dev->atom_set;
-  const calc_t g = 0.005;
+      *pos = p + s * step->drift;
+      *spd = s;
+      s2 += s * s;
+      v[i] = s;
+    }
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    set->speed.dx[n] -= normalized_vert[0] * g;
-    set->speed.dy[n] -= normalized_vert[1] * g;
-    set->speed.dz[n] -= normalized_vert[2] * g;
-  }
-}
+    max_speed2 = MAX (max_speed2, s2);
+    if (sampling->speeds)
+      observables_add_atom (&dev->observables, v, sampling->bin_width);
 
-static void seq_bounce (sotl_device_t *dev)
-{
-  sotl_atom_set_t *set = &dev->atom_set;
-  sotl_domain_t *domain = &dev->domain;
+    if(atom_state[n] > 0)
+      atom_state[n]--;
 
-  for (unsigned n = 0; n < set->natoms; n++) {
-    for (int i = 0; i < 3; i++) {
-        if (set->pos.x[n + i * set->offset] < domain->min_ext[i]) {
-            set->pos.x[n + i * set->offset] = domain->min_ext[i];
-            set->speed.dx[n + i * set->offset] *= -1;
-            atom_state[n] = SHOCK_PERIOD;
-        }
-        if (set->pos.x[n + i * set->offset] > domain->max_ext[i]) {
-            set->pos.x[n + i * set->offset] = domain->max_ext[i];
-            set->speed.dx[n + i * set->offset] *= -1;
-            atom_state[n] = SHOCK_PERIOD;
-        }
-    }
+#ifdef HAVE_LIBGL
+    if (dev->display)
+      seq_update_vbo (set, n);
+#endif
   }
 }
 
@@ -105,78 +126,240 @@ static calc_t squared_distance (sotl_atom_set_t *set, unsigned p1, unsigned p2)
   return dx * dx + dy * dy + dz * dz;
 }
 
-static calc_t lennard_jones (calc_t r2)
+// Add the force on atom current to its speed, and half the energy of its
+// pairs to the potential energy (each pair is visited from both atoms)
+//
+static inline void seq_kick_atom (sotl_atom_set_t *set, unsigned current,
+				  const calc_t *force, calc_t energy)
 {
-  calc_t rr2 = 1.0 / r2;
-  calc_t r6;
-
-  r6 = LENNARD_SIGMA * LENNARD_SIGMA * rr2;
-  r6 = r6 * r6 * r6;
-
-  return 24 * LENNARD_EPSILON * rr2 * (2.0f * r6 * r6 - r6);
+  const calc_t f2 = force[0] * force[0] + force[1] * force[1] +
+    force[2] * force[2];
+
+  set->speed.dx[current] += force[0];
+  set->speed.dx[set->offset + current] += force[1];
+  set->speed.dx[set->offset * 2 + current] += force[2];
+  max_kick2 = MAX (max_kick2, f2);
+  pair_energy += 0.5 * energy;
 }
 
-static void seq_force (sotl_device_t *dev)
+// Forces are computed on atoms [first, last[ of set, the atoms of the
+// device among its ghosts (see seq_force)
+//
+static void seq_n2_force (sotl_atom_set_t *set, unsigned first, unsigned last)
 {
-  sotl_atom_set_t *set = &dev->atom_set;
+  const bool sample = observables_get_sampling ()->energy;
 
-  for (unsigned current = 0; current < set->natoms; current++) {
+  for (unsigned current = first; current < last; current++) {
     calc_t force[3] = { 0.0, 0.0, 0.0 };
+    calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+#ifdef XEON_VECTORIZATION
+    simd_force_range (set, current, 0, set->natoms, force, energy);
+#else
+    const sotl_potential_t *pot = get_potential ();
 
     for (unsigned other = 0; other < set->natoms; other++)
       if (current != other) {
       	calc_t sq_dist = squared_distance (set, current, other);
 
-      	if (sq_dist < LENNARD_SQUARED_CUTOFF) {
-      	  calc_t intensity = lennard_jones (sq_dist);
+      	if (sq_dist < pot->rc2) {
+      	  calc_t intensity = potential_force (pot, sq_dist);
 
       	  force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
       	  force[1] += intensity * (set->pos.x[set->offset + current] -
       				   set->pos.x[set->offset + other]);
       	  force[2] += intensity * (set->pos.x[set->offset * 2 + current] -
       				   set->pos.x[set->offset * 2 + other]);
+      	  if (energy)
+      	    *energy += potential_energy (pot, sq_dist);
       	}
 
       }
+#endif
+
+    seq_kick_atom (set, current, force, e);
+  }
+}
+
+// Linked-cell version: atoms are binned into the boxes of the domain,
+// then each atom only looks at atoms of the surrounding boxes
+//
+static void seq_box_force (sotl_device_t *dev, sotl_atom_set_t *set,
+			   unsigned first, unsigned last)
+{
+  sotl_cell_list_t *cells = &dev->cells;
+  sotl_cell_range_t ranges[CELL_MAX_ROWS];
+  const bool sample = observables_get_sampling ()->energy;
+  uint64_t t = profiling_now ();
+
+  cell_list_build (cells, &dev->domain, set, BOX_SIZE);
+  t = profiling_record (dev, PROF_SORT, t);
+
+  for (unsigned k = 0; k < cells->nboxes; k++) {
+    unsigned nb_ranges = cell_get_neighbours (cells, k, SUBCELL, ranges);
+
+    for (unsigned i = cells->box_start[k]; i < cells->box_start[k + 1]; i++) {
+      unsigned current = cells->atoms[i];
+      calc_t force[3] = { 0.0, 0.0, 0.0 };
+      calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+      if (current < first || current >= last)
+	continue;
+
+      for (unsigned r = 0; r < nb_ranges; r++) {
+#ifdef XEON_VECTORIZATION
+	simd_force_list (set, current, cells->atoms + ranges[r].begin,
+			 ranges[r].end - ranges[r].begin, force, energy);
+#else
+	const sotl_potential_t *pot = get_potential ();
+
+	for (unsigned j = ranges[r].begin; j < ranges[r].end; j++) {
+	  unsigned other = cells->atoms[j];
+
+	  if (current != other) {
+	    calc_t sq_dist = squared_distance (set, current, other);
+
+	    if (sq_dist < pot->rc2) {
+	      calc_t intensity = potential_force (pot, sq_dist);
+
+	      force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
+	      force[1] += intensity * (set->pos.y[current] - set->pos.y[other]);
+	      force[2] += intensity * (set->pos.z[current] - set->pos.z[other]);
+	      if (energy)
+		*energy += potential_energy (pot, sq_dist);
+	    }
+	  }
+	}
+#endif
+      }
 
-    set->speed.dx[current] += force[0];
-    set->speed.dx[set->offset + current] += force[1];
-    set->speed.dx[set->offset * 2 + current] += force[2];
+      seq_kick_atom (set, current, force, e);
+    }
+  }
+
+  profiling_record (dev, PROF_FORCE, t);
+}
+
+// Verlet version: each atom only looks at atoms of its neighbour list,
+// which is rebuilt when an atom moved more than half the skin distance
+//
+static void seq_verlet_force (sotl_device_t *dev, sotl_atom_set_t *set,
+			      unsigned first, unsigned last)
+{
+  sotl_verlet_list_t *list = &dev->verlet;
+  const calc_t skin = VERLET_SKIN_DISTANCE;
+  const bool sample = observables_get_sampling ()->energy;
+  uint64_t t = profiling_now ();
+
+  if (verlet_list_needs_update (list, set, skin)) {
+    // A Morton reordering waits for the lists to be rebuilt
+    if (dev->reorder_pending) {
+      atom_set_sort_morton (&dev->atom_set, &dev->domain);
+      dev->reorder_pending = false;
+    }
+    verlet_list_build (list, &dev->cells, &dev->domain, set, skin, false);
+  }
+  t = profiling_record (dev, PROF_SORT, t);
+
+  for (unsigned current = first; current < last; current++) {
+    calc_t force[3] = { 0.0, 0.0, 0.0 };
+    calc_t e = 0.0, *energy = sample ? &e : NULL;
+
+#ifdef XEON_VECTORIZATION
+    simd_force_list (set, current, list->neighbours + list->start[current],
+		     list->start[current + 1] - list->start[current], force,
+		     energy);
+#else
+    const sotl_potential_t *pot = get_potential ();
+
+    for (unsigned j = list->start[current]; j < list->start[current + 1]; j++) {
+      unsigned other = list->neighbours[j];
+      calc_t sq_dist = squared_distance (set, current, other);
+
+      if (sq_dist < pot->rc2) {
+	calc_t intensity = potential_force (pot, sq_dist);
+
+	force[0] += intensity * (set->pos.x[current] - set->pos.x[other]);
+	force[1] += intensity * (set->pos.y[current] - set->pos.y[other]);
+	force[2] += intensity * (set->pos.z[current] - set->pos.z[other]);
+	if (energy)
+	  *energy += potential_energy (pot, sq_dist);
+      }
+    }
+#endif
+
+    seq_kick_atom (set, current, force, e);
+  }
+
+  profiling_record (dev, PROF_FORCE, t);
+}
+
+// With multiple devices, atoms of this device also interact with ghosts,
+// the atoms of neighbour devices lying next to them in the global set
+//
+static void seq_force (sotl_device_t *dev)
+{
+  sotl_atom_set_t set;
+  const unsigned first = dev->atom_set.nghosts_min;
+  const unsigned last = first + dev->atom_set.natoms;
+
+  atom_set_with_ghosts (&dev->atom_set, &set);
+
+  if (is_verlet_mode)
+    seq_verlet_force (dev, &set, first, last);
+  else if (is_box_mode)
+    seq_box_force (dev, &set, first, last);
+  else {
+    uint64_t t = profiling_now ();
+
+    seq_n2_force (&set, first, last);
+    profiling_record (dev, PROF_FORCE, t);
   }
 }
 
 
 // Main simulation function
 //
-void seq_one_step_move (sotl_device_t *dev)
+// Force pass of a step
+//
+void seq_one_step_force (sotl_device_t *dev)
 {
+  max_kick2 = max_speed2 = 0.0;
+  pair_energy = 0.0;
 
-    printf("TEST\n");
-  // Apply gravity force
+  // Observables of a sampled step start with its force pass
   //
-  if (gravity_enabled)
-    seq_gravity (dev);
+  if (observables_get_sampling ()->energy)
+    observables_clear (&dev->observables);
 
   // Compute interactions between atoms
   //
   if (force_enabled)
     seq_force (dev);
+}
 
-  // Bounce on borders
-  //
-  if(borders_enabled)
-    seq_bounce (dev);
+// Move pass of a step, after seq_one_step_force
+//
+void seq_one_step_integrate (sotl_device_t *dev)
+{
+  uint64_t t;
 
-  // Update positions
+  // Apply gravity, bounce on borders, update positions (and OpenGL
+  // positions)
   //
-  seq_move (dev);
+  t = profiling_now ();
+  seq_integrate (dev);
+  profiling_record (dev, PROF_MOVE, t);
 
-#ifdef HAVE_LIBGL
-  // Update OpenGL position
-  //
-  if (dev->display)
-    seq_update_vbo (dev);
-#endif
+  dev->max_kick2 = max_kick2;
+  dev->max_speed2 = max_speed2;
+  dev->observables.potential += pair_energy;
+}
+
+void seq_one_step_move (sotl_device_t *dev)
+{
+  seq_one_step_force (dev);
+  seq_one_step_integrate (dev);
 }
 
 void seq_init (sotl_device_t *dev)
@@ -188,18 +371,32 @@ void seq_init (sotl_device_t *dev)
 
   borders_enabled = 1;
 
+#ifdef XEON_VECTORIZATION
+  simd_init ();
+#endif
+
   dev->compute = SOTL_COMPUTE_SEQ; // dummy op to avoid warning
 }
 
 void seq_alloc_buffers (sotl_device_t *dev)
 {
-  atom_state = calloc(dev->atom_set.natoms, sizeof(int));
+  // Indexed by atoms, whose number varies with multiple devices
+  atom_state = calloc(dev->atom_set.offset, sizeof(int));
   printf("natoms: %d\n", dev->atom_set.natoms);
+
+  if (cell_list_init (&dev->cells, dev->atom_set.offset) != SOTL_SUCCESS)
+    sotl_log(CRITICAL, "Failed to allocate the cell list\n");
+
+  if (verlet_list_init (&dev->verlet, dev->atom_set.offset) != SOTL_SUCCESS)
+    sotl_log(CRITICAL, "Failed to allocate Verlet lists\n");
 }
 
 void seq_finalize (sotl_device_t *dev)
 {
   free(atom_state);
+  atom_state = NULL;
+  cell_list_free (&dev->cells);
+  verlet_list_free (&dev->verlet);
 
   dev->compute = SOTL_COMPUTE_SEQ; // dummy op to avoid warning
 }
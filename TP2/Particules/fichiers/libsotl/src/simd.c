@@ -0,0 +1,556 @@
+#include "simd.h"
+#include "global_definitions.h"
+#include "potential.h"
+#include "sotl.h"
+
+#include <stdbool.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef void (*pair_range_fn)(const calc_t *x, const calc_t *y, const calc_t *z,
+                              const unsigned begin, const unsigned end,
+                              const calc_t *pos, const sotl_potential_t *pot,
+                              calc_t force[3]);
+
+typedef void (*pair_list_fn)(const calc_t *x, const calc_t *y, const calc_t *z,
+                             const unsigned *others, const unsigned n,
+                             const calc_t *pos, const sotl_potential_t *pot,
+                             calc_t force[3]);
+
+/*
+ * Portable version, vectorized by the compiler. Atoms out of the cutoff
+ * sphere (or current itself) read the first entry of the table and get no
+ * force, so that the loop has no branch.
+ */
+static void generic_force_range(const calc_t *x, const calc_t *y,
+                                const calc_t *z, const unsigned begin,
+                                const unsigned end, const calc_t *pos,
+                                const sotl_potential_t *pot, calc_t force[3])
+{
+    const calc_t *table = pot->table;
+    const calc_t rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz)
+    for (unsigned j = begin; j < end; j++) {
+        calc_t dx = pos[0] - x[j];
+        calc_t dy = pos[1] - y[j];
+        calc_t dz = pos[2] - z[j];
+        calc_t r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        calc_t s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        calc_t t = s - i;
+        calc_t f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+}
+
+static void generic_force_list(const calc_t *x, const calc_t *y,
+                               const calc_t *z, const unsigned *others,
+                               const unsigned n, const calc_t *pos,
+                               const sotl_potential_t *pot, calc_t force[3])
+{
+    const calc_t *table = pot->table;
+    const calc_t rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz)
+    for (unsigned j = 0; j < n; j++) {
+        calc_t dx = pos[0] - x[others[j]];
+        calc_t dy = pos[1] - y[others[j]];
+        calc_t dz = pos[2] - z[others[j]];
+        calc_t r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        calc_t s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        calc_t t = s - i;
+        calc_t f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+}
+
+/*
+ * Portable versions which also sum the energy of the pairs, from the
+ * energy table, for the steps where observables are sampled.
+ */
+static void energy_force_range(const calc_t *x, const calc_t *y,
+                               const calc_t *z, const unsigned begin,
+                               const unsigned end, const calc_t *pos,
+                               const sotl_potential_t *pot, calc_t force[3],
+                               calc_t *energy)
+{
+    const calc_t *table = pot->table, *etable = pot->etable;
+    const calc_t rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0, e = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz,e)
+    for (unsigned j = begin; j < end; j++) {
+        calc_t dx = pos[0] - x[j];
+        calc_t dy = pos[1] - y[j];
+        calc_t dz = pos[2] - z[j];
+        calc_t r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        calc_t s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        calc_t t = s - i;
+        calc_t f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+        e += in ? etable[i] + t * (etable[i + 1] - etable[i]) : 0;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+    *energy += e;
+}
+
+static void energy_force_list(const calc_t *x, const calc_t *y,
+                              const calc_t *z, const unsigned *others,
+                              const unsigned n, const calc_t *pos,
+                              const sotl_potential_t *pot, calc_t force[3],
+                              calc_t *energy)
+{
+    const calc_t *table = pot->table, *etable = pot->etable;
+    const calc_t rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0, e = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz,e)
+    for (unsigned j = 0; j < n; j++) {
+        calc_t dx = pos[0] - x[others[j]];
+        calc_t dy = pos[1] - y[others[j]];
+        calc_t dz = pos[2] - z[others[j]];
+        calc_t r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        calc_t s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        calc_t t = s - i;
+        calc_t f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+        e += in ? etable[i] + t * (etable[i + 1] - etable[i]) : 0;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+    *energy += e;
+}
+
+#if USE_DOUBLE == 1
+/*
+ * Mixed precision versions of the portable kernels: distances are rounded
+ * to float, so that the table lookup and the products run on twice as many
+ * lanes, and the forces are summed in double.
+ */
+static void mixed_force_range(const calc_t *x, const calc_t *y,
+                              const calc_t *z, const unsigned begin,
+                              const unsigned end, const calc_t *pos,
+                              const sotl_potential_t *pot, calc_t force[3])
+{
+    const float *table = pot->ftable;
+    const float rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz)
+    for (unsigned j = begin; j < end; j++) {
+        float dx = pos[0] - x[j];
+        float dy = pos[1] - y[j];
+        float dz = pos[2] - z[j];
+        float r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        float s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        float t = s - i;
+        float f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+}
+
+static void mixed_force_list(const calc_t *x, const calc_t *y,
+                             const calc_t *z, const unsigned *others,
+                             const unsigned n, const calc_t *pos,
+                             const sotl_potential_t *pot, calc_t force[3])
+{
+    const float *table = pot->ftable;
+    const float rc2 = pot->rc2, inv_step = pot->inv_step;
+    calc_t fx = 0, fy = 0, fz = 0;
+
+    #pragma omp simd reduction(+:fx,fy,fz)
+    for (unsigned j = 0; j < n; j++) {
+        float dx = pos[0] - x[others[j]];
+        float dy = pos[1] - y[others[j]];
+        float dz = pos[2] - z[others[j]];
+        float r2 = dx * dx + dy * dy + dz * dz;
+        bool in = (r2 > 0) & (r2 < rc2);
+        float s = in ? r2 * inv_step : 0;
+        int i = (int)s;
+        float t = s - i;
+        float f = in ? table[i] + t * (table[i + 1] - table[i]) : 0;
+
+        fx += f * dx;
+        fy += f * dy;
+        fz += f * dz;
+    }
+
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+}
+#endif /* USE_DOUBLE */
+
+#ifdef HAVE_X86_SIMD
+
+#if USE_DOUBLE == 0
+#define AVX2_WIDTH          8
+#define avx2_vec_t          __m256
+#define avx2_ivec_t         __m256i
+#define avx2_set1           _mm256_set1_ps
+#define avx2_setzero        _mm256_setzero_ps
+#define avx2_loadu          _mm256_loadu_ps
+#define avx2_loadi(i)       _mm256_loadu_si256((const __m256i *)(i))
+#define avx2_gather(b, i)   _mm256_i32gather_ps(b, i, 4)
+#define avx2_cvtt           _mm256_cvttps_epi32
+#define avx2_cvti           _mm256_cvtepi32_ps
+#define avx2_sub            _mm256_sub_ps
+#define avx2_mul            _mm256_mul_ps
+#define avx2_and            _mm256_and_ps
+#define avx2_cmp            _mm256_cmp_ps
+#define avx2_fmadd          _mm256_fmadd_ps
+
+#define AVX512_WIDTH        16
+#define avx512_vec_t        __m512
+#define avx512_ivec_t       __m512i
+#define avx512_mask_t       __mmask16
+#define avx512_set1         _mm512_set1_ps
+#define avx512_setzero      _mm512_setzero_ps
+#define avx512_loadu        _mm512_loadu_ps
+#define avx512_loadi(i)     _mm512_loadu_si512((const void *)(i))
+#define avx512_gather(b, i) _mm512_i32gather_ps(i, b, 4)
+#define avx512_cvtt         _mm512_cvttps_epi32
+#define avx512_cvti         _mm512_cvtepi32_ps
+#define avx512_mul          _mm512_mul_ps
+#define avx512_sub          _mm512_sub_ps
+#define avx512_fmadd        _mm512_fmadd_ps
+#define avx512_maskz_mul    _mm512_maskz_mul_ps
+#define avx512_maskz_fmadd  _mm512_maskz_fmadd_ps
+#define avx512_cmp_mask     _mm512_cmp_ps_mask
+#define avx512_reduce_add   _mm512_reduce_add_ps
+#else
+#define AVX2_WIDTH          4
+#define avx2_vec_t          __m256d
+#define avx2_ivec_t         __m128i
+#define avx2_set1           _mm256_set1_pd
+#define avx2_setzero        _mm256_setzero_pd
+#define avx2_loadu          _mm256_loadu_pd
+#define avx2_loadi(i)       _mm_loadu_si128((const __m128i *)(i))
+#define avx2_gather(b, i)   _mm256_i32gather_pd(b, i, 8)
+#define avx2_cvtt           _mm256_cvttpd_epi32
+#define avx2_cvti           _mm256_cvtepi32_pd
+#define avx2_sub            _mm256_sub_pd
+#define avx2_mul            _mm256_mul_pd
+#define avx2_and            _mm256_and_pd
+#define avx2_cmp            _mm256_cmp_pd
+#define avx2_fmadd          _mm256_fmadd_pd
+
+#define AVX512_WIDTH        8
+#define avx512_vec_t        __m512d
+#define avx512_ivec_t       __m256i
+#define avx512_mask_t       __mmask8
+#define avx512_set1         _mm512_set1_pd
+#define avx512_setzero      _mm512_setzero_pd
+#define avx512_loadu        _mm512_loadu_pd
+#define avx512_loadi(i)     _mm256_loadu_si256((const __m256i *)(i))
+#define avx512_gather(b, i) _mm512_i32gather_pd(i, b, 8)
+#define avx512_cvtt         _mm512_cvttpd_epi32
+#define avx512_cvti         _mm512_cvtepi32_pd
+#define avx512_mul          _mm512_mul_pd
+#define avx512_sub          _mm512_sub_pd
+#define avx512_fmadd        _mm512_fmadd_pd
+#define avx512_maskz_mul    _mm512_maskz_mul_pd
+#define avx512_maskz_fmadd  _mm512_maskz_fmadd_pd
+#define avx512_cmp_mask     _mm512_cmp_pd_mask
+#define avx512_reduce_add   _mm512_reduce_add_pd
+#endif
+
+#define AVX2_TARGET   __attribute__((target("avx2,fma")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+AVX2_TARGET
+static inline calc_t avx2_reduce_add(const avx2_vec_t v)
+{
+#if USE_DOUBLE == 0
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+#else
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+
+    s = _mm_hadd_pd(s, s);
+    return _mm_cvtsd_f64(s);
+#endif
+}
+
+/* Accumulate the forces of one vector of atoms. Lanes out of the cutoff
+ * sphere (or on current itself) read the first entry of the table and are
+ * masked out. */
+AVX2_TARGET
+static inline void avx2_pair_lanes(const avx2_vec_t dx, const avx2_vec_t dy,
+                                   const avx2_vec_t dz,
+                                   const sotl_potential_t *pot,
+                                   avx2_vec_t *fx, avx2_vec_t *fy,
+                                   avx2_vec_t *fz)
+{
+    avx2_vec_t r2, in, s, t, f0, f1, f;
+    avx2_ivec_t i;
+
+    r2 = avx2_fmadd(dz, dz, avx2_fmadd(dy, dy, avx2_mul(dx, dx)));
+    in = avx2_and(avx2_cmp(r2, avx2_setzero(), _CMP_GT_OQ),
+                  avx2_cmp(r2, avx2_set1(pot->rc2), _CMP_LT_OQ));
+
+    s = avx2_and(in, avx2_mul(r2, avx2_set1(pot->inv_step)));
+    i = avx2_cvtt(s);
+    t = avx2_sub(s, avx2_cvti(i));
+    f0 = avx2_gather(pot->table, i);
+    f1 = avx2_gather(pot->table + 1, i);
+    f = avx2_and(in, avx2_fmadd(t, avx2_sub(f1, f0), f0));
+
+    *fx = avx2_fmadd(f, dx, *fx);
+    *fy = avx2_fmadd(f, dy, *fy);
+    *fz = avx2_fmadd(f, dz, *fz);
+}
+
+AVX2_TARGET
+static void avx2_force_range(const calc_t *x, const calc_t *y,
+                             const calc_t *z, const unsigned begin,
+                             const unsigned end, const calc_t *pos,
+                             const sotl_potential_t *pot, calc_t force[3])
+{
+    const avx2_vec_t xi = avx2_set1(pos[0]), yi = avx2_set1(pos[1]),
+                     zi = avx2_set1(pos[2]);
+    avx2_vec_t fx = avx2_setzero(), fy = avx2_setzero(), fz = avx2_setzero();
+    unsigned j;
+
+    for (j = begin; j + AVX2_WIDTH <= end; j += AVX2_WIDTH)
+        avx2_pair_lanes(avx2_sub(xi, avx2_loadu(x + j)),
+                        avx2_sub(yi, avx2_loadu(y + j)),
+                        avx2_sub(zi, avx2_loadu(z + j)), pot, &fx, &fy, &fz);
+
+    force[0] += avx2_reduce_add(fx);
+    force[1] += avx2_reduce_add(fy);
+    force[2] += avx2_reduce_add(fz);
+
+    generic_force_range(x, y, z, j, end, pos, pot, force);
+}
+
+AVX2_TARGET
+static void avx2_force_list(const calc_t *x, const calc_t *y,
+                            const calc_t *z, const unsigned *others,
+                            const unsigned n, const calc_t *pos,
+                            const sotl_potential_t *pot, calc_t force[3])
+{
+    const avx2_vec_t xi = avx2_set1(pos[0]), yi = avx2_set1(pos[1]),
+                     zi = avx2_set1(pos[2]);
+    avx2_vec_t fx = avx2_setzero(), fy = avx2_setzero(), fz = avx2_setzero();
+    unsigned j;
+
+    for (j = 0; j + AVX2_WIDTH <= n; j += AVX2_WIDTH) {
+        avx2_ivec_t idx = avx2_loadi(others + j);
+
+        avx2_pair_lanes(avx2_sub(xi, avx2_gather(x, idx)),
+                        avx2_sub(yi, avx2_gather(y, idx)),
+                        avx2_sub(zi, avx2_gather(z, idx)), pot, &fx, &fy, &fz);
+    }
+
+    force[0] += avx2_reduce_add(fx);
+    force[1] += avx2_reduce_add(fy);
+    force[2] += avx2_reduce_add(fz);
+
+    generic_force_list(x, y, z, others + j, n - j, pos, pot, force);
+}
+
+AVX512_TARGET
+static inline void avx512_pair_lanes(const avx512_vec_t dx,
+                                     const avx512_vec_t dy,
+                                     const avx512_vec_t dz,
+                                     const sotl_potential_t *pot,
+                                     avx512_vec_t *fx, avx512_vec_t *fy,
+                                     avx512_vec_t *fz)
+{
+    avx512_vec_t r2, s, t, f0, f1, f;
+    avx512_ivec_t i;
+    avx512_mask_t in;
+
+    r2 = avx512_fmadd(dz, dz, avx512_fmadd(dy, dy, avx512_mul(dx, dx)));
+    in = avx512_cmp_mask(r2, avx512_setzero(), _CMP_GT_OQ) &
+         avx512_cmp_mask(r2, avx512_set1(pot->rc2), _CMP_LT_OQ);
+
+    s = avx512_maskz_mul(in, r2, avx512_set1(pot->inv_step));
+    i = avx512_cvtt(s);
+    t = avx512_sub(s, avx512_cvti(i));
+    f0 = avx512_gather(pot->table, i);
+    f1 = avx512_gather(pot->table + 1, i);
+    f = avx512_maskz_fmadd(in, t, avx512_sub(f1, f0), f0);
+
+    *fx = avx512_fmadd(f, dx, *fx);
+    *fy = avx512_fmadd(f, dy, *fy);
+    *fz = avx512_fmadd(f, dz, *fz);
+}
+
+AVX512_TARGET
+static void avx512_force_range(const calc_t *x, const calc_t *y,
+                               const calc_t *z, const unsigned begin,
+                               const unsigned end, const calc_t *pos,
+                               const sotl_potential_t *pot, calc_t force[3])
+{
+    const avx512_vec_t xi = avx512_set1(pos[0]), yi = avx512_set1(pos[1]),
+                       zi = avx512_set1(pos[2]);
+    avx512_vec_t fx = avx512_setzero(), fy = avx512_setzero(),
+                 fz = avx512_setzero();
+    unsigned j;
+
+    for (j = begin; j + AVX512_WIDTH <= end; j += AVX512_WIDTH)
+        avx512_pair_lanes(avx512_sub(xi, avx512_loadu(x + j)),
+                          avx512_sub(yi, avx512_loadu(y + j)),
+                          avx512_sub(zi, avx512_loadu(z + j)),
+                          pot, &fx, &fy, &fz);
+
+    force[0] += avx512_reduce_add(fx);
+    force[1] += avx512_reduce_add(fy);
+    force[2] += avx512_reduce_add(fz);
+
+    generic_force_range(x, y, z, j, end, pos, pot, force);
+}
+
+AVX512_TARGET
+static void avx512_force_list(const calc_t *x, const calc_t *y,
+                              const calc_t *z, const unsigned *others,
+                              const unsigned n, const calc_t *pos,
+                              const sotl_potential_t *pot, calc_t force[3])
+{
+    const avx512_vec_t xi = avx512_set1(pos[0]), yi = avx512_set1(pos[1]),
+                       zi = avx512_set1(pos[2]);
+    avx512_vec_t fx = avx512_setzero(), fy = avx512_setzero(),
+                 fz = avx512_setzero();
+    unsigned j;
+
+    for (j = 0; j + AVX512_WIDTH <= n; j += AVX512_WIDTH) {
+        avx512_ivec_t idx = avx512_loadi(others + j);
+
+        avx512_pair_lanes(avx512_sub(xi, avx512_gather(x, idx)),
+                          avx512_sub(yi, avx512_gather(y, idx)),
+                          avx512_sub(zi, avx512_gather(z, idx)),
+                          pot, &fx, &fy, &fz);
+    }
+
+    force[0] += avx512_reduce_add(fx);
+    force[1] += avx512_reduce_add(fy);
+    force[2] += avx512_reduce_add(fz);
+
+    generic_force_list(x, y, z, others + j, n - j, pos, pot, force);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static pair_range_fn force_range = generic_force_range;
+static pair_list_fn force_list = generic_force_list;
+static const char *kernels_name = "generic (omp simd)";
+
+/* Fastest kernels supported by the host CPU. */
+static void select_cpu_kernels(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) {
+        force_range = avx512_force_range;
+        force_list = avx512_force_list;
+        kernels_name = "AVX-512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        force_range = avx2_force_range;
+        force_list = avx2_force_list;
+        kernels_name = "AVX2";
+    }
+#endif
+}
+
+void simd_init(void)
+{
+#if USE_DOUBLE == 1
+    if (get_potential()->mixed) {
+        force_range = mixed_force_range;
+        force_list = mixed_force_list;
+        kernels_name = "mixed precision (omp simd)";
+    } else
+#endif
+        select_cpu_kernels();
+
+    if (sotl_verbose)
+        sotl_log(INFO, "Using %s force kernels\n", kernels_name);
+}
+
+const char *simd_name(void)
+{
+    return kernels_name;
+}
+
+void simd_force_range(const sotl_atom_set_t *set, const unsigned current,
+                      const unsigned begin, const unsigned end,
+                      calc_t force[3], calc_t *energy)
+{
+    const calc_t pos[3] = { set->pos.x[current], set->pos.y[current],
+                            set->pos.z[current] };
+
+    if (energy)
+        energy_force_range(set->pos.x, set->pos.y, set->pos.z, begin, end,
+                           pos, get_potential(), force, energy);
+    else
+        force_range(set->pos.x, set->pos.y, set->pos.z, begin, end, pos,
+                    get_potential(), force);
+}
+
+void simd_force_list(const sotl_atom_set_t *set, const unsigned current,
+                     const unsigned *others, const unsigned n,
+                     calc_t force[3], calc_t *energy)
+{
+    const calc_t pos[3] = { set->pos.x[current], set->pos.y[current],
+                            set->pos.z[current] };
+
+    if (energy)
+        energy_force_list(set->pos.x, set->pos.y, set->pos.z, others, n,
+                          pos, get_potential(), force, energy);
+    else
+        force_list(set->pos.x, set->pos.y, set->pos.z, others, n, pos,
+                   get_potential(), force);
+}
@@ -0,0 +1,245 @@
+#define _XOPEN_SOURCE 600
+
+#include "snapshot.h"
+#include "sotl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Size of the arrays following the header. */
+static size_t snapshot_data_size(const sotl_snapshot_header_t *header)
+{
+    return (size_t)header->offset *
+           (6 * header->precision + sizeof(uint32_t));
+}
+
+static int snapshot_read_header_fd(int fd, sotl_snapshot_header_t *header)
+{
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+        return SOTL_INVALID_VALUE;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)))
+        return SOTL_INVALID_VALUE;
+
+    if (header->version != SNAPSHOT_VERSION) {
+        sotl_log(ERROR, "Unsupported snapshot version %u\n", header->version);
+        return SOTL_INVALID_VALUE;
+    }
+
+    if ((header->precision != sizeof(float) &&
+         header->precision != sizeof(double)) ||
+        header->offset < header->natoms)
+        return SOTL_INVALID_VALUE;
+
+    return SOTL_SUCCESS;
+}
+
+int snapshot_read_header(const char *filename, sotl_snapshot_header_t *header)
+{
+    int fd, ret;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return -errno;
+
+    ret = snapshot_read_header_fd(fd, header);
+    close(fd);
+    return ret;
+}
+
+bool snapshot_probe(const char *filename)
+{
+    char magic[sizeof(((sotl_snapshot_header_t *)0)->magic)];
+    bool found = false;
+    FILE *f;
+
+    if (!(f = fopen(filename, "r")))
+        return false;
+
+    if (fread(magic, sizeof(magic), 1, f) == 1)
+        found = !memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic));
+
+    fclose(f);
+    return found;
+}
+
+/* Write n values of size bytes, then zeros up to offset values. */
+static int snapshot_write_array(FILE *f, const void *values, const size_t size,
+                                const unsigned n, const unsigned offset)
+{
+    static const double zeros[ALIGN];
+
+    if (fwrite(values, size, n, f) != n)
+        return -1;
+
+    for (unsigned i = n; i < offset; i += ALIGN) {
+        unsigned count = MIN(offset - i, ALIGN);
+
+        if (fwrite(zeros, size, count, f) != count)
+            return -1;
+    }
+
+    return 0;
+}
+
+int snapshot_write(const char *filename, const sotl_domain_t *dom,
+                   const sotl_atom_set_t *set)
+{
+    const calc_t *arrays[6] = { set->pos.x, set->pos.y, set->pos.z,
+                                set->speed.dx, set->speed.dy, set->speed.dz };
+    char header_block[SNAPSHOT_HEADER_SIZE] = { 0 };
+    sotl_snapshot_header_t *header = (sotl_snapshot_header_t *)header_block;
+    int ret = 0;
+    FILE *f;
+
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version   = SNAPSHOT_VERSION;
+    header->precision = sizeof(calc_t);
+    header->natoms    = set->natoms;
+    header->offset    = ROUND(set->natoms);
+    for (int i = 0; i < 3; i++) {
+        header->min_ext[i] = dom->min_range[i];
+        header->max_ext[i] = dom->max_range[i];
+    }
+
+    if (!(f = fopen(filename, "w")))
+        return -errno;
+
+    if (fwrite(header_block, sizeof(header_block), 1, f) != 1)
+        ret = -1;
+
+    for (int a = 0; a < 6 && !ret; a++)
+        ret = snapshot_write_array(f, arrays[a], sizeof(calc_t), set->natoms,
+                                   header->offset);
+
+    if (!ret)
+        ret = snapshot_write_array(f, set->id, sizeof(uint32_t), set->natoms,
+                                   header->offset);
+
+    if (ret < 0)
+        ret = -errno;
+    if (fclose(f) < 0 && !ret)
+        ret = -errno;
+
+    return ret;
+}
+/* Ids index the atoms of output files: they must be a permutation of
+ * [0, natoms). */
+static int snapshot_check_ids(const uint32_t *ids, const unsigned n)
+{
+    unsigned char *seen = calloc(n ? n : 1, 1);
+    int ret = SOTL_SUCCESS;
+
+    if (!seen)
+        return SOTL_OUT_OF_MEMORY;
+
+    for (unsigned i = 0; i < n; i++) {
+        if (ids[i] >= n || seen[ids[i]]) {
+            ret = SOTL_INVALID_VALUE;
+            break;
+        }
+        seen[ids[i]] = 1;
+    }
+
+    free(seen);
+    return ret;
+}
+
+/* Copy the arrays of a snapshot that can not be used in place (written
+ * with the other precision, or by a build with a different ALIGN). */
+static int snapshot_convert(const sotl_snapshot_header_t *header,
+                            const char *base, sotl_atom_set_t *set)
+{
+    const unsigned n = header->natoms, offset = header->offset;
+    int ret;
+
+    ret = atom_set_init(set, n, n);
+    if (ret < 0)
+        return ret;
+
+    for (int a = 0; a < 6; a++) {
+        calc_t *dst = (a < 3 ? set->pos.x : set->speed.dx) +
+                      (a % 3) * set->offset;
+
+        if (header->precision == sizeof(float)) {
+            const float *src = (const float *)base + (size_t)a * offset;
+
+            for (unsigned i = 0; i < n; i++)
+                dst[i] = src[i];
+        } else {
+            const double *src = (const double *)base + (size_t)a * offset;
+
+            for (unsigned i = 0; i < n; i++)
+                dst[i] = src[i];
+        }
+    }
+
+    memcpy(set->id, base + (size_t)6 * offset * header->precision,
+           n * sizeof(unsigned));
+    set->current = n;
+
+    return SOTL_SUCCESS;
+}
+
+int snapshot_load(const char *filename, sotl_atom_set_t *set)
+{
+    sotl_snapshot_header_t header;
+    struct stat st;
+    void *map;
+    int fd, ret;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return -errno;
+
+    ret = snapshot_read_header_fd(fd, &header);
+    if (ret < 0)
+        goto out;
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    if ((size_t)st.st_size < SNAPSHOT_HEADER_SIZE + snapshot_data_size(&header)) {
+        sotl_log(ERROR, "Snapshot \"%s\" is truncated\n", filename);
+        ret = SOTL_INVALID_VALUE;
+        goto out;
+    }
+
+    /* Private mapping: the simulation updates atoms in place, pages are
+     * only copied when they are written. */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        goto out;
+    }
+
+    ret = snapshot_check_ids((const uint32_t *)((char *)map + SNAPSHOT_HEADER_SIZE +
+                                                (size_t)6 * header.offset *
+                                                header.precision),
+                             header.natoms);
+    if (ret < 0) {
+        if (ret == SOTL_INVALID_VALUE)
+            sotl_log(ERROR, "Snapshot \"%s\" has invalid atom ids\n", filename);
+        munmap(map, st.st_size);
+        goto out;
+    }
+
+    if (header.precision == sizeof(calc_t) && header.offset % ALIGN == 0) {
+        atom_set_init_mapped(set, header.natoms, header.offset,
+                             (char *)map + SNAPSHOT_HEADER_SIZE, map,
+                             st.st_size);
+    } else {
+        ret = snapshot_convert(&header, (char *)map + SNAPSHOT_HEADER_SIZE, set);
+        munmap(map, st.st_size);
+    }
+
+out:
+    close(fd);
+    return ret;
+}
@@ -14,12 +14,18 @@
 #include "domain.h"
 #include "sotl.h"
 #include "atom.h"
+#include "conf.h"
 #include "default_defines.h"
 #include "global_definitions.h"
 #include "device.h"
+#include "integrator.h"
+#include "observables.h"
 #include "ocl.h"
 #include "ocl_kernels.h"
+#include "potential.h"
 #include "seq.h"
+#include "snapshot.h"
+#include "trajectory.h"
 
 #ifdef HAVE_OMP
 #include "openmp.h"
@@ -58,6 +64,40 @@ static int opengl_device = -1;
 
 static bool no_device_selected = true;
 
+/* Devices own the atoms once the runtime is initialized. */
+static bool runtime_initialized = false;
+
+/* Dump a snapshot instead of a text file at the end. */
+static bool binary_dump = false;
+
+/* Trajectory output (disabled when period is 0). */
+static const char *trajectory_file = NULL;
+static unsigned trajectory_period = 0;
+static unsigned trajectory_policy = SOTL_TRAJECTORY_BLOCK;
+
+/* Iterations run before sotl_main_loop() starts timing. */
+static unsigned warmup_iter = 0;
+
+/* Benchmark mode: wall time of each phase of timed iterations. */
+static bool benchmark = false;
+static sotl_timings_t timings;
+
+/* Sampling of observables (disabled when period is 0). */
+static const char *observables_file = NULL;
+static unsigned observables_period = 0;
+
+/* Chrome trace of the phases of each device (disabled when NULL). */
+static const char *trace_file = NULL;
+
+/* Rebalancing of z cuts between devices (disabled when period is 0). */
+#define REBALANCE_TOLERANCE 0.05    /* Imbalance of step times left alone */
+
+static unsigned rebalance_period = 0;
+static cl_event step_markers[MAX_DEVICES][2];   /* OpenCL step (begin, end) */
+static struct timeval step_start[MAX_DEVICES];  /* CPU step */
+static unsigned long device_busy[MAX_DEVICES];  /* µs since last rebalancing */
+static unsigned long device_work[MAX_DEVICES];  /* atoms moved since then */
+
 static sotl_params_t params;
 
 sotl_params_t *get_params()
@@ -209,27 +249,31 @@ static void sotl_discover_devices()
     }
   }
 
-  // If no OpenCL CPU device was found, create a fake one to enable sequential/OpenMP mode
+  // If no OpenCL CPU device was found, create fake ones to enable
+  // sequential/OpenMP mode: one for each host backend, so that both can be
+  // used together
   //
   if (no_cpu_device) {
     unsigned p = nb_ocl_pfs++;
-    unsigned d = nb_ocl_devs++;
 
     all_platforms[p].vendor = str_malloc ("Fake Vendor");
     all_platforms[p].name = str_malloc ("Fake Platform");
     all_platforms[p].selected = false;
 
-    first_dev[p] = d;
-    last_dev[p] = d;
-
-    all_devices[d].platform = &all_platforms[p];
-    all_devices[d].selected = false;
-    all_devices[d].display = false;
-    all_devices[d].mem_allocated = 0;
-    all_devices[d].name = str_malloc ("Fake CPU Device");
-    all_devices[d].type = CL_DEVICE_TYPE_CPU;
-    all_devices[d].max_workgroup_size = 0;
-    all_devices[d].mem_size = 0;
+    first_dev[p] = nb_ocl_devs;
+    last_dev[p] = nb_ocl_devs + 1;
+
+    for (unsigned d = first_dev[p]; d <= last_dev[p]; d++) {
+      all_devices[d].platform = &all_platforms[p];
+      all_devices[d].selected = false;
+      all_devices[d].display = false;
+      all_devices[d].mem_allocated = 0;
+      all_devices[d].name = str_malloc ("Fake CPU Device");
+      all_devices[d].type = CL_DEVICE_TYPE_CPU;
+      all_devices[d].max_workgroup_size = 0;
+      all_devices[d].mem_size = 0;
+    }
+    nb_ocl_devs += 2;
   }
 }
 
@@ -421,27 +465,84 @@ static void sotl_fix_device_list (void)
 
 }
 
-int sotl_domain_init(const double *xrange, const double *yrange,
-                     const double *zrange, const double *cellbox,
-                     const unsigned natoms)
+static int sotl_global_domain_init(const double x_min, const double y_min,
+                                   const double z_min, const double x_max,
+                                   const double y_max, const double z_max)
 {
-    if (xrange[1] <= xrange[0] || yrange[1] <= yrange[0] || zrange[1] <= zrange[0])
+    if (x_max <= x_min || y_max <= y_min || z_max <= z_min)
         return SOTL_INVALID_VALUE;
 
-    domain_init(get_global_domain(), xrange[0], yrange[0], zrange[0],
-                xrange[1], yrange[1], zrange[1]);
+    domain_init(get_global_domain(), x_min, y_min, z_min, x_max, y_max, z_max);
 
     if (sotl_verbose)
         domain_print(get_global_domain());
 
     sotl_fix_device_list ();
 
+    return SOTL_SUCCESS;
+}
+
+int sotl_domain_init(const double *xrange, const double *yrange,
+                     const double *zrange, const double *cellbox,
+                     const unsigned natoms)
+{
+    int ret;
+
+    ret = sotl_global_domain_init(xrange[0], yrange[0], zrange[0],
+                                  xrange[1], yrange[1], zrange[1]);
+    if (ret < 0)
+        return ret;
+
     atom_set_init (get_global_atom_set(), natoms, natoms);
 
     (void)cellbox;
     return SOTL_SUCCESS;
 }
 
+int sotl_load_snapshot(const char *filename)
+{
+    sotl_snapshot_header_t header;
+    int ret;
+
+    ret = snapshot_read_header(filename, &header);
+    if (ret < 0)
+        return ret;
+
+    ret = sotl_global_domain_init(header.min_ext[0], header.min_ext[1],
+                                  header.min_ext[2], header.max_ext[0],
+                                  header.max_ext[1], header.max_ext[2]);
+    if (ret < 0)
+        return ret;
+
+    return snapshot_load(filename, get_global_atom_set());
+}
+
+int sotl_load_conf(const char *filename)
+{
+    sotl_conf_file_t conf;
+    int ret;
+
+    ret = conf_open(&conf, filename);
+    if (ret < 0)
+        return ret;
+
+    ret = sotl_global_domain_init(conf.min_ext[0], conf.min_ext[1],
+                                  conf.min_ext[2], conf.max_ext[0],
+                                  conf.max_ext[1], conf.max_ext[2]);
+    if (ret == SOTL_SUCCESS)
+        ret = atom_set_init(get_global_atom_set(), conf.natoms, conf.natoms);
+    if (ret == SOTL_SUCCESS)
+        ret = conf_read_atoms(&conf, get_global_atom_set());
+
+    conf_close(&conf);
+    return ret;
+}
+
+int sotl_is_snapshot(const char *filename)
+{
+    return snapshot_probe(filename);
+}
+
 int sotl_set_parameter(const unsigned int name, const void *value)
 {
     switch (name) {
@@ -449,6 +550,24 @@ int sotl_set_parameter(const unsigned int name, const void *value)
         case MD_DELTA_T:
             params.md.delta_t = *(double *)value;
             break;
+        case MD_RESPA_STEPS:
+            if (*(unsigned *)value == 0)
+                return SOTL_INVALID_VALUE;
+            params.md.respa_steps = *(unsigned *)value;
+            break;
+        case MD_RESPA_CUTOFF:
+            params.md.respa_cutoff = *(double *)value;
+            break;
+        case MD_ADAPTIVE_DISPLACEMENT:
+            if (*(double *)value < 0.0)
+                return SOTL_INVALID_VALUE;
+            params.md.adaptive_displacement = *(double *)value;
+            break;
+        case MD_DELTA_T_MAX:
+            if (*(double *)value <= 0.0)
+                return SOTL_INVALID_VALUE;
+            params.md.delta_t_max = *(double *)value;
+            break;
         /* Lennard Jones. */
         case LJ_SIGMA:
             params.lj.sigma = *(double *)value;
@@ -459,11 +578,31 @@ int sotl_set_parameter(const unsigned int name, const void *value)
         case LJ_RCUT:
             params.lj.rcut = *(double *)value;
             break;
+        /* Verlet lists. */
+        case VERLET_SKIN:
+            params.verlet.skin = *(double *)value;
+            break;
+        /* Pair potential. */
+        case POTENTIAL_TYPE:
+            if (*(unsigned *)value > SOTL_POTENTIAL_SOFT_SPHERE)
+                return SOTL_INVALID_VALUE;
+            params.potential.type = *(unsigned *)value;
+            break;
+        case MORSE_ALPHA:
+            params.potential.morse_alpha = *(double *)value;
+            break;
         default:
             return SOTL_INVALID_PARAMETER;
             break;
     }
 
+    /* The force table depends on all parameters but the time steps (which
+     * are applied by integrator_init). */
+    if (name != MD_DELTA_T && name != MD_RESPA_STEPS &&
+        name != MD_RESPA_CUTOFF && name != MD_ADAPTIVE_DISPLACEMENT &&
+        name != MD_DELTA_T_MAX && name != VERLET_SKIN)
+        potential_update();
+
     return SOTL_SUCCESS;
 }
 
@@ -476,6 +615,18 @@ const void *sotl_get_parameter(const unsigned int name)
         case MD_DELTA_T:
             value = (void *)&params.md.delta_t;
             break;
+        case MD_RESPA_STEPS:
+            value = (void *)&params.md.respa_steps;
+            break;
+        case MD_RESPA_CUTOFF:
+            value = (void *)&params.md.respa_cutoff;
+            break;
+        case MD_ADAPTIVE_DISPLACEMENT:
+            value = (void *)&params.md.adaptive_displacement;
+            break;
+        case MD_DELTA_T_MAX:
+            value = (void *)&params.md.delta_t_max;
+            break;
         /* Lennard Jones. */
         case LJ_SIGMA:
             value = (void *)&params.lj.sigma;
@@ -486,6 +637,17 @@ const void *sotl_get_parameter(const unsigned int name)
         case LJ_RCUT:
             value = (void *)&params.lj.rcut;
             break;
+        /* Verlet lists. */
+        case VERLET_SKIN:
+            value = (void *)&params.verlet.skin;
+            break;
+        /* Pair potential. */
+        case POTENTIAL_TYPE:
+            value = (void *)&params.potential.type;
+            break;
+        case MORSE_ALPHA:
+            value = (void *)&params.potential.morse_alpha;
+            break;
         default:
             break;
     }
@@ -509,31 +671,37 @@ int sotl_sync_all_atoms(unsigned *ids, calc_t *pos_x, calc_t *pos_y,
     if (total_natoms != natoms)
         return SOTL_INVALID_VALUE;
 
-    /* Read back atom positions and speeds. */
+    /* Read back atom positions and speeds (host devices compute in their
+     * atom set). */
     offset = 0;
     for (d = 0; d < sotl_nb_devices; d++) {
         sotl_device_t *dev = sotl_devices[d];
-        device_read_back_pos(dev, pos_x + offset, pos_y + offset,
-                             pos_z + offset);
-        device_read_back_spd(dev, spd_x + offset, spd_y + offset,
-                             spd_z + offset);
-        offset += dev->atom_set.natoms;
+        const sotl_atom_set_t *set = &dev->atom_set;
+        const size_t cb = set->natoms * sizeof(calc_t);
+
+        if (dev->compute == SOTL_COMPUTE_OCL) {
+            device_read_back_pos(dev, pos_x + offset, pos_y + offset,
+                                 pos_z + offset);
+            device_read_back_spd(dev, spd_x + offset, spd_y + offset,
+                                 spd_z + offset);
+            if (ids)
+                device_read_back_ids(dev, ids + offset);
+        } else {
+            memcpy(pos_x + offset, set->pos.x, cb);
+            memcpy(pos_y + offset, set->pos.y, cb);
+            memcpy(pos_z + offset, set->pos.z, cb);
+            memcpy(spd_x + offset, set->speed.dx, cb);
+            memcpy(spd_y + offset, set->speed.dy, cb);
+            memcpy(spd_z + offset, set->speed.dz, cb);
+            if (ids)
+                memcpy(ids + offset, set->id, set->natoms * sizeof(unsigned));
+        }
+        offset += set->natoms;
     }
 
-    (void)ids; /* XXX */
     return SOTL_SUCCESS;
 }
 
-int sotl_push_pos_1()
-{
-    return SOTL_NOT_IMPLEMENTED;
-}
-
-int sotl_push_pos_2()
-{
-    return SOTL_NOT_IMPLEMENTED;
-}
-
 int sotl_compute_force()
 {
     return SOTL_NOT_IMPLEMENTED;
@@ -581,6 +749,42 @@ void sotl_add_random_atom()
     sotl_add_atom(x, y, z, dx, dy, dz);
 }
 
+/* Periodic images are built by the box pipelines of the OpenMP and OpenCL
+ * backends (without cluster pairs), on a single device. */
+static bool sotl_torus_supported(void)
+{
+    const sotl_domain_t *dom = get_global_domain();
+
+    if (!is_box_mode || is_verlet_mode || is_half_pair_mode || is_numa_mode) {
+        sotl_log(WARNING, "Torus mode requires the box mode, without Verlet "
+                 "lists, half pairs nor NUMA mode.\n");
+        return false;
+    }
+
+    if (sotl_nb_devices != 1 || sotl_devices[0]->compute == SOTL_COMPUTE_SEQ) {
+        sotl_log(WARNING, "Torus mode requires a single OpenMP or OpenCL "
+                 "device.\n");
+        return false;
+    }
+
+    if (is_cluster_mode && sotl_devices[0]->compute == SOTL_COMPUTE_OCL) {
+        sotl_log(WARNING, "Torus mode requires the box kernel, without "
+                 "cluster pairs.\n");
+        return false;
+    }
+
+    /* Images of the first and last layers of boxes must not overlap. */
+    for (int i = 0; i < 3; i++) {
+        if (dom->max_range[i] - dom->min_range[i] < 2 * SUBCELL * BOX_SIZE) {
+            sotl_log(WARNING, "Torus mode requires a domain of at least "
+                     "%d boxes along each axis.\n", 2 * SUBCELL);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int sotl_runtime_init()
 {
     int ret = 0;
@@ -588,12 +792,67 @@ int sotl_runtime_init()
     if (sotl_verbose)
         sotl_list_devices();
 
+  if (is_mixed_precision) {
+#if USE_DOUBLE == 1
+    // Must be known before OpenCL programs are built
+    potential_set_mixed (true);
+#else
+    // Forces are already evaluated in float
+    sotl_log(WARNING, "Mixed precision requires a double precision "
+	     "build: ignored.\n");
+    is_mixed_precision = false;
+#endif
+  }
+
+  // Host backends keep their state in static variables
+  //
+  unsigned nb_compute[SOTL_COMPUTE_OMP + 1] = { 0 };
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    nb_compute[sotl_devices[d]->compute]++;
+
+  if (nb_compute[SOTL_COMPUTE_SEQ] > 1 || nb_compute[SOTL_COMPUTE_OMP] > 1) {
+    sotl_log(ERROR, "At most one sequential and one OpenMP device can "
+	     "be used.\n");
+    return SOTL_INVALID_DEVICE;
+  }
+
+  integrator_init ();
+
+  // Atoms exchanged between devices are renumbered at every step, so that
+  // neighbour lists would be rebuilt at every step
+  //
+  if (is_verlet_mode && sotl_have_multi()) {
+    sotl_log(WARNING, "Verlet lists are disabled with multiple "
+	     "devices.\n");
+    is_verlet_mode = false;
+  }
+
+  // Before devices allocate their buffers of partial sums
+  //
+  if (observables_period && observables_init (observables_file) < 0) {
+    sotl_log(ERROR, "Failed to open observables file \"%s\"\n",
+	     observables_file);
+    observables_period = 0;
+  }
+
 #ifdef HAVE_LIBGL
   if (sotl_display)
     window_opengl_init (DISPLAY_XSIZE, DISPLAY_YSIZE,
 			get_global_domain()->min_ext, get_global_domain()->max_ext, 1);
 #endif
 
+  if (is_torus_mode && !sotl_torus_supported()) {
+    sotl_log(WARNING, "Torus mode is disabled.\n");
+    is_torus_mode = false;
+  }
+
+  // The period is the extent of the domain given at init. OpenCL programs
+  // are built with the boxes of the period
+  //
+  if (is_torus_mode)
+    domain_make_periodic (get_global_domain ());
+
   // Initialize OpenCL resources associated to device
   //
   for(unsigned d = 0; d < sotl_nb_devices; d++) {
@@ -625,11 +884,24 @@ int sotl_runtime_init()
     sotl_log(DEBUG, "Done.\n");
   }
 
-  if(sotl_verbose)
+  if(sotl_verbose) {
     sotl_log(INFO, "Total #atoms: %d\n", get_global_atom_set()->natoms);
+    sotl_log(INFO, "Using a tabulated %s potential (%d entries)\n",
+	     potential_name(get_potential()->type), POTENTIAL_TABLE_SIZE);
+  }
 
-  if(sotl_have_multi()) {
-    sotl_log(WARNING, "Multiple devices is NOT really supported.\n");
+  if (rebalance_period && !sotl_have_multi()) {
+    /* Nothing to balance with a single device. */
+    rebalance_period = 0;
+  }
+
+  if (reorder_period) {
+    if (sotl_have_multi()) {
+      /* Devices own z slabs of the global set, which must stay sorted. */
+      sotl_log(WARNING, "Morton reordering is disabled with multiple devices.\n");
+      reorder_period = 0;
+    } else
+      atom_set_sort_morton(get_global_atom_set(), get_global_domain());
   }
 
 #ifdef HAVE_LIBGL
@@ -690,26 +962,478 @@ int sotl_runtime_init()
   // Sphere mode because change_skin needs to rebuild everything
   // from main memory). Also, it is not possible in Dump mode,
   // because sotl uses the global buffer to get back positions and
-  // dump them on disk
-  if (!sotl_dump) {
-    for (unsigned d = 0; d < sotl_nb_devices; d++) {
-      if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL) {
-        /* Memory allocated by the global atom set on the CPU
-         * may be used by other versions like sequential or OpenMP. */
-        break;
-      }
+  // dump them on disk. Neither when atoms are periodically
+  // reordered on the host, nor with multiple devices, which exchange
+  // atoms through the global set, nor in torus mode, where OpenCL
+  // buffers enlarged for periodic images are refilled from it.
+  if (!sotl_dump && !reorder_period && !sotl_have_multi() && !is_torus_mode) {
+    bool host_device = false;
+
+    /* Memory allocated by the global atom set on the CPU
+     * may be used by other versions like sequential or OpenMP. */
+    for (unsigned d = 0; d < sotl_nb_devices; d++)
+      if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL)
+        host_device = true;
+
+    if (!host_device)
       atom_set_free(get_global_atom_set());
-    }
   }
 #endif
 
+    if (trajectory_period) {
+      int err = trajectory_open (trajectory_file,
+				 get_global_atom_set()->natoms,
+				 trajectory_policy);
+      if (err < 0) {
+	sotl_log(ERROR, "Failed to open trajectory file \"%s\"\n",
+		 trajectory_file);
+	trajectory_period = 0;
+      }
+    }
+
+    for (unsigned d = 0; d < sotl_nb_devices; d++)
+      profiling_init (sotl_devices[d]);
+
+    runtime_initialized = true;
     return ret;
 }
 
-static void sotl_one_iteration (void)
+// Steps of devices are timed to rebalance them: host time for CPU devices,
+// time between two markers for OpenCL ones, which is only known once the
+// device is done (see sotl_collect_step_times)
+//
+static void sotl_step_begin (const unsigned d)
+{
+  sotl_device_t *dev = sotl_devices[d];
+
+  if (dev->compute == SOTL_COMPUTE_OCL)
+    clEnqueueMarkerWithWaitList (dev->queue, 0, NULL, &step_markers[d][0]);
+  else
+    gettimeofday (&step_start[d], NULL);
+}
+
+static void sotl_step_end (const unsigned d, const bool done)
+{
+  sotl_device_t *dev = sotl_devices[d];
+
+  if (dev->compute == SOTL_COMPUTE_OCL) {
+    clEnqueueMarkerWithWaitList (dev->queue, 0, NULL, &step_markers[d][1]);
+  } else {
+    struct timeval t;
+
+    gettimeofday (&t, NULL);
+    device_busy[d] += TIME_DIFF (step_start[d], t);
+  }
+
+  if (done)
+    device_work[d] += dev->atom_set.natoms;
+}
+
+static void sotl_collect_step_times (void)
+{
+  for (unsigned d = 0; d < sotl_nb_devices; d++) {
+    cl_ulong start, end;
+
+    if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL)
+      continue;
+
+    clGetEventProfilingInfo (step_markers[d][0], CL_PROFILING_COMMAND_START,
+			     sizeof (cl_ulong), &start, NULL);
+    clGetEventProfilingInfo (step_markers[d][1], CL_PROFILING_COMMAND_END,
+			     sizeof (cl_ulong), &end, NULL);
+    device_busy[d] += (end - start) / 1000;
+
+    clReleaseEvent (step_markers[d][0]);
+    clReleaseEvent (step_markers[d][1]);
+  }
+}
+
+// Move z cuts so that devices get atoms in proportion of their speed
+// (atoms moved per µs since the last rebalancing), when their step times
+// differ too much. The global set must be sorted along z
+//
+static void sotl_rebalance (void)
+{
+  sotl_domain_t *dom = get_global_domain ();
+  double shares[MAX_DEVICES], total = 0.0, imbalance;
+  unsigned long max_busy = 0, sum_busy = 0;
+  struct timeval t1, t2;
+  unsigned moved;
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++) {
+    max_busy = MAX (max_busy, device_busy[d]);
+    sum_busy += device_busy[d];
+    shares[d] = device_busy[d] ? (double) device_work[d] / device_busy[d] : 0.0;
+    total += shares[d];
+
+    if (sotl_verbose)
+      sotl_log (INFO, "Device %d [%s]: %d atoms, %lu µs busy\n", d,
+		sotl_devices[d]->name, sotl_devices[d]->atom_set.natoms,
+		device_busy[d]);
+  }
+
+  imbalance = sum_busy ? (double) max_busy * sotl_nb_devices / sum_busy : 1.0;
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    device_busy[d] = device_work[d] = 0;
+
+  if (imbalance <= 1.0 + REBALANCE_TOLERANCE || total == 0.0) {
+    sotl_log (PERF, "Rebalancing: imbalance %.3f, z cuts kept\n", imbalance);
+    return;
+  }
+
+  gettimeofday (&t1, NULL);
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    shares[d] /= total;
+
+  moved = domain_rebalance (dom, shares);
+  if (moved)
+    for (unsigned d = 0; d < sotl_nb_devices; d++)
+      device_set_domain (sotl_devices[d], dom->subdomains[d]);
+
+  gettimeofday (&t2, NULL);
+
+  sotl_log (PERF, "Rebalancing: imbalance %.3f, %d atoms migrated in %ld µs\n",
+	    imbalance, moved, (long) TIME_DIFF (t1, t2));
+}
+
+// Wait for the queued work of OpenCL devices
+//
+static void sotl_finish_devices (void)
+{
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    if (sotl_devices[d]->compute == SOTL_COMPUTE_OCL)
+      clFinish (sotl_devices[d]->queue);
+}
+
+// Point sub set sub to the atoms of set from first on
+//
+static void sotl_point_to (sotl_atom_set_t *sub, const sotl_atom_set_t *set,
+			   const unsigned first)
+{
+  sub->pos.x    = set->pos.x    + first;
+  sub->pos.y    = set->pos.y    + first;
+  sub->pos.z    = set->pos.z    + first;
+  sub->speed.dx = set->speed.dx + first;
+  sub->speed.dy = set->speed.dy + first;
+  sub->speed.dz = set->speed.dz + first;
+  sub->id       = set->id       + first;
+}
+
+// Exchange atoms between OpenCL devices without reading them all back:
+// each device sorts its own atoms along the boxes of their new positions,
+// and only its slabs at z cuts, its first and last two z planes of boxes,
+// go through the host. The outer plane of a slab holds the atoms which
+// left for the neighbour, the inner one the ghosts of the neighbour. Other
+// atoms stay on the device, only shifted when the numbers of atoms leaving
+// and arriving on the left differ. Atoms move less than a box per step, as
+// box sort assumes anyway.
+//
+// Slabs are staged in the global set, which is then out of date, and the
+// atom set of each device points to its own part of the global set, where
+// the other way of sotl_exchange_atoms reads it back. Returns false when
+// that way must be taken: with host devices, which work in the global set,
+// with a sub domain thinner than two z planes of boxes, or when ghosts no
+// longer fit in borders
+//
+static bool sotl_exchange_slabs (void)
+{
+  const unsigned n = sotl_nb_devices;
+  sotl_atom_set_t *set = get_global_atom_set ();
+  sotl_atom_set_t left[MAX_DEVICES], right[MAX_DEVICES];
+  unsigned out_left[MAX_DEVICES], out_right[MAX_DEVICES];
+  unsigned nghosts_min[MAX_DEVICES], nghosts_max[MAX_DEVICES];
+  unsigned first = 0;
+
+  for (unsigned d = 0; d < n; d++)
+    if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL
+	|| sotl_devices[d]->domain.boxes[2] < 4)
+      return false;
+
+  for (unsigned d = 0; d < n; d++)
+    ocl_sort_own_atoms (sotl_devices[d]);
+
+  // No slab on the outer sides of the first and last devices, which keep
+  // the atoms leaving the domain
+  //
+  for (unsigned d = 0; d < n; d++) {
+    sotl_device_t *dev = sotl_devices[d];
+    const int bz = dev->domain.boxes[2];
+
+    left[d] = right[d] = *set;
+    left[d].natoms = right[d].natoms = 0;
+    out_left[d] = out_right[d] = 0;
+
+    if (d > 0) {
+      left[d].natoms = device_get_natoms_left (dev);
+      out_left[d] = device_get_natoms_in_z (dev, 0, 1);
+    }
+    if (d < n - 1) {
+      right[d].natoms = device_get_natoms_right (dev);
+      out_right[d] = device_get_natoms_in_z (dev, bz - 1, bz);
+    }
+  }
+
+  // Ghosts are the border of the neighbour and the atoms which left for it
+  //
+  for (unsigned d = 0; d < n; d++) {
+    nghosts_min[d] = nghosts_max[d] = 0;
+    if (d > 0)
+      nghosts_min[d] = right[d - 1].natoms - out_right[d - 1] + out_left[d];
+    if (d < n - 1)
+      nghosts_max[d] = left[d + 1].natoms - out_left[d + 1] + out_right[d];
+
+    if (MAX (nghosts_min[d], nghosts_max[d])
+	> sotl_devices[d]->atom_set.offset_ghosts)
+      return false;
+  }
+
+  for (unsigned d = 0; d < n; d++) {
+    sotl_device_t *dev = sotl_devices[d];
+
+    sotl_point_to (&left[d], set, first);
+    first += left[d].natoms;
+    sotl_point_to (&right[d], set, first);
+    first += right[d].natoms;
+
+    device_read_atoms (dev, 0, &left[d]);
+    device_read_atoms (dev, dev->atom_set.natoms - right[d].natoms, &right[d]);
+    clFlush (dev->queue);
+  }
+  sotl_finish_devices ();
+
+  // Own atoms: arrivals from the left, kept atoms, arrivals from the right
+  //
+  for (unsigned d = 0; d < n; d++) {
+    sotl_device_t *dev = sotl_devices[d];
+    sotl_atom_set_t *own = &dev->atom_set;
+    const unsigned in_left = d > 0 ? out_right[d - 1] : 0;
+    const unsigned in_right = d < n - 1 ? out_left[d + 1] : 0;
+    const unsigned kept = own->natoms - out_left[d] - out_right[d];
+    const unsigned natoms = in_left + kept + in_right;
+
+    device_move_atoms (dev, out_left[d], in_left, kept);
+
+    if (d > 0) {
+      const sotl_atom_set_t *prev = &right[d - 1];
+      const unsigned border = prev->natoms - in_left;
+
+      device_write_atoms (dev, prev, border, in_left, 0);
+      device_write_atoms (dev, prev, 0, border, -(int) nghosts_min[d]);
+      device_write_atoms (dev, &left[d], 0, out_left[d], -(int) out_left[d]);
+    }
+    if (d < n - 1) {
+      const sotl_atom_set_t *next = &left[d + 1];
+      const unsigned border = next->natoms - in_right;
+
+      device_write_atoms (dev, next, 0, in_right, in_left + kept);
+      device_write_atoms (dev, next, in_right, border, natoms);
+      device_write_atoms (dev, &right[d], right[d].natoms - out_right[d],
+			  out_right[d], natoms + border);
+    }
+
+    own->natoms = own->current = natoms;
+    own->nghosts_min = nghosts_min[d];
+    own->nghosts_max = nghosts_max[d];
+    clFlush (dev->queue);
+  }
+
+  // Staged slabs must be written before the global set changes
+  //
+  sotl_finish_devices ();
+
+  first = 0;
+  for (unsigned d = 0; d < n; d++) {
+    sotl_point_to (&sotl_devices[d]->atom_set, set, first);
+    first += sotl_devices[d]->atom_set.natoms;
+  }
+
+  return true;
+}
+
+// Atoms crossing z cuts move to the next device, and ghosts follow atoms
+// on the borders of neighbours: on the devices when they are all OpenCL
+// ones (see sotl_exchange_slabs), else, and to rebalance devices, by
+// reading back all devices into the global set, which holds their slabs
+// one after the other, sorting it along z again and giving each device its
+// new slab and ghosts
+//
+static void sotl_exchange_atoms (const bool rebalance)
+{
+  sotl_domain_t *dom = get_global_domain ();
+
+  if (!rebalance && sotl_exchange_slabs ()) {
+    if (rebalance_period)
+      sotl_collect_step_times ();
+    return;
+  }
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    if (sotl_devices[d]->compute == SOTL_COMPUTE_OCL)
+      device_read_buffers (sotl_devices[d]);
+
+  if (rebalance_period)
+    sotl_collect_step_times ();
+
+  domain_exchange (dom);
+
+  if (rebalance)
+    sotl_rebalance ();
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    device_set_atoms (sotl_devices[d], dom->subdomains[d]->atom_set);
+}
+
+// Run step (a whole step, or its last pass if done) on device d
+//
+static void sotl_device_step (const unsigned d,
+			      void (*step) (sotl_device_t *), const bool done)
+{
+  if (rebalance_period)
+    sotl_step_begin (d);
+
+  step (sotl_devices[d]);
+
+  if (rebalance_period)
+    sotl_step_end (d, done);
+}
+
+// One force evaluation and move on all devices, with the durations set
+// by the integrator
+//
+static void sotl_step_devices (const bool rebalance)
+{
+  struct timeval t1, t2, t3;
+  unsigned nb_host = 0;
+
+  if (benchmark)
+    gettimeofday (&t1, NULL);
+
+  // OpenCL devices only queue their step, so that host devices (OpenMP or
+  // sequential) compute theirs meanwhile
+  //
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    if (sotl_devices[d]->compute == SOTL_COMPUTE_OCL) {
+      sotl_device_step (d, device_one_step_move, true);
+      clFlush (sotl_devices[d]->queue);
+    } else
+      nb_host++;
+
+  // Host devices work in place in the global set, where the ghosts of one
+  // are atoms of its neighbours: when there are several of them, all
+  // compute their forces before any moves its atoms
+  //
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL) {
+      if (nb_host > 1)
+	sotl_device_step (d, device_one_step_force, false);
+      else
+	sotl_device_step (d, device_one_step_move, true);
+    }
+
+  for (unsigned d = 0; d < sotl_nb_devices && nb_host > 1; d++)
+    if (sotl_devices[d]->compute != SOTL_COMPUTE_OCL)
+      sotl_device_step (d, device_one_step_integrate, true);
+
+  if (benchmark) {
+    sotl_finish_devices ();
+    gettimeofday (&t2, NULL);
+    timings.phase[SOTL_PHASE_STEP] += TIME_DIFF (t1, t2);
+  }
+
+  if (sotl_have_multi ()) {
+    uint64_t t = profiling_now ();
+
+    sotl_exchange_atoms (rebalance);
+    profiling_record (NULL, PROF_EXCHANGE, t);
+  }
+
+  if (benchmark && sotl_have_multi ()) {
+    gettimeofday (&t3, NULL);
+    timings.phase[SOTL_PHASE_EXCHANGE] += TIME_DIFF (t2, t3);
+  }
+}
+
+// Pick the next time step from the maxima of the last substep over all
+// devices (OpenCL devices reduced them per work-group)
+//
+static void sotl_adapt_time_step (void)
+{
+  calc_t max_speed2 = 0.0, max_kick2 = 0.0;
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++) {
+    sotl_device_t *dev = sotl_devices[d];
+
+    if (dev->compute == SOTL_COMPUTE_OCL)
+      device_read_stats (dev);
+    max_speed2 = MAX (max_speed2, dev->max_speed2);
+    max_kick2 = MAX (max_kick2, dev->max_kick2);
+  }
+
+  integrator_adapt (max_speed2, max_kick2);
+}
+
+// Sum the observables of all devices (OpenCL devices reduce them on the
+// device and only read back the sums) into the sample of iteration iter
+//
+static void sotl_sample_observables (unsigned long iter)
+{
+  sotl_observables_t total;
+
+  observables_clear (&total);
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++) {
+    sotl_device_t *dev = sotl_devices[d];
+
+    if (dev->compute == SOTL_COMPUTE_OCL)
+      device_read_observables (dev);
+    observables_add (&total, &dev->observables);
+  }
+
+  observables_record (&total, iter);
+}
+
+// Warm-up iterations (record unset) take neither samples of observables
+// nor trajectory frames
+//
+static void sotl_one_iteration (const bool record)
 {
+  static unsigned long iter = 0;
+  bool reorder = reorder_period && (iter + 1) % reorder_period == 0;
+  const unsigned nsteps = integrator_nb_substeps ();
+  bool sample = record && observables_period &&
+    (iter + 1) % observables_period == 0;
+
   for (unsigned d = 0; d < sotl_nb_devices; d++)
-    device_one_step_move (sotl_devices[d]);
+    if (reorder) {
+      uint64_t t = profiling_now ();
+
+      device_reorder_atoms (sotl_devices[d]);
+      profiling_record (sotl_devices[d], PROF_SORT, t);
+    }
+
+  // Inner steps of RESPA (a single one otherwise): ghosts must be exchanged
+  // before each force evaluation
+  //
+  for (unsigned k = 0; k < nsteps; k++) {
+    integrator_set_substep (k);
+    observables_set_substep (sample, k, nsteps);
+    sotl_step_devices (k == nsteps - 1 && rebalance_period &&
+		       (iter + 1) % rebalance_period == 0);
+  }
+
+  if (integrator_is_adaptive ())
+    sotl_adapt_time_step ();
+
+  if (sample) {
+    observables_set_substep (false, 0, nsteps);
+    sotl_sample_observables (iter + 1);
+  }
+
+  iter++;
+  if (record && trajectory_period && iter % trajectory_period == 0)
+    trajectory_capture (iter);
 }
 
 #ifdef HAVE_LIBGL
@@ -720,7 +1444,7 @@ static void sotl_one_step (void)
   ocl_acquire (sotl_devices[opengl_device]);
 
   if (move_enabled)
-    sotl_one_iteration ();
+    sotl_one_iteration (true);
 
   ocl_release (sotl_devices[opengl_device]);
 }
@@ -742,60 +1466,66 @@ void sotl_main_loop (unsigned nb_iter)
   force_enabled = 1;
   borders_enabled = 0;
 
-
-#ifdef PROFILING
   struct timeval t1,t2;
-#endif
-#ifdef DEBUG
-  cl_ulong start, end;
-#endif
 
-#ifdef PROFILING
-  for (unsigned d = 0; d < sotl_nb_devices; d++)
-    profiling_init(sotl_devices[d]);
+  // Warm-up iterations are neither timed nor profiled
+  //
+  for (unsigned i = 0; i < warmup_iter; ++i)
+    sotl_one_iteration (false);
+  sotl_finish_devices ();
 
-#ifdef DEBUG
-  {
-    null_kernel (sotl_devices[0]);
-    clGetEventProfilingInfo(sotl_devices[0]->prof_events[KERNEL_NULL], CL_PROFILING_COMMAND_END,
-			    sizeof(cl_ulong), &start, NULL);
+  memset (&timings, 0, sizeof (timings));
+
+  for (unsigned d = 0; d < sotl_nb_devices; d++)
+    profiling_reset_counters (sotl_devices[d]);
+  profiling_reset_counters (NULL);
 
-  }
-#endif
   gettimeofday (&t1,NULL);
-#endif
 
   for (unsigned i = 0; i < nb_iter; ++i)
-    sotl_one_iteration ();
+    sotl_one_iteration (true);
 
-  for (unsigned d = 0; d < sotl_nb_devices; d++)
-    if (sotl_devices[d]->compute == SOTL_COMPUTE_OCL)
-      clFinish (sotl_devices[d]->queue);
+  sotl_finish_devices ();
 
-#ifdef PROFILING
   gettimeofday (&t2,NULL);
+
+  if (benchmark && nb_iter) {
+    timings.natoms = get_global_atom_set ()->natoms;
+    timings.nb_iter = nb_iter;
+    timings.phase[SOTL_PHASE_ITERATION] = TIME_DIFF (t1, t2);
+    for (int p = 0; p < SOTL_NB_PHASES; p++)
+      timings.phase[p] /= nb_iter;
+  }
+
+#ifdef PROFILING
   sotl_log(PERF, "   #atoms\ttime/i (µs)\tMatoms/i/s\n");
   sotl_log(PERF, "%9d\t%11.0lf\t%10.1lf\n",
 	   get_global_atom_set ()->natoms,
 	   ((double)TIME_DIFF(t1, t2)) / nb_iter,
 	   (double)get_global_atom_set ()->natoms/(((double)TIME_DIFF(t1, t2)) / (nb_iter)));
-	   
-#ifdef DEBUG
-  {
-    null_kernel (sotl_devices[0]);
-    clGetEventProfilingInfo (sotl_devices[0]->prof_events[KERNEL_NULL], CL_PROFILING_COMMAND_START,
-			     sizeof(cl_ulong), &end, NULL);
-
-  }
-  sotl_log(DEBUG, "OpenCL pretends %f µs ;)\n", (end - start) / nb_iter * 1.0e-3f);
-#endif
 
   for (unsigned d = 0; d < sotl_nb_devices; d++)
     profiling_finalize (sotl_devices[d]);
-
+  profiling_finalize (NULL);
 #endif
 }
 
+int sotl_push_pos_1()
+{
+    integrator_set_half_step(true);
+    sotl_step_devices(false);
+
+    return SOTL_SUCCESS;
+}
+
+int sotl_push_pos_2()
+{
+    integrator_set_half_step(false);
+    sotl_step_devices(false);
+
+    return SOTL_SUCCESS;
+}
+
 #define CONF_FORMAT_NUM_ATOMS   "%09d"
 #define CONF_FORMAT_DOMAIN_SIZE "%f %f"
 #define CONF_FORMAT_SPEED       "%d"
@@ -809,7 +1539,7 @@ static void sotl_write_file_header(FILE *f, const sotl_domain_t *d,
 
     // Dimensions of the domain.
     for (int i = 0; i < 3; i++) {
-        fprintf (f, CONF_FORMAT_DOMAIN_SIZE"\n", d->min_ext[i], d->max_ext[i]);
+        fprintf (f, CONF_FORMAT_DOMAIN_SIZE"\n", d->min_range[i], d->max_range[i]);
     }
 
     // Speed information.
@@ -827,34 +1557,110 @@ static void sotl_write_file_body(FILE *f, const sotl_atom_set_t *s)
     }
 }
 
-int sotl_dump_positions(const char *filename)
+/* Copy atoms of src at their input position in set. */
+static void sotl_gather_atom_set(sotl_atom_set_t *set, const sotl_atom_set_t *src)
 {
-    FILE *f;
+    for (unsigned i = 0; i < src->natoms; i++) {
+        unsigned id = src->id[i];
+
+        set->pos.x[id]    = src->pos.x[i];
+        set->pos.y[id]    = src->pos.y[i];
+        set->pos.z[id]    = src->pos.z[i];
+        set->speed.dx[id] = src->speed.dx[i];
+        set->speed.dy[id] = src->speed.dy[i];
+        set->speed.dz[id] = src->speed.dz[i];
+        set->id[id]       = id;
+    }
+}
 
-    if (!(f = fopen (filename, "w")))
-        return -errno;
+/* Gather all atoms back in input order (they may have been sorted), from
+ * the devices once the runtime is initialized, else from the global set. */
+static int sotl_gather_atoms(sotl_atom_set_t *set)
+{
+    int ret;
 
-    sotl_write_file_header (f, get_global_domain(), get_global_atom_set());
+    ret = atom_set_init (set, get_global_atom_set()->natoms,
+                         get_global_atom_set()->natoms);
+    if (ret < 0)
+        return ret;
+    set->current = set->natoms;
+
+    if (!runtime_initialized) {
+        sotl_gather_atom_set (set, get_global_atom_set());
+        return SOTL_SUCCESS;
+    }
 
     for (unsigned d = 0; d < sotl_nb_devices; d++) {
         sotl_device_t *dev = sotl_devices[d];
 
-        /* Read back positions and spees from global memory. */
-        device_read_buffers (dev);
+        /* Read back positions and speeds from global memory. */
+        if (dev->compute == SOTL_COMPUTE_OCL)
+            device_read_buffers (dev);
+
+        sotl_gather_atom_set (set, &dev->atom_set);
+    }
+
+    return SOTL_SUCCESS;
+}
+
+int sotl_dump_positions(const char *filename)
+{
+    sotl_atom_set_t set;
+    FILE *f;
+    int ret;
+
+    ret = sotl_gather_atoms (&set);
+    if (ret < 0)
+        return ret;
 
-        sotl_write_file_body (f, &dev->atom_set);
+    if (!(f = fopen (filename, "w"))) {
+        ret = -errno;
+        atom_set_free (&set);
+        return ret;
     }
 
+    sotl_write_file_header (f, get_global_domain(), &set);
+    sotl_write_file_body (f, &set);
+    atom_set_free (&set);
+
     if (fclose(f) < 0)
         return -errno;
     return 0;
 }
 
+int sotl_dump_snapshot(const char *filename)
+{
+    sotl_atom_set_t set;
+    int ret;
+
+    ret = sotl_gather_atoms (&set);
+    if (ret < 0)
+        return ret;
+
+    ret = snapshot_write (filename, get_global_domain(), &set);
+    atom_set_free (&set);
+
+    return ret;
+}
+
 static void sotl_default_params_init()
 {
+    params.md.delta_t      = MD_DELTA_T_DEFAULT_VALUE;
+    params.md.respa_steps  = MD_RESPA_STEPS_DEFAULT_VALUE;
+    params.md.respa_cutoff = MD_RESPA_CUTOFF_DEFAULT_VALUE;
+    params.md.adaptive_displacement = MD_ADAPTIVE_DISPLACEMENT_DEFAULT_VALUE;
+    params.md.delta_t_max  = MD_DELTA_T_MAX_DEFAULT_VALUE;
+
     params.lj.sigma   = LJ_SIGMA_DEFAULT_VALUE;
     params.lj.epsilon = LJ_EPSILON_DEFAULT_VALUE;
     params.lj.rcut    = LJ_RCUT_DEFAULT_VALUE;
+
+    params.verlet.skin = VERLET_SKIN_DEFAULT_VALUE;
+
+    params.potential.type        = POTENTIAL_TYPE_DEFAULT_VALUE;
+    params.potential.morse_alpha = MORSE_ALPHA_DEFAULT_VALUE;
+
+    potential_update();
 }
 
 int sotl_init()
@@ -896,13 +1702,129 @@ void sotl_enable_dump()
     sotl_dump = 1;
 }
 
+void sotl_enable_binary_dump()
+{
+    sotl_dump = 1;
+    binary_dump = true;
+}
+
+void sotl_enable_trajectory(const char *filename, const unsigned period,
+                            const unsigned policy)
+{
+    trajectory_file   = filename;
+    trajectory_period = period;
+    trajectory_policy = policy;
+}
+
+void sotl_enable_observables(const char *filename, const unsigned period)
+{
+    observables_file   = filename;
+    observables_period = period;
+}
+
+int sotl_get_observables(sotl_observables_t *obs)
+{
+    return observables_get(obs);
+}
+
+void sotl_enable_trace(const char *filename)
+{
+    trace_file = filename;
+    profiling_enable_trace();
+}
+
+void sotl_set_warmup(const unsigned nb_iter)
+{
+    warmup_iter = nb_iter;
+}
+
+void sotl_enable_benchmark()
+{
+    benchmark = true;
+}
+
+int sotl_get_timings(sotl_timings_t *t)
+{
+    if (!timings.nb_iter)
+        return SOTL_INVALID_VALUE;
+
+    *t = timings;
+    return SOTL_SUCCESS;
+}
+
+void sotl_enable_box_mode()
+{
+    is_box_mode = true;
+}
+
+void sotl_enable_verlet_mode()
+{
+    is_verlet_mode = true;
+}
+
+void sotl_enable_half_pair_mode()
+{
+    is_half_pair_mode = true;
+}
+
+void sotl_enable_numa_mode()
+{
+    is_numa_mode = true;
+}
+
+void sotl_enable_torus_mode()
+{
+    is_torus_mode = true;
+}
+
+void sotl_enable_cluster_mode()
+{
+    is_cluster_mode = true;
+}
+
+void sotl_enable_mixed_precision()
+{
+    is_mixed_precision = true;
+}
+
+void sotl_enable_reordering(const unsigned period)
+{
+    reorder_period = period;
+}
+
+void sotl_enable_rebalancing(const unsigned period)
+{
+    rebalance_period = period;
+}
+
 void sotl_finalize()
 {
+    /* Let the writer thread finish pending frames. */
+    trajectory_close();
+
+    integrator_finalize();
+
+    observables_finalize();
+
+    /* OpenCL queues are still there to complete the trace. */
+    if (trace_file && profiling_write_trace(trace_file) < 0)
+        sotl_log(ERROR, "Failed to write trace file \"%s\"\n", trace_file);
+
+    for (unsigned d = 0; d < sotl_nb_devices; d++)
+        profiling_release(sotl_devices[d]);
+
     /* Dump atom positions to disk. */
     if (sotl_dump) {
+        const char *filename = binary_dump ? "dump.sotl" : "dump.conf";
+        int ret;
+
         if (sotl_verbose)
-            sotl_log(INFO, "Dumping positions to file \"dump.conf\"...\n");
-        if (sotl_dump_positions ("dump.conf") < 0)
+            sotl_log(INFO, "Dumping positions to file \"%s\"...\n", filename);
+        if (binary_dump)
+            ret = sotl_dump_snapshot (filename);
+        else
+            ret = sotl_dump_positions (filename);
+        if (ret < 0)
             sotl_log(ERROR, "Failed to dump atom positions\n");
         if (sotl_verbose)
             sotl_log(INFO, "Done\n");
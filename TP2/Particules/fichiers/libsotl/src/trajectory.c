@@ -0,0 +1,329 @@
+#define _XOPEN_SOURCE 600
+
+#include "trajectory.h"
+#include "device.h"
+#include "profiling.h"
+#include "sotl.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Atoms of one device in a frame. */
+typedef struct {
+    calc_t *x;                  /* y and z follow, stride values apart */
+    unsigned stride;
+    unsigned *id;
+    unsigned natoms;
+    cl_event event;             /* pending readback (or NULL) */
+} sotl_frame_part_t;
+
+/* A frame of the ring: positions and ids of each device. */
+typedef struct {
+    calc_t *pos;
+    unsigned *id;
+    sotl_frame_part_t *parts;   /* one per device */
+    unsigned long step;
+} sotl_frame_t;
+
+static struct {
+    FILE *file;
+    unsigned natoms;
+    unsigned policy;
+
+    sotl_frame_t frames[TRAJECTORY_RING_SIZE];
+    calc_t *ordered;            /* frame in input order (writer only) */
+    unsigned head;              /* next frame to capture */
+    unsigned tail;              /* next frame to write */
+    unsigned count;             /* frames waiting to be written */
+    bool closing;
+    bool failed;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+
+    unsigned long nb_captured, nb_dropped;
+    unsigned long stall_time;   /* waiting for a free frame (µs) */
+    unsigned long capture_time; /* copying or starting readbacks (µs) */
+    unsigned long write_time;   /* writer thread (µs) */
+} traj = {
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .freed  = PTHREAD_COND_INITIALIZER,
+};
+
+/* Reorder a frame by atom id and append it to the file. */
+static void trajectory_write_frame(const sotl_frame_t *frame)
+{
+    const unsigned n = traj.natoms;
+    uint64_t step = frame->step;
+
+    for (unsigned d = 0; d < sotl_nb_devices; d++) {
+        sotl_frame_part_t *part = &frame->parts[d];
+        const calc_t *x = part->x;
+        const calc_t *y = x + part->stride;
+        const calc_t *z = y + part->stride;
+
+        if (part->event) {
+            clWaitForEvents(1, &part->event);
+            clReleaseEvent(part->event);
+            part->event = NULL;
+        }
+
+        if (traj.failed)
+            continue;
+
+        for (unsigned i = 0; i < part->natoms; i++) {
+            unsigned id = part->id[i];
+
+            traj.ordered[id]         = x[i];
+            traj.ordered[n + id]     = y[i];
+            traj.ordered[2 * n + id] = z[i];
+        }
+    }
+
+    if (traj.failed)
+        return;
+
+    if (fwrite(&step, sizeof(step), 1, traj.file) != 1 ||
+        fwrite(traj.ordered, sizeof(calc_t), 3 * n, traj.file) != 3 * n) {
+        sotl_log(ERROR, "Failed to write trajectory: %s\n", strerror(errno));
+        traj.failed = true;
+    }
+}
+
+static void *trajectory_writer(void *arg)
+{
+    struct timeval t1, t2;
+
+    (void)arg;
+
+    for (;;) {
+        sotl_frame_t *frame;
+
+        pthread_mutex_lock(&traj.lock);
+        while (!traj.count && !traj.closing)
+            pthread_cond_wait(&traj.filled, &traj.lock);
+        if (!traj.count) {
+            pthread_mutex_unlock(&traj.lock);
+            break;
+        }
+        frame = &traj.frames[traj.tail];
+        pthread_mutex_unlock(&traj.lock);
+
+        gettimeofday(&t1, NULL);
+        trajectory_write_frame(frame);
+        gettimeofday(&t2, NULL);
+        traj.write_time += TIME_DIFF(t1, t2);
+
+        pthread_mutex_lock(&traj.lock);
+        traj.tail = (traj.tail + 1) % TRAJECTORY_RING_SIZE;
+        traj.count--;
+        pthread_cond_signal(&traj.freed);
+        pthread_mutex_unlock(&traj.lock);
+    }
+
+    return NULL;
+}
+
+static void trajectory_free(void)
+{
+    for (unsigned f = 0; f < TRAJECTORY_RING_SIZE; f++) {
+        free(traj.frames[f].pos);
+        free(traj.frames[f].id);
+        free(traj.frames[f].parts);
+        traj.frames[f].pos = NULL;
+        traj.frames[f].id = NULL;
+        traj.frames[f].parts = NULL;
+    }
+    free(traj.ordered);
+    traj.ordered = NULL;
+}
+
+/* Values between the axes of a device in a frame. */
+static unsigned trajectory_stride(const sotl_device_t *dev)
+{
+    if (dev->compute == SOTL_COMPUTE_OCL)
+        return device_read_back_stride(dev);
+    return dev->atom_set.offset;
+}
+
+int trajectory_open(const char *filename, const unsigned natoms,
+                    const unsigned policy)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    sotl_trajectory_header_t header = { .version = TRAJECTORY_VERSION };
+    size_t pos_size = 0, id_size = 0;
+    int ret;
+
+    traj.natoms = natoms;
+    traj.policy = policy;
+    traj.head = traj.tail = traj.count = 0;
+    traj.closing = traj.failed = false;
+
+    /* Each device gets room for its whole capacity, laid out as its
+     * readbacks are (see device_read_back_async()). */
+    for (unsigned d = 0; d < sotl_nb_devices; d++) {
+        pos_size += 3 * trajectory_stride(sotl_devices[d]);
+        id_size  += sotl_devices[d]->atom_set.offset;
+    }
+
+    /* Page-aligned frames, so that devices can read back into them
+     * directly. */
+    for (unsigned f = 0; f < TRAJECTORY_RING_SIZE; f++) {
+        sotl_frame_t *frame = &traj.frames[f];
+        size_t pos_offset = 0, id_offset = 0;
+
+        if (posix_memalign((void **)&frame->pos, page,
+                           (pos_size + 1) * sizeof(calc_t)) ||
+            posix_memalign((void **)&frame->id, page,
+                           (id_size + 1) * sizeof(unsigned)) ||
+            !(frame->parts = calloc(sotl_nb_devices,
+                                    sizeof(sotl_frame_part_t)))) {
+            trajectory_free();
+            return SOTL_OUT_OF_MEMORY;
+        }
+
+        for (unsigned d = 0; d < sotl_nb_devices; d++) {
+            sotl_frame_part_t *part = &frame->parts[d];
+
+            part->stride = trajectory_stride(sotl_devices[d]);
+            part->x  = frame->pos + pos_offset;
+            part->id = frame->id + id_offset;
+            pos_offset += 3 * part->stride;
+            id_offset  += sotl_devices[d]->atom_set.offset;
+        }
+    }
+
+    traj.ordered = malloc(3 * (natoms + 1) * sizeof(calc_t));
+    if (!traj.ordered) {
+        trajectory_free();
+        return SOTL_OUT_OF_MEMORY;
+    }
+
+    if (!(traj.file = fopen(filename, "w"))) {
+        ret = -errno;
+        trajectory_free();
+        return ret;
+    }
+
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.precision = sizeof(calc_t);
+    header.natoms    = natoms;
+    if (fwrite(&header, sizeof(header), 1, traj.file) != 1) {
+        ret = -errno;
+        fclose(traj.file);
+        traj.file = NULL;
+        trajectory_free();
+        return ret;
+    }
+
+    ret = pthread_create(&traj.writer, NULL, trajectory_writer, NULL);
+    if (ret) {
+        fclose(traj.file);
+        traj.file = NULL;
+        trajectory_free();
+        return -ret;
+    }
+
+    return SOTL_SUCCESS;
+}
+
+/* Copy positions and ids of all devices. Readbacks of OpenCL devices are
+ * only started: the writer waits for them, while the next steps run. */
+static void trajectory_copy_devices(sotl_frame_t *frame)
+{
+    for (unsigned d = 0; d < sotl_nb_devices; d++) {
+        sotl_device_t *dev = sotl_devices[d];
+        const sotl_atom_set_t *s = &dev->atom_set;
+        sotl_frame_part_t *part = &frame->parts[d];
+
+        if (dev->compute == SOTL_COMPUTE_OCL &&
+            part->stride == device_read_back_stride(dev)) {
+            /* The queue is in order: ids are read when positions are. */
+            clReleaseEvent(device_read_back_ids_async(dev, part->id));
+            part->event = device_read_back_async(dev, false, part->x);
+        } else if (dev->compute == SOTL_COMPUTE_OCL) {
+            /* Borders were enlarged since the ring was allocated. */
+            device_read_back_ids(dev, part->id);
+            device_read_back_pos(dev, part->x, part->x + part->stride,
+                                 part->x + 2 * part->stride);
+        } else {
+            memcpy(part->x, s->pos.x, s->natoms * sizeof(calc_t));
+            memcpy(part->x + part->stride, s->pos.y, s->natoms * sizeof(calc_t));
+            memcpy(part->x + 2 * part->stride, s->pos.z,
+                   s->natoms * sizeof(calc_t));
+            memcpy(part->id, s->id, s->natoms * sizeof(unsigned));
+        }
+        part->natoms = s->natoms;
+    }
+}
+
+void trajectory_capture(const unsigned long step)
+{
+    struct timeval t1, t2, t3;
+    sotl_frame_t *frame;
+
+    if (!traj.file)
+        return;
+
+    gettimeofday(&t1, NULL);
+
+    pthread_mutex_lock(&traj.lock);
+    if (traj.count == TRAJECTORY_RING_SIZE &&
+        traj.policy == SOTL_TRAJECTORY_DROP) {
+        traj.nb_dropped++;
+        pthread_mutex_unlock(&traj.lock);
+        return;
+    }
+    while (traj.count == TRAJECTORY_RING_SIZE)
+        pthread_cond_wait(&traj.freed, &traj.lock);
+    frame = &traj.frames[traj.head];
+    pthread_mutex_unlock(&traj.lock);
+
+    gettimeofday(&t2, NULL);
+
+    trajectory_copy_devices(frame);
+    frame->step = step;
+
+    pthread_mutex_lock(&traj.lock);
+    traj.head = (traj.head + 1) % TRAJECTORY_RING_SIZE;
+    traj.count++;
+    pthread_cond_signal(&traj.filled);
+    pthread_mutex_unlock(&traj.lock);
+
+    gettimeofday(&t3, NULL);
+    traj.stall_time   += TIME_DIFF(t1, t2);
+    traj.capture_time += TIME_DIFF(t2, t3);
+    traj.nb_captured++;
+}
+
+void trajectory_close(void)
+{
+    if (!traj.file)
+        return;
+
+    pthread_mutex_lock(&traj.lock);
+    traj.closing = true;
+    pthread_cond_signal(&traj.filled);
+    pthread_mutex_unlock(&traj.lock);
+    pthread_join(traj.writer, NULL);
+
+    if (fclose(traj.file) < 0 && !traj.failed)
+        sotl_log(ERROR, "Failed to write trajectory: %s\n", strerror(errno));
+    traj.file = NULL;
+    trajectory_free();
+
+    sotl_log(PERF, "  Trajectory: %lu frames captured, %lu dropped\n",
+             traj.nb_captured, traj.nb_dropped);
+    sotl_log(PERF, "  Trajectory: %lu µs stalled, %lu µs capturing, "
+             "%lu µs writing (background)\n",
+             traj.stall_time, traj.capture_time, traj.write_time);
+}
@@ -0,0 +1,195 @@
+#include "verlet.h"
+#include "sotl.h"
+
+#include <stdlib.h>
+
+/* Extra room when growing the neighbours array. */
+#define VERLET_GROWTH 1.25
+
+#define FREE(x)     \
+    do {            \
+        free(x);    \
+        x = NULL;   \
+    } while (0)
+
+int verlet_list_init(sotl_verlet_list_t *list, const unsigned maxatoms)
+{
+    list->capacity   = maxatoms;
+    list->size       = 0;
+    list->natoms     = 0;
+    list->neighbours = NULL;
+    list->max_disp2  = 0;
+    list->valid      = false;
+    list->half       = false;
+    list->nb_builds  = 0;
+    list->nb_checks  = 0;
+
+    list->start   = malloc((maxatoms + 1) * sizeof(unsigned));
+    list->ref_pos = malloc(3 * maxatoms * sizeof(calc_t));
+
+    if (!list->start || !list->ref_pos) {
+        verlet_list_free(list);
+        return SOTL_OUT_OF_MEMORY;
+    }
+
+    return SOTL_SUCCESS;
+}
+
+void verlet_list_free(sotl_verlet_list_t *list)
+{
+    FREE(list->start);
+    FREE(list->neighbours);
+    FREE(list->ref_pos);
+    list->size = 0;
+}
+
+bool verlet_list_needs_update(sotl_verlet_list_t *list,
+                              const sotl_atom_set_t *set, const calc_t skin)
+{
+    const calc_t *ref_x = list->ref_pos;
+    const calc_t *ref_y = list->ref_pos + list->capacity;
+    const calc_t *ref_z = list->ref_pos + list->capacity * 2;
+    calc_t max_disp2 = 0;
+    bool update;
+
+    #pragma omp single
+    {
+        list->max_disp2 = 0;
+        list->nb_checks++;
+    }
+
+    if (list->valid) {
+        #pragma omp for nowait
+        for (unsigned n = 0; n < set->natoms; n++) {
+            calc_t dx = set->pos.x[n] - ref_x[n];
+            calc_t dy = set->pos.y[n] - ref_y[n];
+            calc_t dz = set->pos.z[n] - ref_z[n];
+            calc_t d2 = dx * dx + dy * dy + dz * dz;
+
+            if (d2 > max_disp2)
+                max_disp2 = d2;
+        }
+
+        #pragma omp critical
+        {
+            if (max_disp2 > list->max_disp2)
+                list->max_disp2 = max_disp2;
+        }
+        #pragma omp barrier
+    }
+
+    update = !list->valid || list->max_disp2 > 0.25 * skin * skin;
+
+    /* Every thread must have read the result before a build resets it. */
+    #pragma omp barrier
+
+    return update;
+}
+
+/* Visit neighbours of all atoms of box k closer than sqrt(cutoff2). The
+ * number of neighbours of each atom is stored in start[atom + 1] when
+ * neighbours is NULL, otherwise they are written from start[atom]. */
+static void verlet_list_visit_box(sotl_verlet_list_t *list,
+                                  const sotl_cell_list_t *cells,
+                                  const sotl_atom_set_t *set,
+                                  const unsigned k, const calc_t cutoff2,
+                                  unsigned *neighbours)
+{
+    sotl_cell_range_t ranges[CELL_ROWS(1)];
+    unsigned nb_ranges = cell_get_neighbours(cells, k, 1, ranges);
+
+    for (unsigned i = cells->box_start[k]; i < cells->box_start[k + 1]; i++) {
+        unsigned current = cells->atoms[i];
+        unsigned count = 0;
+
+        for (unsigned r = 0; r < nb_ranges; r++) {
+            for (unsigned j = ranges[r].begin; j < ranges[r].end; j++) {
+                unsigned other = cells->atoms[j];
+                calc_t dx, dy, dz;
+
+                if (current == other || (list->half && other < current))
+                    continue;
+
+                dx = set->pos.x[other] - set->pos.x[current];
+                dy = set->pos.y[other] - set->pos.y[current];
+                dz = set->pos.z[other] - set->pos.z[current];
+
+                if (dx * dx + dy * dy + dz * dz < cutoff2) {
+                    if (neighbours)
+                        neighbours[list->start[current] + count] = other;
+                    count++;
+                }
+            }
+        }
+
+        if (!neighbours)
+            list->start[current + 1] = count;
+    }
+}
+
+void verlet_list_build(sotl_verlet_list_t *list, sotl_cell_list_t *cells,
+                       const sotl_domain_t *dom, const sotl_atom_set_t *set,
+                       const calc_t skin, const bool half)
+{
+    const calc_t cutoff = LENNARD_CUTOFF + skin;
+    const calc_t cutoff2 = cutoff * cutoff;
+    calc_t *ref_x = list->ref_pos;
+    calc_t *ref_y = list->ref_pos + list->capacity;
+    calc_t *ref_z = list->ref_pos + list->capacity * 2;
+
+    /* Boxes of size cutoff + skin: candidates are in the 27 boxes around. */
+    #pragma omp single
+    {
+        cell_list_build(cells, dom, set, cutoff);
+        list->half = half;
+    }
+
+    /* Count neighbours of each atom. */
+    #pragma omp for schedule(dynamic, 16)
+    for (unsigned k = 0; k < cells->nboxes; k++)
+        verlet_list_visit_box(list, cells, set, k, cutoff2, NULL);
+
+    /* Turn counts into offsets and grow the neighbours array if needed. */
+    #pragma omp single
+    {
+        list->start[0] = 0;
+        for (unsigned n = 0; n < set->natoms; n++)
+            list->start[n + 1] += list->start[n];
+
+        if (list->start[set->natoms] > list->size) {
+            list->size = list->start[set->natoms] * VERLET_GROWTH;
+            free(list->neighbours);
+            list->neighbours = malloc(list->size * sizeof(unsigned));
+            if (!list->neighbours)
+                sotl_log(CRITICAL, "Failed to allocate Verlet lists\n");
+        }
+
+        list->natoms = set->natoms;
+        list->valid = true;
+        list->nb_builds++;
+    }
+
+    #pragma omp for schedule(dynamic, 16)
+    for (unsigned k = 0; k < cells->nboxes; k++)
+        verlet_list_visit_box(list, cells, set, k, cutoff2,
+                              list->neighbours);
+
+    #pragma omp for
+    for (unsigned n = 0; n < set->natoms; n++) {
+        ref_x[n] = set->pos.x[n];
+        ref_y[n] = set->pos.y[n];
+        ref_z[n] = set->pos.z[n];
+    }
+}
+
+void verlet_list_print_stats(const sotl_verlet_list_t *list)
+{
+    if (!list->nb_builds)
+        return;
+
+    sotl_log(PERF, "  Verlet lists rebuilt %lu times in %lu steps "
+             "(every %.1f steps, %.1f neighbours/atom)\n",
+             list->nb_builds, list->nb_checks,
+             (double)list->nb_checks / list->nb_builds,
+             (double)list->start[list->natoms] / MAX(list->natoms, 1));
+}
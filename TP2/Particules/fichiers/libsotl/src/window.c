@@ -58,7 +58,6 @@ static void reshape (int w, int h)
 static unsigned true_redisplay = 1;
 
 static float mvmatrix[4][4];
-float normalized_vert[3] = { 0.0, 1.0, 0.0 };
 
 static void drawScene ()
 {
@@ -14,7 +14,7 @@
 
 char *MD_FILE = "conf/default.conf";
 
-/* Molecular dynamics parameters. */
+/* Molecular dynamics parameters (default time step). */
 static const double md_delta_t = 1.0;
 
 /* Lennard Jones parameters. */
@@ -36,10 +36,31 @@ static void usage(const char *name)
     fprintf(stderr, "\t-d | --device <n>\t\tSelect device #n\n");
     fprintf(stderr, "\t-o | --output-device <n>\tSet output device\n");
     fprintf(stderr, "\t-f | --file-dump\t\tDump atom positions to file\n");
+    fprintf(stderr, "\t-F | --binary-dump\t\tDump atom positions to a binary snapshot\n");
+    fprintf(stderr, "\t-T | --trajectory <period>\tWrite positions to \"trajectory.traj\" every <period> iterations\n");
+    fprintf(stderr, "\t-D | --drop-frames\t\tDrop trajectory frames rather than wait for the writer\n");
+    fprintf(stderr, "\t-S | --observables <period>\tWrite energies, temperature and momentum to \"observables.dat\" every <period> iterations\n");
+    fprintf(stderr, "\t-p | --trace <file>\t\tWrite a Chrome trace of the phases of each step to <file>\n");
+    fprintf(stderr, "\t-C | --convert <file>\t\tConvert the input to <file> (text <-> snapshot) and exit\n");
+    fprintf(stderr, "\t-b | --box-mode\t\t\tSort atoms into boxes to compute forces\n");
+    fprintf(stderr, "\t-e | --delta-t <dt>\t\tTime step of velocity Verlet (default 1)\n");
+    fprintf(stderr, "\t-k | --respa <n>\t\tIntegrate short-range forces in <n> inner steps (RESPA)\n");
+    fprintf(stderr, "\t-A | --adaptive <d>\t\tAdapt the time step so that atoms move less than <d> per step\n");
+    fprintf(stderr, "\t-E | --delta-t-max <dt>\t\tLargest adaptive time step (default 10)\n");
+    fprintf(stderr, "\t-V | --verlet <skin>\t\tUse Verlet lists with the given skin distance (CPU, single device)\n");
+    fprintf(stderr, "\t-H | --half-pair\t\tCompute each interaction once (OpenMP)\n");
+    fprintf(stderr, "\t-N | --numa\t\t\tSplit the domain into one slab per NUMA node (OpenMP)\n");
+    fprintf(stderr, "\t-t | --torus\t\t\tPeriodic boundaries instead of walls (box mode, one OpenMP or OpenCL device)\n");
+    fprintf(stderr, "\t-K | --clusters\t\t\tUse the cluster-pair force kernel (OpenCL box mode)\n");
+    fprintf(stderr, "\t-M | --mixed\t\t\tEvaluate pair forces in float, integrate in double\n");
+    fprintf(stderr, "\t-m | --morton <period>\t\tReorder atoms along a Morton curve every <period> iterations\n");
+    fprintf(stderr, "\t-L | --balance <period>\t\tMove z boundaries between devices every <period> iterations\n");
+    fprintf(stderr, "\t-P | --potential <name>\t\tPair potential: lj (default), morse or soft-sphere\n");
     fprintf(stderr, "\t-s | --seq <n>\t\tRun sequential version over device #n\n");
     fprintf(stderr, "\t-O | --omp <n>\t\tRun openmp version over device #n\n");
     fprintf(stderr, "\t-R | --random-atoms\t\tRandomize atoms\n");
     fprintf(stderr, "\t-i | --nb_iter <n>\t\tNumber of iterations\n");
+    fprintf(stderr, "\t-W | --warmup <n>\t\tRun <n> iterations before timing\n");
     fprintf(stderr, "\t-n | --natoms <n>\t\tNumber of atoms\n");
 }
 
@@ -52,7 +73,18 @@ int main(int argc, char *argv[])
     int nb_iter_to_ignore = 0;
     long nb_iter = 0;
     bool randomize_atoms = false;
+    double verlet_skin = 0.0;
+    double delta_t = md_delta_t;
+    unsigned respa_steps = 1;
+    double displacement = 0.0;
+    double delta_t_max = 0.0;
+    unsigned potential = SOTL_POTENTIAL_LJ;
     unsigned natoms = 0;
+    const char *convert_file = NULL;
+    unsigned trajectory_period = 0;
+    unsigned trajectory_policy = SOTL_TRAJECTORY_BLOCK;
+    unsigned observables_period = 0;
+    bool snapshot = false;
     int ret;
 
     if (sotl_init() < 0) {
@@ -70,7 +102,28 @@ int main(int argc, char *argv[])
             {"gpu",             no_argument,        0, 'g'},
             {"cpu",             no_argument,        0, 'c'},
             {"file-dump",       no_argument,        0, 'f'},
+            {"binary-dump",     no_argument,        0, 'F'},
+            {"convert",         required_argument,  0, 'C'},
+            {"trajectory",      required_argument,  0, 'T'},
+            {"drop-frames",     no_argument,        0, 'D'},
+            {"observables",     required_argument,  0, 'S'},
+            {"trace",           required_argument,  0, 'p'},
+            {"box-mode",        no_argument,        0, 'b'},
+            {"delta-t",         required_argument,  0, 'e'},
+            {"respa",           required_argument,  0, 'k'},
+            {"adaptive",        required_argument,  0, 'A'},
+            {"delta-t-max",     required_argument,  0, 'E'},
+            {"verlet",          required_argument,  0, 'V'},
+            {"half-pair",       no_argument,        0, 'H'},
+            {"numa",            no_argument,        0, 'N'},
+            {"torus",           no_argument,        0, 't'},
+            {"clusters",        no_argument,        0, 'K'},
+            {"mixed",           no_argument,        0, 'M'},
+            {"morton",          required_argument,  0, 'm'},
+            {"balance",         required_argument,  0, 'L'},
+            {"potential",       required_argument,  0, 'P'},
             {"nb-iter",         required_argument,  0, 'i'},
+            {"warmup",          required_argument,  0, 'W'},
             {"natoms",          required_argument,  0, 'n'},
             {"device",          required_argument,  0, 'd'},
             {"seq",             required_argument,  0, 's'},
@@ -81,7 +134,7 @@ int main(int argc, char *argv[])
 
         /* getopt_long stores the option index here. */
         int option_index = 0;
-        int c = getopt_long(argc, argv, "i:n:Rlvhagcfd:s:o:O:",
+        int c = getopt_long(argc, argv, "i:W:n:RlvhagcfFC:T:DS:p:be:k:A:E:V:HNtKMm:L:P:d:s:o:O:",
                             long_options, &option_index);
         if (c == -1)
             break;
@@ -94,6 +147,13 @@ int main(int argc, char *argv[])
                     nb_iter = 1;
                 }
                 break;
+            case 'W':
+                nb_iter_to_ignore = strtol(optarg, NULL, 10);
+                if (nb_iter_to_ignore < 0) {
+                    fprintf(stderr, "WARNING: Invalid value for warm-up iterations. Default to 0.\n");
+                    nb_iter_to_ignore = 0;
+                }
+                break;
             case 'R':
                 randomize_atoms = true;
                 break;
@@ -135,6 +195,133 @@ int main(int argc, char *argv[])
             case 'f':
                 sotl_enable_dump();
                 break;
+            case 'F':
+                sotl_enable_binary_dump();
+                break;
+            case 'C':
+                convert_file = optarg;
+                break;
+            case 'T':
+                {
+                    long period = strtol(optarg, NULL, 10);
+
+                    if (period <= 0) {
+                        fprintf(stderr, "WARNING: Invalid value for trajectory period. Default to 1.\n");
+                        period = 1;
+                    }
+                    trajectory_period = period;
+                }
+                break;
+            case 'D':
+                trajectory_policy = SOTL_TRAJECTORY_DROP;
+                break;
+            case 'S':
+                {
+                    long period = strtol(optarg, NULL, 10);
+
+                    if (period <= 0) {
+                        fprintf(stderr, "WARNING: Invalid value for observables period. Default to 1.\n");
+                        period = 1;
+                    }
+                    observables_period = period;
+                }
+                break;
+            case 'p':
+                sotl_enable_trace(optarg);
+                break;
+            case 'b':
+                sotl_enable_box_mode();
+                break;
+            case 'e':
+                delta_t = strtod(optarg, NULL);
+                if (delta_t <= 0.0) {
+                    fprintf(stderr, "WARNING: Invalid value for time step. Default to %g.\n",
+                            md_delta_t);
+                    delta_t = md_delta_t;
+                }
+                break;
+            case 'k':
+                {
+                    long steps = strtol(optarg, NULL, 10);
+
+                    if (steps <= 0) {
+                        fprintf(stderr, "WARNING: Invalid value for RESPA steps. Default to 1.\n");
+                        steps = 1;
+                    }
+                    respa_steps = steps;
+                }
+                break;
+            case 'A':
+                displacement = strtod(optarg, NULL);
+                if (displacement <= 0.0) {
+                    fprintf(stderr, "WARNING: Invalid value for displacement. Time step is fixed.\n");
+                    displacement = 0.0;
+                }
+                break;
+            case 'E':
+                delta_t_max = strtod(optarg, NULL);
+                if (delta_t_max <= 0.0) {
+                    fprintf(stderr, "WARNING: Invalid value for largest time step. Default to %g.\n",
+                            MD_DELTA_T_MAX_DEFAULT_VALUE);
+                    delta_t_max = 0.0;
+                }
+                break;
+            case 'V':
+                verlet_skin = strtod(optarg, NULL);
+                if (verlet_skin <= 0.0) {
+                    fprintf(stderr, "WARNING: Invalid value for skin. Default to %g.\n",
+                            VERLET_SKIN_DEFAULT_VALUE);
+                    verlet_skin = VERLET_SKIN_DEFAULT_VALUE;
+                }
+                sotl_enable_verlet_mode();
+                break;
+            case 'H':
+                sotl_enable_half_pair_mode();
+                break;
+            case 'N':
+                sotl_enable_numa_mode();
+                break;
+            case 't':
+                sotl_enable_torus_mode();
+                break;
+            case 'K':
+                sotl_enable_cluster_mode();
+                break;
+            case 'M':
+                sotl_enable_mixed_precision();
+                break;
+            case 'm':
+                {
+                    long period = strtol(optarg, NULL, 10);
+
+                    if (period <= 0) {
+                        fprintf(stderr, "WARNING: Invalid value for reordering period. Default to 1.\n");
+                        period = 1;
+                    }
+                    sotl_enable_reordering(period);
+                }
+                break;
+            case 'L':
+                {
+                    long period = strtol(optarg, NULL, 10);
+
+                    if (period <= 0) {
+                        fprintf(stderr, "WARNING: Invalid value for balancing period. Default to 100.\n");
+                        period = 100;
+                    }
+                    sotl_enable_rebalancing(period);
+                }
+                break;
+            case 'P':
+                if (!strcmp(optarg, "morse")) {
+                    potential = SOTL_POTENTIAL_MORSE;
+                } else if (!strcmp(optarg, "soft-sphere")) {
+                    potential = SOTL_POTENTIAL_SOFT_SPHERE;
+                } else if (strcmp(optarg, "lj")) {
+                    fprintf(stderr, "WARNING: Unknown potential '%s'. Default to lj.\n",
+                            optarg);
+                }
+                break;
             case 'd':
                 sotl_add_ocl_device_by_id(atoi(optarg));
                 break;
@@ -161,8 +348,7 @@ int main(int argc, char *argv[])
     if (optind < argc)
         MD_FILE = argv[optind++];
 
-    FILE *fp = NULL;
-    bool read_speed = false;
+    bool conf_file = false;
     unsigned xytiles, ztiles;
 
     if (natoms != 0) {
@@ -181,50 +367,87 @@ int main(int argc, char *argv[])
 	  ((randomize_atoms || l < 2) ? xytiles : ztiles) * LATTICE_TILE - LATTICE_TILE * 0.5;
       }
 
+    } else if (sotl_is_snapshot (MD_FILE)) {
+      snapshot = true;
     } else {
-      fp = fopen (MD_FILE, "r");
-      if (fp == NULL) {
-	perror("fopen");
-	exit(1);
-      }
-
-      psotl_read_file_header(fp, &natoms, domain_min, domain_max, &read_speed); 
+      conf_file = true;
     }
 
-    double xrange[2], yrange[2], zrange[2];
+    if (snapshot || conf_file) {
+        /* The file holds both the domain and the atoms. */
+        if (snapshot)
+            ret = sotl_load_snapshot(MD_FILE);
+        else
+            ret = sotl_load_conf(MD_FILE);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to load \"%s\" : '%s'.\n",
+                    MD_FILE, strerror(-ret));
+            return 1;
+        }
+    } else {
+        double xrange[2], yrange[2], zrange[2];
 
-    xrange[0] = domain_min[0];
-    xrange[1] = domain_max[0];
-    yrange[0] = domain_min[1];
-    yrange[1] = domain_max[1];
-    zrange[0] = domain_min[2];
-    zrange[1] = domain_max[2];
-    ret = sotl_domain_init(xrange, yrange, zrange, NULL, natoms);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to initialize the global domain : '%s'.\n",
-                strerror(-ret));
-        return 1;
+        xrange[0] = domain_min[0];
+        xrange[1] = domain_max[0];
+        yrange[0] = domain_min[1];
+        yrange[1] = domain_max[1];
+        zrange[0] = domain_min[2];
+        zrange[1] = domain_max[2];
+        ret = sotl_domain_init(xrange, yrange, zrange, NULL, natoms);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to initialize the global domain : '%s'.\n",
+                    strerror(-ret));
+            return 1;
+        }
+
+        if (randomize_atoms) {
+          for (int i = 0; i < natoms; ++i)
+            sotl_add_random_atom();
+        } else {
+          psotl_lattice_atoms (natoms, xytiles, ztiles);
+        }
     }
 
-    if (fp != NULL)
-      psotl_read_file_body (fp, natoms, read_speed);
-    else {
-      if (randomize_atoms) {
-        for (int i = 0; i < natoms; ++i)
-          sotl_add_random_atom();
-      } else {
-	psotl_lattice_atoms (natoms, xytiles, ztiles);
-      }
+    if (convert_file != NULL) {
+        /* Snapshots become text files, anything else a snapshot. */
+        if (snapshot)
+            ret = sotl_dump_positions(convert_file);
+        else
+            ret = sotl_dump_snapshot(convert_file);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to convert to \"%s\" : '%s'.\n",
+                    convert_file, strerror(-ret));
+            return 1;
+        }
+        return 0;
     }
 
     /* Set Molecular Dynamics parameters. */
-    sotl_set_parameter(MD_DELTA_T,  (void *)&md_delta_t);
+    sotl_set_parameter(MD_DELTA_T,  (void *)&delta_t);
+    sotl_set_parameter(MD_RESPA_STEPS, (void *)&respa_steps);
+    sotl_set_parameter(MD_ADAPTIVE_DISPLACEMENT, (void *)&displacement);
+    if (delta_t_max > 0.0)
+        sotl_set_parameter(MD_DELTA_T_MAX, (void *)&delta_t_max);
 
     /* Set Lennard Jones parameters. */
     sotl_set_parameter(LJ_SIGMA,    (void *)&lj_sigma);
     sotl_set_parameter(LJ_EPSILON,  (void *)&lj_epsilon);
     sotl_set_parameter(LJ_RCUT,     (void *)&lj_rcut);
 
+    /* Set pair potential parameters. */
+    sotl_set_parameter(POTENTIAL_TYPE, (void *)&potential);
+
+    /* Set Verlet lists parameters. */
+    if (verlet_skin > 0.0)
+        sotl_set_parameter(VERLET_SKIN, (void *)&verlet_skin);
+
+    if (trajectory_period)
+        sotl_enable_trajectory("trajectory.traj", trajectory_period,
+                               trajectory_policy);
+
+    if (observables_period)
+        sotl_enable_observables("observables.dat", observables_period);
+
     ret = sotl_runtime_init();
     if (ret < 0) {
         fprintf(stderr, "Failed to distribute atoms among selected devices = '%s'.\n",
@@ -232,6 +455,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    sotl_set_warmup (nb_iter_to_ignore);
     sotl_main_loop (nb_iter);
 
     sotl_finalize ();
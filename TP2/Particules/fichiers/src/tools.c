@@ -8,69 +8,6 @@
 #include "sotl.h"
 #include "default_defines.h"
 
-static calc_t rand_calc_t (calc_t mn, calc_t mx);
-
-static calc_t rand_calc_t (calc_t mn, calc_t mx)
-{
-    calc_t r = random () / (calc_t) RAND_MAX;
-    return mn + (mx - mn) * r;
-}
-
-int psotl_read_file_header(FILE *fd, unsigned *natoms,
-			   calc_t *min_ext, calc_t *max_ext, bool *read_speed)
-{
-  int read_speed_int; 
-
-  fscanf(fd, "%d", natoms);
-
-  for (int l = 0; l < 3; l++) {
-#if USE_DOUBLE == 0
-    fscanf (fd, "%f %f", &min_ext[l], &max_ext[l]);
-#else
-    fscanf (fd, "%lf %lf", &min_ext[l], &max_ext[l]);
-#endif
-  }
-
-  fscanf(fd, "%d", &read_speed_int);
-  *read_speed = (bool)read_speed_int;
-
-  return 0;
-}
-
-int psotl_read_file_body(FILE *fd,
-			 unsigned natoms_to_read, bool read_speed)
-{
-  calc_t posx, posy, posz, spdx, spdy, spdz;
-
-  for (int i = 0; i < natoms_to_read; i++) {
-#if USE_DOUBLE == 0
-    fscanf(fd, "%f %f %f", &posx, &posy, &posz);
-#else
-    fscanf(fd, "%lf %lf %lf", &posx, &posy, &posz);
-#endif
-    if (read_speed) {
-#if USE_DOUBLE == 0
-      fscanf(fd, "%f %f %f", &spdx, &spdy, &spdz);
-#else
-      fscanf(fd, "%lf %lf %lf", &spdx, &spdy, &spdz);
-#endif
-    } else {
-      // Velocity norm is between 5% and 20% of atom radius, in a
-      // random direction
-      calc_t speed = rand_calc_t (ATOM_RADIUS * 0.05, ATOM_RADIUS * 0.2);
-      calc_t lat = rand_calc_t (-M_PI / 2, M_PI / 2);
-      calc_t lon = rand_calc_t (0.0, M_PI * 2);
-      spdx = cos (lon) * cos (lat) * speed;
-      spdy = sin (lat) * speed;
-      spdz = -sin (lon) * cos (lat) * speed;
-    }
-
-    sotl_add_atom (posx, posy, posz, spdx, spdy, spdz);
-  }
-
-  return 0;
-}
-
 static unsigned nb_atoms = 0;
 
 void add_atom(unsigned x, unsigned y, unsigned z,
@@ -0,0 +1,287 @@
+/*
+ * sotl-check: consistency checks of the library, run by ctest. Each check
+ * runs the same system in two configurations (for instance on one or two
+ * devices) and compares the results.
+ *
+ * The library keeps its state in globals, so each run happens in a child
+ * process, which sends its results back through a pipe. A check exits
+ * with 0 when it passes, 1 when it fails and 77 when it cannot run on
+ * this host (missing devices).
+ */
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "default_defines.h"
+#include "sotl.h"
+
+/* Same physics as the atoms application. */
+static const double md_delta_t  = 1.0;
+static const double lj_sigma    = 0.503968201;
+static const double lj_epsilon  = 0.001;
+static const double lj_rcut     = 0.6047618412; /* 1.2 * lj_sigma */
+
+/* Face-centered cubic lattice of CHECK_TILES^3 cells, 4 atoms each. */
+#define CHECK_TILES  10
+#define CHECK_NATOMS (4 * CHECK_TILES * CHECK_TILES * CHECK_TILES)
+
+#define CHECK_SKIP   77
+
+typedef struct {
+    bool two_devices;           /* Sequential and OpenMP devices */
+    bool half_pairs;
+    bool box_mode;
+    unsigned nb_iter;
+} check_run_t;
+
+typedef struct {
+    int status;                 /* 0, or CHECK_SKIP */
+    double potential;           /* Pair energy of the last iteration */
+    calc_t pos[3][CHECK_NATOMS];        /* Positions, by atom id */
+} check_result_t;
+
+/* Atoms of the lattice, with small pseudo-random speeds (the same in
+ * every run). */
+static int check_atoms(void)
+{
+    const double range[2] = { 0.0, CHECK_TILES * LATTICE_TILE };
+    static const double corner[4][3] = {
+        { 0.0, 0.0, 0.0 }, { 0.0, 0.5, 0.5 }, { 0.5, 0.0, 0.5 }, { 0.5, 0.5, 0.0 }
+    };
+    unsigned seed = 1;
+    int ret;
+
+    ret = sotl_domain_init(range, range, range, NULL, CHECK_NATOMS);
+    if (ret < 0)
+        return ret;
+
+    for (unsigned z = 0; z < CHECK_TILES; z++)
+        for (unsigned y = 0; y < CHECK_TILES; y++)
+            for (unsigned x = 0; x < CHECK_TILES; x++)
+                for (int c = 0; c < 4; c++) {
+                    calc_t spd[3];
+
+                    for (int i = 0; i < 3; i++) {
+                        seed = seed * 1103515245 + 12345;
+                        spd[i] = 0.002 * (((seed >> 16) & 0x7fff) / 32767.0 - 0.5);
+                    }
+                    sotl_add_atom((x + corner[c][0]) * LATTICE_TILE,
+                                  (y + corner[c][1]) * LATTICE_TILE,
+                                  (z + corner[c][2]) * LATTICE_TILE,
+                                  spd[0], spd[1], spd[2]);
+                }
+
+    return SOTL_SUCCESS;
+}
+
+/* Child side of a run: simulate and fill res. Returns 0 on success. */
+static int check_child(const check_run_t *run, check_result_t *res)
+{
+    static unsigned ids[CHECK_NATOMS];
+    static calc_t pos[3][CHECK_NATOMS], spd[3][CHECK_NATOMS];
+    sotl_observables_t obs;
+    int null = open("/dev/null", O_WRONLY);
+
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    if (sotl_init() < 0)
+        return 1;
+
+    /* Fake CPU devices 0 and 1 when there is no OpenCL CPU device. */
+    if (sotl_add_seq_device_by_id(0) < 0 ||
+        (run->two_devices && sotl_add_omp_device_by_id(1) < 0)) {
+        res->status = CHECK_SKIP;
+        return 0;
+    }
+
+    if (run->half_pairs)
+        sotl_enable_half_pair_mode();
+    if (run->box_mode)
+        sotl_enable_box_mode();
+
+    if (check_atoms() < 0)
+        return 1;
+
+    sotl_set_parameter(MD_DELTA_T, (void *)&md_delta_t);
+    sotl_set_parameter(LJ_SIGMA,   (void *)&lj_sigma);
+    sotl_set_parameter(LJ_EPSILON, (void *)&lj_epsilon);
+    sotl_set_parameter(LJ_RCUT,    (void *)&lj_rcut);
+
+    sotl_enable_observables("/dev/null", 1);
+
+    if (sotl_runtime_init() < 0)
+        return 1;
+
+    sotl_main_loop(run->nb_iter);
+
+    if (sotl_get_observables(&obs) < 0 || obs.natoms != CHECK_NATOMS)
+        return 1;
+    res->potential = obs.potential;
+
+    if (sotl_sync_all_atoms(ids, pos[0], pos[1], pos[2], spd[0], spd[1],
+                            spd[2], CHECK_NATOMS) < 0)
+        return 1;
+
+    for (unsigned n = 0; n < CHECK_NATOMS; n++) {
+        if (ids[n] >= CHECK_NATOMS)
+            return 1;
+        for (int i = 0; i < 3; i++)
+            res->pos[i][ids[n]] = pos[i][n];
+    }
+
+    sotl_finalize();
+
+    res->status = 0;
+    return 0;
+}
+
+/* Run the system once. Returns 0 on success. */
+static int check_run(const check_run_t *run, check_result_t *res)
+{
+    char *buf = (char *)res;
+    size_t done = 0;
+    int fds[2], status;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return -errno;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -errno;
+    }
+    if (pid == 0) {
+        int ret;
+
+        close(fds[0]);
+        ret = check_child(run, res);
+        for (done = 0; !ret && done < sizeof(*res); ) {
+            ssize_t n = write(fds[1], buf + done, sizeof(*res) - done);
+
+            if (n < 0 && errno != EINTR)
+                ret = 1;
+            else if (n > 0)
+                done += n;
+        }
+        _exit(ret);
+    }
+
+    close(fds[1]);
+    while (done < sizeof(*res)) {
+        ssize_t n = read(fds[0], buf + done, sizeof(*res) - done);
+
+        if (n == 0 || (n < 0 && errno != EINTR))
+            break;
+        if (n > 0)
+            done += n;
+    }
+    close(fds[0]);
+
+    waitpid(pid, &status, 0);
+
+    if (done != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    return 0;
+}
+
+/* Run both configurations. Returns 0 when both ran, else the exit code of
+ * the check. */
+static int check_pair(const check_run_t *a, const check_run_t *b,
+                      check_result_t *ra, check_result_t *rb)
+{
+    if (check_run(a, ra) < 0 || check_run(b, rb) < 0) {
+        fprintf(stderr, "A run failed\n");
+        return 1;
+    }
+    if (ra->status == CHECK_SKIP || rb->status == CHECK_SKIP) {
+        fprintf(stderr, "Two CPU devices are required\n");
+        return CHECK_SKIP;
+    }
+    return 0;
+}
+
+static bool check_close(const char *what, const double a, const double b,
+                        const double tolerance)
+{
+    const bool ok = fabs(a - b) <= tolerance;
+
+    fprintf(stderr, "%s: %.9g vs %.9g (%s)\n", what, a, b,
+            ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* Half pairs on the sub set of the OpenMP device, which has ghosts on one
+ * side, give the energy of full pairs. */
+static int check_half_pairs(check_result_t *full, check_result_t *half)
+{
+    const check_run_t a = { true, false, false, 5 };
+    const check_run_t b = { true, true, false, 5 };
+    int ret = check_pair(&a, &b, full, half);
+
+    if (ret)
+        return ret;
+
+    return !check_close("potential energy", half->potential, full->potential,
+                        1e-4 * fabs(full->potential));
+}
+
+/* Atoms exchanged between two devices follow the trajectories of a single
+ * device. */
+static int check_multi_devices(check_result_t *one, check_result_t *two)
+{
+    const check_run_t a = { false, false, true, 20 };
+    const check_run_t b = { true, false, true, 20 };
+    double max_dist = 0.0;
+    int ret = check_pair(&a, &b, one, two);
+
+    if (ret)
+        return ret;
+
+    for (unsigned n = 0; n < CHECK_NATOMS; n++)
+        for (int i = 0; i < 3; i++)
+            max_dist = fmax(max_dist, fabs(one->pos[i][n] - two->pos[i][n]));
+
+    ret = !check_close("potential energy", two->potential, one->potential,
+                       1e-4 * fabs(one->potential));
+    ret |= !check_close("largest position difference", max_dist, 0.0, 1e-4);
+
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(check_result_t *, check_result_t *);
+} checks[] = {
+    { "half-pairs",    check_half_pairs },
+    { "multi-devices", check_multi_devices },
+};
+
+int main(int argc, char *argv[])
+{
+    static check_result_t results[2];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <check>\n", argv[0]);
+        return 1;
+    }
+
+    for (unsigned k = 0; k < sizeof(checks) / sizeof(*checks); k++)
+        if (!strcmp(argv[1], checks[k].name))
+            return checks[k].run(&results[0], &results[1]);
+
+    fprintf(stderr, "Unknown check '%s'\n", argv[1]);
+    return 1;
+}